@@ -0,0 +1,97 @@
+#ifndef REDIS_QUADTREE_ASYNC_QUADTREE_HPP
+#define REDIS_QUADTREE_ASYNC_QUADTREE_HPP
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <hiredis/async.h>
+#include <util.hpp>
+#include <node.hpp>
+#include <scripts.hpp>
+#include <quadtree.hpp>
+
+// the quadtree on a hiredis async context, every call returns right away and its callback runs
+// from the context's event loop (e.g. epoll_loop) once the reply is in
+// any number of calls can be in flight on the one connection, redis runs them in the order they were made
+// insert, remove and relocate always run as the lua scripts, a client side descent would wait on redis at every level
+// cacheNodes and useScripts in the options are ignored, and the nodes above minDepth are only
+// laid out by the blocking quadtree (the scripts still never merge them), the thresholds are read from the tree
+// once, when it's made
+// keyPrefix applies, cluster doesn't: the tree has to be in one redis
+class async_quadtree {
+    public:
+        // the entity as it is after the operation, ownerKey is empty if it isn't in the tree
+        typedef std::function<void (const entity& _ent)> entity_callback;
+        // if the connection goes away part way through, this gets whatever was read up to then
+        typedef std::function<void (std::vector<entity>& _ents)> entities_callback;
+
+        // the context has to stay attached to an event loop and outlive every call made here
+        async_quadtree (redisAsyncContext* _context, const rectangle& _rect, const quadtree_options& _options = quadtree_options () );
+
+        void get_entity (uint32_t _id, const entity_callback& _callback);
+
+        void insert_entity (const entity& _ent, const entity_callback& _callback = entity_callback () );
+        void remove_entity (const entity& _ent, const entity_callback& _callback = entity_callback () );
+        void relocate_entity (const entity& _ent, const entity_callback& _callback = entity_callback () );
+
+        void get_entities (const rectangle& _rect, const entities_callback& _callback);
+
+        // calls that haven't run their callback yet
+        size_t pending () const;
+        // what redis replied to the last script that failed, set before that call's callback runs, which gets
+        // the entity read back from the tree since the script may have written part of its change
+        const std::string& script_error () const;
+
+    private:
+        struct request;
+        struct query;
+        struct query_step;
+
+        void run_script (script_id _script, const entity& _ent, const entity_callback& _callback);
+        void send_script (request* _request);
+        // reads the request's entity into it and finishes it
+        void look_up (request* _request);
+        void finish (request* _request);
+
+        query_step* read (query* _query, size_t _index, redisCallbackFn* _fn, const char* _format, ...);
+        void read_level (query* _query);
+        void next_level (query* _query);
+
+        static void on_config_reply (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_script_loaded (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_script_reply (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_entity_owner (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_entity_reply (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_root_reply (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_node_reply (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_bucket_reply (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_members_reply (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_member_reply (redisAsyncContext* _context, void* _reply, void* _data);
+        static void on_step_done (query_step* _step);
+
+    private:
+        redisAsyncContext* context;
+        // the tree's own, once its config reply is in
+        uint32_t maxEntitiesPerNode;
+        uint32_t mergeEntities;
+        uint32_t minNodeSize;
+
+        const key_scheme keyScheme;
+        std::string rootKey;
+        const entity_layout entityLayout;
+        const coordinate_encoding coordinates;
+        const uint32_t minDepth;
+        const double looseness;
+        const bool countSubtrees;
+        const key_space keySpace;
+
+        std::string scriptShas[SCRIPT_COUNT];
+        std::string scriptError;
+        size_t scriptsLoading;
+        // mutations made before the scripts are loaded, sent once they are
+        std::vector<request*> waiting;
+
+        size_t inFlight;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef REDIS_QUADTREE_CLUSTER_ROUTER_HPP
+#define REDIS_QUADTREE_CLUSTER_ROUTER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <hiredis/hiredis.h>
+
+// a blocking context spread over every master of a redis cluster: each command goes to the master serving
+// the slot of its first key (see key_slot) and the replies come back in the order the commands were queued
+// like they do on one context, so the quadtree's pipelines work unchanged
+// the master replies are read from are waited on only after everything queued anywhere has been sent, so a
+// pipeline touching several masters costs one round trip with each of them working on its share at once
+class cluster_router {
+    public:
+        // the slot map is read from _seed, which stays the caller's and only gets the commands without a key,
+        // every master gets a connection of its own
+        // against a redis that isn't a cluster everything goes to _seed
+        cluster_router (redisContext* _seed);
+        ~cluster_router ();
+
+        // _args with their keys already mapped (see key_space)
+        void append (const std::vector<std::string>& _args);
+        // the reply to the oldest command not read yet, MOVED and ASK are followed and the command sent again
+        // _waited is set if this had to wait on redis, REDIS_ERR if a connection failed
+        int get_reply (void** _reply, bool& _waited);
+        // sends everything queued without waiting on it
+        void flush ();
+
+        // the masters the slot map named, 0 if _seed isn't a cluster
+        size_t masters () const;
+
+    private:
+        struct queued_command {
+            size_t connection;
+            // kept to send it again if it was redirected
+            std::vector<std::string> args;
+        };
+
+        // false if redis didn't answer with a slot map, the one there was is kept then
+        bool read_slots ();
+        size_t connection_for (const std::string& _address);
+        void send (size_t _connection, const std::vector<std::string>& _args);
+        // the next reply on a connection, one that was read ahead first
+        int read (size_t _connection, void** _reply, bool& _waited);
+        // the next reply on the connection itself
+        int receive (size_t _connection, void** _reply, bool& _waited);
+        // reads ahead everything a connection still owes, so what's sent on it next is what's read next
+        int drain (size_t _connection);
+
+    private:
+        // connections[0] is the seed
+        std::vector<redisContext*> connections;
+        std::vector<std::string> addresses;
+        // replies read ahead of their turn, and commands sent whose reply hasn't been read off the connection
+        std::vector<std::deque<void*> > readAhead;
+        std::vector<size_t> outstanding;
+
+        std::vector<size_t> slotConnections;
+        size_t masterCount;
+        std::deque<queued_command> order;
+};
+
+#endif
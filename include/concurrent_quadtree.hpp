@@ -0,0 +1,83 @@
+#ifndef REDIS_QUADTREE_CONCURRENT_QUADTREE_HPP
+#define REDIS_QUADTREE_CONCURRENT_QUADTREE_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+#include <quadtree.hpp>
+
+// the quadtree shared between threads: a pool of worker threads, each with its own connection
+// and its own quadtree, so nothing in a quadtree is ever touched by two threads
+// every call is safe from any thread and blocks until a worker has run it
+// reads run fully in parallel, mutations only wait on others in the same subtree (see lockDepth)
+class concurrent_quadtree {
+    public:
+        // _options.minDepth is raised to _lockDepth and cacheNodes and writeBehind are ignored, a cache or an
+        // in process tree per worker couldn't see the others' changes
+        // the tree is split into 4^_lockDepth subtrees for locking, plus one lock for the nodes above them
+        // every connection selects _db first, unless it's 0 or _options.cluster is set
+        concurrent_quadtree (const std::string& _host, int _port, const rectangle& _rect, size_t _threads,
+            uint32_t _lockDepth = 2, const quadtree_options& _options = quadtree_options (), int _db = 0);
+        ~concurrent_quadtree ();
+
+        // false if any of the connections failed, nothing else works then
+        bool connected () const;
+        size_t size () const;
+
+        void get_entity (uint32_t _id, entity& _ent);
+
+        void insert_entity (entity& _ent);
+        void remove_entity (entity& _ent);
+        void relocate_entity (entity& _ent);
+
+        void get_entities (const rectangle& _rect, std::vector<entity>& _ents);
+        void get_entities_in_radius (const point& _center, uint32_t _radius, std::vector<entity>& _ents);
+        void get_entities_in_polygon (const std::vector<point>& _vertices, std::vector<entity>& _ents);
+        void get_nearest (const point& _pos, size_t _k, std::vector<entity>& _ents, uint32_t _maxRadius = 0);
+        // runs a batch of queries spread over every worker, _ents[n] gets the result of _rects[n]
+        void get_entities (const std::vector<rectangle>& _rects, std::vector<std::vector<entity> >& _ents);
+
+    private:
+        typedef std::function<void (quadtree& _tree)> job;
+
+        struct worker {
+            redisContext* context;
+            quadtree* tree;
+            std::thread thread;
+        };
+
+        void run (const job& _job);
+        void submit (const job& _job);
+        void work (worker* _worker);
+
+        size_t position_lock (const point& _pos) const;
+        size_t node_lock (const std::string& _nodeKey) const;
+        // false if the entity turned out to be in a subtree _lock doesn't cover
+        bool refresh_owner (quadtree& _tree, entity& _ent, size_t _lock) const;
+        void lock (size_t _first, size_t _second);
+        void unlock (size_t _first, size_t _second);
+
+    private:
+        std::vector<worker*> workers;
+        bool ok;
+
+        std::deque<job> jobs;
+        std::mutex jobsMutex;
+        std::condition_variable jobsReady;
+        bool stopping;
+
+        const key_scheme keyScheme;
+        const uint32_t lockDepth;
+        rectangle rect;
+        // the key of every node at lockDepth, mapped to its lock
+        std::unordered_map<std::string, size_t> subtreeLocks;
+        // one per subtree and the last one for the nodes above lockDepth
+        std::vector<std::mutex*> locks;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef REDIS_QUADTREE_ENTITY_ARENA_HPP
+#define REDIS_QUADTREE_ENTITY_ARENA_HPP
+
+#include <string>
+#include <vector>
+#include <node.hpp>
+
+// range query results without an entity (and its two strings) per result: every entity is its id, position
+// and the index of its owner's key, which all the entities of a node share
+// clear keeps the memory, so an arena reused from one query to the next only allocates while it grows past
+// the biggest result it has held
+class entity_arena {
+    public:
+        struct ref {
+            uint32_t id;
+            point pos;
+            uint32_t owner;
+        };
+
+        entity_arena ();
+
+        void clear ();
+        size_t size () const;
+        bool empty () const;
+
+        const ref& operator[] (size_t _n) const;
+        const std::string& owner_key (const ref& _ref) const;
+        const std::string& owner_key (uint32_t _owner) const;
+        // result _n as a whole entity, its key and ownerKey filled in
+        void get (size_t _n, entity& _ent) const;
+        // every result as a whole entity, appended to _ents
+        void get_all (std::vector<entity>& _ents) const;
+
+        // the index the entities of a node with _key get, reusing a string kept from before
+        uint32_t add_owner (const char* _key, size_t _len);
+        uint32_t add_owner (const std::string& _key);
+        void add (uint32_t _id, const point& _pos, uint32_t _owner);
+        // drops the last result, e.g. one a filter turned down
+        void pop_back ();
+
+    private:
+        std::vector<ref> refs;
+        // owners[ownerCount, end) are kept for their memory only
+        std::vector<std::string> owners;
+        size_t ownerCount;
+};
+
+// the arena versions of parse_bucket and parse_entity (see node.hpp), the entities go to _owner unless
+// their hash names another one
+void parse_bucket (const redisReply* _reply, uint32_t _owner, entity_arena& _arena);
+bool parse_entity (coordinate_encoding _encoding, uint32_t _id, const redisReply* _reply, uint32_t _owner, entity_arena& _arena);
+
+#endif
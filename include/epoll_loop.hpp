@@ -0,0 +1,53 @@
+#ifndef REDIS_QUADTREE_EPOLL_LOOP_HPP
+#define REDIS_QUADTREE_EPOLL_LOOP_HPP
+
+#include <vector>
+#include <hiredis/async.h>
+
+// minimal event loop for hiredis async contexts, so async_quadtree doesn't need libevent
+// single threaded: attach, run and every hiredis callback happen on the thread driving the loop
+class epoll_loop {
+    public:
+        epoll_loop ();
+        ~epoll_loop ();
+
+        // hooks the context's read/write events into this loop, fails if it's already attached somewhere
+        bool attach (redisAsyncContext* _context);
+
+        // waits up to _timeout ms (-1 for no limit) and handles whatever is ready
+        // returns the number of contexts that had events, or -1 on error
+        int run_once (int _timeout);
+        // handles events until stop () is called or every attached context is gone
+        void run ();
+        void stop ();
+
+        size_t size () const;
+
+    private:
+        struct watch {
+            epoll_loop* loop;
+            redisAsyncContext* context;
+            int fd;
+            bool reading, writing;
+            bool registered;
+        };
+
+        static void add_read (void* _data);
+        static void del_read (void* _data);
+        static void add_write (void* _data);
+        static void del_write (void* _data);
+        static void cleanup (void* _data);
+
+        void update (watch* _watch);
+
+    private:
+        int epollFd;
+        bool running;
+
+        // watches of the contexts still attached, the destructor detaches and frees whatever is left
+        std::vector<watch*> watches;
+        // watches whose context went away, freed once the current batch of events is handled
+        std::vector<watch*> retired;
+};
+
+#endif
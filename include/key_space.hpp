@@ -0,0 +1,42 @@
+#ifndef REDIS_QUADTREE_KEY_SPACE_HPP
+#define REDIS_QUADTREE_KEY_SPACE_HPP
+
+#include <string>
+#include <vector>
+#include <node.hpp>
+
+// the slot a redis cluster keeps _key in, only the part between the first '{' and the '}' after it
+// is hashed if there is one
+uint16_t key_slot (const std::string& _key);
+
+// the arguments of a command that are keys, [_first, _end), empty for commands without any
+void command_keys (const std::vector<std::string>& _args, size_t& _first, size_t& _end);
+
+// the names a tree's keys have in redis, the tree itself (node keys, owner fields, entities:index values,
+// change messages) only ever uses the plain keys and these are applied as the commands are sent
+// with a prefix every key starts with it, so several trees can share one redis or cluster
+// tagged, every key of a node also gets the hash tag of its subtree at _shardDepth ("{root:tl:br}:bl:rect"),
+// so all of a subtree's nodes are in one cluster slot, the nodes above _shardDepth get the root's tag and
+// an entity's keys are hashed on their own
+class key_space {
+    public:
+        key_space (key_scheme _keyScheme, const std::string& _prefix, bool _tagged, uint32_t _shardDepth);
+
+        // false while every key is used as it is
+        bool maps () const;
+        const std::string& prefix () const;
+
+        std::string map (const std::string& _key) const;
+        void map_args (std::vector<std::string>& _args) const;
+
+        // the key of the subtree _nodeKey is in, the one its hash tag names
+        std::string subtree_key (const std::string& _nodeKey) const;
+
+    private:
+        const key_scheme keyScheme;
+        const std::string keyPrefix;
+        const bool tagged;
+        const uint32_t shardDepth;
+};
+
+#endif
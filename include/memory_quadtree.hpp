@@ -0,0 +1,163 @@
+#ifndef REDIS_QUADTREE_MEMORY_QUADTREE_HPP
+#define REDIS_QUADTREE_MEMORY_QUADTREE_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <spatial_index.hpp>
+#include <quadtree.hpp>
+
+// what changed in a memory_quadtree since the last memory_quadtree::take_changes, in the shape redis
+// keeps it (see quadtree_options::writeBehind)
+struct tree_changes {
+    // nodes that were added or changed, and their entities as LAYOUT_PACKED records
+    std::vector<node> nodes;
+    std::vector<std::string> buckets;
+    std::vector<std::string> removedNodes;
+    // entities that were added, moved or changed node, and the ids of the ones that were removed
+    std::vector<entity> entities;
+    std::vector<uint32_t> removedEntities;
+    // with countSubtrees, the nodes whose subtree total changed and their totals now
+    std::vector<std::pair<std::string, uint32_t> > totals;
+};
+
+// the same tree kept entirely in process, for a single process that doesn't need redis at all and for
+// telling how much of an operation's cost is the tree itself rather than the round trips
+// nodes split, merge and name themselves the way quadtree's do (with the same options), but nothing is
+// shared, every memory_quadtree is a tree of its own
+// keyScheme, minDepth and looseness are used as they are, entityLayout, cacheNodes and useScripts are ignored
+class memory_quadtree : public spatial_index {
+    public:
+        memory_quadtree (const rectangle& _rect, const quadtree_options& _options = quadtree_options () );
+
+        // ownerKey is empty if the entity isn't in the tree
+        void get_entity (uint32_t _id, entity& _ent);
+
+        // an id that's already in the tree is moved to the new position
+        void insert_entity (entity& _ent);
+        // the tree knows every entity's owner, so only the id has to be right
+        void remove_entity (entity& _ent);
+        void relocate_entity (entity& _ent);
+
+        using spatial_index::get_entities;
+        void get_entities (const region& _region, std::vector<entity>& _ents);
+        void get_entities (const region& _region, entity_arena& _arena);
+        void get_nearest (const point& _pos, size_t _k, std::vector<entity>& _ents, uint32_t _maxRadius = 0);
+
+        // depth first, a subtree inside the region that the offset covers whole is skipped by its total
+        using spatial_index::visit_entities;
+        size_t visit_entities (const region& _region, const entity_visitor& _visit, size_t _offset = 0, size_t _limit = 0);
+
+        // every node keeps its subtree total whatever the options, countSubtrees only decides whether
+        // take_changes hands them over
+        using spatial_index::count_entities;
+        size_t count_entities (const region& _region);
+        void density_grid (const rectangle& _rect, uint32_t _level, std::vector<density_cell>& _cells);
+
+        void relocate_entities (std::vector<entity>& _ents);
+        void insert_entities (std::vector<entity>& _ents);
+
+        // nodes split and merge by these from their next change on, see quadtree_options::maxEntitiesPerNode
+        void set_thresholds (uint32_t _maxEntities, uint32_t _mergeEntities);
+
+        size_t size () const;
+        // nodes in use, the root included
+        size_t node_count () const;
+
+        // start remembering what changes, see take_changes
+        void track_changes ();
+        // nodes and entities changed since the last take_changes
+        size_t changed () const;
+        // hands over everything that changed since the last call, each node and entity shows up once
+        // however many times it changed
+        void take_changes (tree_changes& _changes);
+        // marks what _changes named as changed again, e.g. after writing them failed, the next take_changes
+        // hands it over as the tree has it then
+        void return_changes (const tree_changes& _changes);
+
+        // every node (each after its parent) and every entity, in the shape restore takes them
+        void get_tree (std::vector<node>& _nodes, std::vector<entity>& _ents) const;
+        // replaces the whole tree with _nodes (the root first, every node after its parent) and _ents, which go
+        // into the nodes named by their ownerKeys, e.g. to take over a tree read from redis
+        void restore (const std::vector<node>& _nodes, const std::vector<entity>& _ents);
+
+    private:
+        // what a node's bucket holds for each entity, the same fields as a LAYOUT_PACKED record
+        struct record {
+            uint32_t id;
+            point pos;
+        };
+
+        // where an entity's record is: the node and its index in that node's bucket
+        struct slot {
+            uint32_t node;
+            uint32_t index;
+        };
+
+        // nodes are kept in one array and reference each other by index, the four subnodes of a node
+        // are next to each other starting at children, a node merged away has no parent
+        struct mem_node {
+            rectangle rect;
+            uint32_t parent;
+            uint32_t children;
+            uint32_t depth;
+            // entities in this node and every node below it
+            uint32_t total;
+        };
+
+        uint32_t quadrant_of (uint32_t _node, const point& _pos) const;
+        bool subdivide (uint32_t _node);
+        // lays out the four subnodes, without moving anything into them
+        void add_subnodes (uint32_t _node);
+        void subdivide_to_min_depth (uint32_t _node);
+        void clean (uint32_t _node);
+        bool subtree_empty (uint32_t _node) const;
+        // deletes the subnodes of _node, anything still in them moves up into it
+        void merge (uint32_t _node);
+
+        // walks down from _node to where _ent belongs and adds it there
+        void add_below (uint32_t _node, entity& _ent);
+        void add_entity (uint32_t _node, entity& _ent);
+        void take_entity (const slot& _slot);
+        // adds _count to the total of _node and of every node above it
+        void add_to_totals (uint32_t _node, int32_t _count);
+
+        void make_entity (uint32_t _node, const record& _record, entity& _ent) const;
+
+        void node_changed (uint32_t _node);
+        void entity_changed (uint32_t _id);
+        void total_changed (uint32_t _node);
+
+    private:
+        static const uint32_t noNode = UINT32_MAX;
+
+        uint32_t maxEntitiesPerNode;
+        uint32_t mergeEntities;
+        const uint32_t minNodeSize;
+        const key_scheme keyScheme;
+        const uint32_t minDepth;
+        const double looseness;
+        const bool countSubtrees;
+
+        // mem_node holds what a descent looks at, the buckets and keys are only touched at the end of one
+        std::vector<mem_node> nodes;
+        std::vector<std::vector<record> > buckets;
+        std::vector<std::string> keys;
+        // the first node of every block of four that was merged away, reused by the next subdivide
+        std::vector<uint32_t> freeBlocks;
+
+        std::unordered_map<uint32_t, slot> slots;
+        // what get_entities into a vector collects its results in before they're copied out
+        entity_arena results;
+
+        bool tracking;
+        std::vector<bool> nodeChanged;
+        std::vector<uint32_t> changedNodes;
+        std::vector<std::string> removedKeys;
+        std::unordered_set<uint32_t> changedEntities;
+        std::vector<bool> totalChanged;
+        std::vector<uint32_t> changedTotals;
+};
+
+#endif
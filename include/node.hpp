@@ -0,0 +1,60 @@
+#ifndef REDIS_QUADTREE_NODE_HPP
+#define REDIS_QUADTREE_NODE_HPP
+
+#include <string>
+#include <vector>
+#include <hiredis/hiredis.h>
+#include <util.hpp>
+
+// how node keys are named in redis
+enum key_scheme {
+    KEYS_PATH,      // "root:tl:br", the quadrant path from the root spelled out
+    KEYS_MORTON     // the node's locational code in a few binary bytes, see morton_key
+};
+
+// how a node's entities are stored in redis
+enum entity_layout {
+    LAYOUT_SETS,    // "<node>:entities" set of ids plus an "entities:<id>" hash (x, y, owner) per entity
+    LAYOUT_PACKED   // "<node>:bucket" string of fixed width (id, x, y) records plus one "entities:index" hash (id -> owner)
+};
+
+struct entity {
+    union {
+        uint32_t id;
+        unsigned char bytes[4];
+    };
+    point pos;
+    std::string key;
+    std::string ownerKey;
+};
+
+// size of one entity in a LAYOUT_PACKED node bucket: the id and position bytes in host byte order
+// (the lua scripts read them as little endian)
+const size_t entityRecordSize = sizeof (uint32_t) + sizeof (point);
+
+struct node {
+    std::string key;
+    std::string parentKey;
+    bool subdivided;
+    uint32_t entities;
+    rectangle rect;
+};
+
+std::string root_key (key_scheme _scheme);
+std::string subnode_key (key_scheme _scheme, const std::string& _nodeKey, int _quad);
+// empty for the root
+std::string parent_key (key_scheme _scheme, const std::string& _nodeKey);
+// number of levels below the root (which is 0)
+uint32_t node_depth (key_scheme _scheme, const std::string& _nodeKey);
+
+// readers for the replies the quadtree works with, shared by the blocking and async versions
+bool parse_node (const redisReply* _reply, node& _node);
+// the numbers are read in place, without a string made of them
+bool parse_entity (coordinate_encoding _encoding, const char* _id, const redisReply* _reply, entity& _ent);
+void parse_bucket (const redisReply* _reply, const std::string& _ownerKey, std::vector<entity>& _ents);
+
+void pack_entity (const entity& _ent, std::string& _bucket);
+// byte offset of the entity's record in a bucket, std::string::npos if it isn't there
+size_t find_entity (const std::string& _bucket, uint32_t _id);
+
+#endif
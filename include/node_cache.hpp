@@ -0,0 +1,27 @@
+#ifndef REDIS_QUADTREE_NODE_CACHE_HPP
+#define REDIS_QUADTREE_NODE_CACHE_HPP
+
+#include <string>
+#include <unordered_map>
+#include <node.hpp>
+
+// in-process copy of the tree structure (subdivided flag, entity count and rect of each node)
+// the quadtree keeps it up to date through the hooks below whenever it changes a node
+class node_cache {
+    public:
+        bool get (const std::string& _key, node& _node) const;
+        void put (const node& _node);
+
+        void erase (const std::string& _key);
+        void clear ();
+
+        void set_subdivided (const std::string& _key, bool _subdivided);
+        void add_entities (const std::string& _key, int32_t _count);
+
+        size_t size () const;
+
+    private:
+        std::unordered_map<std::string, node> nodes;
+};
+
+#endif
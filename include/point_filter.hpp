@@ -0,0 +1,35 @@
+#ifndef REDIS_QUADTREE_POINT_FILTER_HPP
+#define REDIS_QUADTREE_POINT_FILTER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <node.hpp>
+
+// a bucket's entities with one array per field, so a filter over the positions reads nothing but them
+struct point_columns {
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> xs;
+    std::vector<uint32_t> ys;
+
+    void clear ();
+    size_t size () const;
+    // appends the LAYOUT_PACKED records in _records, a partial record at the end is left out
+    void add_records (const char* _records, size_t _bytes);
+};
+
+// writes the index of every point strictly inside _rect (see rectangle::contains) to _keep, which has room
+// for _count, in order, and returns how many there were
+// the kernel is picked once from what the cpu supports (avx2, then sse2, then a plain loop), configuring
+// with -DRQTREE_SIMD=OFF defines RQTREE_NO_SIMD and leaves only the plain loop
+size_t filter_inside (const rectangle& _rect, const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep);
+// the plain loop, whatever the cpu supports
+size_t filter_inside_scalar (const rectangle& _rect, const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep);
+// the kernel filter_inside runs, "avx2", "sse2" or "scalar"
+const char* filter_kernel ();
+
+typedef size_t (*filter_fn) (const rectangle&, const uint32_t*, const uint32_t*, size_t, uint32_t*);
+// the kernel called _name, null if this build or cpu hasn't got it, so a test can run each one
+filter_fn find_filter_kernel (const char* _name);
+
+#endif
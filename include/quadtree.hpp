@@ -2,31 +2,132 @@
 #define REDIS_QUADTREE_QUADTREE_HPP
 
 #include <string>
+#include <cstdarg>
 #include <vector>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_set>
+#include <unordered_map>
 #include <hiredis/hiredis.h>
 #include <util.hpp>
+#include <region.hpp>
+#include <node.hpp>
+#include <node_cache.hpp>
+#include <scripts.hpp>
+#include <spatial_index.hpp>
+#include <entity_arena.hpp>
+#include <key_space.hpp>
+#include <cluster_router.hpp>
 
-struct entity {
-    union {
-        uint32_t id;
-        unsigned char bytes[4];
-    };
-    point pos;
-    std::string key;
-    std::string ownerKey;
-};
+struct quadtree_options {
+    quadtree_options ()
+        : maxEntitiesPerNode (10), mergeEntities (0), minNodeSize (8), thresholdInterval (1000), adaptiveThresholds (false),
+          adaptiveMin (4), adaptiveMax (256), keyScheme (KEYS_PATH), entityLayout (LAYOUT_SETS), coordinates (COORDS_TEXT), minDepth (0), looseness (1.0),
+          cacheNodes (false), useScripts (false), optimistic (false), writeBehind (false), flushInterval (5), flushThreshold (4096),
+          cluster (false), shardDepth (2), countSubtrees (false) {}
+
+    // a node subdivides once it holds more than maxEntitiesPerNode, unless its quadrants would be narrower than
+    // minNodeSize, and its subnodes merge back into it once they're empty or once the node and everything below it
+    // hold no more than mergeEntities (kept below maxEntitiesPerNode), so a node near the threshold doesn't split
+    // and merge over and over, at the cost of counting a small subtree whenever one of its leaves gets that small
+    // the tree keeps these in its root's hash: the client that makes it writes its own, and every client takes
+    // the tree's from there (see quadtree::set_thresholds), minNodeSize only when the quadtree is made
+    uint32_t maxEntitiesPerNode;
+    uint32_t mergeEntities;
+    uint32_t minNodeSize;
+    // every thresholdInterval operations the thresholds are read from the tree again (0 never), to take up the
+    // ones another client set, with adaptiveThresholds they are then also tuned from what those operations cost
+    // (see quadtree::tune_thresholds) to between adaptiveMin and adaptiveMax entities per node, keeping the ratio
+    // of mergeEntities to maxEntitiesPerNode, and written back for every client
+    // tuning needs the stats (RQTREE_STATS), with writeBehind the thresholds are only read when the quadtree is made
+    uint32_t thresholdInterval;
+    bool adaptiveThresholds;
+    uint32_t adaptiveMin;
+    uint32_t adaptiveMax;
+
+    // rqtree_migrate converts a KEYS_PATH tree to KEYS_MORTON
+    key_scheme keyScheme;
+    // has to match the layout the tree was created with
+    entity_layout entityLayout;
+    // how the entity hashes (LAYOUT_SETS) and node rects hold their coordinates, COORDS_BINARY sends and reads
+    // them as their bytes instead of formatting and parsing decimals, has to match what the tree was created with
+    coordinate_encoding coordinates;
+    // nodes above this depth are subdivided up front and never merged back, so the tree's shape down to
+    // here is fixed and every subtree at this depth can be changed independently (see concurrent_quadtree)
+    uint32_t minDepth;
+    // above 1 the tree is loose: an entity only leaves its node once it is outside the node's rect grown
+    // to looseness times its size (see rectangle::loosened), so entities jittering around an edge stay put
+    // queries search the grown rects, every client of the tree has to use the same value
+    double looseness;
+
+    // keep the node structure in process so descents don't read it back from redis
+    // only safe while this quadtree is the only writer
+    bool cacheNodes;
+    // run insert, remove and relocate as server side lua scripts (one round trip each)
+    // falls back to walking the tree from the client if the scripts can't be loaded
+    bool useScripts;
+    // run every step of the client side walk (an add, a move, a subdivide, a merge) as a transaction that WATCHes
+    // the keys the step read and is retried from what redis holds now if another client changed them first, so
+    // several clients can write the tree at once without a lock or the scripts, at a round trip or two per step
+    // relocate_entities and insert_entities go one entity at a time, the scripts are atomic already
+    bool optimistic;
+
+    // keep the whole tree in process (a memory_quadtree read from redis when the quadtree is made), run every
+    // operation there and write what changed to redis from a background thread, see quadtree::flush
+    // only safe while this quadtree is the only writer, and changes not yet written are lost if the process dies
+    // cacheNodes and useScripts are ignored
+    bool writeBehind;
+    // a write starts once a change is flushInterval milliseconds old, or sooner once flushThreshold nodes
+    // and entities have changed, an entity that moved several times in between is written once
+    uint32_t flushInterval;
+    size_t flushThreshold;
 
-struct node {
-    std::string key;
-    std::string parentKey;
-    bool subdivided;
-    uint32_t entities;
-    rectangle rect;
+    // with cacheNodes or writeBehind, take what's kept in process from this snapshot (see quadtree::save_snapshot)
+    // when the quadtree is made instead of reading it from redis, falls back to redis if the file isn't usable
+    std::string snapshotPath;
+
+    // publish the keys of the nodes every mutation changed on this channel, one PUBLISH per operation sent
+    // as it finishes without waiting on its reply, so other clients can drop those nodes from their caches
+    // (see quadtree::listen_for_changes), every client writing the tree has to use the same channel
+    // ignored with writeBehind
+    std::string changeChannel;
+
+    // every key of the tree starts with this in redis, so several trees can share one redis or cluster
+    // every client of a tree has to use the same prefix
+    std::string keyPrefix;
+    // the context given to the quadtree is one node of a redis cluster: the slot map is read from it, every master
+    // gets a connection of its own and each command goes to the master holding its key (see cluster_router)
+    // every key of a node is hash tagged with its subtree at shardDepth (see key_space), and minDepth is raised to
+    // shardDepth so those subtrees always exist, a range query reads the subtrees it reaches from all of their
+    // masters at once, every client of the tree has to use the same shardDepth
+    // a step of the tree spans several slots, so useScripts and optimistic are ignored and writeBehind's
+    // writes aren't one transaction, against a redis that isn't a cluster everything goes to the context
+    bool cluster;
+    uint32_t shardDepth;
+
+    // keep the number of entities in every node's subtree in <node>:total, moved along with each entity by the
+    // nodes below where its old and new paths meet, so count_entities takes a subtree inside the region from
+    // one counter and density_grid reads a level's counts in one pipeline
+    // costs an INCRBY per level an add, a remove or a move between subtrees changes, every client writing the tree
+    // has to use it from when the tree is made
+    bool countSubtrees;
 };
 
-class quadtree {
+// mergeEntities as a tree uses it, below _maxEntities so a node that just merged never has to split again
+uint32_t merge_threshold (uint32_t _maxEntities, uint32_t _mergeEntities);
+
+class memory_quadtree;
+struct tree_changes;
+
+// the tree kept in redis, every operation reads and writes it there so any number of clients can share it
+class quadtree : public spatial_index {
     public:
-        quadtree (redisContext* _context, const rectangle& _rect);
+        quadtree (redisContext* _context, const rectangle& _rect, const quadtree_options& _options = quadtree_options () );
+        // with writeBehind, the last changes are flushed before this returns
+        ~quadtree ();
 
         void get_entity (uint32_t _id, entity& _ent);
 
@@ -34,35 +135,322 @@ class quadtree {
         void remove_entity (entity& _ent);
         void relocate_entity (entity& _ent);
 
-        void get_entities (const rectangle& _rect, std::vector<entity>& _ents);
+        using spatial_index::get_entities;
+        void get_entities (const region& _region, std::vector<entity>& _ents);
+        void get_entities (const region& _region, entity_arena& _arena);
+        // nodes are visited nearest first a pipelined batch at a time, and the search stops once the
+        // closest unvisited node is farther than the _k-th candidate
+        void get_nearest (const point& _pos, size_t _k, std::vector<entity>& _ents, uint32_t _maxRadius = 0);
+
+        // in get_entities' order, a level at a time, but the nodes are read a pipelined batch at a time (small at
+        // first, doubling from there) and each entity is handed out as its reply comes in
+        // a node inside the region that the offset covers whole isn't read at all, and no more nodes are read once
+        // the ones inside the region hold enough entities for _limit
+        using spatial_index::visit_entities;
+        size_t visit_entities (const region& _region, const entity_visitor& _visit, size_t _offset = 0, size_t _limit = 0);
+
+        // a level at a time like get_entities, but the nodes on the region's edge are the only ones whose entities
+        // are read, without countSubtrees the nodes inside it are read for their counters all the way down
+        using spatial_index::count_entities;
+        size_t count_entities (const region& _region);
+        // every node down to _level that could intersect _rect is derived from the rects and read in one pipeline,
+        // without countSubtrees a cell that's subdivided has the counters of its subtree read a level at a time
+        void density_grid (const rectangle& _rect, uint32_t _level, std::vector<density_cell>& _cells);
+
+        // relocate a batch of entities (e.g. everything that moved this tick) with their new positions
+        // entities that stay in their owner node only get their position written, the rest move in the same
+        // pipeline unless their new node has to be subdivided, and each node they left is cleaned once
+        void relocate_entities (std::vector<entity>& _ents);
+
+        // load a batch of entities into an empty tree, the nodes are laid out in memory first
+        // and then written in bounded pipelines (falls back to insert_entity if the tree isn't empty)
+        void insert_entities (std::vector<entity>& _ents);
+
+        // drop every cached node, e.g. after another client changed the tree
+        void clear_cache ();
+        // read everything kept in process from redis in one walk, a level at a time with every node of a level
+        // in one pipeline: the whole node cache with cacheNodes, the whole tree with writeBehind (after a flush)
+        // returns the number of nodes read, 0 if this quadtree keeps nothing in process
+        size_t warm ();
+
+        // write the whole tree, nodes and entities, to a snapshot file (see snapshot.hpp), read from redis
+        // unless writeBehind already holds it
+        bool save_snapshot (const std::string& _path);
+        // take what's kept in process from a snapshot instead of from redis, without reading redis at all
+        // the snapshot has to be of the tree redis holds now, changes not yet flushed are dropped
+        // false if the file isn't usable or this quadtree keeps nothing in process
+        bool load_snapshot (const std::string& _path);
+
+        // the thresholds the tree splits and merges nodes by now, see quadtree_options::maxEntitiesPerNode
+        uint32_t split_threshold () const;
+        uint32_t merge_threshold () const;
+        // stores new thresholds with the tree, a node splits or merges by them from its next change on and the
+        // other clients take them up within thresholdInterval operations
+        void set_thresholds (uint32_t _maxEntities, uint32_t _mergeEntities);
+
+        // false once the scripts couldn't be (re)loaded and mutations walk the tree from the client
+        bool runs_scripts () const;
+        // the error the last script that failed replied with (a lua error, OOM, BUSY...), empty while none has
+        // redis keeps whatever a script wrote before it failed, so the entity it was run for is read back and
+        // handed to the caller as redis holds it, not as if the operation had worked
+        const std::string& script_error () const;
+        // the rect of a node as redis holds it, false if there's no such node
+        bool get_node_rect (const std::string& _nodeKey, rectangle& _rect);
+        // the cluster masters commands are spread over, 0 unless the tree runs on a cluster
+        size_t masters () const;
+
+        // with cacheNodes and a changeChannel, subscribe to the channel on _subscriber (a connection of its own,
+        // which isn't usable for anything else after this) and drop the nodes other clients changed from the
+        // cache, the changes are applied as the next operation starts so a read only sees a split or merge
+        // once its message has arrived
+        // the cache starts out empty, and caching stops altogether if the subscription is lost
+        bool listen_for_changes (redisContext* _subscriber);
+
+        // with writeBehind, blocks until every change made so far is in redis, e.g. for a checkpoint
+        // false if a write failed, what redis turned down is tried again by the next write, after the
+        // connection is lost nothing more gets written
+        bool flush ();
 
     private:
+        // opened next to the op_counters::scope of every public operation, the outermost one applies the
+        // changes other clients made before the operation runs and publishes the ones it made once it's done
+        class change_scope {
+            public:
+                change_scope (quadtree& _tree)
+                    : tree (_tree), outermost (_tree.changeDepth++ == 0) {
+                    if (outermost)
+                        tree.apply_changes ();
+                }
+                ~change_scope () {
+                    tree.changeDepth--;
+                    if (outermost) {
+                        tree.publish_changes ();
+                        tree.mergedKeys.clear ();
+                        tree.refresh_thresholds ();
+                    }
+                }
+
+            private:
+                quadtree& tree;
+                const bool outermost;
+        };
+
         bool subdivide (const node& _node);
+        bool can_subdivide (const node& _node) const;
+        void subdivide_to_min_depth (node& _node);
+        bool is_empty ();
         void clean (node& _node);
+        // moves every entity below _node up into it and deletes its subnodes, false if the node and its subtree
+        // hold more than mergeEntities, the subtree is read a level at a time and only as far as it takes to tell
+        bool merge_subtree (node& _node);
+
+        // the thresholds stored with the tree, false if they couldn't be read, minNodeSize only with _nodeSize
+        // (every node is laid out by it, it can't change under a tree that's in use)
+        bool read_thresholds (bool _nodeSize = false);
+        // every thresholdInterval operations, as the outermost change_scope closes
+        void refresh_thresholds ();
+        // the leaf size that balances what a round trip costs against what an entity in a reply costs, over the
+        // operations since the last tuning
+        void tune_thresholds ();
 
         void get_node (const std::string& _nodeKey, node& _node);
+        void get_subnode (const node& _node, int _quad, node& _subnode);
+        void read_node (node& _node, bool _readRect);
         void get_destination_node (const entity& _ent, const node& _currNode, node& _destNode, bool& _stayParent);
 
         void add_entity (const node& _node, entity& _ent);
         void update_entity (const entity& _ent);
         void delete_entity (entity& _ent);
         void move_entity (entity& _ent, const node& _srcNode, const node& _destNode);
-        void reinsert_entity (entity& _ent, const node& _ownerNode, node& _destNode);
-        void relocate_entity (entity& _ent, node& _ownerNode, node& _currNode, node& _destNode);
+        // adds _ent to the node under _currNode it belongs in, or moves it there from _ownerNode
+        // false if it turned out not to be in _ownerNode anymore (optimistic)
+        bool place_entity (entity& _ent, const node* _ownerNode, node& _currNode);
+        bool relocate_entity (entity& _ent, node& _ownerNode, node& _currNode, node& _destNode);
+        void split_bucket (const node& _node, const std::vector<entity>& _ents);
+        std::string read_bucket (const std::string& _nodeKey);
+        void write_bucket (const std::string& _nodeKey, const std::string& _bucket);
+        // with countSubtrees, what moving _count entities from _srcKey's subtree to _destKey's (either empty for an
+        // add or a remove) does to the totals: the nodes above _srcKey lose them and the ones above _destKey gain
+        // them, up to where the two paths meet
+        void total_deltas (const std::string& _srcKey, const std::string& _destKey, int32_t _count,
+            std::unordered_map<std::string, int32_t>& _deltas) const;
+        // queues an INCRBY per total that changes, returns how many were queued
+        size_t append_totals (const std::unordered_map<std::string, int32_t>& _deltas);
+        size_t append_totals (const std::string& _srcKey, const std::string& _destKey, int32_t _count);
 
         void get_node_entities (const node& _node, std::vector<entity>& _ents);
-        void get_entities (const node& _node, const rectangle& _rect, std::vector<entity>& _ents);
+        // _visited gets every node the search read
+        void get_entities (std::vector<node>& _nodes, std::vector<bool>& _contained, const region& _region, entity_arena& _arena,
+            std::vector<node>* _visited = NULL);
         void get_all_entities (const node& _node, std::vector<entity>& _ents);
+        // _contained tells which of _nodes are inside _region
+        size_t count_entities (std::vector<node>& _nodes, std::vector<bool>& _contained, const region& _region);
 
-        void delete_empty_subnodes (const std::string& _nodeKey, bool& empty);
+        // _emptyKeys gets every node whose subnodes can be deleted, deepest first
+        void find_empty_subnodes (const std::string& _nodeKey, bool& empty, std::vector<std::string>& _emptyKeys);
         void delete_subnodes (const std::string& _nodeKey);
 
+        // the optimistic transactions, every one of these is a no-op that succeeds without optimistic
+        // starts a step: WATCH _node and reread it, false if it changed since it was read (_node is then as it is
+        // now, or its parent if it was merged away)
+        bool watch_node (node& _node);
+        // adds _ent's record to the step and checks it's still in its owner
+        bool watch_owner (const entity& _ent);
+        // adds _keys to the step, only queued, nothing outside of a step
+        void watch (const std::vector<std::string>& _keys);
+        void unwatch ();
+        // opens the transaction, every write helper calls this before it queues anything
+        void begin_writes ();
+        // ends the step, false if it lost to another client and nothing was written
+        bool exec ();
+
+        void layout_entities (node& _node, std::vector<entity>& _ents, size_t _begin, size_t _end, std::vector<node>& _nodes);
+        void write_entities (const std::vector<node>& _nodes, const std::vector<entity>& _ents);
+        void read_replies (size_t _count);
+        // false if the connection failed
+        bool drop_unread_replies ();
+        void append_command (const std::vector<std::string>& _args);
+        // every command goes through these, so they can be counted
+        void append (const char* _format, ...);
+        redisReply* command (const char* _format, ...);
+        redisReply* get_reply ();
+        // below the counters, where the keys are mapped and the commands routed, the flusher uses these directly
+        void queue (const char* _format, ...);
+        void vqueue (const char* _format, va_list _args);
+        void queue_argv (const std::vector<std::string>& _args);
+        void send_argv (const std::vector<std::string>& _args);
+        // false if the connection failed, _waited is set if this had to wait on redis
+        bool next_reply (void** _reply, bool& _waited);
+        // sends everything queued without waiting on it
+        void flush_output ();
+
+        // how a mutation run as a script went
+        enum script_result {
+            SCRIPT_DONE,
+            // redis replied with an error, see script_error
+            SCRIPT_FAILED,
+            // it never ran (the scripts couldn't be loaded or the connection failed), the client side has to do it
+            SCRIPT_NOT_RUN
+        };
+
+        bool load_scripts ();
+        script_result run_script (script_id _script, const entity& _ent, std::string& _ownerKey);
+        void append_script (script_id _script, const entity& _ent);
+        bool is_noscript (const redisReply* _reply) const;
+        // frees the error reply of a script, remembering it for script_error
+        void script_failed (redisReply* _reply);
+        // frees _reply, _dirtyKeys gets the nodes the script subdivided or cleaned
+        void read_script_reply (redisReply* _reply, std::string& _ownerKey, std::vector<std::string>& _dirtyKeys);
+        void uncache_subtree (const std::string& _nodeKey);
+
+        // remembers a node this operation changed for publish_changes
+        void node_changed (const std::string& _nodeKey);
+        void publish_changes ();
+        void apply_changes ();
+        // the node and everything below it, cached or not, as far as a split or merge of it reaches
+        void forget_node (const std::string& _nodeKey);
+        void run_listener ();
+        // rereads the owner of every entity owned by one of _nodeKeys or a node below them
+        void refresh_owners (std::vector<entity>& _ents, const std::unordered_set<std::string>& _nodeKeys);
+
+        // every node and entity in the tree, a level at a time
+        void read_tree (std::vector<node>& _nodes, std::vector<entity>& _ents);
+        // the same without the entities
+        void read_nodes (std::vector<node>& _nodes);
+        // wakes the flusher if an operation just made the first change or crossed flushThreshold
+        void wake_flusher (size_t _changedBefore);
+        void run_flusher ();
+        // takes the changes and writes them in one transaction, with writeMutex held
+        bool write_changes ();
+
+        std::string subnode_key (const std::string& _nodeKey, int _quad) const;
+        std::string parent_key (const std::string& _nodeKey) const;
+
     private:
         redisContext* context;
-        const uint32_t maxEntitiesPerNode;
-        const uint32_t minNodeSize;
+        // with cluster, every command goes through this instead of straight to the context
+        cluster_router* router;
+        const key_space keySpace;
+        // set from the tree, see read_thresholds
+        uint32_t maxEntitiesPerNode;
+        uint32_t mergeEntities;
+        uint32_t minNodeSize;
+        const uint32_t thresholdInterval;
+        const bool adaptiveThresholds;
+        const uint32_t adaptiveMin;
+        const uint32_t adaptiveMax;
+        // mergeEntities over maxEntitiesPerNode as the options had them, what tuning keeps
+        const double mergeRatio;
+        uint32_t operationsSinceRefresh;
+        // the stats as of the last tuning, and the time a read of the thresholds took (a moving average)
+        quadtree_stats tunedStats;
+        double roundTripNanos;
+        // gets the nodes merge_subtree merged entities into, the owners of what was below them changed
+        std::vector<std::string> mergedKeys;
+
+        const key_scheme keyScheme;
+        std::string rootKey;
+        // the rect the tree was made with, what a snapshot is checked against
+        const rectangle rootRect;
+        const entity_layout entityLayout;
+        const coordinate_encoding coordinates;
+        const uint32_t minDepth;
+        const double looseness;
+        const bool countSubtrees;
+
+        // what get_entities into a vector collects its results in before they're copied out
+        entity_arena results;
+
+        bool cacheNodes;
+        node_cache cache;
+
+        bool useScripts;
+        std::string scriptShas[SCRIPT_COUNT];
+        std::string scriptError;
+
+        const bool optimistic;
+        // a step is being watched, and its MULTI has been queued
+        bool watching;
+        bool inMulti;
+        // gets the nodes subdivide splits while it's set
+        std::unordered_set<std::string>* subdividedKeys;
+
+        // commands were queued since the last time the context waited on redis
+        bool unsent;
+        // replies to commands that were sent without waiting, read and dropped before the next reply
+        size_t unreadReplies;
+        // vqueue and send_argv build every command in these, so a mapped command reuses their buffers
+        std::vector<std::string> formatArgs;
+        std::vector<const char*> sendArgv;
+        std::vector<size_t> sendArgvLengths;
+
+        const std::string changeChannel;
+        // tells this quadtree's own messages apart from the others'
+        std::string sourceId;
+        std::unordered_set<std::string> changedKeys;
+        uint32_t changeDepth;
+
+        redisContext* subscriber;
+        std::thread listener;
+        std::atomic<bool> listenerStopping;
+        // set by the listener, the rest is guarded by incomingMutex
+        std::atomic<bool> changesWaiting;
+        std::mutex incomingMutex;
+        std::vector<std::string> incomingKeys;
+        bool listenerLost;
 
-        std::vector<entity> tempEnts;
+        // with writeBehind the operations run on local, and only the flusher uses the context
+        memory_quadtree* local;
+        std::mutex localMutex;
+        // held for the whole of a write, so writes go out in the order their changes were taken
+        std::mutex writeMutex;
+        std::condition_variable flushWake;
+        std::thread flusher;
+        bool stopping;
+        // the connection was lost writing, the changes stay in local from then on
+        bool writeFailed;
+        const std::chrono::milliseconds flushInterval;
+        const size_t flushThreshold;
 };
 
 #endif
@@ -0,0 +1,68 @@
+#ifndef REDIS_QUADTREE_REGION_HPP
+#define REDIS_QUADTREE_REGION_HPP
+
+#include <vector>
+#include <util.hpp>
+
+// the area a range query searches, the descent only needs to know how it relates to points and node rects
+// a node inside the region has all of its entities taken without testing them, one outside it is never read
+class region {
+    public:
+        virtual ~region () {}
+
+        virtual bool contains (const point& _point) const = 0;
+        virtual bool contains (const rectangle& _rect) const = 0;
+        virtual bool intersects (const rectangle& _rect) const = 0;
+
+        // the index of every point in _xs and _ys this contains written to _keep (room for _count), in order,
+        // returns how many there were, one contains call per point unless a region has something faster
+        virtual size_t filter (const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep) const;
+};
+
+class rectangle_region : public region {
+    public:
+        rectangle_region (const rectangle& _rect);
+
+        bool contains (const point& _point) const;
+        bool contains (const rectangle& _rect) const;
+        bool intersects (const rectangle& _rect) const;
+        // a simd kernel, see filter_inside
+        size_t filter (const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep) const;
+
+    private:
+        rectangle rect;
+};
+
+// every point within _radius of _center, its edge included
+class circle : public region {
+    public:
+        circle (const point& _center, uint32_t _radius);
+
+        bool contains (const point& _point) const;
+        bool contains (const rectangle& _rect) const;
+        bool intersects (const rectangle& _rect) const;
+
+    private:
+        point center;
+        uint64_t squaredRadius;
+};
+
+// a convex polygon with its vertices in order (either way around), its edges included
+// one with no area (fewer than three vertices, or all of them on a line) contains nothing
+// the math is exact while coordinates stay below 2^31
+class polygon : public region {
+    public:
+        polygon (const std::vector<point>& _vertices);
+
+        bool contains (const point& _point) const;
+        bool contains (const rectangle& _rect) const;
+        bool intersects (const rectangle& _rect) const;
+
+    private:
+        std::vector<point> vertices;
+        rectangle bounds;
+        // 1 if the vertices go counter clockwise (y down), -1 if clockwise, 0 if they're all on one line
+        int winding;
+};
+
+#endif
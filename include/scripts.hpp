@@ -0,0 +1,22 @@
+#ifndef REDIS_QUADTREE_SCRIPTS_HPP
+#define REDIS_QUADTREE_SCRIPTS_HPP
+
+#include <string>
+
+// lua versions of the quadtree mutations, each one runs server side as a single EVALSHA
+// every script takes ARGV[1] = maxEntitiesPerNode, ARGV[2] = minNodeSize, ARGV[3] = key_scheme,
+// ARGV[4] = entity_layout, ARGV[5] = minDepth, ARGV[6] = looseness, ARGV[7] = the key prefix (see key_space),
+// ARGV[8] = coordinate_encoding, ARGV[9] = countSubtrees and ARGV[10] = mergeEntities ahead of its own arguments, and
+// replies with the entity's owner key followed by the keys of every node it changed
+enum script_id {
+    SCRIPT_INSERT,      // ARGV[11] = id, ARGV[12] = x, ARGV[13] = y
+    SCRIPT_REMOVE,      // ARGV[11] = id
+    SCRIPT_RELOCATE,    // ARGV[11] = id, ARGV[12] = x, ARGV[13] = y
+    SCRIPT_COUNT
+};
+
+std::string script_source (script_id _script);
+// looseness written out exactly, the scripts have to grow node rects the same way the client does
+std::string looseness_arg (double _looseness);
+
+#endif
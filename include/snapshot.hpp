@@ -0,0 +1,22 @@
+#ifndef REDIS_QUADTREE_SNAPSHOT_HPP
+#define REDIS_QUADTREE_SNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+#include <node.hpp>
+
+// a tree's nodes and entities in one binary file, so a restarted process can take its tree back without
+// reading redis (see quadtree::save_snapshot)
+// the file is a header, a table of fixed size node records, a table of entity records and the node keys,
+// all in host byte order, and it is read through mmap so loading is one pass over the mapped tables
+// a snapshot says nothing about whether redis still holds the same tree, that's up to whoever loads it
+
+// the nodes have to be in the order memory_quadtree::restore takes them, every node after its parent
+bool write_snapshot (const std::string& _path, const rectangle& _rect, key_scheme _keyScheme,
+    const std::vector<node>& _nodes, const std::vector<entity>& _ents);
+
+// false if the file can't be read, is damaged or was written for another root rect or key scheme
+bool read_snapshot (const std::string& _path, const rectangle& _rect, key_scheme _keyScheme,
+    std::vector<node>& _nodes, std::vector<entity>& _ents);
+
+#endif
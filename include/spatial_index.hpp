@@ -0,0 +1,84 @@
+#ifndef REDIS_QUADTREE_SPATIAL_INDEX_HPP
+#define REDIS_QUADTREE_SPATIAL_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <functional>
+#include <util.hpp>
+#include <region.hpp>
+#include <node.hpp>
+#include <entity_arena.hpp>
+#include <stats.hpp>
+
+// one cell of a density_grid: a node of the tree and how many entities its subtree holds
+struct density_cell {
+    std::string key;
+    rectangle rect;
+    uint32_t count;
+};
+
+// what every engine of the tree can do, so the same code runs against redis (quadtree) or against
+// the tree kept in process (memory_quadtree)
+class spatial_index {
+    public:
+        // gets each entity of a visit_entities as soon as it's read, returning false stops the query there
+        typedef std::function<bool (const entity& _ent)> entity_visitor;
+
+        virtual ~spatial_index () {}
+
+        virtual void get_entity (uint32_t _id, entity& _ent) = 0;
+
+        virtual void insert_entity (entity& _ent) = 0;
+        virtual void remove_entity (entity& _ent) = 0;
+        virtual void relocate_entity (entity& _ent) = 0;
+
+        void get_entities (const rectangle& _rect, std::vector<entity>& _ents);
+        void get_entities_in_radius (const point& _center, uint32_t _radius, std::vector<entity>& _ents);
+        // _vertices make up a convex polygon, in order either way around
+        void get_entities_in_polygon (const std::vector<point>& _vertices, std::vector<entity>& _ents);
+        // any other shape, see region
+        virtual void get_entities (const region& _region, std::vector<entity>& _ents) = 0;
+        // the same into an arena that's cleared first, reusing one from query to query a big result
+        // doesn't cost an allocation per entity
+        virtual void get_entities (const region& _region, entity_arena& _arena) = 0;
+        // the _k entities closest to _pos, nearest first, none farther than _maxRadius (0 for no limit)
+        virtual void get_nearest (const point& _pos, size_t _k, std::vector<entity>& _ents, uint32_t _maxRadius = 0) = 0;
+
+        size_t visit_entities (const rectangle& _rect, const entity_visitor& _visit, size_t _offset = 0, size_t _limit = 0);
+        // the entities of _region one at a time without collecting them, skipping the first _offset and stopping after
+        // _limit (0 for no limit), returns how many _visit got, which mustn't call back into the tree
+        // the nodes are read lazily, only as many as it takes to get that far, and the order is the engine's own
+        // but the same every time, so _offset and _limit page through a tree that isn't changing
+        virtual size_t visit_entities (const region& _region, const entity_visitor& _visit, size_t _offset = 0, size_t _limit = 0) = 0;
+        // one such page of the region into _ents (cleared first)
+        void get_entities (const region& _region, std::vector<entity>& _ents, size_t _offset, size_t _limit);
+
+        size_t count_entities (const rectangle& _rect);
+        // how many entities get_entities would return, a subtree inside the region is counted from its total
+        // without reading its entities where the engine keeps subtree totals (see quadtree_options::countSubtrees)
+        virtual size_t count_entities (const region& _region) = 0;
+        // a cell per node at depth _level whose rect intersects _rect, or per leaf above that depth where the tree
+        // doesn't reach it, each with the total of its subtree (its whole rect, not only the part inside _rect)
+        // entities kept by a node above the cells, on the edge of its quadrants, aren't in any of them
+        virtual void density_grid (const rectangle& _rect, uint32_t _level, std::vector<density_cell>& _cells) = 0;
+
+        // relocate a batch of entities (e.g. everything that moved this tick) with their new positions
+        virtual void relocate_entities (std::vector<entity>& _ents) = 0;
+        virtual void insert_entities (std::vector<entity>& _ents) = 0;
+        // same as insert_entities, reading "<id> <x> <y>" lines from a text file
+        bool load_entities (const std::string& _filename);
+
+        // running totals over every operation
+        const quadtree_io& io () const;
+        // the same counters and the wall time split up by public operation, see stats.hpp
+        const quadtree_stats& stats () const;
+        void reset_stats ();
+        // write the stats of the last _intervalSeconds to _out every _intervalSeconds, NULL stops the dumps
+        void dump_stats (std::ostream* _out, uint32_t _intervalSeconds);
+
+    protected:
+        op_counters counters;
+};
+
+#endif
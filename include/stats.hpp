@@ -0,0 +1,129 @@
+#ifndef REDIS_QUADTREE_STATS_HPP
+#define REDIS_QUADTREE_STATS_HPP
+
+#include <cstdint>
+#include <chrono>
+#include <ostream>
+
+// configuring with -DRQTREE_STATS=OFF defines RQTREE_NO_STATS, which compiles every counter out
+// and leaves the stats at zero
+#ifdef RQTREE_NO_STATS
+#define RQTREE_COUNT(_counters, _counter, _n) ( (void)0)
+#else
+#define RQTREE_COUNT(_counters, _counter, _n) ( (_counters).io._counter += (_n) )
+#endif
+
+// what a tree's operations have cost so far, a round trip is every time it had to wait on a reply
+// subdivides and cleans only count the ones walked from the client, the scripts do theirs server side
+// memory_quadtree never talks to redis, so it only counts nodes, subdivides and cleans
+struct quadtree_io {
+    quadtree_io ()
+        : commands (0), roundTrips (0), replyBytes (0), nodesVisited (0), subdivides (0), cleans (0), conflicts (0) {}
+
+    quadtree_io& operator+= (const quadtree_io& _io);
+    quadtree_io operator- (const quadtree_io& _io) const;
+
+    uint64_t commands;
+    uint64_t roundTrips;
+    // the strings in the replies, without the protocol around them
+    uint64_t replyBytes;
+    uint64_t nodesVisited;
+    uint64_t subdivides;
+    uint64_t cleans;
+    // optimistic transactions that were dropped because another client changed what they read, and retried
+    uint64_t conflicts;
+};
+
+// the public quadtree operations, get_entities covers every region query, visit_entities every streamed one and
+// count_entities every region count
+enum stats_op {
+    OP_GET_ENTITY,
+    OP_INSERT_ENTITY,
+    OP_REMOVE_ENTITY,
+    OP_RELOCATE_ENTITY,
+    OP_GET_ENTITIES,
+    OP_GET_NEAREST,
+    OP_RELOCATE_ENTITIES,
+    OP_INSERT_ENTITIES,
+    OP_COUNT_ENTITIES,
+    OP_DENSITY_GRID,
+    OP_VISIT_ENTITIES,
+    OP_COUNT
+};
+
+const char* op_name (stats_op _op);
+
+struct op_stats {
+    op_stats ()
+        : calls (0), nanos (0) {}
+
+    uint64_t calls;
+    // wall time
+    uint64_t nanos;
+    quadtree_io io;
+};
+
+struct quadtree_stats {
+    op_stats ops[OP_COUNT];
+
+    quadtree_stats& operator+= (const quadtree_stats& _stats);
+    quadtree_stats operator- (const quadtree_stats& _stats) const;
+
+    // one line per operation that was called
+    void write (std::ostream& _out) const;
+};
+
+// the counters of one tree, which is only ever used from one thread so none of this needs to be atomic
+class op_counters {
+    public:
+        // opened at the start of every public operation, books what it cost once it goes out of scope
+        // an operation called from inside another one counts towards the outer one
+        class scope {
+            public:
+#ifdef RQTREE_NO_STATS
+                scope (op_counters&, stats_op) {}
+#else
+                scope (op_counters& _counters, stats_op _op)
+                    : counters (_counters), op (_op), outermost (_counters.depth++ == 0), startIo (_counters.io),
+                      start (std::chrono::steady_clock::now () ) {}
+                ~scope () {
+                    counters.depth--;
+                    if (outermost)
+                        counters.book (op, start, startIo);
+                }
+
+            private:
+                op_counters& counters;
+                const stats_op op;
+                const bool outermost;
+                const quadtree_io startIo;
+                const std::chrono::steady_clock::time_point start;
+#endif
+        };
+
+        op_counters ();
+
+        const quadtree_stats& stats () const;
+        void reset ();
+        // write the stats of the last _intervalSeconds to _out every _intervalSeconds, checked as operations
+        // finish so nothing runs in the background, NULL stops the dumps
+        void dump_every (std::ostream* _out, uint32_t _intervalSeconds);
+
+    public:
+        // running totals over every operation, added to with RQTREE_COUNT
+        quadtree_io io;
+
+    private:
+        void book (stats_op _op, const std::chrono::steady_clock::time_point& _start, const quadtree_io& _startIo);
+
+    private:
+        quadtree_stats opStats;
+        uint32_t depth;
+
+        std::ostream* dumpOut;
+        std::chrono::steady_clock::duration dumpInterval;
+        std::chrono::steady_clock::time_point nextDump;
+        quadtree_stats lastDump;
+};
+
+#endif
@@ -5,6 +5,13 @@
 #include <cstdint>
 #include <hiredis/hiredis.h>
 
+// how entity positions and node rects are stored in their redis hashes
+enum coordinate_encoding {
+    COORDS_TEXT,    // decimal strings
+    COORDS_BINARY   // the 4 bytes of each value in host byte order, as point and rectangle hold them
+                    // (the lua scripts read them as little endian)
+};
+
 class point {
     public:
         point () {}
@@ -25,13 +32,23 @@ class rectangle {
     public:
         rectangle () {}
         rectangle (uint32_t _x, uint32_t _y, uint32_t _width, uint32_t _height);
-        rectangle (redisContext* _context, std::string _key);
+        rectangle (redisContext* _context, std::string _key, coordinate_encoding _encoding = COORDS_TEXT);
+        // the reply to HVALS <node>:rect, the fields are read where they are in the reply
+        rectangle (const redisReply* _reply, coordinate_encoding _encoding = COORDS_TEXT);
+
+        // one of the four rectangles this splits into (0 = tl, 1 = tr, 2 = bl, 3 = br)
+        rectangle quadrant (int _quad) const;
+        // grown around its center to _looseness times its size, the bounds of a loose quadtree node
+        rectangle loosened (double _looseness) const;
 
         const bool contains (const point& _point) const;
         const bool contains (const rectangle& _rect) const;
 
         const bool intersects (const rectangle& _rect) const;
 
+        // from _point to the closest point of this rect, 0 if it's inside
+        uint64_t squared_distance (const point& _point) const;
+
     public:
         union {
             struct {
@@ -44,4 +61,35 @@ class rectangle {
         };
 };
 
+uint64_t squared_distance (const point& _a, const point& _b);
+
+// one coordinate as the argument of a %b, formatted on the stack:
+// append ("HSET %s x %b", key, arg.data (), arg.size () )
+class coordinate_arg {
+    public:
+        coordinate_arg (coordinate_encoding _encoding, uint32_t _value);
+
+        const char* data () const { return bytes; }
+        size_t size () const { return length; }
+
+    private:
+        char bytes[12];
+        size_t length;
+};
+
+// the coordinate in a reply string, read in place, 0 if the reply isn't a string
+uint32_t read_coordinate (coordinate_encoding _encoding, const redisReply* _reply);
+// the decimal number in a reply string (a counter or an id), read in place
+uint32_t read_uint (const redisReply* _reply);
+uint32_t read_uint (const char* _str);
+
+// interleaves the bits of x and y, points that are close in space end up close in this order
+uint64_t morton_code (uint32_t _x, uint32_t _y);
+
+// compact node keys, built from a node's locational code: a leading 1 bit followed by the morton
+// bits of its quadrant at every level (the root is 1, its top right subnode is 0b101, ...)
+// the code is stored 7 bits per byte with the high bit set, so a key never contains a zero or ':'
+std::string morton_key (uint64_t _code);
+uint64_t morton_key_code (const std::string& _key);
+
 #endif
@@ -0,0 +1,479 @@
+#include <cstdarg>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <async_quadtree.hpp>
+
+// a mutation or get_entity waiting on its reply
+struct async_quadtree::request {
+    async_quadtree* tree;
+    script_id script;
+    entity ent;
+    entity_callback callback;
+    // set once the script has been sent as a plain EVAL
+    bool evaluated;
+    // what redis replied to the script if it failed, the entity is read back before the callback gets it
+    std::string error;
+};
+
+// a get_entities call, it runs one tree level at a time like quadtree::get_entities
+// the next level is read once every reply of the current one is in
+struct async_quadtree::query {
+    async_quadtree* tree;
+    rectangle rect;
+    std::vector<node> nodes, subnodes;
+    std::vector<bool> contained, subnodesContained;
+    std::vector<entity> ents;
+    entities_callback callback;
+    size_t outstanding;
+};
+
+// one command sent for a query, _index is the node it's about
+struct async_quadtree::query_step {
+    query* owner;
+    size_t index;
+    std::string id;
+};
+
+async_quadtree::async_quadtree (redisAsyncContext* _context, const rectangle& _rect, const quadtree_options& _options)
+    : maxEntitiesPerNode (std::max (_options.maxEntitiesPerNode, 1u) ),
+      mergeEntities (merge_threshold (maxEntitiesPerNode, _options.mergeEntities) ), minNodeSize (_options.minNodeSize), keyScheme (_options.keyScheme), entityLayout (_options.entityLayout),
+      coordinates (_options.coordinates), minDepth (_options.minDepth), looseness (std::max (_options.looseness, 1.0) ),
+      countSubtrees (_options.countSubtrees), keySpace (_options.keyScheme, _options.keyPrefix, false, 0),
+      scriptsLoading (SCRIPT_COUNT), inFlight (0) {
+    context = _context;
+    rootKey = root_key (keyScheme);
+
+    std::string nodeKey = keySpace.map (rootKey), rectKey = keySpace.map (rootKey + ":rect");
+
+    // setup the base of the quadtree unless it's already there, the rect fields keep this order for HVALS
+    // the rect goes first, a client that finds the root has to find all of it (see quadtree's constructor)
+    coordinate_arg x (coordinates, _rect.x), y (coordinates, _rect.y), w (coordinates, _rect.width), h (coordinates, _rect.height);
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s x %b", rectKey.c_str (), x.data (), x.size () );
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s y %b", rectKey.c_str (), y.data (), y.size () );
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s w %b", rectKey.c_str (), w.data (), w.size () );
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s h %b", rectKey.c_str (), h.data (), h.size () );
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s subdivided 0", nodeKey.c_str () );
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s entities 0", nodeKey.c_str () );
+
+    // the thresholds stored with the tree win over the options, redis replies in order so they're in before the
+    // scripts are loaded and anything runs
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s maxEntities %u", nodeKey.c_str (), maxEntitiesPerNode);
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s mergeEntities %u", nodeKey.c_str (), mergeEntities);
+    redisAsyncCommand (context, NULL, NULL, "HSETNX %s minNodeSize %u", nodeKey.c_str (), minNodeSize);
+    redisAsyncCommand (context, on_config_reply, this, "HMGET %s maxEntities mergeEntities minNodeSize", nodeKey.c_str () );
+
+    for (int i = 0; i < SCRIPT_COUNT; i++) {
+        request* loading = new request ();
+        loading->tree = this;
+        loading->script = (script_id)i;
+
+        std::string source = script_source ( (script_id)i);
+        if (redisAsyncCommand (context, on_script_loaded, loading, "SCRIPT LOAD %b", source.data (), source.size () ) != REDIS_OK) {
+            scriptsLoading--;
+            delete loading;
+        }
+    }
+}
+
+void async_quadtree::get_entity (uint32_t _id, const entity_callback& _callback) {
+    request* req = new request ();
+    req->tree = this;
+    req->script = SCRIPT_COUNT;
+    req->ent.id = _id;
+    req->callback = _callback;
+    inFlight++;
+
+    look_up (req);
+}
+
+void async_quadtree::insert_entity (const entity& _ent, const entity_callback& _callback) {
+    run_script (SCRIPT_INSERT, _ent, _callback);
+}
+
+void async_quadtree::remove_entity (const entity& _ent, const entity_callback& _callback) {
+    run_script (SCRIPT_REMOVE, _ent, _callback);
+}
+
+void async_quadtree::relocate_entity (const entity& _ent, const entity_callback& _callback) {
+    run_script (SCRIPT_RELOCATE, _ent, _callback);
+}
+
+void async_quadtree::get_entities (const rectangle& _rect, const entities_callback& _callback) {
+    query* q = new query ();
+    q->tree = this;
+    q->rect = _rect;
+    q->callback = _callback;
+    q->outstanding = 0;
+    inFlight++;
+
+    // the root is read on its own first, it then makes up the first level
+    node rootNode;
+    rootNode.key = rootKey;
+    rootNode.parentKey = "";
+    q->subnodes.push_back (rootNode);
+    q->subnodesContained.push_back (false);
+
+    read (q, 0, on_node_reply, "HMGET %s subdivided entities", keySpace.map (rootKey).c_str () );
+    read (q, 0, on_root_reply, "HVALS %s", keySpace.map (rootKey + ":rect").c_str () );
+
+    if (q->outstanding == 0) {
+        q->subnodes.clear ();
+        next_level (q);
+    }
+}
+
+size_t async_quadtree::pending () const {
+    return inFlight;
+}
+
+const std::string& async_quadtree::script_error () const {
+    return scriptError;
+}
+
+void async_quadtree::run_script (script_id _script, const entity& _ent, const entity_callback& _callback) {
+    request* req = new request ();
+    req->tree = this;
+    req->script = _script;
+    req->ent = _ent;
+    req->callback = _callback;
+    req->evaluated = false;
+    inFlight++;
+
+    if (scriptsLoading > 0)
+        waiting.push_back (req);
+    else
+        send_script (req);
+}
+
+void async_quadtree::send_script (request* _request) {
+    // fall back to sending the whole source if the script couldn't be loaded
+    if (scriptShas[_request->script].empty () )
+        _request->evaluated = true;
+
+    const entity& ent = _request->ent;
+    std::string args[16] = {
+        "EVALSHA", scriptShas[_request->script], "0",
+        std::to_string (maxEntitiesPerNode), std::to_string (minNodeSize), std::to_string (keyScheme), std::to_string (entityLayout),
+        std::to_string (minDepth), looseness_arg (looseness), keySpace.prefix (), std::to_string (coordinates), countSubtrees ? "1" : "0",
+        std::to_string (mergeEntities),
+        std::to_string (ent.id),
+        std::to_string (ent.pos.x), std::to_string (ent.pos.y)
+    };
+    if (_request->evaluated) {
+        args[0] = "EVAL";
+        args[1] = script_source (_request->script);
+    }
+
+    const char* argv[16];
+    size_t argvlen[16];
+
+    for (int i = 0; i < 16; i++) {
+        argv[i] = args[i].data ();
+        argvlen[i] = args[i].size ();
+    }
+
+    if (redisAsyncCommandArgv (context, on_script_reply, _request, 16, argv, argvlen) != REDIS_OK) {
+        _request->ent.ownerKey = "";
+        finish (_request);
+    }
+}
+
+void async_quadtree::look_up (request* _request) {
+    entity& ent = _request->ent;
+    ent.key = "entities:" + std::to_string (ent.id);
+    ent.ownerKey = "";
+
+    int status;
+    if (entityLayout == LAYOUT_PACKED)
+        status = redisAsyncCommand (context, on_entity_owner, _request, "HGET %s %u", keySpace.map ("entities:index").c_str (), ent.id);
+    else
+        status = redisAsyncCommand (context, on_entity_reply, _request, "HMGET %s x y owner", keySpace.map (ent.key).c_str () );
+
+    if (status != REDIS_OK)
+        finish (_request);
+}
+
+void async_quadtree::finish (request* _request) {
+    inFlight--;
+
+    if (!_request->error.empty () )
+        scriptError = _request->error;
+
+    if (_request->callback)
+        _request->callback (_request->ent);
+    delete _request;
+}
+
+async_quadtree::query_step* async_quadtree::read (query* _query, size_t _index, redisCallbackFn* _fn, const char* _format, ...) {
+    query_step* step = new query_step ();
+    step->owner = _query;
+    step->index = _index;
+
+    va_list ap;
+    va_start (ap, _format);
+    int status = redisvAsyncCommand (context, _fn, step, _format, ap);
+    va_end (ap);
+
+    // nothing more can be sent once the context is disconnecting, the query finishes with what it has
+    if (status != REDIS_OK) {
+        delete step;
+        return NULL;
+    }
+
+    _query->outstanding++;
+    return step;
+}
+
+void async_quadtree::read_level (query* _query) {
+    for (size_t i = 0; i < _query->nodes.size (); i++) {
+        const node& currNode = _query->nodes[i];
+
+        if (currNode.entities > 0) {
+            if (entityLayout == LAYOUT_PACKED)
+                read (_query, i, on_bucket_reply, "GET %s", keySpace.map (currNode.key + ":bucket").c_str () );
+            else
+                read (_query, i, on_members_reply, "SMEMBERS %s", keySpace.map (currNode.key + ":entities").c_str () );
+        }
+
+        if (!currNode.subdivided)
+            continue;
+
+        for (int quad = 0; quad < 4; quad++) {
+            node subnode;
+            subnode.key = subnode_key (keyScheme, currNode.key, quad);
+            subnode.parentKey = currNode.key;
+            subnode.rect = currNode.rect.quadrant (quad);
+
+            // skip subnodes that are outside the search area
+            rectangle bounds = subnode.rect.loosened (looseness);
+            bool contained = _query->contained[i] || _query->rect.contains (bounds);
+            if (!contained && !_query->rect.intersects (bounds) )
+                continue;
+
+            _query->subnodes.push_back (subnode);
+            _query->subnodesContained.push_back (contained);
+            read (_query, _query->subnodes.size () - 1, on_node_reply, "HMGET %s subdivided entities", keySpace.map (subnode.key).c_str () );
+        }
+    }
+}
+
+void async_quadtree::next_level (query* _query) {
+    // levels where nothing had to be read are skipped straight away
+    while (true) {
+        _query->nodes.swap (_query->subnodes);
+        _query->contained.swap (_query->subnodesContained);
+        _query->subnodes.clear ();
+        _query->subnodesContained.clear ();
+
+        if (_query->nodes.empty () ) {
+            inFlight--;
+            _query->callback (_query->ents);
+            delete _query;
+            return;
+        }
+
+        read_level (_query);
+        if (_query->outstanding > 0)
+            return;
+    }
+}
+
+void async_quadtree::on_config_reply (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    async_quadtree* tree = (async_quadtree*)_data;
+
+    if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 3)
+        return;
+    for (size_t n = 0; n < 3; n++) {
+        if (reply->element[n]->type != REDIS_REPLY_STRING)
+            return;
+    }
+
+    tree->maxEntitiesPerNode = std::max ( (uint32_t)strtoul (reply->element[0]->str, NULL, 10), 1u);
+    tree->mergeEntities = merge_threshold (tree->maxEntitiesPerNode, strtoul (reply->element[1]->str, NULL, 10) );
+    tree->minNodeSize = strtoul (reply->element[2]->str, NULL, 10);
+}
+
+void async_quadtree::on_script_loaded (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    request* loading = (request*)_data;
+    async_quadtree* tree = loading->tree;
+
+    if (reply && reply->type == REDIS_REPLY_STRING)
+        tree->scriptShas[loading->script] = reply->str;
+    delete loading;
+
+    if (--tree->scriptsLoading > 0)
+        return;
+
+    std::vector<request*> waiting;
+    waiting.swap (tree->waiting);
+
+    for (size_t n = 0; n < waiting.size (); n++)
+        tree->send_script (waiting[n]);
+}
+
+void async_quadtree::on_script_reply (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    request* req = (request*)_data;
+
+    if (reply && reply->type == REDIS_REPLY_ERROR && strncmp (reply->str, "NOSCRIPT", 8) == 0 && !req->evaluated) {
+        // the server's script cache was flushed, EVAL loads it again
+        req->evaluated = true;
+        req->tree->send_script (req);
+        return;
+    }
+
+    // a script that failed part way keeps what it wrote up to there, the callback gets the entity as it is now
+    if (reply && reply->type == REDIS_REPLY_ERROR) {
+        req->error.assign (reply->str, reply->len);
+        req->tree->look_up (req);
+        return;
+    }
+
+    req->ent.ownerKey = "";
+    if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements > 0)
+        req->ent.ownerKey = reply->element[0]->str;
+
+    req->ent.key = req->ent.ownerKey != "" ? "entities:" + std::to_string (req->ent.id) : "";
+    req->tree->finish (req);
+}
+
+void async_quadtree::on_entity_owner (redisAsyncContext* _context, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    request* req = (request*)_data;
+
+    // the index has the owner, and the owner's bucket has the position
+    if (reply && reply->type == REDIS_REPLY_STRING) {
+        req->ent.ownerKey = reply->str;
+        std::string bucketKey = req->tree->keySpace.map (req->ent.ownerKey + ":bucket");
+        if (redisAsyncCommand (_context, on_entity_reply, req, "GET %s", bucketKey.c_str () ) == REDIS_OK)
+            return;
+    }
+
+    req->ent.ownerKey = "";
+    req->tree->finish (req);
+}
+
+void async_quadtree::on_entity_reply (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    request* req = (request*)_data;
+    entity& ent = req->ent;
+    bool found = false;
+
+    if (reply && req->tree->entityLayout == LAYOUT_PACKED) {
+        if (reply->type == REDIS_REPLY_STRING) {
+            std::string bucket (reply->str, reply->len);
+            size_t offset = find_entity (bucket, ent.id);
+
+            if (offset != std::string::npos) {
+                memcpy (ent.pos.bytes, bucket.data () + offset + sizeof (uint32_t), sizeof (point) );
+                found = true;
+            }
+        }
+    }
+    else if (reply) {
+        found = parse_entity (req->tree->coordinates, std::to_string (ent.id).c_str (), reply, ent);
+    }
+
+    if (!found)
+        ent.ownerKey = "";
+    req->tree->finish (req);
+}
+
+void async_quadtree::on_root_reply (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    query_step* step = (query_step*)_data;
+    query* q = step->owner;
+
+    // the root's flags came in first, so it's only dropped once this is in
+    if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 4) {
+        q->subnodes[0].rect = rectangle (reply, q->tree->coordinates);
+        rectangle bounds = q->subnodes[0].rect.loosened (q->tree->looseness);
+        q->subnodesContained[0] = q->rect.contains (bounds);
+
+        if (!q->rect.intersects (bounds) )
+            q->subnodes.clear ();
+    }
+    else {
+        q->subnodes.clear ();
+    }
+
+    on_step_done (step);
+}
+
+void async_quadtree::on_node_reply (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    query_step* step = (query_step*)_data;
+
+    node& subnode = step->owner->subnodes[step->index];
+    if (!reply || !parse_node (reply, subnode) ) {
+        subnode.subdivided = false;
+        subnode.entities = 0;
+    }
+
+    on_step_done (step);
+}
+
+void async_quadtree::on_bucket_reply (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    query_step* step = (query_step*)_data;
+    query* q = step->owner;
+
+    if (reply) {
+        size_t first = q->ents.size ();
+        parse_bucket (reply, q->nodes[step->index].key, q->ents);
+
+        // drop whatever is outside the search area
+        if (!q->contained[step->index]) {
+            size_t kept = first;
+            for (size_t n = first; n < q->ents.size (); n++) {
+                if (q->rect.contains (q->ents[n].pos) )
+                    q->ents[kept++] = q->ents[n];
+            }
+            q->ents.resize (kept);
+        }
+    }
+
+    on_step_done (step);
+}
+
+void async_quadtree::on_members_reply (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    query_step* step = (query_step*)_data;
+    query* q = step->owner;
+
+    if (reply && reply->type == REDIS_REPLY_ARRAY) {
+        for (size_t n = 0; n < reply->elements; n++) {
+            std::string entityKey = q->tree->keySpace.map (std::string ("entities:").append (reply->element[n]->str, reply->element[n]->len) );
+            query_step* member = q->tree->read (q, step->index, on_member_reply, "HMGET %b x y owner", entityKey.data (), entityKey.size () );
+            if (member)
+                member->id = reply->element[n]->str;
+        }
+    }
+
+    on_step_done (step);
+}
+
+void async_quadtree::on_member_reply (redisAsyncContext*, void* _reply, void* _data) {
+    redisReply* reply = (redisReply*)_reply;
+    query_step* step = (query_step*)_data;
+    query* q = step->owner;
+
+    entity ent;
+    if (reply && parse_entity (q->tree->coordinates, step->id.c_str (), reply, ent) ) {
+        if (q->contained[step->index] || q->rect.contains (ent.pos) )
+            q->ents.push_back (ent);
+    }
+
+    on_step_done (step);
+}
+
+void async_quadtree::on_step_done (query_step* _step) {
+    query* q = _step->owner;
+    delete _step;
+
+    if (--q->outstanding == 0)
+        q->tree->next_level (q);
+}
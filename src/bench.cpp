@@ -0,0 +1,915 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <hiredis/hiredis.h>
+#include <quadtree.hpp>
+#include <memory_quadtree.hpp>
+#include <concurrent_quadtree.hpp>
+
+// runs a set of workloads against a redis server and reports, for every kind of operation, its latency
+// percentiles and the commands and round trips it cost
+// the database it runs in (--db) is emptied before every workload
+// --engine memory runs the same workloads on memory_quadtree, without redis, to show the cost of the tree itself
+// the contention workload forks --writers processes that write the same tree at once, with --optimistic to
+// see what the transactions cost and without it to see what goes wrong
+// --cluster runs against a redis cluster, --host and --port name any one of its nodes and every master is
+// emptied instead of --db, which a cluster doesn't have
+// the threads workload runs the same uniform queries through concurrent_quadtree for every --threads count, to
+// show how the query throughput scales with worker threads
+
+struct bench_options {
+    bench_options ()
+        : host ("localhost"), port (6379), db (15), entities (10000), ops (10000), ticks (10), querySize (256),
+          worldSize (16384), writers (4), threads ({1, 2, 4, 8}), memory (false), workloads ("uniform,clustered,walk,mixed,churn,delete") {}
+
+    std::string host;
+    int port;
+    int db;
+
+    uint32_t entities;
+    uint32_t ops;
+    uint32_t ticks;
+    uint32_t querySize;
+    uint32_t worldSize;
+    uint32_t writers;
+    std::vector<uint32_t> threads;
+
+    bool memory;
+    std::string workloads;
+    std::string jsonPath;
+    quadtree_options tree;
+};
+
+// latencies bucketed by their top 4 significant bits, so the percentiles are within about 6% at any scale
+class histogram {
+    public:
+        histogram ()
+            : buckets (64 * 16, 0), count (0), total (0), max (0) {}
+
+        void add (uint64_t _nanos, const quadtree_io& _before, const quadtree_io& _after) {
+            buckets[bucket (_nanos)]++;
+            count++;
+            total += _nanos;
+            max = std::max (max, _nanos);
+            io += _after - _before;
+        }
+
+        // the upper bound of the bucket the _fraction-th latency is in
+        uint64_t percentile (double _fraction) const {
+            uint64_t rank = (uint64_t)(_fraction * count);
+            uint64_t seen = 0;
+
+            for (size_t n = 0; n < buckets.size (); n++) {
+                seen += buckets[n];
+                if (seen > rank)
+                    return std::min (upper_bound (n), max);
+            }
+            return max;
+        }
+
+        uint64_t size () const { return count; }
+        double mean () const { return count ? (double)total / count : 0; }
+        uint64_t maximum () const { return max; }
+        double commands_per_op () const { return count ? (double)io.commands / count : 0; }
+        double round_trips_per_op () const { return count ? (double)io.roundTrips / count : 0; }
+        double reply_bytes_per_op () const { return count ? (double)io.replyBytes / count : 0; }
+        double nodes_per_op () const { return count ? (double)io.nodesVisited / count : 0; }
+        double conflicts_per_op () const { return count ? (double)io.conflicts / count : 0; }
+        uint64_t conflicts () const { return io.conflicts; }
+
+        void merge (const histogram& _other) {
+            for (size_t n = 0; n < buckets.size (); n++)
+                buckets[n] += _other.buckets[n];
+            count += _other.count;
+            total += _other.total;
+            max = std::max (max, _other.max);
+            io += _other.io;
+        }
+
+        // as raw bytes, only for another process running the same binary
+        void save (std::string& _out) const {
+            _out.append ( (const char*)&buckets[0], buckets.size () * sizeof (uint64_t) );
+            _out.append ( (const char*)&count, sizeof (count) );
+            _out.append ( (const char*)&total, sizeof (total) );
+            _out.append ( (const char*)&max, sizeof (max) );
+            _out.append ( (const char*)&io, sizeof (io) );
+        }
+
+        bool load (const std::string& _in, size_t& _offset) {
+            size_t size = buckets.size () * sizeof (uint64_t) + 3 * sizeof (uint64_t) + sizeof (io);
+            if (_offset + size > _in.size () )
+                return false;
+
+            const char* data = _in.data () + _offset;
+            memcpy (&buckets[0], data, buckets.size () * sizeof (uint64_t) );
+            data += buckets.size () * sizeof (uint64_t);
+            memcpy (&count, data, sizeof (count) );
+            memcpy (&total, data + sizeof (count), sizeof (total) );
+            memcpy (&max, data + 2 * sizeof (count), sizeof (max) );
+            memcpy (&io, data + 3 * sizeof (count), sizeof (io) );
+
+            _offset += size;
+            return true;
+        }
+
+    private:
+        static size_t bucket (uint64_t _nanos) {
+            if (_nanos < 16)
+                return _nanos;
+
+            int bits = 63 - __builtin_clzll (_nanos);
+            return (bits - 3) * 16 + ( (_nanos >> (bits - 4) ) & 15);
+        }
+
+        static uint64_t upper_bound (size_t _bucket) {
+            if (_bucket < 16)
+                return _bucket;
+
+            int bits = _bucket / 16 + 3;
+            return ( (uint64_t)(16 + _bucket % 16 + 1) << (bits - 4) ) - 1;
+        }
+
+    private:
+        std::vector<uint64_t> buckets;
+        uint64_t count;
+        uint64_t total;
+        uint64_t max;
+        quadtree_io io;
+};
+
+struct result {
+    std::string workload;
+    std::string operation;
+    histogram latencies;
+};
+
+static redisContext* context;
+static bench_options options;
+// a deque so the histograms handed out stay put as more are added
+static std::deque<result> results;
+
+static histogram& latencies (const std::string& _workload, const std::string& _operation) {
+    for (std::deque<result>::iterator it = results.begin (); it != results.end (); it++) {
+        if (it->workload == _workload && it->operation == _operation)
+            return it->latencies;
+    }
+
+    results.push_back (result () );
+    results.back ().workload = _workload;
+    results.back ().operation = _operation;
+    return results.back ().latencies;
+}
+
+static void timed (spatial_index& _tree, histogram& _latencies, const std::function<void ()>& _op) {
+    quadtree_io before = _tree.io ();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+
+    _op ();
+
+    uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - start).count ();
+    _latencies.add (nanos, before, _tree.io () );
+}
+
+static bool flush (redisContext* _context) {
+    redisReply* reply = (redisReply*)redisCommand (_context, "FLUSHDB");
+    bool ok = reply && reply->type != REDIS_REPLY_ERROR;
+    if (reply)
+        freeReplyObject (reply);
+    return ok;
+}
+
+static bool flush () {
+    if (!options.tree.cluster)
+        return flush (context);
+
+    // every master the slot map names, a range is {start, end, {host, port, ...}, replicas...}
+    redisReply* reply = (redisReply*)redisCommand (context, "CLUSTER SLOTS");
+    bool ok = reply && reply->type == REDIS_REPLY_ARRAY;
+
+    for (size_t n = 0; ok && n < reply->elements; n++) {
+        redisReply* master = reply->element[n]->element[2];
+        redisContext* masterContext = redisConnect (master->element[0]->str, master->element[1]->integer);
+
+        ok = !masterContext->err && flush (masterContext);
+        redisFree (masterContext);
+    }
+
+    if (reply)
+        freeReplyObject (reply);
+    return ok;
+}
+
+// a cluster only has database 0
+static bool select_db (redisContext* _context) {
+    if (options.tree.cluster)
+        return true;
+
+    redisReply* reply = (redisReply*)redisCommand (_context, "SELECT %i", options.db);
+    bool ok = reply && reply->type != REDIS_REPLY_ERROR;
+    if (reply)
+        freeReplyObject (reply);
+    return ok;
+}
+
+static uint32_t coordinate () {
+    return rand () % (options.worldSize - 1) + 1;
+}
+
+static point uniform_point () {
+    return point (coordinate (), coordinate () );
+}
+
+// most points land around a few hotspots
+static point clustered_point () {
+    static const int hotspots = 8;
+    static const uint32_t spread = 256;
+
+    if (rand () % 10 == 0)
+        return uniform_point ();
+
+    int hotspot = rand () % hotspots;
+    uint32_t cx = (hotspot * 2654435761u) % (options.worldSize - 2 * spread) + spread;
+    uint32_t cy = (hotspot * 40503u + 7919u) % (options.worldSize - 2 * spread) + spread;
+
+    return point (cx + rand () % (2 * spread) - spread + 1, cy + rand () % (2 * spread) - spread + 1);
+}
+
+static rectangle query_rect (const point& _center) {
+    uint32_t half = options.querySize / 2;
+    uint32_t x = _center.x > half ? _center.x - half : 0;
+    uint32_t y = _center.y > half ? _center.y - half : 0;
+
+    return rectangle (x, y, options.querySize, options.querySize);
+}
+
+static point step (const point& _pos) {
+    int x = (int)_pos.x + rand () % 33 - 16;
+    int y = (int)_pos.y + rand () % 33 - 16;
+    int last = options.worldSize - 1;
+
+    return point (std::min (std::max (x, 1), last), std::min (std::max (y, 1), last) );
+}
+
+static void insert (spatial_index& _tree, const std::string& _workload, std::vector<entity>& _ents, const std::function<point ()>& _position) {
+    histogram& inserts = latencies (_workload, "insert");
+
+    for (uint32_t n = 0; n < options.entities; n++) {
+        entity ent;
+        ent.id = n + 1;
+        ent.pos = _position ();
+
+        timed (_tree, inserts, [&] { _tree.insert_entity (ent); });
+        _ents.push_back (ent);
+    }
+
+    // subdividing moves entities after they were inserted
+    for (std::vector<entity>::iterator it = _ents.begin (); it != _ents.end (); it++)
+        _tree.get_entity (it->id, *it);
+}
+
+static void query (spatial_index& _tree, const std::string& _workload, const std::function<point ()>& _position) {
+    histogram& queries = latencies (_workload, "query");
+    // one arena for every query, the way a caller that queries every tick would
+    entity_arena found;
+
+    for (uint32_t n = 0; n < options.ops; n++) {
+        rectangle_region rect (query_rect (_position () ) );
+        timed (_tree, queries, [&] { _tree.get_entities (rect, found); });
+    }
+
+    // the same sort of rects again, only counted, with --count-subtrees most of each comes from totals
+    histogram& counts = latencies (_workload, "count");
+    for (uint32_t n = 0; n < options.ops; n++) {
+        rectangle_region rect (query_rect (_position () ) );
+        timed (_tree, counts, [&] { _tree.count_entities (rect); });
+    }
+
+    // and only the first few of each, streamed, which reads only as far into the tree as it takes to find them
+    histogram& firsts = latencies (_workload, "first_10");
+    for (uint32_t n = 0; n < options.ops; n++) {
+        rectangle_region rect (query_rect (_position () ) );
+        timed (_tree, firsts, [&] { _tree.visit_entities (rect, [] (const entity&) { return true; }, 0, 10); });
+    }
+}
+
+static void uniform_workload (spatial_index& _tree) {
+    std::vector<entity> ents;
+    insert (_tree, "uniform", ents, uniform_point);
+    query (_tree, "uniform", uniform_point);
+}
+
+static void clustered_workload (spatial_index& _tree) {
+    std::vector<entity> ents;
+    insert (_tree, "clustered", ents, clustered_point);
+    query (_tree, "clustered", clustered_point);
+}
+
+static void walk_workload (spatial_index& _tree) {
+    std::vector<entity> ents;
+    insert (_tree, "walk", ents, uniform_point);
+
+    histogram& relocates = latencies ("walk", "relocate");
+    for (uint32_t tick = 0; tick < options.ticks; tick++) {
+        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
+            _tree.get_entity (it->id, *it);
+            it->pos = step (it->pos);
+            timed (_tree, relocates, [&] { _tree.relocate_entity (*it); });
+        }
+    }
+
+    // the same walk again, a whole tick per call
+    histogram& batches = latencies ("walk", "relocate_batch");
+    for (uint32_t tick = 0; tick < options.ticks; tick++) {
+        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++)
+            it->pos = step (it->pos);
+        timed (_tree, batches, [&] { _tree.relocate_entities (ents); });
+    }
+}
+
+static void mixed_workload (spatial_index& _tree) {
+    std::vector<entity> ents;
+    insert (_tree, "mixed", ents, uniform_point);
+
+    histogram& queries = latencies ("mixed", "query");
+    histogram& relocates = latencies ("mixed", "relocate");
+    histogram& inserts = latencies ("mixed", "insert");
+    histogram& removes = latencies ("mixed", "remove");
+    uint32_t nextId = options.entities + 1;
+    entity_arena found;
+
+    // 70% queries, 20% relocations, 5% inserts and 5% removals
+    for (uint32_t n = 0; n < options.ops; n++) {
+        int pick = rand () % 100;
+
+        if (pick < 70 || ents.empty () ) {
+            rectangle_region rect (query_rect (uniform_point () ) );
+            timed (_tree, queries, [&] { _tree.get_entities (rect, found); });
+        }
+        else if (pick < 90) {
+            entity& ent = ents[rand () % ents.size ()];
+            _tree.get_entity (ent.id, ent);
+            ent.pos = step (ent.pos);
+            timed (_tree, relocates, [&] { _tree.relocate_entity (ent); });
+        }
+        else if (pick < 95) {
+            entity ent;
+            ent.id = nextId++;
+            ent.pos = uniform_point ();
+            timed (_tree, inserts, [&] { _tree.insert_entity (ent); });
+            ents.push_back (ent);
+        }
+        else {
+            size_t index = rand () % ents.size ();
+            entity ent = ents[index];
+            ents[index] = ents.back ();
+            ents.pop_back ();
+
+            _tree.get_entity (ent.id, ent);
+            timed (_tree, removes, [&] { _tree.remove_entity (ent); });
+        }
+    }
+}
+
+// entities leave and come back somewhere else, which keeps leaves around the split threshold splitting and merging
+// unless --merge-entities leaves room between the two, the throughput is of the remove and insert pairs
+static void churn_workload (spatial_index& _tree) {
+    std::vector<entity> ents;
+    insert (_tree, "churn", ents, clustered_point);
+
+    histogram& removes = latencies ("churn", "remove");
+    histogram& inserts = latencies ("churn", "insert");
+    quadtree_io before = _tree.io ();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+
+    for (uint32_t n = 0; n < options.ops; n++) {
+        entity& ent = ents[rand () % ents.size ()];
+        _tree.get_entity (ent.id, ent);
+        timed (_tree, removes, [&] { _tree.remove_entity (ent); });
+
+        ent.pos = clustered_point ();
+        timed (_tree, inserts, [&] { _tree.insert_entity (ent); });
+    }
+
+    double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+    quadtree_io io = _tree.io () - before;
+    printf ("Churn: %.0f ops/s, %.3f subdivides and %.3f cleans per op\n", 2 * options.ops / seconds,
+        options.ops ? (double)io.subdivides / (2 * options.ops) : 0.0, options.ops ? (double)io.cleans / (2 * options.ops) : 0.0);
+}
+
+static void delete_workload (spatial_index& _tree) {
+    std::vector<entity> ents;
+    for (uint32_t n = 0; n < options.entities; n++) {
+        entity ent;
+        ent.id = n + 1;
+        ent.pos = uniform_point ();
+        ents.push_back (ent);
+    }
+
+    histogram& loads = latencies ("delete", "insert_entities");
+    timed (_tree, loads, [&] { _tree.insert_entities (ents); });
+
+    histogram& removes = latencies ("delete", "remove");
+    std::mt19937 order (1);
+    std::shuffle (ents.begin (), ents.end (), order);
+    for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
+        _tree.get_entity (it->id, *it);
+        timed (_tree, removes, [&] { _tree.remove_entity (*it); });
+    }
+}
+
+// the contention writers' operations, in the order their histograms are sent back
+static const char* contentionOps[] = {"insert", "relocate", "remove"};
+static const int contentionOpCount = 3;
+
+// one writer process with a connection and ids of its own, around the same hotspots as every other writer
+// sends its histograms and then the id and position of every entity it left in the tree to _fd
+static int contention_writer (uint32_t _writer, int _fd) {
+    redisContext* writerContext = redisConnect (options.host.c_str (), options.port);
+    if (writerContext->err)
+        return 1;
+
+    if (!select_db (writerContext) )
+        return 1;
+
+    srand (_writer + 2);
+    quadtree tree (writerContext, rectangle (0, 0, options.worldSize, options.worldSize), options.tree);
+    histogram ops[contentionOpCount];
+
+    uint32_t share = options.entities / options.writers;
+    std::vector<entity> ents;
+
+    for (uint32_t n = 0; n < share; n++) {
+        entity ent;
+        ent.id = _writer * share + n + 1;
+        ent.pos = clustered_point ();
+
+        timed (tree, ops[0], [&] { tree.insert_entity (ent); });
+        ents.push_back (ent);
+    }
+
+    for (uint32_t tick = 0; tick < options.ticks; tick++) {
+        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
+            // another writer may have moved it since, like any other client would
+            tree.get_entity (it->id, *it);
+            it->pos = step (it->pos);
+            timed (tree, ops[1], [&] { tree.relocate_entity (*it); });
+        }
+    }
+
+    std::string report;
+    std::vector<uint32_t> kept;
+
+    for (size_t n = 0; n < ents.size (); n++) {
+        if (n % 4 == 0) {
+            tree.get_entity (ents[n].id, ents[n]);
+            timed (tree, ops[2], [&] { tree.remove_entity (ents[n]); });
+        }
+        else {
+            kept.push_back (ents[n].id);
+            kept.push_back (ents[n].pos.x);
+            kept.push_back (ents[n].pos.y);
+        }
+    }
+
+    for (int op = 0; op < contentionOpCount; op++)
+        ops[op].save (report);
+    if (!kept.empty () )
+        report.append ( (const char*)&kept[0], kept.size () * sizeof (uint32_t) );
+
+    for (size_t offset = 0; offset < report.size (); ) {
+        ssize_t written = write (_fd, report.data () + offset, report.size () - offset);
+        if (written <= 0)
+            return 1;
+        offset += written;
+    }
+
+    return 0;
+}
+
+// every writer inserts, walks and removes its own entities in the same area at the same time, then the
+// tree is checked against what they say they left in it
+static bool contention_workload () {
+    std::vector<pid_t> pids;
+    std::vector<int> fds;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+
+    for (uint32_t writer = 0; writer < options.writers; writer++) {
+        int pipeFds[2];
+        if (pipe (pipeFds) != 0)
+            return false;
+
+        pid_t pid = fork ();
+        if (pid == 0) {
+            close (pipeFds[0]);
+            // nothing the parent set up is touched on the way out
+            _exit (contention_writer (writer, pipeFds[1]) );
+        }
+
+        close (pipeFds[1]);
+        if (pid < 0) {
+            close (pipeFds[0]);
+            return false;
+        }
+
+        pids.push_back (pid);
+        fds.push_back (pipeFds[0]);
+    }
+
+    std::map<uint32_t, point> expected;
+    bool reported = true;
+
+    for (size_t n = 0; n < fds.size (); n++) {
+        std::string report;
+        char buffer[65536];
+        ssize_t size;
+
+        while ( (size = read (fds[n], buffer, sizeof (buffer) ) ) > 0)
+            report.append (buffer, size);
+        close (fds[n]);
+
+        size_t offset = 0;
+        for (int op = 0; op < contentionOpCount && reported; op++) {
+            histogram writerOps;
+            reported = writerOps.load (report, offset);
+            latencies ("contention", contentionOps[op]).merge (writerOps);
+        }
+
+        for (; reported && offset + 3 * sizeof (uint32_t) <= report.size (); offset += 3 * sizeof (uint32_t) ) {
+            uint32_t kept[3];
+            memcpy (kept, report.data () + offset, sizeof (kept) );
+            expected[kept[0]] = point (kept[1], kept[2]);
+        }
+    }
+
+    for (size_t n = 0; n < pids.size (); n++) {
+        int status;
+        if (waitpid (pids[n], &status, 0) != pids[n] || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+            reported = false;
+    }
+
+    double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+
+    if (!reported) {
+        std::cout << "Error: a contention writer failed" << std::endl;
+        return false;
+    }
+
+    // everything the writers left has to be in the tree once, where they left it, and nothing else
+    quadtree_options checkOptions = options.tree;
+    checkOptions.cacheNodes = false;
+    quadtree tree (context, rectangle (0, 0, options.worldSize, options.worldSize), checkOptions);
+
+    std::vector<entity> found;
+    tree.get_entities (rectangle (0, 0, options.worldSize, options.worldSize), found);
+
+    size_t wrong = found.size () > expected.size () ? found.size () - expected.size () : 0;
+    for (std::vector<entity>::iterator it = found.begin (); it != found.end (); it++) {
+        std::map<uint32_t, point>::iterator kept = expected.find (it->id);
+        if (kept == expected.end () || kept->second.x != it->pos.x || kept->second.y != it->pos.y) {
+            wrong++;
+            continue;
+        }
+        expected.erase (kept);
+    }
+    wrong += expected.size ();
+
+    uint64_t ops = 0, conflicts = 0;
+    for (int op = 0; op < contentionOpCount; op++) {
+        const histogram& h = latencies ("contention", contentionOps[op]);
+        ops += h.size ();
+        conflicts += h.conflicts ();
+    }
+
+    printf ("Contention: %u writers, %.0f ops/s, %.3f retries per op, %s\n", options.writers, ops / seconds,
+        ops ? (double)conflicts / ops : 0.0, wrong ? (std::to_string (wrong) + " entities missing or out of place").c_str () : "consistent");
+    return true;
+}
+
+// the same queries from as many threads as concurrent_quadtree has workers, each thread waits on its own query
+// before sending the next, so the throughput is what the workers keep up with
+static bool threads_workload () {
+    rectangle rect (0, 0, options.worldSize, options.worldSize);
+    std::vector<rectangle> rects;
+    for (uint32_t n = 0; n < options.ops; n++)
+        rects.push_back (query_rect (uniform_point () ) );
+
+    for (size_t count = 0; count < options.threads.size (); count++) {
+        uint32_t threads = options.threads[count];
+        concurrent_quadtree tree (options.host, options.port, rect, threads, 2, options.tree, options.db);
+        if (!tree.connected () ) {
+            std::cout << "Error: couldn't connect " << threads << " workers" << std::endl;
+            return false;
+        }
+
+        // the first tree lays out the entities, every one after that finds them there
+        if (count == 0) {
+            for (uint32_t n = 0; n < options.entities; n++) {
+                entity ent;
+                ent.id = n + 1;
+                ent.pos = uniform_point ();
+                tree.insert_entity (ent);
+            }
+        }
+
+        std::vector<histogram> queries (threads);
+        std::vector<std::thread> callers;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+
+        for (uint32_t caller = 0; caller < threads; caller++) {
+            callers.push_back (std::thread ([&, caller] {
+                std::vector<entity> found;
+                quadtree_io none;
+
+                for (size_t n = caller; n < rects.size (); n += threads) {
+                    std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now ();
+                    found.clear ();
+                    tree.get_entities (rects[n], found);
+                    queries[caller].add (std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - sent).count (),
+                        none, none);
+                }
+            }) );
+        }
+        for (size_t n = 0; n < callers.size (); n++)
+            callers[n].join ();
+
+        double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+
+        histogram& merged = latencies ("threads", "query x" + std::to_string (threads) );
+        for (size_t n = 0; n < queries.size (); n++)
+            merged.merge (queries[n]);
+
+        printf ("Threads: %u threads, %.0f queries/s, %.0f per thread\n", threads, options.ops / seconds, options.ops / seconds / threads);
+    }
+
+    return true;
+}
+
+static void print_results () {
+    printf ("%-10s %-16s %9s %10s %10s %10s %10s %10s %9s %9s\n", "workload", "operation", "count",
+        "mean us", "p50 us", "p99 us", "p999 us", "max us", "cmds/op", "rtts/op");
+
+    for (std::deque<result>::const_iterator it = results.begin (); it != results.end (); it++) {
+        const histogram& h = it->latencies;
+        printf ("%-10s %-16s %9llu %10.1f %10.1f %10.1f %10.1f %10.1f %9.2f %9.2f\n", it->workload.c_str (), it->operation.c_str (),
+            (unsigned long long)h.size (), h.mean () / 1000, h.percentile (0.5) / 1000.0, h.percentile (0.99) / 1000.0,
+            h.percentile (0.999) / 1000.0, h.maximum () / 1000.0, h.commands_per_op (), h.round_trips_per_op () );
+    }
+}
+
+static std::string thread_counts () {
+    std::string counts;
+    for (size_t n = 0; n < options.threads.size (); n++)
+        counts += (n ? ", " : "") + std::to_string (options.threads[n]);
+    return counts;
+}
+
+static bool write_json (const std::string& _path) {
+    std::ofstream file (_path.c_str () );
+    if (!file.is_open () )
+        return false;
+
+    const quadtree_options& tree = options.tree;
+    file << "{\n  \"options\": {"
+        << "\"entities\": " << options.entities << ", \"ops\": " << options.ops << ", \"ticks\": " << options.ticks
+        << ", \"query_size\": " << options.querySize << ", \"world_size\": " << options.worldSize
+        << ", \"max_entities\": " << tree.maxEntitiesPerNode << ", \"merge_entities\": " << tree.mergeEntities
+        << ", \"adaptive\": " << (tree.adaptiveThresholds ? "true" : "false") << ", \"min_node_size\": " << tree.minNodeSize
+        << ", \"layout\": \"" << (tree.entityLayout == LAYOUT_PACKED ? "packed" : "sets") << "\""
+        << ", \"keys\": \"" << (tree.keyScheme == KEYS_MORTON ? "morton" : "path") << "\""
+        << ", \"scripts\": " << (tree.useScripts ? "true" : "false") << ", \"cache\": " << (tree.cacheNodes ? "true" : "false")
+        << ", \"write_behind\": " << (tree.writeBehind ? "true" : "false")
+        << ", \"optimistic\": " << (tree.optimistic ? "true" : "false") << ", \"count_subtrees\": " << (tree.countSubtrees ? "true" : "false") << ", \"writers\": " << options.writers
+        << ", \"threads\": [" << thread_counts () << "]"
+        << ", \"looseness\": " << tree.looseness << ", \"engine\": \"" << (options.memory ? "memory" : "redis") << "\"},\n  \"results\": [";
+
+    for (size_t n = 0; n < results.size (); n++) {
+        const histogram& h = results[n].latencies;
+        file << (n ? ",\n" : "\n") << "    {\"workload\": \"" << results[n].workload << "\", \"operation\": \"" << results[n].operation << "\""
+            << ", \"count\": " << h.size () << ", \"mean_ns\": " << (uint64_t)h.mean ()
+            << ", \"p50_ns\": " << h.percentile (0.5) << ", \"p99_ns\": " << h.percentile (0.99) << ", \"p999_ns\": " << h.percentile (0.999)
+            << ", \"max_ns\": " << h.maximum () << ", \"commands_per_op\": " << h.commands_per_op ()
+            << ", \"round_trips_per_op\": " << h.round_trips_per_op () << ", \"reply_bytes_per_op\": " << h.reply_bytes_per_op ()
+            << ", \"nodes_per_op\": " << h.nodes_per_op () << ", \"conflicts_per_op\": " << h.conflicts_per_op () << "}";
+    }
+
+    file << "\n  ]\n}\n";
+    return true;
+}
+
+static void usage () {
+    std::cout << "usage: rqtree_bench [options]\n"
+        << "  --host <host> --port <port> --db <index>   server and database to use (emptied, 15 by default)\n"
+        << "  --entities <n>            entities per workload (10000)\n"
+        << "  --ops <n>                 queries, or mixed operations, per workload (10000)\n"
+        << "  --ticks <n>               random walk ticks (10)\n"
+        << "  --query-size <n>          side of the query rects (256)\n"
+        << "  --world-size <n>          side of the tree (16384)\n"
+        << "  --max-entities <n>        maxEntitiesPerNode (10)\n"
+        << "  --merge-entities <n>      mergeEntities, subtrees merge at this many entities instead of at none (0)\n"
+        << "  --adaptive                adaptiveThresholds, the thresholds are tuned as the workload runs\n"
+        << "  --min-node-size <n>       minNodeSize (8)\n"
+        << "  --layout <sets|packed> --keys <path|morton> --coords <text|binary> --looseness <f> --scripts --cache\n"
+        << "  --engine <redis|memory>   run against redis or memory_quadtree (redis)\n"
+        << "  --write-behind            writeBehind, the latencies leave out the writes made in the background\n"
+        << "  --optimistic              optimistic, every client side step is a WATCH/MULTI/EXEC transaction\n"
+        << "  --cluster                 cluster, --host and --port name one node of a redis cluster\n"
+        << "  --shard-depth <n>         shardDepth with --cluster (2)\n"
+        << "  --prefix <prefix>         keyPrefix\n"
+        << "  --count-subtrees          countSubtrees, the uniform and clustered queries are counted as well either way\n"
+        << "  --writers <n>             processes writing the tree at once in the contention workload (4)\n"
+        << "  --threads <n,...>         concurrent_quadtree worker threads the threads workload runs with (1,2,4,8)\n"
+        << "  --workloads <list>        any of uniform,clustered,walk,mixed,churn,delete,contention,threads (all but contention and threads)\n"
+        << "  --json <file>             also write the results as json\n";
+}
+
+static bool parse_args (int _argc, char** _argv) {
+    for (int n = 1; n < _argc; n++) {
+        std::string arg = _argv[n];
+
+        if (arg == "--scripts")
+            options.tree.useScripts = true;
+        else if (arg == "--cache")
+            options.tree.cacheNodes = true;
+        else if (arg == "--write-behind")
+            options.tree.writeBehind = true;
+        else if (arg == "--optimistic")
+            options.tree.optimistic = true;
+        else if (arg == "--cluster")
+            options.tree.cluster = true;
+        else if (arg == "--count-subtrees")
+            options.tree.countSubtrees = true;
+        else if (arg == "--adaptive")
+            options.tree.adaptiveThresholds = true;
+        else if (n + 1 >= _argc)
+            return false;
+        else {
+            std::string value = _argv[++n];
+
+            if (arg == "--host")
+                options.host = value;
+            else if (arg == "--port")
+                options.port = atoi (value.c_str () );
+            else if (arg == "--db")
+                options.db = atoi (value.c_str () );
+            else if (arg == "--entities")
+                options.entities = atoi (value.c_str () );
+            else if (arg == "--ops")
+                options.ops = atoi (value.c_str () );
+            else if (arg == "--ticks")
+                options.ticks = atoi (value.c_str () );
+            else if (arg == "--query-size")
+                options.querySize = atoi (value.c_str () );
+            else if (arg == "--world-size")
+                options.worldSize = atoi (value.c_str () );
+            else if (arg == "--writers")
+                options.writers = atoi (value.c_str () );
+            else if (arg == "--threads") {
+                options.threads.clear ();
+                for (size_t start = 0; start <= value.size (); ) {
+                    size_t end = std::min (value.find (',', start), value.size () );
+                    uint32_t threads = atoi (value.substr (start, end - start).c_str () );
+                    if (threads == 0)
+                        return false;
+                    options.threads.push_back (threads);
+                    start = end + 1;
+                }
+            }
+            else if (arg == "--max-entities")
+                options.tree.maxEntitiesPerNode = atoi (value.c_str () );
+            else if (arg == "--merge-entities")
+                options.tree.mergeEntities = atoi (value.c_str () );
+            else if (arg == "--min-node-size")
+                options.tree.minNodeSize = atoi (value.c_str () );
+            else if (arg == "--layout" && (value == "sets" || value == "packed") )
+                options.tree.entityLayout = value == "packed" ? LAYOUT_PACKED : LAYOUT_SETS;
+            else if (arg == "--keys" && (value == "path" || value == "morton") )
+                options.tree.keyScheme = value == "morton" ? KEYS_MORTON : KEYS_PATH;
+            else if (arg == "--coords" && (value == "text" || value == "binary") )
+                options.tree.coordinates = value == "binary" ? COORDS_BINARY : COORDS_TEXT;
+            else if (arg == "--engine" && (value == "redis" || value == "memory") )
+                options.memory = value == "memory";
+            else if (arg == "--looseness")
+                options.tree.looseness = atof (value.c_str () );
+            else if (arg == "--shard-depth")
+                options.tree.shardDepth = atoi (value.c_str () );
+            else if (arg == "--prefix")
+                options.tree.keyPrefix = value;
+            else if (arg == "--workloads")
+                options.workloads = value;
+            else if (arg == "--json")
+                options.jsonPath = value;
+            else
+                return false;
+        }
+    }
+
+    // the workloads pick random entities and steps out of these, none of them can be empty
+    return options.worldSize > 2 * 256 + 2 && options.querySize > 0 && options.writers > 0 && options.entities > 0 &&
+        options.ops > 0 && options.ticks > 0;
+}
+
+int main (int argc, char** argv) {
+    if (!parse_args (argc, argv) ) {
+        usage ();
+        return -1;
+    }
+
+    if (!options.memory) {
+        context = redisConnect (options.host.c_str (), options.port);
+        if (context->err) {
+            std::cout << "Error: " << context->errstr << std::endl;
+            return -1;
+        }
+
+        if (!select_db (context) ) {
+            std::cout << "Error: can't select database " << options.db << std::endl;
+            return -1;
+        }
+    }
+
+    struct workload {
+        const char* name;
+        void (*run) (spatial_index& _tree);
+    } workloads[] = {
+        {"uniform", uniform_workload},
+        {"clustered", clustered_workload},
+        {"walk", walk_workload},
+        {"mixed", mixed_workload},
+        {"churn", churn_workload},
+        {"delete", delete_workload}
+    };
+
+    std::string selected = "," + options.workloads + ",";
+
+    for (size_t n = 0; n < sizeof (workloads) / sizeof (workloads[0]); n++) {
+        if (selected.find (std::string (",") + workloads[n].name + ",") == std::string::npos)
+            continue;
+
+        // every workload walks the same random sequence
+        srand (1);
+        rectangle rect (0, 0, options.worldSize, options.worldSize);
+
+        if (options.memory) {
+            memory_quadtree tree (rect, options.tree);
+            workloads[n].run (tree);
+        }
+        else {
+            if (!flush () ) {
+                std::cout << "Error: can't empty database " << options.db << std::endl;
+                return -1;
+            }
+
+            quadtree tree (context, rect, options.tree);
+            workloads[n].run (tree);
+        }
+
+        std::cout << "Finished " << workloads[n].name << std::endl;
+    }
+
+    // the writers each need a connection of their own, so this one doesn't run on a tree made here
+    if (selected.find (",contention,") != std::string::npos) {
+        if (options.memory)
+            std::cout << "Skipped contention, it needs redis" << std::endl;
+        else if (!flush () || !contention_workload () )
+            return -1;
+        else
+            std::cout << "Finished contention" << std::endl;
+    }
+
+    if (selected.find (",threads,") != std::string::npos) {
+        srand (1);
+        if (options.memory)
+            std::cout << "Skipped threads, it needs redis" << std::endl;
+        else if (!flush () || !threads_workload () )
+            return -1;
+        else
+            std::cout << "Finished threads" << std::endl;
+    }
+
+    if (!options.memory) {
+        flush ();
+        redisFree (context);
+    }
+
+    print_results ();
+
+    if (!options.jsonPath.empty () && !write_json (options.jsonPath) ) {
+        std::cout << "Error: can't write " << options.jsonPath << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
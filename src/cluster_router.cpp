@@ -0,0 +1,238 @@
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <cluster_router.hpp>
+#include <key_space.hpp>
+
+static const size_t slotCount = 16384;
+// how often one command is sent again before its MOVED or ASK is handed back as the reply
+static const int maxRedirects = 5;
+
+cluster_router::cluster_router (redisContext* _seed)
+    : slotConnections (slotCount, 0), masterCount (0) {
+    connections.push_back (_seed);
+    addresses.push_back ("");
+    readAhead.resize (1);
+    outstanding.push_back (0);
+
+    read_slots ();
+}
+
+cluster_router::~cluster_router () {
+    for (size_t n = 0; n < connections.size (); n++) {
+        for (size_t i = 0; i < readAhead[n].size (); i++)
+            freeReplyObject (readAhead[n][i]);
+
+        if (n > 0)
+            redisFree (connections[n]);
+    }
+}
+
+void cluster_router::append (const std::vector<std::string>& _args) {
+    size_t first, end;
+    command_keys (_args, first, end);
+
+    size_t connection = first < end ? slotConnections[key_slot (_args[first])] : 0;
+    send (connection, _args);
+
+    order.push_back (queued_command ());
+    order.back ().connection = connection;
+    order.back ().args = _args;
+}
+
+int cluster_router::get_reply (void** _reply, bool& _waited) {
+    _waited = false;
+    if (order.empty () )
+        return REDIS_ERR;
+
+    queued_command command;
+    command.connection = order.front ().connection;
+    command.args.swap (order.front ().args);
+    order.pop_front ();
+
+    if (read (command.connection, _reply, _waited) != REDIS_OK)
+        return REDIS_ERR;
+
+    for (int n = 0; n < maxRedirects; n++) {
+        redisReply* reply = (redisReply*)*_reply;
+        if (reply->type != REDIS_REPLY_ERROR)
+            break;
+
+        // "MOVED <slot> <host>:<port>" once the slot has moved for good, "ASK ..." while it's being moved
+        bool moved = strncmp (reply->str, "MOVED ", 6) == 0;
+        bool ask = strncmp (reply->str, "ASK ", 4) == 0;
+        if (!moved && !ask)
+            break;
+
+        size_t target = connection_for (strrchr (reply->str, ' ') + 1);
+        if (target == connections.size () )
+            break;
+
+        if (moved) {
+            slotConnections[atoi (reply->str + 6) % slotCount] = target;
+            // the rest of the map most likely changed along with it
+            read_slots ();
+        }
+        freeReplyObject (reply);
+
+        if (drain (target) != REDIS_OK)
+            return REDIS_ERR;
+
+        if (ask) {
+            void* asking;
+            send (target, std::vector<std::string> (1, "ASKING") );
+            send (target, command.args);
+
+            if (receive (target, &asking, _waited) != REDIS_OK)
+                return REDIS_ERR;
+            freeReplyObject (asking);
+        }
+        else {
+            send (target, command.args);
+        }
+
+        if (receive (target, _reply, _waited) != REDIS_OK)
+            return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+void cluster_router::flush () {
+    for (size_t n = 0; n < connections.size (); n++) {
+        // the write buffer is a C string, and every command in it starts with '*'
+        int done = connections[n]->obuf[0] == '\0';
+        while (!done && redisBufferWrite (connections[n], &done) == REDIS_OK);
+    }
+}
+
+size_t cluster_router::masters () const {
+    return masterCount;
+}
+
+bool cluster_router::read_slots () {
+    void* result;
+    bool waited;
+
+    if (drain (0) != REDIS_OK)
+        return false;
+
+    std::vector<std::string> args;
+    args.push_back ("CLUSTER");
+    args.push_back ("SLOTS");
+    send (0, args);
+
+    if (receive (0, &result, waited) != REDIS_OK)
+        return false;
+
+    // a reply is {start, end, {host, port, ...}, replicas...} per slot range
+    redisReply* reply = (redisReply*)result;
+    bool mapped = reply->type == REDIS_REPLY_ARRAY && reply->elements > 0;
+    std::set<size_t> masters;
+
+    for (size_t n = 0; mapped && n < reply->elements; n++) {
+        redisReply* range = reply->element[n];
+        if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 || range->element[2]->type != REDIS_REPLY_ARRAY
+            || range->element[2]->elements < 2 || range->element[2]->element[0]->type != REDIS_REPLY_STRING)
+            continue;
+
+        redisReply* master = range->element[2];
+        std::string address = std::string (master->element[0]->str) + ":" + std::to_string (master->element[1]->integer);
+
+        size_t connection = connection_for (address);
+        if (connection == connections.size () )
+            continue;
+
+        masters.insert (connection);
+        for (long long slot = range->element[0]->integer; slot <= range->element[1]->integer && slot < (long long)slotCount; slot++)
+            slotConnections[slot] = connection;
+    }
+
+    freeReplyObject (reply);
+
+    if (mapped)
+        masterCount = masters.size ();
+    return mapped;
+}
+
+size_t cluster_router::connection_for (const std::string& _address) {
+    for (size_t n = 1; n < addresses.size (); n++) {
+        if (addresses[n] == _address)
+            return n;
+    }
+
+    size_t colon = _address.rfind (':');
+    if (colon == std::string::npos)
+        return connections.size ();
+
+    redisContext* context = redisConnect (_address.substr (0, colon).c_str (), atoi (_address.c_str () + colon + 1) );
+    if (!context || context->err) {
+        if (context)
+            redisFree (context);
+        return connections.size ();
+    }
+
+    connections.push_back (context);
+    addresses.push_back (_address);
+    readAhead.resize (connections.size () );
+    outstanding.push_back (0);
+    return connections.size () - 1;
+}
+
+void cluster_router::send (size_t _connection, const std::vector<std::string>& _args) {
+    std::vector<const char*> argv;
+    std::vector<size_t> argvlen;
+
+    for (size_t i = 0; i < _args.size (); i++) {
+        argv.push_back (_args[i].data () );
+        argvlen.push_back (_args[i].size () );
+    }
+
+    redisAppendCommandArgv (connections[_connection], argv.size (), &argv[0], &argvlen[0]);
+    outstanding[_connection]++;
+}
+
+int cluster_router::read (size_t _connection, void** _reply, bool& _waited) {
+    std::deque<void*>& ahead = readAhead[_connection];
+
+    if (!ahead.empty () ) {
+        *_reply = ahead.front ();
+        ahead.pop_front ();
+        return REDIS_OK;
+    }
+
+    return receive (_connection, _reply, _waited);
+}
+
+int cluster_router::receive (size_t _connection, void** _reply, bool& _waited) {
+    redisContext* context = connections[_connection];
+    void* reply = NULL;
+
+    if (redisGetReplyFromReader (context, &reply) != REDIS_OK)
+        return REDIS_ERR;
+
+    if (!reply) {
+        // everything queued goes out first, so the other masters work on theirs while this one is waited on
+        flush ();
+        _waited = true;
+
+        if (redisGetReply (context, &reply) != REDIS_OK)
+            return REDIS_ERR;
+    }
+
+    outstanding[_connection]--;
+    *_reply = reply;
+    return REDIS_OK;
+}
+
+int cluster_router::drain (size_t _connection) {
+    void* reply;
+    bool waited;
+
+    while (outstanding[_connection] > 0) {
+        if (receive (_connection, &reply, waited) != REDIS_OK)
+            return REDIS_ERR;
+        readAhead[_connection].push_back (reply);
+    }
+    return REDIS_OK;
+}
@@ -0,0 +1,298 @@
+#include <future>
+#include <algorithm>
+#include <concurrent_quadtree.hpp>
+
+concurrent_quadtree::concurrent_quadtree (const std::string& _host, int _port, const rectangle& _rect, size_t _threads,
+    uint32_t _lockDepth, const quadtree_options& _options, int _db)
+    : ok (true), stopping (false), keyScheme (_options.keyScheme), lockDepth (_lockDepth) {
+    quadtree_options options = _options;
+    options.cacheNodes = false;
+    options.writeBehind = false;
+    options.minDepth = std::max (options.minDepth, lockDepth);
+
+    // the trees are set up one after the other, only the first one has to lay out the top of the tree
+    for (size_t i = 0; i < std::max (_threads, (size_t)1); i++) {
+        worker* w = new worker ();
+        w->context = redisConnect (_host.c_str (), _port);
+        w->tree = NULL;
+        workers.push_back (w);
+
+        if (!w->context || w->context->err) {
+            ok = false;
+            break;
+        }
+
+        if (_db != 0 && !_options.cluster) {
+            redisReply* reply = (redisReply*)redisCommand (w->context, "SELECT %i", _db);
+            ok = reply && reply->type != REDIS_REPLY_ERROR;
+            if (reply)
+                freeReplyObject (reply);
+            if (!ok)
+                break;
+        }
+
+        w->tree = new quadtree (w->context, _rect, options);
+    }
+
+    std::string rootKey = root_key (keyScheme);
+    std::vector<std::string> keys (1, rootKey), subkeys;
+
+    for (uint32_t depth = 0; depth < lockDepth; depth++) {
+        subkeys.clear ();
+        for (size_t n = 0; n < keys.size (); n++) {
+            for (int quad = 0; quad < 4; quad++)
+                subkeys.push_back (subnode_key (keyScheme, keys[n], quad) );
+        }
+        keys.swap (subkeys);
+    }
+
+    for (size_t n = 0; n < keys.size (); n++)
+        locks.push_back (new std::mutex ());
+    locks.push_back (new std::mutex ());
+
+    if (!ok)
+        return;
+
+    // the rect the tree was created with wins over _rect, read through a tree so its key prefix and cluster apply
+    quadtree& tree = *workers[0]->tree;
+    rect = _rect;
+    tree.get_node_rect (rootKey, rect);
+
+    // a tree too small to be split down to lockDepth falls back to the one lock above the subtrees
+    rectangle subtreeRect;
+    if (tree.get_node_rect (keys[0], subtreeRect) ) {
+        for (size_t n = 0; n < keys.size (); n++)
+            subtreeLocks[keys[n]] = n;
+    }
+
+    for (size_t i = 0; i < workers.size (); i++)
+        workers[i]->thread = std::thread (&concurrent_quadtree::work, this, workers[i]);
+}
+
+concurrent_quadtree::~concurrent_quadtree () {
+    {
+        std::lock_guard<std::mutex> guard (jobsMutex);
+        stopping = true;
+    }
+    jobsReady.notify_all ();
+
+    for (size_t i = 0; i < workers.size (); i++) {
+        if (workers[i]->thread.joinable () )
+            workers[i]->thread.join ();
+
+        delete workers[i]->tree;
+        if (workers[i]->context)
+            redisFree (workers[i]->context);
+        delete workers[i];
+    }
+
+    for (size_t n = 0; n < locks.size (); n++)
+        delete locks[n];
+}
+
+bool concurrent_quadtree::connected () const {
+    return ok;
+}
+
+size_t concurrent_quadtree::size () const {
+    return workers.size ();
+}
+
+void concurrent_quadtree::get_entity (uint32_t _id, entity& _ent) {
+    run ([&] (quadtree& _tree) { _tree.get_entity (_id, _ent); });
+}
+
+void concurrent_quadtree::insert_entity (entity& _ent) {
+    size_t first = position_lock (_ent.pos);
+
+    lock (first, first);
+    run ([&] (quadtree& _tree) { _tree.insert_entity (_ent); });
+    unlock (first, first);
+}
+
+void concurrent_quadtree::remove_entity (entity& _ent) {
+    // cleaning never goes above lockDepth, so the owner's subtree is all that changes
+    size_t first = node_lock (_ent.ownerKey);
+    bool locked = false;
+
+    while (!locked) {
+        lock (first, first);
+        run ([&] (quadtree& _tree) {
+            locked = refresh_owner (_tree, _ent, first);
+            if (locked && _ent.ownerKey != "")
+                _tree.remove_entity (_ent);
+        });
+        unlock (first, first);
+
+        first = node_lock (_ent.ownerKey);
+    }
+}
+
+void concurrent_quadtree::relocate_entity (entity& _ent) {
+    // the entity leaves its owner's subtree and ends up in the one at its new position
+    size_t first = node_lock (_ent.ownerKey);
+    size_t second = position_lock (_ent.pos);
+    bool locked = false;
+
+    while (!locked) {
+        lock (first, second);
+        run ([&] (quadtree& _tree) {
+            locked = refresh_owner (_tree, _ent, first);
+            if (locked && _ent.ownerKey != "")
+                _tree.relocate_entity (_ent);
+        });
+        unlock (first, second);
+
+        first = node_lock (_ent.ownerKey);
+    }
+}
+
+void concurrent_quadtree::get_entities (const rectangle& _rect, std::vector<entity>& _ents) {
+    run ([&] (quadtree& _tree) { _tree.get_entities (_rect, _ents); });
+}
+
+void concurrent_quadtree::get_entities_in_radius (const point& _center, uint32_t _radius, std::vector<entity>& _ents) {
+    run ([&] (quadtree& _tree) { _tree.get_entities_in_radius (_center, _radius, _ents); });
+}
+
+void concurrent_quadtree::get_entities_in_polygon (const std::vector<point>& _vertices, std::vector<entity>& _ents) {
+    run ([&] (quadtree& _tree) { _tree.get_entities_in_polygon (_vertices, _ents); });
+}
+
+void concurrent_quadtree::get_nearest (const point& _pos, size_t _k, std::vector<entity>& _ents, uint32_t _maxRadius) {
+    run ([&] (quadtree& _tree) { _tree.get_nearest (_pos, _k, _ents, _maxRadius); });
+}
+
+void concurrent_quadtree::get_entities (const std::vector<rectangle>& _rects, std::vector<std::vector<entity> >& _ents) {
+    _ents.resize (_rects.size () );
+    if (!ok)
+        return;
+
+    std::mutex doneMutex;
+    std::condition_variable done;
+    size_t remaining = _rects.size ();
+
+    for (size_t n = 0; n < _rects.size (); n++) {
+        submit ([&, n] (quadtree& _tree) {
+            _tree.get_entities (_rects[n], _ents[n]);
+
+            std::lock_guard<std::mutex> guard (doneMutex);
+            if (--remaining == 0)
+                done.notify_one ();
+        });
+    }
+
+    std::unique_lock<std::mutex> guard (doneMutex);
+    done.wait (guard, [&remaining] { return remaining == 0; });
+}
+
+void concurrent_quadtree::run (const job& _job) {
+    // there are no workers to run it
+    if (!ok)
+        return;
+
+    std::promise<void> finished;
+
+    submit ([&] (quadtree& _tree) {
+        _job (_tree);
+        finished.set_value ();
+    });
+
+    finished.get_future ().wait ();
+}
+
+void concurrent_quadtree::submit (const job& _job) {
+    {
+        std::lock_guard<std::mutex> guard (jobsMutex);
+        jobs.push_back (_job);
+    }
+    jobsReady.notify_one ();
+}
+
+void concurrent_quadtree::work (worker* _worker) {
+    while (true) {
+        job next;
+
+        {
+            std::unique_lock<std::mutex> guard (jobsMutex);
+            jobsReady.wait (guard, [this] { return stopping || !jobs.empty (); });
+
+            if (jobs.empty () )
+                return;
+
+            next = jobs.front ();
+            jobs.pop_front ();
+        }
+
+        next (*_worker->tree);
+    }
+}
+
+size_t concurrent_quadtree::position_lock (const point& _pos) const {
+    size_t top = locks.size () - 1;
+    std::string nodeKey = root_key (keyScheme);
+    rectangle nodeRect = rect;
+
+    // follow the quadrants down to lockDepth, a point on one of their edges stays in the nodes above
+    for (uint32_t depth = 0; depth < lockDepth; depth++) {
+        int quad = 0;
+        while (quad < 4 && !nodeRect.quadrant (quad).contains (_pos) )
+            quad++;
+
+        if (quad == 4)
+            return top;
+
+        nodeKey = subnode_key (keyScheme, nodeKey, quad);
+        nodeRect = nodeRect.quadrant (quad);
+    }
+
+    std::unordered_map<std::string, size_t>::const_iterator it = subtreeLocks.find (nodeKey);
+    return it != subtreeLocks.end () ? it->second : top;
+}
+
+size_t concurrent_quadtree::node_lock (const std::string& _nodeKey) const {
+    size_t top = locks.size () - 1;
+    if (_nodeKey == "")
+        return top;
+
+    uint32_t depth = node_depth (keyScheme, _nodeKey);
+    if (depth < lockDepth)
+        return top;
+
+    std::string nodeKey = _nodeKey;
+    for (; depth > lockDepth; depth--)
+        nodeKey = parent_key (keyScheme, nodeKey);
+
+    std::unordered_map<std::string, size_t>::const_iterator it = subtreeLocks.find (nodeKey);
+    return it != subtreeLocks.end () ? it->second : top;
+}
+
+bool concurrent_quadtree::refresh_owner (quadtree& _tree, entity& _ent, size_t _lock) const {
+    // the scripts look the owner up themselves
+    if (_tree.runs_scripts () )
+        return true;
+
+    // another thread's insert can have moved the entity down since _ent was read, but only within
+    // its subtree, so the caller's lock is wrong only if _ent is from before its own last relocation
+    entity current;
+    _tree.get_entity (_ent.id, current);
+    _ent.ownerKey = current.ownerKey;
+
+    return _ent.ownerKey == "" || node_lock (_ent.ownerKey) == _lock;
+}
+
+void concurrent_quadtree::lock (size_t _first, size_t _second) {
+    // always in the same order so two relocations can't deadlock
+    if (_first > _second)
+        std::swap (_first, _second);
+
+    locks[_first]->lock ();
+    if (_second != _first)
+        locks[_second]->lock ();
+}
+
+void concurrent_quadtree::unlock (size_t _first, size_t _second) {
+    locks[_first]->unlock ();
+    if (_second != _first)
+        locks[_second]->unlock ();
+}
@@ -0,0 +1,106 @@
+#include <cstring>
+#include <entity_arena.hpp>
+
+entity_arena::entity_arena ()
+    : ownerCount (0) {
+}
+
+void entity_arena::clear () {
+    refs.clear ();
+    ownerCount = 0;
+}
+
+size_t entity_arena::size () const {
+    return refs.size ();
+}
+
+bool entity_arena::empty () const {
+    return refs.empty ();
+}
+
+const entity_arena::ref& entity_arena::operator[] (size_t _n) const {
+    return refs[_n];
+}
+
+const std::string& entity_arena::owner_key (const ref& _ref) const {
+    return owners[_ref.owner];
+}
+
+const std::string& entity_arena::owner_key (uint32_t _owner) const {
+    return owners[_owner];
+}
+
+void entity_arena::get (size_t _n, entity& _ent) const {
+    const ref& found = refs[_n];
+
+    _ent.id = found.id;
+    _ent.pos = found.pos;
+    _ent.key = "entities:" + std::to_string (found.id);
+    _ent.ownerKey = owners[found.owner];
+}
+
+void entity_arena::get_all (std::vector<entity>& _ents) const {
+    size_t first = _ents.size ();
+    _ents.resize (first + refs.size () );
+
+    for (size_t n = 0; n < refs.size (); n++)
+        get (n, _ents[first + n]);
+}
+
+uint32_t entity_arena::add_owner (const char* _key, size_t _len) {
+    if (ownerCount == owners.size () )
+        owners.push_back (std::string () );
+
+    owners[ownerCount].assign (_key, _len);
+    return ownerCount++;
+}
+
+uint32_t entity_arena::add_owner (const std::string& _key) {
+    return add_owner (_key.data (), _key.size () );
+}
+
+void entity_arena::add (uint32_t _id, const point& _pos, uint32_t _owner) {
+    ref added;
+    added.id = _id;
+    added.pos = _pos;
+    added.owner = _owner;
+    refs.push_back (added);
+}
+
+void entity_arena::pop_back () {
+    refs.pop_back ();
+}
+
+void parse_bucket (const redisReply* _reply, uint32_t _owner, entity_arena& _arena) {
+    // reply to GET <node>:bucket
+    if (_reply->type != REDIS_REPLY_STRING)
+        return;
+
+    uint32_t id;
+    point pos;
+
+    for (size_t offset = 0; offset + entityRecordSize <= (size_t)_reply->len; offset += entityRecordSize) {
+        memcpy (&id, _reply->str + offset, sizeof (uint32_t) );
+        memcpy (pos.bytes, _reply->str + offset + sizeof (uint32_t), sizeof (point) );
+        _arena.add (id, pos, _owner);
+    }
+}
+
+bool parse_entity (coordinate_encoding _encoding, uint32_t _id, const redisReply* _reply, uint32_t _owner, entity_arena& _arena) {
+    // reply to HMGET entities:<id> x y owner, same checks as the other parse_entity
+    if (_reply->type != REDIS_REPLY_ARRAY || _reply->elements != 3)
+        return false;
+    for (size_t n = 0; n < 3; n++) {
+        if (_reply->element[n]->type != REDIS_REPLY_STRING)
+            return false;
+    }
+
+    // the owner is the node the entity was found in, unless another client just moved it
+    const redisReply* owner = _reply->element[2];
+    const std::string& ownerKey = _arena.owner_key (_owner);
+    if (ownerKey.size () != (size_t)owner->len || memcmp (ownerKey.data (), owner->str, owner->len) != 0)
+        _owner = _arena.add_owner (owner->str, owner->len);
+
+    _arena.add (_id, point (read_coordinate (_encoding, _reply->element[0]), read_coordinate (_encoding, _reply->element[1]) ), _owner);
+    return true;
+}
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <epoll_loop.hpp>
+
+static const int maxEvents = 64;
+
+epoll_loop::epoll_loop ()
+    : running (false) {
+    epollFd = epoll_create1 (EPOLL_CLOEXEC);
+}
+
+epoll_loop::~epoll_loop () {
+    // contexts that outlive the loop stop calling into it, their watches would dangle otherwise
+    for (size_t n = 0; n < watches.size (); n++) {
+        redisAsyncContext* context = watches[n]->context;
+        context->ev.addRead = NULL;
+        context->ev.delRead = NULL;
+        context->ev.addWrite = NULL;
+        context->ev.delWrite = NULL;
+        context->ev.cleanup = NULL;
+        context->ev.data = NULL;
+        delete watches[n];
+    }
+
+    for (size_t n = 0; n < retired.size (); n++)
+        delete retired[n];
+
+    if (epollFd != -1)
+        close (epollFd);
+}
+
+bool epoll_loop::attach (redisAsyncContext* _context) {
+    if (epollFd == -1 || _context->ev.data != NULL)
+        return false;
+
+    watch* w = new watch ();
+    w->loop = this;
+    w->context = _context;
+    w->fd = _context->c.fd;
+    w->reading = false;
+    w->writing = false;
+    w->registered = false;
+
+    _context->ev.addRead = add_read;
+    _context->ev.delRead = del_read;
+    _context->ev.addWrite = add_write;
+    _context->ev.delWrite = del_write;
+    _context->ev.cleanup = cleanup;
+    _context->ev.data = w;
+
+    watches.push_back (w);
+    return true;
+}
+
+int epoll_loop::run_once (int _timeout) {
+    epoll_event events[maxEvents];
+    int count = epoll_wait (epollFd, events, maxEvents, _timeout);
+
+    for (int n = 0; n < count; n++) {
+        watch* w = (watch*)events[n].data.ptr;
+
+        // errors and hangups are picked up by hiredis when it tries to read
+        if (w->context && (events[n].events & (EPOLLIN | EPOLLERR | EPOLLHUP) ) )
+            redisAsyncHandleRead (w->context);
+
+        // the read can free the context, cleanup () clears it when that happens
+        if (w->context && (events[n].events & EPOLLOUT) )
+            redisAsyncHandleWrite (w->context);
+    }
+
+    for (size_t n = 0; n < retired.size (); n++)
+        delete retired[n];
+    retired.clear ();
+
+    return count;
+}
+
+void epoll_loop::run () {
+    running = true;
+
+    while (running && !watches.empty ()) {
+        if (run_once (-1) == -1)
+            break;
+    }
+
+    running = false;
+}
+
+void epoll_loop::stop () {
+    running = false;
+}
+
+size_t epoll_loop::size () const {
+    return watches.size ();
+}
+
+void epoll_loop::add_read (void* _data) {
+    watch* w = (watch*)_data;
+    if (!w->reading) {
+        w->reading = true;
+        w->loop->update (w);
+    }
+}
+
+void epoll_loop::del_read (void* _data) {
+    watch* w = (watch*)_data;
+    if (w->reading) {
+        w->reading = false;
+        w->loop->update (w);
+    }
+}
+
+void epoll_loop::add_write (void* _data) {
+    watch* w = (watch*)_data;
+    if (!w->writing) {
+        w->writing = true;
+        w->loop->update (w);
+    }
+}
+
+void epoll_loop::del_write (void* _data) {
+    watch* w = (watch*)_data;
+    if (w->writing) {
+        w->writing = false;
+        w->loop->update (w);
+    }
+}
+
+void epoll_loop::cleanup (void* _data) {
+    watch* w = (watch*)_data;
+    w->reading = false;
+    w->writing = false;
+    w->loop->update (w);
+
+    // there could still be an event for this watch in the batch being handled
+    w->context = NULL;
+    w->loop->watches.erase (std::find (w->loop->watches.begin (), w->loop->watches.end (), w) );
+    w->loop->retired.push_back (w);
+}
+
+void epoll_loop::update (watch* _watch) {
+    epoll_event event;
+    event.events = (_watch->reading ? (uint32_t)EPOLLIN : 0) | (_watch->writing ? (uint32_t)EPOLLOUT : 0);
+    event.data.ptr = _watch;
+
+    if (event.events == 0) {
+        if (_watch->registered)
+            epoll_ctl (epollFd, EPOLL_CTL_DEL, _watch->fd, &event);
+        _watch->registered = false;
+    }
+    else if (_watch->registered) {
+        epoll_ctl (epollFd, EPOLL_CTL_MOD, _watch->fd, &event);
+    }
+    else {
+        epoll_ctl (epollFd, EPOLL_CTL_ADD, _watch->fd, &event);
+        _watch->registered = true;
+    }
+}
@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <util.hpp>
+#include <node.hpp>
+#include <point_filter.hpp>
+
+// times the filter a range query runs over a boundary bucket, no redis needed:
+// the loop over whole entities get_entities used to run, the plain loop over point_columns and the kernel
+// filter_inside picked for this cpu, in nanoseconds per candidate
+// usage: rqtree_filter_bench [candidates per pass (100000000)]
+
+static const uint32_t bucketSizes[] = {16, 64, 256, 4096};
+// the bucket spans this, the query rect covers about half of it
+static const uint32_t side = 4096;
+
+static double nanos_since (std::chrono::steady_clock::time_point _start, uint64_t _candidates) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - _start).count () / (double)_candidates;
+}
+
+int main (int argc, char** argv) {
+    uint64_t perPass = argc > 1 ? strtoull (argv[1], NULL, 10) : 100000000;
+    rectangle rect (side / 4, side / 8, side / 2, side);
+
+    std::cout << "kernel " << filter_kernel () << "\n"
+        << "bucket     entities   columns    kernel   (ns per candidate)" << std::endl;
+
+    for (size_t b = 0; b < sizeof (bucketSizes) / sizeof (bucketSizes[0]); b++) {
+        uint32_t size = bucketSizes[b];
+        uint64_t passes = std::max<uint64_t> (perPass / size, 1);
+
+        // the same bucket as entities and as packed records
+        std::vector<entity> bucket (size);
+        std::string records;
+        srand (size);
+
+        for (uint32_t n = 0; n < size; n++) {
+            bucket[n].id = n + 1;
+            bucket[n].pos = point (rand () % side, rand () % side);
+            bucket[n].key = "entities:" + std::to_string (n + 1);
+            bucket[n].ownerKey = "root:tl:br:bl:tr";
+            pack_entity (bucket[n], records);
+        }
+
+        point_columns columns;
+        columns.add_records (records.data (), records.size () );
+        std::vector<uint32_t> keep (size);
+        std::vector<entity> ents;
+        uint64_t found[3] = {0, 0, 0};
+        double nanos[3];
+
+        // copy the bucket out and drop what's outside, the way get_entities did before the columns
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+        for (uint64_t pass = 0; pass < passes; pass++) {
+            ents.assign (bucket.begin (), bucket.end () );
+            ents.erase (std::remove_if (ents.begin (), ents.end (),
+                [&rect] (const entity& _ent) { return !rect.contains (_ent.pos); }), ents.end () );
+            found[0] += ents.size ();
+        }
+        nanos[0] = nanos_since (start, passes * size);
+
+        start = std::chrono::steady_clock::now ();
+        for (uint64_t pass = 0; pass < passes; pass++)
+            found[1] += filter_inside_scalar (rect, columns.xs.data (), columns.ys.data (), size, keep.data () );
+        nanos[1] = nanos_since (start, passes * size);
+
+        start = std::chrono::steady_clock::now ();
+        for (uint64_t pass = 0; pass < passes; pass++)
+            found[2] += filter_inside (rect, columns.xs.data (), columns.ys.data (), size, keep.data () );
+        nanos[2] = nanos_since (start, passes * size);
+
+        if (found[0] != found[1] || found[0] != found[2]) {
+            std::cout << "Error: the filters disagree on a bucket of " << size << std::endl;
+            return -1;
+        }
+
+        printf ("%-10u %-10.2f %-10.2f %-10.2f\n", size, nanos[0], nanos[1], nanos[2]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <cstring>
+#include <strings.h>
+#include <key_space.hpp>
+
+static const uint16_t slotCount = 16384;
+
+// crc16 xmodem, the one redis cluster hashes keys with
+static uint16_t crc16 (const char* _bytes, size_t _len) {
+    uint16_t crc = 0;
+
+    for (size_t n = 0; n < _len; n++) {
+        crc ^= (uint16_t)( (unsigned char)_bytes[n]) << 8;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+uint16_t key_slot (const std::string& _key) {
+    size_t open = _key.find ('{');
+
+    if (open != std::string::npos) {
+        size_t close = _key.find ('}', open + 1);
+
+        // an empty tag doesn't count, the whole key is hashed then
+        if (close != std::string::npos && close > open + 1)
+            return crc16 (_key.data () + open + 1, close - open - 1) % slotCount;
+    }
+
+    return crc16 (_key.data (), _key.size () ) % slotCount;
+}
+
+void command_keys (const std::vector<std::string>& _args, size_t& _first, size_t& _end) {
+    _first = _end = 1;
+    if (_args.size () < 2)
+        return;
+
+    const char* name = _args[0].c_str ();
+
+    // only the commands the quadtree sends, every other one has its key first
+    if (strcasecmp (name, "MULTI") == 0 || strcasecmp (name, "EXEC") == 0 || strcasecmp (name, "UNWATCH") == 0
+        || strcasecmp (name, "PUBLISH") == 0 || strcasecmp (name, "SUBSCRIBE") == 0 || strcasecmp (name, "SCRIPT") == 0
+        || strcasecmp (name, "EVAL") == 0 || strcasecmp (name, "EVALSHA") == 0 || strcasecmp (name, "SELECT") == 0
+        || strcasecmp (name, "CLUSTER") == 0 || strcasecmp (name, "PING") == 0)
+        return;
+
+    if (strcasecmp (name, "WATCH") == 0 || strcasecmp (name, "DEL") == 0 || strcasecmp (name, "EXISTS") == 0)
+        _end = _args.size ();
+    else
+        _end = 2;
+}
+
+key_space::key_space (key_scheme _keyScheme, const std::string& _prefix, bool _tagged, uint32_t _shardDepth)
+    : keyScheme (_keyScheme), keyPrefix (_prefix), tagged (_tagged), shardDepth (_shardDepth) {
+}
+
+bool key_space::maps () const {
+    return tagged || !keyPrefix.empty ();
+}
+
+const std::string& key_space::prefix () const {
+    return keyPrefix;
+}
+
+std::string key_space::map (const std::string& _key) const {
+    // entities:<id> and entities:index aren't a node's, no node key starts with them
+    if (!tagged || _key.compare (0, 9, "entities:") == 0)
+        return keyPrefix + _key;
+
+    // a node's other keys are its own followed by ":rect", ":entities", ":bucket" or ":total"
+    std::string nodeKey = _key;
+    size_t colon = _key.rfind (':');
+    if (colon != std::string::npos) {
+        const char* suffix = _key.c_str () + colon + 1;
+        if (strcmp (suffix, "rect") == 0 || strcmp (suffix, "entities") == 0 || strcmp (suffix, "bucket") == 0 ||
+            strcmp (suffix, "total") == 0)
+            nodeKey.resize (colon);
+    }
+
+    std::string subtree = subtree_key (nodeKey);
+
+    // a path key already starts with its subtree's, a morton key doesn't
+    if (keyScheme == KEYS_PATH)
+        return keyPrefix + "{" + subtree + "}" + _key.substr (subtree.size () );
+    return keyPrefix + "{" + subtree + "}" + _key;
+}
+
+void key_space::map_args (std::vector<std::string>& _args) const {
+    size_t first, end;
+    command_keys (_args, first, end);
+
+    for (size_t n = first; n < end; n++) {
+        // the common case needs no copy of the key
+        if (!tagged || _args[n].compare (0, 9, "entities:") == 0)
+            _args[n].insert (0, keyPrefix);
+        else
+            _args[n] = map (_args[n]);
+    }
+}
+
+std::string key_space::subtree_key (const std::string& _nodeKey) const {
+    uint32_t depth = node_depth (keyScheme, _nodeKey);
+
+    if (depth < shardDepth)
+        return root_key (keyScheme);
+    if (depth == shardDepth)
+        return _nodeKey;
+
+    if (keyScheme == KEYS_MORTON)
+        return morton_key (morton_key_code (_nodeKey) >> (2 * (depth - shardDepth) ) );
+    // "root" and then ":" and a quadrant per level
+    return _nodeKey.substr (0, 4 + 3 * shardDepth);
+}
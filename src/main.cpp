@@ -1,6 +1,10 @@
 #include <ctime>
 #include <iostream>
+#include <algorithm>
 #include <quadtree.hpp>
+#include <async_quadtree.hpp>
+#include <epoll_loop.hpp>
+#include <memory_quadtree.hpp>
 
 int main (int argcontext, char** argv) {
     redisContext* context = redisConnect ("localhost", 6379);
@@ -9,7 +13,11 @@ int main (int argcontext, char** argv) {
         return -1;
     }
 
-    quadtree qtree (context, rectangle (0, 0, 4096, 4096) );
+    quadtree_options options;
+    options.cacheNodes = true;
+    options.useScripts = true;
+
+    quadtree qtree (context, rectangle (0, 0, 4096, 4096), options);
 
     srand (time (NULL) );
     time_t start, stop;
@@ -45,6 +53,51 @@ int main (int argcontext, char** argv) {
     std::cout << "Got " << ents2.size () << " entities searching " << times << " times in " << stop - start << " seconds" << std::endl;
     ents2.clear ();
 
+    start = time (NULL);
+    for (int n = 0; n < times; n++)
+        qtree.get_nearest (point (rand () % 4095 + 1, rand () % 4095 + 1), 5, ents2);
+    stop = time (NULL);
+
+    std::cout << "Got " << ents2.size () << " nearest entities searching " << times << " times in " << stop - start << " seconds" << std::endl;
+    ents2.clear ();
+
+    start = time (NULL);
+    for (int n = 0; n < times; n++) {
+        x = rand () % 3800 + 101;
+        y = rand () % 3800 + 101;
+        qtree.get_entities_in_radius (point (x, y), 100, ents2);
+    }
+    stop = time (NULL);
+
+    std::cout << "Got " << ents2.size () << " entities searching " << times << " circles in " << stop - start << " seconds" << std::endl;
+    ents2.clear ();
+
+    // move everything a little, one call per entity and then all of them as one batch
+    for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++)
+        qtree.get_entity ( (*it).id, *it);
+
+    int rounds = 10;
+    start = time (NULL);
+    for (int n = 0; n < rounds; n++) {
+        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
+            (*it).pos = point (std::min (std::max ( (int)(*it).pos.x + rand () % 33 - 16, 1), 4095), std::min (std::max ( (int)(*it).pos.y + rand () % 33 - 16, 1), 4095) );
+            qtree.relocate_entity (*it);
+        }
+    }
+    stop = time (NULL);
+
+    std::cout << "Relocated " << entityNum << " entities " << rounds << " times in " << stop - start << " seconds" << std::endl;
+
+    start = time (NULL);
+    for (int n = 0; n < rounds; n++) {
+        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++)
+            (*it).pos = point (std::min (std::max ( (int)(*it).pos.x + rand () % 33 - 16, 1), 4095), std::min (std::max ( (int)(*it).pos.y + rand () % 33 - 16, 1), 4095) );
+        qtree.relocate_entities (ents);
+    }
+    stop = time (NULL);
+
+    std::cout << "Relocated " << entityNum << " entities " << rounds << " times in batches in " << stop - start << " seconds" << std::endl;
+
     start = time (NULL);
     for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
         qtree.get_entity ( (*it).id, *it);
@@ -54,8 +107,172 @@ int main (int argcontext, char** argv) {
     stop = time (NULL);
 
     std::cout << "Removed " << entityNum << " entities in " << stop - start << " seconds" << std::endl;
+    qtree.stats ().write (std::cout);
 
     redisFree (context);
 
+    // the same again without waiting on each reply, every call is in flight at once
+    redisAsyncContext* asyncContext = redisAsyncConnect ("localhost", 6379);
+    if (asyncContext->err) {
+        std::cout << "Error: " << asyncContext->errstr << std::endl;
+        return -1;
+    }
+
+    epoll_loop loop;
+    loop.attach (asyncContext);
+    async_quadtree asyncTree (asyncContext, rectangle (0, 0, 4096, 4096), options);
+
+    start = time (NULL);
+    for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++)
+        asyncTree.insert_entity (*it);
+    while (asyncTree.pending () > 0)
+        loop.run_once (-1);
+    stop = time (NULL);
+
+    std::cout << "Added " << entityNum << " entities asynchronously in " << stop - start << " seconds" << std::endl;
+
+    size_t found = 0;
+    start = time (NULL);
+    for (int n = 0; n < times; n++) {
+        x = rand () % 3800 + 1;
+        y = rand () % 3800 + 1;
+        asyncTree.get_entities (rectangle (y, x, 200, 200), [&found] (std::vector<entity>& _ents) { found += _ents.size (); });
+    }
+    while (asyncTree.pending () > 0)
+        loop.run_once (-1);
+    stop = time (NULL);
+
+    std::cout << "Got " << found << " entities searching " << times << " times asynchronously in " << stop - start << " seconds" << std::endl;
+
+    start = time (NULL);
+    for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++)
+        asyncTree.remove_entity (*it);
+    while (asyncTree.pending () > 0)
+        loop.run_once (-1);
+    stop = time (NULL);
+
+    std::cout << "Removed " << entityNum << " entities asynchronously in " << stop - start << " seconds" << std::endl;
+
+    redisAsyncFree (asyncContext);
+
+    // a random walk with a tight and then a loose tree, every entity changing node costs a handful of writes
+    context = redisConnect ("localhost", 6379);
+    if (context->err) {
+        std::cout << "Error: " << context->errstr << std::endl;
+        return -1;
+    }
+
+    int walkers = 500;
+    int ticks = 20;
+
+    for (int loose = 0; loose < 2; loose++) {
+        quadtree_options walkOptions;
+        walkOptions.looseness = loose ? 1.5 : 1.0;
+        quadtree walkTree (context, rectangle (0, 0, 4096, 4096), walkOptions);
+
+        // the same walk both times
+        srand (walkers);
+        std::vector<entity> walk;
+        for (int i = 0; i < walkers; i++) {
+            entity ent;
+            ent.id = nextId + i;
+            ent.pos = point (rand () % 4095 + 1, rand () % 4095 + 1);
+            walkTree.insert_entity (ent);
+            walk.push_back (ent);
+        }
+        for (std::vector<entity>::iterator it = walk.begin (); it != walk.end (); it++)
+            walkTree.get_entity ( (*it).id, *it);
+
+        size_t changes = 0;
+        std::vector<std::string> ownerKeys;
+        start = time (NULL);
+        for (int tick = 0; tick < ticks; tick++) {
+            ownerKeys.clear ();
+            for (std::vector<entity>::iterator it = walk.begin (); it != walk.end (); it++) {
+                ownerKeys.push_back ( (*it).ownerKey);
+                (*it).pos = point (std::min (std::max ( (int)(*it).pos.x + rand () % 33 - 16, 1), 4095), std::min (std::max ( (int)(*it).pos.y + rand () % 33 - 16, 1), 4095) );
+            }
+
+            walkTree.relocate_entities (walk);
+
+            for (size_t n = 0; n < walk.size (); n++) {
+                if (walk[n].ownerKey != ownerKeys[n])
+                    changes++;
+            }
+        }
+        stop = time (NULL);
+
+        std::cout << "Random walk of " << walkers << " entities with looseness " << walkOptions.looseness << ": "
+            << (double)changes / ticks << " node changes per tick over " << ticks << " ticks in " << stop - start << " seconds" << std::endl;
+
+        for (std::vector<entity>::iterator it = walk.begin (); it != walk.end (); it++)
+            walkTree.remove_entity (*it);
+    }
+
+    // and once more with the writes left to the background, a walker's every step in a window is one write
+    {
+        quadtree_options behindOptions;
+        behindOptions.writeBehind = true;
+        quadtree behindTree (context, rectangle (0, 0, 4096, 4096), behindOptions);
+
+        srand (walkers);
+        std::vector<entity> walk;
+        for (int i = 0; i < walkers; i++) {
+            entity ent;
+            ent.id = nextId + i;
+            ent.pos = point (rand () % 4095 + 1, rand () % 4095 + 1);
+            behindTree.insert_entity (ent);
+            walk.push_back (ent);
+        }
+
+        start = time (NULL);
+        for (int tick = 0; tick < ticks; tick++) {
+            for (std::vector<entity>::iterator it = walk.begin (); it != walk.end (); it++)
+                (*it).pos = point (std::min (std::max ( (int)(*it).pos.x + rand () % 33 - 16, 1), 4095), std::min (std::max ( (int)(*it).pos.y + rand () % 33 - 16, 1), 4095) );
+
+            behindTree.relocate_entities (walk);
+        }
+        bool flushed = behindTree.flush ();
+        stop = time (NULL);
+
+        std::cout << "Random walk of " << walkers << " entities written behind over " << ticks << " ticks in " << stop - start << " seconds"
+            << (flushed ? "" : ", but the writes failed") << std::endl;
+
+        // a restarted client can take the whole node structure in one walk instead of a node at a time
+        quadtree_options warmOptions;
+        warmOptions.cacheNodes = true;
+        quadtree warmTree (context, rectangle (0, 0, 4096, 4096), warmOptions);
+
+        size_t warmed = warmTree.warm ();
+        std::cout << "Warmed " << warmed << " nodes in " << warmTree.io ().roundTrips << " round trips" << std::endl;
+
+        for (std::vector<entity>::iterator it = walk.begin (); it != walk.end (); it++)
+            behindTree.remove_entity (*it);
+    }
+
+    redisFree (context);
+
+    // the same kind of tree without redis, everything it costs is the tree itself
+    memory_quadtree memTree (rectangle (0, 0, 4096, 4096) );
+    int memEntities = 100000;
+
+    start = time (NULL);
+    for (int i = 0; i < memEntities; i++) {
+        entity ent;
+        ent.id = i + 1;
+        ent.pos = point (rand () % 4095 + 1, rand () % 4095 + 1);
+        memTree.insert_entity (ent);
+    }
+
+    ents2.clear ();
+    times = 10000;
+    for (int n = 0; n < times; n++)
+        memTree.get_entities (rectangle (rand () % 3800 + 1, rand () % 3800 + 1, 200, 200), ents2);
+    stop = time (NULL);
+
+    std::cout << "Added " << memEntities << " entities to a memory_quadtree and got " << ents2.size () << " entities searching "
+        << times << " times in " << stop - start << " seconds" << std::endl;
+    memTree.stats ().write (std::cout);
+
     return 0;
 }
@@ -0,0 +1,818 @@
+#include <algorithm>
+#include <queue>
+#include <memory_quadtree.hpp>
+
+const uint32_t memory_quadtree::noNode;
+
+memory_quadtree::memory_quadtree (const rectangle& _rect, const quadtree_options& _options)
+    : maxEntitiesPerNode (std::max (_options.maxEntitiesPerNode, 1u) ),
+      mergeEntities (merge_threshold (maxEntitiesPerNode, _options.mergeEntities) ), minNodeSize (_options.minNodeSize), keyScheme (_options.keyScheme),
+      minDepth (_options.minDepth), looseness (std::max (_options.looseness, 1.0) ), countSubtrees (_options.countSubtrees), tracking (false) {
+    mem_node root;
+    root.rect = _rect;
+    root.parent = noNode;
+    root.children = noNode;
+    root.depth = 0;
+    root.total = 0;
+
+    nodes.push_back (root);
+    buckets.resize (1);
+    keys.push_back (root_key (keyScheme) );
+    nodeChanged.resize (1);
+    totalChanged.resize (1);
+
+    subdivide_to_min_depth (0);
+}
+
+void memory_quadtree::get_entity (uint32_t _id, entity& _ent) {
+    op_counters::scope scope (counters, OP_GET_ENTITY);
+
+    std::unordered_map<uint32_t, slot>::const_iterator it = slots.find (_id);
+    if (it == slots.end () ) {
+        _ent.id = _id;
+        _ent.key = "";
+        _ent.ownerKey = "";
+        return;
+    }
+
+    make_entity (it->second.node, buckets[it->second.node][it->second.index], _ent);
+}
+
+void memory_quadtree::insert_entity (entity& _ent) {
+    op_counters::scope scope (counters, OP_INSERT_ENTITY);
+
+    if (slots.count (_ent.id) ) {
+        relocate_entity (_ent);
+        return;
+    }
+
+    // entities outside of the tree are never inserted
+    if (!nodes[0].rect.contains (_ent.pos) ) {
+        _ent.key = "";
+        _ent.ownerKey = "";
+        return;
+    }
+
+    add_below (0, _ent);
+}
+
+void memory_quadtree::remove_entity (entity& _ent) {
+    op_counters::scope scope (counters, OP_REMOVE_ENTITY);
+
+    _ent.key = "";
+    _ent.ownerKey = "";
+
+    std::unordered_map<uint32_t, slot>::iterator it = slots.find (_ent.id);
+    if (it == slots.end () )
+        return;
+
+    uint32_t owner = it->second.node;
+    take_entity (it->second);
+
+    if (buckets[owner].size () <= mergeEntities)
+        clean (owner);
+}
+
+void memory_quadtree::relocate_entity (entity& _ent) {
+    op_counters::scope scope (counters, OP_RELOCATE_ENTITY);
+
+    std::unordered_map<uint32_t, slot>::iterator it = slots.find (_ent.id);
+    if (it == slots.end () )
+        return;
+
+    slot found = it->second;
+    uint32_t owner = found.node;
+    buckets[owner][found.index].pos = _ent.pos;
+
+    // move up until a node contains the entity, the owner keeps it anywhere in its loose bounds
+    uint32_t currNode = owner;
+    RQTREE_COUNT (counters, nodesVisited, 1);
+
+    while (!nodes[currNode].rect.contains (_ent.pos) ) {
+        if (currNode == owner && nodes[owner].rect.loosened (looseness).contains (_ent.pos) )
+            break;
+
+        // outside of the tree, it stays where it was
+        if (nodes[currNode].parent == noNode) {
+            currNode = owner;
+            break;
+        }
+
+        currNode = nodes[currNode].parent;
+        RQTREE_COUNT (counters, nodesVisited, 1);
+    }
+
+    uint32_t destNode = quadrant_of (currNode, _ent.pos);
+
+    if (currNode == owner && destNode == noNode) {
+        make_entity (owner, buckets[owner][found.index], _ent);
+        node_changed (owner);
+        entity_changed (_ent.id);
+        return;
+    }
+
+    take_entity (found);
+    add_below (destNode != noNode ? destNode : currNode, _ent);
+
+    // the entity left its owner for another part of the tree
+    if (currNode != owner && buckets[owner].size () <= mergeEntities) {
+        clean (owner);
+
+        // a merge can take it up with the rest of a subtree
+        const slot& now = slots[_ent.id];
+        make_entity (now.node, buckets[now.node][now.index], _ent);
+    }
+}
+
+void memory_quadtree::get_entities (const region& _region, std::vector<entity>& _ents) {
+    get_entities (_region, results);
+    results.get_all (_ents);
+}
+
+void memory_quadtree::get_entities (const region& _region, entity_arena& _arena) {
+    op_counters::scope scope (counters, OP_GET_ENTITIES);
+    _arena.clear ();
+
+    rectangle bounds = nodes[0].rect.loosened (looseness);
+    if (!_region.intersects (bounds) )
+        return;
+
+    // nodes still to search, and whether they're inside the region
+    std::vector<std::pair<uint32_t, bool> > pending (1, std::make_pair (0, _region.contains (bounds) ) );
+
+    while (!pending.empty () ) {
+        uint32_t currNode = pending.back ().first;
+        bool contained = pending.back ().second;
+        pending.pop_back ();
+        RQTREE_COUNT (counters, nodesVisited, 1);
+
+        const std::vector<record>& bucket = buckets[currNode];
+        if (!bucket.empty () ) {
+            uint32_t owner = _arena.add_owner (keys[currNode]);
+
+            for (size_t n = 0; n < bucket.size (); n++) {
+                if (contained || _region.contains (bucket[n].pos) )
+                    _arena.add (bucket[n].id, bucket[n].pos, owner);
+            }
+        }
+
+        if (nodes[currNode].children == noNode)
+            continue;
+
+        for (uint32_t subnode = nodes[currNode].children; subnode < nodes[currNode].children + 4; subnode++) {
+            // skip subnodes that are outside the search area, a subnode's loose bounds are inside its parent's
+            bounds = nodes[subnode].rect.loosened (looseness);
+            bool subnodeContained = contained || _region.contains (bounds);
+
+            if (subnodeContained || _region.intersects (bounds) )
+                pending.push_back (std::make_pair (subnode, subnodeContained) );
+        }
+    }
+}
+
+size_t memory_quadtree::visit_entities (const region& _region, const entity_visitor& _visit, size_t _offset, size_t _limit) {
+    op_counters::scope scope (counters, OP_VISIT_ENTITIES);
+
+    rectangle bounds = nodes[0].rect.loosened (looseness);
+    if (!_region.intersects (bounds) )
+        return 0;
+
+    // the subnodes go on in reverse, so they come off in quadrant order
+    std::vector<std::pair<uint32_t, bool> > pending (1, std::make_pair (0, _region.contains (bounds) ) );
+    size_t visited = 0;
+    entity ent;
+
+    while (!pending.empty () ) {
+        uint32_t currNode = pending.back ().first;
+        bool contained = pending.back ().second;
+        pending.pop_back ();
+
+        if (contained && nodes[currNode].total <= _offset) {
+            _offset -= nodes[currNode].total;
+            continue;
+        }
+        RQTREE_COUNT (counters, nodesVisited, 1);
+
+        const std::vector<record>& bucket = buckets[currNode];
+        for (size_t n = 0; n < bucket.size (); n++) {
+            if (!contained && !_region.contains (bucket[n].pos) )
+                continue;
+            if (_offset > 0) {
+                _offset--;
+                continue;
+            }
+
+            make_entity (currNode, bucket[n], ent);
+            visited++;
+            if (!_visit (ent) || visited == _limit)
+                return visited;
+        }
+
+        if (nodes[currNode].children == noNode)
+            continue;
+
+        for (uint32_t subnode = nodes[currNode].children + 4; subnode-- > nodes[currNode].children; ) {
+            bounds = nodes[subnode].rect.loosened (looseness);
+            bool subnodeContained = contained || _region.contains (bounds);
+
+            if (subnodeContained || _region.intersects (bounds) )
+                pending.push_back (std::make_pair (subnode, subnodeContained) );
+        }
+    }
+
+    return visited;
+}
+
+void memory_quadtree::get_nearest (const point& _pos, size_t _k, std::vector<entity>& _ents, uint32_t _maxRadius) {
+    op_counters::scope scope (counters, OP_GET_NEAREST);
+
+    if (_k == 0)
+        return;
+
+    uint64_t limit = _maxRadius > 0 ? (uint64_t)_maxRadius * _maxRadius : UINT64_MAX;
+
+    typedef std::pair<uint64_t, uint32_t> queued_node;
+    typedef std::pair<uint64_t, slot> candidate;
+    auto fartherNode = [] (const queued_node& _a, const queued_node& _b) { return _a.first > _b.first; };
+    auto nearerCandidate = [] (const candidate& _a, const candidate& _b) { return _a.first < _b.first; };
+
+    // nodes still to visit nearest first, and the _k nearest entities so far farthest first
+    std::priority_queue<queued_node, std::vector<queued_node>, decltype (fartherNode)> frontier (fartherNode);
+    std::priority_queue<candidate, std::vector<candidate>, decltype (nearerCandidate)> best (nearerCandidate);
+
+    frontier.push (std::make_pair (nodes[0].rect.loosened (looseness).squared_distance (_pos), 0) );
+
+    while (!frontier.empty () ) {
+        // a node farther away than the _k-th candidate can't hold anything nearer
+        uint64_t bound = best.size () < _k ? limit : best.top ().first;
+        if (frontier.top ().first > bound)
+            break;
+
+        uint32_t currNode = frontier.top ().second;
+        frontier.pop ();
+        RQTREE_COUNT (counters, nodesVisited, 1);
+
+        const std::vector<record>& bucket = buckets[currNode];
+        for (uint32_t n = 0; n < bucket.size (); n++) {
+            uint64_t distance = squared_distance (_pos, bucket[n].pos);
+            if (distance > limit)
+                continue;
+
+            slot found = {currNode, n};
+            if (best.size () < _k)
+                best.push (std::make_pair (distance, found) );
+            else if (distance < best.top ().first) {
+                best.pop ();
+                best.push (std::make_pair (distance, found) );
+            }
+        }
+
+        if (nodes[currNode].children == noNode)
+            continue;
+
+        bound = best.size () < _k ? limit : best.top ().first;
+
+        // empty leaves have nothing to offer
+        for (uint32_t subnode = nodes[currNode].children; subnode < nodes[currNode].children + 4; subnode++) {
+            if (nodes[subnode].children == noNode && buckets[subnode].empty () )
+                continue;
+
+            uint64_t distance = nodes[subnode].rect.loosened (looseness).squared_distance (_pos);
+            if (distance <= bound)
+                frontier.push (std::make_pair (distance, subnode) );
+        }
+    }
+
+    size_t first = _ents.size ();
+    _ents.resize (first + best.size () );
+
+    for (size_t n = _ents.size (); n > first; n--) {
+        const slot& found = best.top ().second;
+        make_entity (found.node, buckets[found.node][found.index], _ents[n - 1]);
+        best.pop ();
+    }
+}
+
+size_t memory_quadtree::count_entities (const region& _region) {
+    op_counters::scope scope (counters, OP_COUNT_ENTITIES);
+
+    rectangle bounds = nodes[0].rect.loosened (looseness);
+    if (!_region.intersects (bounds) )
+        return 0;
+    RQTREE_COUNT (counters, nodesVisited, 1);
+    if (_region.contains (bounds) )
+        return nodes[0].total;
+
+    // a subnode inside the region counts as its total, only the nodes on the region's edge look at their entities
+    size_t count = 0;
+    std::vector<uint32_t> pending (1, 0);
+
+    while (!pending.empty () ) {
+        uint32_t currNode = pending.back ();
+        pending.pop_back ();
+
+        const std::vector<record>& bucket = buckets[currNode];
+        for (size_t n = 0; n < bucket.size (); n++) {
+            if (_region.contains (bucket[n].pos) )
+                count++;
+        }
+
+        if (nodes[currNode].children == noNode)
+            continue;
+
+        for (uint32_t subnode = nodes[currNode].children; subnode < nodes[currNode].children + 4; subnode++) {
+            bounds = nodes[subnode].rect.loosened (looseness);
+            if (!_region.intersects (bounds) )
+                continue;
+
+            RQTREE_COUNT (counters, nodesVisited, 1);
+            if (_region.contains (bounds) )
+                count += nodes[subnode].total;
+            else
+                pending.push_back (subnode);
+        }
+    }
+
+    return count;
+}
+
+void memory_quadtree::density_grid (const rectangle& _rect, uint32_t _level, std::vector<density_cell>& _cells) {
+    op_counters::scope scope (counters, OP_DENSITY_GRID);
+
+    if (!_rect.intersects (nodes[0].rect) )
+        return;
+
+    std::vector<uint32_t> pending (1, 0);
+
+    while (!pending.empty () ) {
+        uint32_t currNode = pending.back ();
+        pending.pop_back ();
+        RQTREE_COUNT (counters, nodesVisited, 1);
+
+        const mem_node& cellNode = nodes[currNode];
+        if (cellNode.depth >= _level || cellNode.children == noNode) {
+            density_cell cell;
+            cell.key = keys[currNode];
+            cell.rect = cellNode.rect;
+            cell.count = cellNode.total;
+            _cells.push_back (cell);
+            continue;
+        }
+
+        for (uint32_t subnode = cellNode.children; subnode < cellNode.children + 4; subnode++) {
+            if (_rect.intersects (nodes[subnode].rect) )
+                pending.push_back (subnode);
+        }
+    }
+}
+
+void memory_quadtree::relocate_entities (std::vector<entity>& _ents) {
+    op_counters::scope scope (counters, OP_RELOCATE_ENTITIES);
+
+    // nothing to batch up without round trips
+    for (std::vector<entity>::iterator it = _ents.begin (); it != _ents.end (); it++)
+        relocate_entity (*it);
+}
+
+void memory_quadtree::insert_entities (std::vector<entity>& _ents) {
+    op_counters::scope scope (counters, OP_INSERT_ENTITIES);
+
+    for (std::vector<entity>::iterator it = _ents.begin (); it != _ents.end (); it++)
+        insert_entity (*it);
+}
+
+void memory_quadtree::set_thresholds (uint32_t _maxEntities, uint32_t _mergeEntities) {
+    maxEntitiesPerNode = std::max (_maxEntities, 1u);
+    mergeEntities = merge_threshold (maxEntitiesPerNode, _mergeEntities);
+}
+
+size_t memory_quadtree::size () const {
+    return slots.size ();
+}
+
+size_t memory_quadtree::node_count () const {
+    return nodes.size () - freeBlocks.size () * 4;
+}
+
+void memory_quadtree::get_tree (std::vector<node>& _nodes, std::vector<entity>& _ents) const {
+    // breadth first, so every node comes after its parent the way restore takes them
+    std::vector<uint32_t> order (1, 0);
+
+    for (size_t n = 0; n < order.size (); n++) {
+        uint32_t index = order[n];
+        const mem_node& currNode = nodes[index];
+
+        _nodes.push_back (node () );
+        node& state = _nodes.back ();
+        state.key = keys[index];
+        state.parentKey = currNode.parent == noNode ? "" : keys[currNode.parent];
+        state.subdivided = currNode.children != noNode;
+        state.entities = buckets[index].size ();
+        state.rect = currNode.rect;
+
+        for (std::vector<record>::const_iterator it = buckets[index].begin (); it != buckets[index].end (); it++) {
+            _ents.emplace_back ();
+            make_entity (index, *it, _ents.back () );
+        }
+
+        if (currNode.children != noNode) {
+            for (uint32_t subnode = currNode.children; subnode < currNode.children + 4; subnode++)
+                order.push_back (subnode);
+        }
+    }
+}
+
+void memory_quadtree::track_changes () {
+    tracking = true;
+}
+
+size_t memory_quadtree::changed () const {
+    return changedNodes.size () + changedEntities.size ();
+}
+
+void memory_quadtree::take_changes (tree_changes& _changes) {
+    _changes.nodes.clear ();
+    _changes.buckets.clear ();
+    _changes.removedNodes.clear ();
+    _changes.entities.clear ();
+    _changes.removedEntities.clear ();
+    _changes.totals.clear ();
+
+    _changes.removedNodes.swap (removedKeys);
+
+    for (std::vector<uint32_t>::iterator it = changedNodes.begin (); it != changedNodes.end (); it++) {
+        nodeChanged[*it] = false;
+
+        // merged away since it changed, it's in removedNodes
+        const mem_node& changedNode = nodes[*it];
+        if (*it != 0 && changedNode.parent == noNode)
+            continue;
+
+        node state;
+        state.key = keys[*it];
+        state.parentKey = changedNode.parent == noNode ? "" : keys[changedNode.parent];
+        state.subdivided = changedNode.children != noNode;
+        state.entities = buckets[*it].size ();
+        state.rect = changedNode.rect;
+        _changes.nodes.push_back (state);
+
+        // a record is laid out just like a LAYOUT_PACKED one
+        static_assert (sizeof (record) == entityRecordSize, "bucket records have to match LAYOUT_PACKED");
+        _changes.buckets.push_back (std::string () );
+        if (!buckets[*it].empty () )
+            _changes.buckets.back ().assign ( (const char*)&buckets[*it][0], buckets[*it].size () * sizeof (record) );
+    }
+    changedNodes.clear ();
+
+    for (std::unordered_set<uint32_t>::iterator it = changedEntities.begin (); it != changedEntities.end (); it++) {
+        std::unordered_map<uint32_t, slot>::const_iterator found = slots.find (*it);
+
+        if (found == slots.end () )
+            _changes.removedEntities.push_back (*it);
+        else {
+            _changes.entities.emplace_back ();
+            make_entity (found->second.node, buckets[found->second.node][found->second.index], _changes.entities.back () );
+        }
+    }
+    changedEntities.clear ();
+
+    for (std::vector<uint32_t>::iterator it = changedTotals.begin (); it != changedTotals.end (); it++) {
+        totalChanged[*it] = false;
+
+        if (*it == 0 || nodes[*it].parent != noNode)
+            _changes.totals.push_back (std::make_pair (keys[*it], nodes[*it].total) );
+    }
+    changedTotals.clear ();
+}
+
+void memory_quadtree::return_changes (const tree_changes& _changes) {
+    if (!tracking)
+        return;
+
+    std::unordered_map<std::string, uint32_t> live;
+    for (uint32_t n = 0; n < nodes.size (); n++) {
+        if (n == 0 || nodes[n].parent != noNode)
+            live[keys[n]] = n;
+    }
+
+    // a node that's gone since is deleted again, one deleted in the failed write and back since is
+    // deleted and then written whole
+    std::vector<std::string> returned = _changes.removedNodes;
+    for (size_t n = 0; n < _changes.nodes.size (); n++)
+        returned.push_back (_changes.nodes[n].key);
+    for (size_t n = 0; n < _changes.totals.size (); n++)
+        returned.push_back (_changes.totals[n].first);
+
+    for (size_t n = 0; n < returned.size (); n++) {
+        std::unordered_map<std::string, uint32_t>::const_iterator found = live.find (returned[n]);
+        if (n < _changes.removedNodes.size () || found == live.end () )
+            removedKeys.push_back (returned[n]);
+        if (found != live.end () ) {
+            node_changed (found->second);
+            total_changed (found->second);
+        }
+    }
+
+    for (size_t n = 0; n < _changes.entities.size (); n++)
+        entity_changed (_changes.entities[n].id);
+    for (size_t n = 0; n < _changes.removedEntities.size (); n++)
+        entity_changed (_changes.removedEntities[n]);
+}
+
+void memory_quadtree::restore (const std::vector<node>& _nodes, const std::vector<entity>& _ents) {
+    nodes.clear ();
+    buckets.clear ();
+    keys.clear ();
+    freeBlocks.clear ();
+    slots.clear ();
+    nodeChanged.clear ();
+    totalChanged.clear ();
+
+    if (_nodes.empty () )
+        return;
+
+    mem_node root;
+    root.rect = _nodes[0].rect;
+    root.parent = noNode;
+    root.children = noNode;
+    root.depth = 0;
+    root.total = 0;
+
+    nodes.push_back (root);
+    buckets.resize (1);
+    keys.push_back (_nodes[0].key);
+    nodeChanged.resize (1);
+    totalChanged.resize (1);
+
+    std::unordered_map<std::string, uint32_t> indices;
+    indices[_nodes[0].key] = 0;
+
+    for (std::vector<node>::const_iterator it = _nodes.begin (); it != _nodes.end (); it++) {
+        std::unordered_map<std::string, uint32_t>::iterator found = indices.find (it->key);
+        if (!it->subdivided || found == indices.end () || nodes[found->second].children != noNode)
+            continue;
+
+        uint32_t index = found->second;
+        add_subnodes (index);
+
+        for (uint32_t subnode = nodes[index].children; subnode < nodes[index].children + 4; subnode++)
+            indices[keys[subnode]] = subnode;
+    }
+
+    for (std::vector<entity>::const_iterator it = _ents.begin (); it != _ents.end (); it++) {
+        entity ent = *it;
+        std::unordered_map<std::string, uint32_t>::iterator found = indices.find (ent.ownerKey);
+
+        // an owner that isn't in _nodes, find it a place instead
+        if (found != indices.end () )
+            add_entity (found->second, ent);
+        else if (nodes[0].rect.contains (ent.pos) )
+            add_below (0, ent);
+    }
+
+    // the tree is what it was handed, nothing in it has changed
+    changedNodes.clear ();
+    removedKeys.clear ();
+    changedEntities.clear ();
+    std::fill (totalChanged.begin (), totalChanged.end (), false);
+    changedTotals.clear ();
+}
+
+uint32_t memory_quadtree::quadrant_of (uint32_t _node, const point& _pos) const {
+    const mem_node& currNode = nodes[_node];
+    if (currNode.children == noNode)
+        return noNode;
+
+    for (uint32_t subnode = currNode.children; subnode < currNode.children + 4; subnode++) {
+        if (nodes[subnode].rect.contains (_pos) )
+            return subnode;
+    }
+    return noNode;
+}
+
+bool memory_quadtree::subdivide (uint32_t _node) {
+    // don't subdivide if we've reached the minimum
+    const rectangle& rect = nodes[_node].rect;
+    if (rect.width / 2 < minNodeSize || rect.height / 2 < minNodeSize)
+        return false;
+    RQTREE_COUNT (counters, subdivides, 1);
+
+    add_subnodes (_node);
+
+    // move the entities down a level, the ones that don't fit in a subnode stay here
+    std::vector<record>& bucket = buckets[_node];
+    uint32_t kept = 0;
+
+    for (uint32_t n = 0; n < bucket.size (); n++) {
+        uint32_t subnode = quadrant_of (_node, bucket[n].pos);
+        slot& moved = slots[bucket[n].id];
+
+        if (subnode == noNode) {
+            moved.index = kept;
+            bucket[kept++] = bucket[n];
+        }
+        else {
+            moved.node = subnode;
+            moved.index = buckets[subnode].size ();
+            buckets[subnode].push_back (bucket[n]);
+            entity_changed (bucket[n].id);
+
+            // still in this node's subtree, only the subnode's total changes
+            nodes[subnode].total++;
+            total_changed (subnode);
+        }
+    }
+    bucket.resize (kept);
+
+    return true;
+}
+
+void memory_quadtree::add_subnodes (uint32_t _node) {
+    uint32_t first;
+    if (!freeBlocks.empty () ) {
+        first = freeBlocks.back ();
+        freeBlocks.pop_back ();
+    }
+    else {
+        first = nodes.size ();
+        nodes.resize (first + 4);
+        buckets.resize (first + 4);
+        keys.resize (first + 4);
+        nodeChanged.resize (first + 4);
+        totalChanged.resize (first + 4);
+    }
+
+    for (int quad = 0; quad < 4; quad++) {
+        mem_node& subnode = nodes[first + quad];
+        subnode.rect = nodes[_node].rect.quadrant (quad);
+        subnode.parent = _node;
+        subnode.children = noNode;
+        subnode.depth = nodes[_node].depth + 1;
+        subnode.total = 0;
+
+        keys[first + quad] = subnode_key (keyScheme, keys[_node], quad);
+        node_changed (first + quad);
+    }
+
+    nodes[_node].children = first;
+    node_changed (_node);
+}
+
+void memory_quadtree::subdivide_to_min_depth (uint32_t _node) {
+    if (nodes[_node].depth >= minDepth)
+        return;
+
+    if (nodes[_node].children == noNode && !subdivide (_node) )
+        return;
+
+    for (int quad = 0; quad < 4; quad++)
+        subdivide_to_min_depth (nodes[_node].children + quad);
+}
+
+void memory_quadtree::clean (uint32_t _node) {
+    RQTREE_COUNT (counters, cleans, 1);
+
+    // nodes above the minimum depth keep their subnodes
+    if (nodes[_node].depth < minDepth)
+        return;
+
+    if (nodes[_node].children != noNode) {
+        // a subtree that isn't empty still merges once it's down to mergeEntities
+        if (nodes[_node].total > mergeEntities && !subtree_empty (_node) )
+            return;
+        merge (_node);
+    }
+
+    // this node is down to the threshold now too, see if its parent can merge
+    if (buckets[_node].size () <= mergeEntities && nodes[_node].parent != noNode)
+        clean (nodes[_node].parent);
+}
+
+bool memory_quadtree::subtree_empty (uint32_t _node) const {
+    uint32_t first = nodes[_node].children;
+    if (first == noNode)
+        return true;
+
+    for (uint32_t subnode = first; subnode < first + 4; subnode++) {
+        if (!buckets[subnode].empty () || !subtree_empty (subnode) )
+            return false;
+    }
+    return true;
+}
+
+void memory_quadtree::merge (uint32_t _node) {
+    uint32_t first = nodes[_node].children;
+
+    for (uint32_t subnode = first; subnode < first + 4; subnode++) {
+        if (nodes[subnode].children != noNode)
+            merge (subnode);
+
+        // whatever is left below moves up into this node, the subtree's total stays the same
+        std::vector<record>& bucket = buckets[subnode];
+        for (std::vector<record>::iterator it = bucket.begin (); it != bucket.end (); it++) {
+            slot& moved = slots[it->id];
+            moved.node = _node;
+            moved.index = buckets[_node].size ();
+            buckets[_node].push_back (*it);
+            entity_changed (it->id);
+        }
+        bucket.clear ();
+
+        nodes[subnode].parent = noNode;
+        if (tracking)
+            removedKeys.push_back (keys[subnode]);
+    }
+
+    nodes[_node].children = noNode;
+    node_changed (_node);
+    freeBlocks.push_back (first);
+}
+
+void memory_quadtree::add_below (uint32_t _node, entity& _ent) {
+    // the same descent as quadtree::insert_entity
+    while (true) {
+        RQTREE_COUNT (counters, nodesVisited, 1);
+
+        // there's still room here, or this is as small as the nodes can get
+        if (nodes[_node].children == noNode && (buckets[_node].size () + 1 <= maxEntitiesPerNode || !subdivide (_node) ) )
+            break;
+
+        // if this entity won't fit in the subnodes it stays here
+        uint32_t subnode = quadrant_of (_node, _ent.pos);
+        if (subnode == noNode)
+            break;
+
+        _node = subnode;
+    }
+
+    add_entity (_node, _ent);
+}
+
+void memory_quadtree::add_entity (uint32_t _node, entity& _ent) {
+    record added;
+    added.id = _ent.id;
+    added.pos = _ent.pos;
+
+    slot& found = slots[_ent.id];
+    found.node = _node;
+    found.index = buckets[_node].size ();
+    buckets[_node].push_back (added);
+    add_to_totals (_node, 1);
+
+    make_entity (_node, added, _ent);
+    node_changed (_node);
+    entity_changed (_ent.id);
+}
+
+void memory_quadtree::take_entity (const slot& _slot) {
+    // the last record in the bucket fills the gap
+    // _slot may be the entry that's erased below
+    uint32_t node = _slot.node;
+    uint32_t index = _slot.index;
+    std::vector<record>& bucket = buckets[node];
+    uint32_t id = bucket[index].id;
+
+    bucket[index] = bucket.back ();
+    slots[bucket[index].id].index = index;
+    bucket.pop_back ();
+
+    slots.erase (id);
+    add_to_totals (node, -1);
+    node_changed (node);
+    entity_changed (id);
+}
+
+void memory_quadtree::add_to_totals (uint32_t _node, int32_t _count) {
+    for (; _node != noNode; _node = nodes[_node].parent) {
+        nodes[_node].total += _count;
+        total_changed (_node);
+    }
+}
+
+void memory_quadtree::make_entity (uint32_t _node, const record& _record, entity& _ent) const {
+    _ent.id = _record.id;
+    _ent.pos = _record.pos;
+    _ent.key = "entities:" + std::to_string (_record.id);
+    _ent.ownerKey = keys[_node];
+}
+
+void memory_quadtree::node_changed (uint32_t _node) {
+    if (!tracking || nodeChanged[_node])
+        return;
+
+    nodeChanged[_node] = true;
+    changedNodes.push_back (_node);
+}
+
+void memory_quadtree::entity_changed (uint32_t _id) {
+    if (tracking)
+        changedEntities.insert (_id);
+}
+
+void memory_quadtree::total_changed (uint32_t _node) {
+    if (!tracking || !countSubtrees || totalChanged[_node])
+        return;
+
+    totalChanged[_node] = true;
+    changedTotals.push_back (_node);
+}
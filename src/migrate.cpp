@@ -0,0 +1,213 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <hiredis/hiredis.h>
+#include <util.hpp>
+#include <node.hpp>
+#include <key_space.hpp>
+
+// converts a tree stored with KEYS_PATH node keys ("root:tl:br") to KEYS_MORTON keys in place
+// the tree is walked one level at a time with a pipeline per level
+// works with either entity layout, a node has an entity set or a packed bucket but never both
+// the keys are renamed under the clients' feet, so every client of the tree has to be stopped until it's done
+// and started again with keyScheme KEYS_MORTON, a tree sharded over a cluster (cluster, tagged keys) can't
+// be converted, its keys would change slots
+// a failure halfway leaves a tree with both kinds of keys that has to be restored from a backup
+
+static std::string host = "localhost";
+static int port = 6379;
+static int db = 0;
+static std::string prefix;
+
+static bool parse_args (int _argc, char** _argv) {
+    for (int n = 1; n + 1 < _argc; n += 2) {
+        std::string arg = _argv[n], value = _argv[n + 1];
+
+        if (arg == "--host")
+            host = value;
+        else if (arg == "--port")
+            port = atoi (value.c_str () );
+        else if (arg == "--db")
+            db = atoi (value.c_str () );
+        else if (arg == "--prefix")
+            prefix = value;
+        else
+            return false;
+    }
+
+    return _argc % 2 == 1;
+}
+
+// the next pipelined reply, null once the connection is gone
+static redisReply* next_reply (redisContext* _context) {
+    redisReply* reply = NULL;
+    if (redisGetReply (_context, (void**)&reply) != REDIS_OK)
+        return NULL;
+    return reply;
+}
+
+static int lost (redisContext* _context) {
+    std::cout << "Error: " << (_context->err ? _context->errstr : "no reply") <<
+        ", the tree is only partly converted" << std::endl;
+    redisFree (_context);
+    return -1;
+}
+
+int main (int argc, char** argv) {
+    if (!parse_args (argc, argv) ) {
+        std::cout << "usage: rqtree_migrate [--host <host>] [--port <port>] [--db <index>] [--prefix <keyPrefix>]" << std::endl;
+        return -1;
+    }
+
+    const char* quads[4] = {"tl", "tr", "bl", "br"};
+    const key_space keys (KEYS_PATH, prefix, false, 0);
+
+    redisContext* context = redisConnect (host.c_str (), port);
+    if (context->err) {
+        std::cout << "Error: " << context->errstr << std::endl;
+        return -1;
+    }
+
+    redisReply* reply = (redisReply*)redisCommand (context, "SELECT %i", db);
+    bool selected = reply && reply->type != REDIS_REPLY_ERROR;
+    if (reply)
+        freeReplyObject (reply);
+
+    if (!selected) {
+        std::cout << "Error: can't select database " << db << std::endl;
+        redisFree (context);
+        return -1;
+    }
+
+    std::string rootKey = keys.map (morton_key (1) ), pathRootKey = keys.map ("root");
+
+    reply = (redisReply*)redisCommand (context, "EXISTS %b", rootKey.data (), rootKey.size () );
+    bool converted = reply && reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+    if (reply)
+        freeReplyObject (reply);
+
+    reply = (redisReply*)redisCommand (context, "EXISTS %b", pathRootKey.data (), pathRootKey.size () );
+    bool found = reply && reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+    if (reply)
+        freeReplyObject (reply);
+
+    if (converted || !found) {
+        std::cout << "Error: no quadtree with path keys to convert" << std::endl;
+        redisFree (context);
+        return -1;
+    }
+
+    std::vector<std::string> nodeKeys (1, "root");
+    std::vector<uint64_t> codes (1, 1);
+    std::vector<std::string> subnodeKeys;
+    std::vector<uint64_t> subnodeCodes;
+    size_t nodes = 0, entities = 0, failed = 0;
+
+    while (!nodeKeys.empty () ) {
+        subnodeKeys.clear ();
+        subnodeCodes.clear ();
+
+        for (size_t i = 0; i < nodeKeys.size (); i++) {
+            redisAppendCommand (context, "HGET %s subdivided", keys.map (nodeKeys[i]).c_str () );
+            redisAppendCommand (context, "SMEMBERS %s", keys.map (nodeKeys[i] + ":entities").c_str () );
+            redisAppendCommand (context, "GET %s", keys.map (nodeKeys[i] + ":bucket").c_str () );
+            redisAppendCommand (context, "EXISTS %s", keys.map (nodeKeys[i] + ":total").c_str () );
+        }
+
+        size_t pending = 0;
+        for (size_t i = 0; i < nodeKeys.size (); i++) {
+            const std::string& nodeKey = nodeKeys[i];
+            std::string newKey = morton_key (codes[i]);
+
+            if (!(reply = next_reply (context) ) )
+                return lost (context);
+            if (reply->type == REDIS_REPLY_STRING && reply->str[0] == '1') {
+                for (int quad = 0; quad < 4; quad++) {
+                    subnodeKeys.push_back (nodeKey + ":" + quads[quad]);
+                    subnodeCodes.push_back ( (codes[i] << 2) | quad);
+                }
+            }
+            freeReplyObject (reply);
+
+            redisAppendCommand (context, "RENAME %s %s", keys.map (nodeKey).c_str (), keys.map (newKey).c_str () );
+            redisAppendCommand (context, "RENAME %s %s", keys.map (nodeKey + ":rect").c_str (), keys.map (newKey + ":rect").c_str () );
+            pending += 2;
+
+            if (!(reply = next_reply (context) ) )
+                return lost (context);
+            if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0) {
+                redisAppendCommand (context, "RENAME %s %s", keys.map (nodeKey + ":entities").c_str (),
+                    keys.map (newKey + ":entities").c_str () );
+                pending++;
+
+                // point every entity at its owner's new key, which is kept without the prefix
+                for (size_t n = 0; n < reply->elements; n++) {
+                    std::string entityKey = keys.map ("entities:" + std::string (reply->element[n]->str, reply->element[n]->len) );
+                    redisAppendCommand (context, "HSET %b owner %b", entityKey.data (), entityKey.size (), newKey.data (), newKey.size () );
+                    pending++;
+                }
+                entities += reply->elements;
+            }
+            freeReplyObject (reply);
+
+            if (!(reply = next_reply (context) ) )
+                return lost (context);
+            if (reply->type == REDIS_REPLY_STRING && reply->len > 0) {
+                std::string indexKey = keys.map ("entities:index");
+                redisAppendCommand (context, "RENAME %s %s", keys.map (nodeKey + ":bucket").c_str (),
+                    keys.map (newKey + ":bucket").c_str () );
+                pending++;
+
+                // the records keep their place, only the index has to follow the node
+                for (size_t offset = 0; offset + entityRecordSize <= (size_t)reply->len; offset += entityRecordSize) {
+                    uint32_t id;
+                    memcpy (&id, reply->str + offset, sizeof (uint32_t) );
+                    redisAppendCommand (context, "HSET %s %u %b", indexKey.c_str (), id, newKey.data (), newKey.size () );
+                    pending++;
+                    entities++;
+                }
+            }
+            freeReplyObject (reply);
+
+            // only there with countSubtrees
+            if (!(reply = next_reply (context) ) )
+                return lost (context);
+            if (reply->type == REDIS_REPLY_INTEGER && reply->integer == 1) {
+                redisAppendCommand (context, "RENAME %s %s", keys.map (nodeKey + ":total").c_str (),
+                    keys.map (newKey + ":total").c_str () );
+                pending++;
+            }
+            freeReplyObject (reply);
+        }
+
+        // a rename or owner update that failed leaves that node or entity behind, the rest carries on so
+        // everything that could be converted was
+        for (size_t n = 0; n < pending; n++) {
+            if (!(reply = next_reply (context) ) )
+                return lost (context);
+            if (reply->type == REDIS_REPLY_ERROR) {
+                if (!failed)
+                    std::cout << "Error: " << reply->str << std::endl;
+                failed++;
+            }
+            freeReplyObject (reply);
+        }
+
+        nodes += nodeKeys.size ();
+        nodeKeys.swap (subnodeKeys);
+        codes.swap (subnodeCodes);
+    }
+
+    redisFree (context);
+
+    if (failed) {
+        std::cout << failed << " commands failed, the tree is only partly converted" << std::endl;
+        return -1;
+    }
+
+    std::cout << "Converted " << nodes << " nodes and " << entities << " entities" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <cstring>
+#include <algorithm>
+#include <node.hpp>
+
+static const char* quads[4] = {"tl", "tr", "bl", "br"};
+
+std::string root_key (key_scheme _scheme) {
+    return _scheme == KEYS_MORTON ? morton_key (1) : "root";
+}
+
+std::string subnode_key (key_scheme _scheme, const std::string& _nodeKey, int _quad) {
+    if (_scheme == KEYS_MORTON)
+        return morton_key ( (morton_key_code (_nodeKey) << 2) | _quad);
+
+    return _nodeKey + ":" + quads[_quad];
+}
+
+std::string parent_key (key_scheme _scheme, const std::string& _nodeKey) {
+    if (_nodeKey == root_key (_scheme) )
+        return "";
+
+    if (_scheme == KEYS_MORTON)
+        return morton_key (morton_key_code (_nodeKey) >> 2);
+
+    return _nodeKey.substr (0, _nodeKey.size () - 3);
+}
+
+uint32_t node_depth (key_scheme _scheme, const std::string& _nodeKey) {
+    uint32_t depth = 0;
+
+    if (_scheme == KEYS_MORTON) {
+        // two bits per level below the leading 1
+        for (uint64_t code = morton_key_code (_nodeKey); code > 1; code >>= 2)
+            depth++;
+    }
+    else {
+        depth = std::count (_nodeKey.begin (), _nodeKey.end (), ':');
+    }
+
+    return depth;
+}
+
+bool parse_node (const redisReply* _reply, node& _node) {
+    bool exists = false;
+
+    _node.subdivided = false;
+    _node.entities = 0;
+
+    // reply to HMGET <node> subdivided entities
+    if (_reply->type == REDIS_REPLY_ARRAY && _reply->elements == 2) {
+        if (_reply->element[0]->type == REDIS_REPLY_STRING) {
+            _node.subdivided = read_uint (_reply->element[0]) != 0;
+            exists = true;
+        }
+        _node.entities = read_uint (_reply->element[1]);
+    }
+
+    return exists;
+}
+
+bool parse_entity (coordinate_encoding _encoding, const char* _id, const redisReply* _reply, entity& _ent) {
+    // reply to HMGET entities:<id> x y owner
+    // a hash that's half written or half deleted by another client counts as missing
+    if (_reply->type != REDIS_REPLY_ARRAY || _reply->elements != 3)
+        return false;
+    for (size_t n = 0; n < 3; n++) {
+        if (_reply->element[n]->type != REDIS_REPLY_STRING)
+            return false;
+    }
+
+    _ent.id = read_uint (_id);
+    _ent.pos = point (read_coordinate (_encoding, _reply->element[0]), read_coordinate (_encoding, _reply->element[1]) );
+    _ent.key.assign ("entities:").append (_id);
+    _ent.ownerKey.assign (_reply->element[2]->str, _reply->element[2]->len);
+
+    return true;
+}
+
+void parse_bucket (const redisReply* _reply, const std::string& _ownerKey, std::vector<entity>& _ents) {
+    // reply to GET <node>:bucket
+    if (_reply->type != REDIS_REPLY_STRING)
+        return;
+
+    entity ent;
+    ent.ownerKey = _ownerKey;
+
+    for (size_t offset = 0; offset + entityRecordSize <= (size_t)_reply->len; offset += entityRecordSize) {
+        memcpy (ent.bytes, _reply->str + offset, sizeof (uint32_t) );
+        memcpy (ent.pos.bytes, _reply->str + offset + sizeof (uint32_t), sizeof (point) );
+        ent.key = "entities:" + std::to_string (ent.id);
+        _ents.push_back (ent);
+    }
+}
+
+void pack_entity (const entity& _ent, std::string& _bucket) {
+    _bucket.append ( (const char*)_ent.bytes, sizeof (uint32_t) );
+    _bucket.append ( (const char*)_ent.pos.bytes, sizeof (point) );
+}
+
+size_t find_entity (const std::string& _bucket, uint32_t _id) {
+    for (size_t offset = 0; offset + entityRecordSize <= _bucket.size (); offset += entityRecordSize) {
+        if (memcmp (_bucket.data () + offset, &_id, sizeof (uint32_t) ) == 0)
+            return offset;
+    }
+
+    return std::string::npos;
+}
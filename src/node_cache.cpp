@@ -0,0 +1,41 @@
+#include <node_cache.hpp>
+
+bool node_cache::get (const std::string& _key, node& _node) const {
+    std::unordered_map<std::string, node>::const_iterator it = nodes.find (_key);
+
+    if (it == nodes.end () )
+        return false;
+
+    _node = it->second;
+    return true;
+}
+
+void node_cache::put (const node& _node) {
+    nodes[_node.key] = _node;
+}
+
+void node_cache::erase (const std::string& _key) {
+    nodes.erase (_key);
+}
+
+void node_cache::clear () {
+    nodes.clear ();
+}
+
+void node_cache::set_subdivided (const std::string& _key, bool _subdivided) {
+    std::unordered_map<std::string, node>::iterator it = nodes.find (_key);
+
+    if (it != nodes.end () )
+        it->second.subdivided = _subdivided;
+}
+
+void node_cache::add_entities (const std::string& _key, int32_t _count) {
+    std::unordered_map<std::string, node>::iterator it = nodes.find (_key);
+
+    if (it != nodes.end () )
+        it->second.entities += _count;
+}
+
+size_t node_cache::size () const {
+    return nodes.size ();
+}
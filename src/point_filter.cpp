@@ -0,0 +1,152 @@
+#include <cstring>
+#include <point_filter.hpp>
+
+#if !defined (RQTREE_NO_SIMD) && (defined (__x86_64__) || defined (__i386__) ) && defined (__GNUC__)
+#define RQTREE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+void point_columns::clear () {
+    ids.clear ();
+    xs.clear ();
+    ys.clear ();
+}
+
+size_t point_columns::size () const {
+    return ids.size ();
+}
+
+void point_columns::add_records (const char* _records, size_t _bytes) {
+    size_t count = _bytes / entityRecordSize, first = ids.size ();
+    ids.resize (first + count);
+    xs.resize (first + count);
+    ys.resize (first + count);
+
+    // a record is the id, x and y in host byte order
+    for (size_t n = 0; n < count; n++) {
+        const char* record = _records + n * entityRecordSize;
+        memcpy (&ids[first + n], record, sizeof (uint32_t) );
+        memcpy (&xs[first + n], record + sizeof (uint32_t), sizeof (uint32_t) );
+        memcpy (&ys[first + n], record + 2 * sizeof (uint32_t), sizeof (uint32_t) );
+    }
+}
+
+size_t filter_inside_scalar (const rectangle& _rect, const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep) {
+    size_t kept = 0;
+
+    // branch free, a boundary bucket keeps about half of its points in no particular order
+    for (size_t n = 0; n < _count; n++) {
+        _keep[kept] = n;
+        kept += (_xs[n] > _rect.x) & (_ys[n] > _rect.y) & (_xs[n] < _rect.x2) & (_ys[n] < _rect.y2);
+    }
+
+    return kept;
+}
+
+#ifdef RQTREE_X86_KERNELS
+
+// there's no unsigned compare before avx512, flipping the sign bit makes the signed one order unsigned values
+static const uint32_t signBit = 0x80000000u;
+
+// the bit of every lane set in _mask, turned into indices from _base
+static size_t keep_lanes (uint32_t _mask, size_t _base, uint32_t* _keep) {
+    size_t kept = 0;
+
+    while (_mask) {
+        _keep[kept++] = _base + __builtin_ctz (_mask);
+        _mask &= _mask - 1;
+    }
+
+    return kept;
+}
+
+__attribute__ ( (target ("sse2") ) )
+static size_t filter_inside_sse2 (const rectangle& _rect, const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep) {
+    const __m128i flip = _mm_set1_epi32 (signBit);
+    const __m128i left = _mm_set1_epi32 (_rect.x ^ signBit), top = _mm_set1_epi32 (_rect.y ^ signBit);
+    const __m128i right = _mm_set1_epi32 (_rect.x2 ^ signBit), bottom = _mm_set1_epi32 (_rect.y2 ^ signBit);
+    size_t kept = 0, n = 0;
+
+    for (; n + 4 <= _count; n += 4) {
+        __m128i x = _mm_xor_si128 (_mm_loadu_si128 ( (const __m128i*)(_xs + n) ), flip);
+        __m128i y = _mm_xor_si128 (_mm_loadu_si128 ( (const __m128i*)(_ys + n) ), flip);
+
+        __m128i inside = _mm_and_si128 (_mm_and_si128 (_mm_cmpgt_epi32 (x, left), _mm_cmpgt_epi32 (y, top) ),
+            _mm_and_si128 (_mm_cmplt_epi32 (x, right), _mm_cmplt_epi32 (y, bottom) ) );
+        kept += keep_lanes (_mm_movemask_ps (_mm_castsi128_ps (inside) ), n, _keep + kept);
+    }
+
+    for (size_t i = 0, tail = filter_inside_scalar (_rect, _xs + n, _ys + n, _count - n, _keep + kept); i < tail; i++)
+        _keep[kept++] += n;
+
+    return kept;
+}
+
+__attribute__ ( (target ("avx2") ) )
+static size_t filter_inside_avx2 (const rectangle& _rect, const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep) {
+    const __m256i flip = _mm256_set1_epi32 (signBit);
+    const __m256i left = _mm256_set1_epi32 (_rect.x ^ signBit), top = _mm256_set1_epi32 (_rect.y ^ signBit);
+    const __m256i right = _mm256_set1_epi32 (_rect.x2 ^ signBit), bottom = _mm256_set1_epi32 (_rect.y2 ^ signBit);
+    size_t kept = 0, n = 0;
+
+    for (; n + 8 <= _count; n += 8) {
+        __m256i x = _mm256_xor_si256 (_mm256_loadu_si256 ( (const __m256i*)(_xs + n) ), flip);
+        __m256i y = _mm256_xor_si256 (_mm256_loadu_si256 ( (const __m256i*)(_ys + n) ), flip);
+
+        // x > left and right > x, the same for y
+        __m256i inside = _mm256_and_si256 (_mm256_and_si256 (_mm256_cmpgt_epi32 (x, left), _mm256_cmpgt_epi32 (y, top) ),
+            _mm256_and_si256 (_mm256_cmpgt_epi32 (right, x), _mm256_cmpgt_epi32 (bottom, y) ) );
+        kept += keep_lanes (_mm256_movemask_ps (_mm256_castsi256_ps (inside) ), n, _keep + kept);
+    }
+
+    for (size_t i = 0, tail = filter_inside_scalar (_rect, _xs + n, _ys + n, _count - n, _keep + kept); i < tail; i++)
+        _keep[kept++] += n;
+
+    return kept;
+}
+
+#endif
+
+static filter_fn pick_kernel (const char** _name) {
+#ifdef RQTREE_X86_KERNELS
+    __builtin_cpu_init ();
+
+    if (__builtin_cpu_supports ("avx2") ) {
+        *_name = "avx2";
+        return filter_inside_avx2;
+    }
+    if (__builtin_cpu_supports ("sse2") ) {
+        *_name = "sse2";
+        return filter_inside_sse2;
+    }
+#endif
+
+    *_name = "scalar";
+    return filter_inside_scalar;
+}
+
+static const char* kernelName;
+static const filter_fn kernel = pick_kernel (&kernelName);
+
+size_t filter_inside (const rectangle& _rect, const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep) {
+    return kernel (_rect, _xs, _ys, _count, _keep);
+}
+
+const char* filter_kernel () {
+    return kernelName;
+}
+
+filter_fn find_filter_kernel (const char* _name) {
+    if (!strcmp (_name, "scalar") )
+        return filter_inside_scalar;
+#ifdef RQTREE_X86_KERNELS
+    __builtin_cpu_init ();
+
+    if (!strcmp (_name, "avx2") && __builtin_cpu_supports ("avx2") )
+        return filter_inside_avx2;
+    if (!strcmp (_name, "sse2") && __builtin_cpu_supports ("sse2") )
+        return filter_inside_sse2;
+#endif
+
+    return NULL;
+}
@@ -1,60 +1,283 @@
+#include <cstdarg>
+#include <cstdlib>
+#include <cerrno>
 #include <iostream>
 #include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <queue>
+#include <deque>
+#include <random>
+#include <poll.h>
 
 #include <sstream>
 #include <quadtree.hpp>
+#include <memory_quadtree.hpp>
+#include <snapshot.hpp>
+#include <point_filter.hpp>
+
+// commands queued before insert_entities stops to read their replies
+static const size_t bulkPipelineSize = 4096;
+// how long the change listener waits on its connection before checking whether it should stop, in ms
+static const int listenerPollInterval = 50;
+static const size_t bulkSetSize = 512;
+// nodes get_nearest reads per pipeline
+static const size_t nearestBatchSize = 16;
+// nodes visit_entities reads in its first pipeline, every one after that reads twice as many up to bulkPipelineSize
+static const size_t visitBatchSize = 16;
+
+// splits a command formatted by hiredis ("*<argc>\r\n" and "$<len>\r\n<arg>\r\n" per argument) back into its arguments
+static void parse_command (const char* _command, size_t _length, std::vector<std::string>& _args) {
+    const char* end = _command + _length;
+    const char* at = _command + 1;
+    long count = strtol (at, NULL, 10);
+
+    at = strchr (at, '\n') + 1;
+    for (long n = 0; n < count && at < end; n++) {
+        size_t length = strtoul (at + 1, NULL, 10);
+        at = strchr (at, '\n') + 1;
+
+        _args.push_back (std::string (at, length) );
+        at += length + 2;
+    }
+}
+
+// the arguments of a command straight from its format, split on spaces the way redisvFormatCommand does it, so
+// the keys can be mapped before anything is formatted
+// only takes %s, %b, %u, %i, %d and %%, false for anything else (with _args partly used up)
+// _args keeps its strings from command to command, their buffers are reused, _count is how many this one has
+static bool format_args (const char* _format, va_list _args, std::vector<std::string>& _argv, size_t& _count) {
+    char number[16];
+    bool inArg = false;
+    _count = 0;
+
+    for (const char* c = _format; *c; c++) {
+        if (*c == ' ') {
+            if (inArg)
+                _count++;
+            inArg = false;
+            continue;
+        }
+
+        if (!inArg) {
+            if (_count == _argv.size () )
+                _argv.push_back (std::string () );
+            _argv[_count].clear ();
+            inArg = true;
+        }
+
+        std::string& arg = _argv[_count];
+        if (*c != '%' || c[1] == '\0') {
+            arg.push_back (*c);
+            continue;
+        }
+
+        switch (*++c) {
+            case 's':
+                arg.append (va_arg (_args, const char*) );
+                break;
+            case 'b': {
+                const char* data = va_arg (_args, const char*);
+                size_t size = va_arg (_args, size_t);
+                arg.append (data, size);
+                break;
+            }
+            case 'u':
+                arg.append (number, snprintf (number, sizeof (number), "%u", va_arg (_args, unsigned int) ) );
+                break;
+            case 'i':
+            case 'd':
+                arg.append (number, snprintf (number, sizeof (number), "%d", va_arg (_args, int) ) );
+                break;
+            case '%':
+                arg.push_back ('%');
+                break;
+            default:
+                return false;
+        }
+    }
+
+    if (inArg)
+        _count++;
+    return true;
+}
+
+// the size of every string in a reply
+static uint64_t reply_bytes (const redisReply* _reply) {
+    if (!_reply)
+        return 0;
 
-quadtree::quadtree (redisContext* _context, const rectangle& _rect)
-    : maxEntitiesPerNode (10), minNodeSize (8) {
+    if (_reply->type == REDIS_REPLY_ARRAY) {
+        uint64_t bytes = 0;
+        for (size_t n = 0; n < _reply->elements; n++)
+            bytes += reply_bytes (_reply->element[n]);
+        return bytes;
+    }
+
+    if (_reply->type == REDIS_REPLY_STRING || _reply->type == REDIS_REPLY_STATUS || _reply->type == REDIS_REPLY_ERROR)
+        return _reply->len;
+    return 0;
+}
+
+quadtree::quadtree (redisContext* _context, const rectangle& _rect, const quadtree_options& _options)
+    : keySpace (_options.keyScheme, _options.keyPrefix, _options.cluster, _options.shardDepth), maxEntitiesPerNode (std::max (_options.maxEntitiesPerNode, 1u) ),
+      mergeEntities (::merge_threshold (maxEntitiesPerNode, _options.mergeEntities) ), minNodeSize (_options.minNodeSize), thresholdInterval (_options.thresholdInterval),
+      adaptiveThresholds (_options.adaptiveThresholds), adaptiveMin (std::max (_options.adaptiveMin, 1u) ), adaptiveMax (std::max (_options.adaptiveMax, adaptiveMin) ),
+      mergeRatio ( (double)mergeEntities / maxEntitiesPerNode), operationsSinceRefresh (0), roundTripNanos (0), keyScheme (_options.keyScheme), rootRect (_rect), entityLayout (_options.entityLayout),
+      coordinates (_options.coordinates), minDepth (_options.cluster ? std::max (_options.minDepth, _options.shardDepth) : _options.minDepth), looseness (std::max (_options.looseness, 1.0) ),
+      countSubtrees (_options.countSubtrees), cacheNodes (_options.cacheNodes), useScripts (false), optimistic (_options.optimistic && !_options.writeBehind && !_options.cluster), watching (false), inMulti (false), subdividedKeys (NULL), unsent (false),
+      unreadReplies (0), changeChannel (_options.writeBehind ? "" : _options.changeChannel), changeDepth (0), subscriber (NULL),
+      listenerStopping (false), changesWaiting (false), listenerLost (false), local (NULL), stopping (false), writeFailed (false), flushInterval (_options.flushInterval), flushThreshold (_options.flushThreshold) {
     context = _context;
+    router = _options.cluster ? new cluster_router (context) : NULL;
+    rootKey = root_key (keyScheme);
+
+    if (!changeChannel.empty () ) {
+        std::random_device random;
+        sourceId = std::to_string (random () ) + "-" + std::to_string (random () );
+    }
+
+    const char* nodeKey = rootKey.c_str ();
 
     // check if the root already exists
     redisReply* reply;
-    reply = (redisReply*)redisCommand (context, "EXISTS root");
+    reply = command ("EXISTS %s", nodeKey);
 
     if (reply->type == REDIS_REPLY_INTEGER && reply->integer == 0) {
         freeReplyObject (reply);
         //std::cout << "Creating quadtree with size (" << _rect.x << ", " << _rect.y << ", " << _rect.width << ", " << _rect.height << ")" << std::endl;
-        // setup the base of the quadtree in redis
-        redisAppendCommand (context, "HSET root subdivided 0");
-        redisAppendCommand (context, "HSET root entities 0");
-
-        redisAppendCommand (context, "HSET root:rect x %i", _rect.x);
-        redisAppendCommand (context, "HSET root:rect y %i", _rect.y);
-        redisAppendCommand (context, "HSET root:rect w %i", _rect.width);
-        redisAppendCommand (context, "HSET root:rect h %i", _rect.height);
+        // setup the base of the quadtree in redis, without overwriting what another client
+        // creating it at the same time may already have added
+        // the rect goes first, a client that finds the root has to find all of it
+        coordinate_arg x (coordinates, _rect.x), y (coordinates, _rect.y), w (coordinates, _rect.width), h (coordinates, _rect.height);
+        append ("HSETNX %s:rect x %b", nodeKey, x.data (), x.size () );
+        append ("HSETNX %s:rect y %b", nodeKey, y.data (), y.size () );
+        append ("HSETNX %s:rect w %b", nodeKey, w.data (), w.size () );
+        append ("HSETNX %s:rect h %b", nodeKey, h.data (), h.size () );
+
+        append ("HSETNX %s subdivided 0", nodeKey);
+        append ("HSETNX %s entities 0", nodeKey);
 
         for (int n = 0; n < 6; n++) {
-            redisGetReply (context, (void**)&reply);
+            reply = get_reply ();
             freeReplyObject (reply);
         }
     }
+    else {
+        freeReplyObject (reply);
+    }
+
+    // the thresholds the tree was made with win over the options, a tree from before they were kept takes these
+    append ("HSETNX %s maxEntities %u", nodeKey, maxEntitiesPerNode);
+    append ("HSETNX %s mergeEntities %u", nodeKey, mergeEntities);
+    append ("HSETNX %s minNodeSize %u", nodeKey, minNodeSize);
+    read_replies (3);
+    read_thresholds (true);
+
+    if (minDepth > 0) {
+        node rootNode;
+        get_node (rootKey, rootNode);
+        subdivide_to_min_depth (rootNode);
+    }
+
+    if (_options.writeBehind) {
+        // the tree in process takes over from here, starting out the same as the one in redis
+        cacheNodes = false;
+
+        quadtree_options localOptions = _options;
+        localOptions.maxEntitiesPerNode = maxEntitiesPerNode;
+        localOptions.mergeEntities = mergeEntities;
+        localOptions.minNodeSize = minNodeSize;
+        local = new memory_quadtree (_rect, localOptions);
+        if (_options.snapshotPath.empty () || !load_snapshot (_options.snapshotPath) )
+            warm ();
+        local->track_changes ();
+
+        flusher = std::thread (&quadtree::run_flusher, this);
+    }
+    else {
+        if (cacheNodes && !_options.snapshotPath.empty () )
+            load_snapshot (_options.snapshotPath);
+        if (_options.useScripts && !router)
+            useScripts = load_scripts ();
+    }
+}
+
+quadtree::~quadtree () {
+    if (subscriber) {
+        listenerStopping = true;
+        listener.join ();
+    }
+
+    if (local) {
+        {
+            std::lock_guard<std::mutex> lock (localMutex);
+            stopping = true;
+        }
+        flushWake.notify_one ();
+        flusher.join ();
+
+        delete local;
+    }
+
+    // leave the context with nothing left to read
+    drop_unread_replies ();
+    delete router;
 }
 
 void quadtree::get_entity (uint32_t _id, entity& _ent) {
+    op_counters::scope scope (counters, OP_GET_ENTITY);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->get_entity (_id, _ent);
+        return;
+    }
+
+    _ent.id = _id;
     _ent.key = "entities:" + std::to_string (_id);
 
     redisReply* reply;
-    reply = (redisReply*)redisCommand (context, "EXISTS %s", _ent.key.c_str () );
+
+    if (entityLayout == LAYOUT_PACKED) {
+        // the index has the owner, and the owner's bucket has the position
+        reply = command ("HGET entities:index %u", _id);
+
+        if (reply->type == REDIS_REPLY_STRING) {
+            std::string ownerKey = reply->str;
+            std::string bucket = read_bucket (ownerKey);
+            size_t offset = find_entity (bucket, _id);
+
+            if (offset != std::string::npos) {
+                memcpy (_ent.pos.bytes, bucket.data () + offset + sizeof (uint32_t), sizeof (point) );
+                _ent.ownerKey = ownerKey;
+            }
+        }
+        freeReplyObject (reply);
+        return;
+    }
+
+    reply = command ("EXISTS %s", _ent.key.c_str () );
 
     if (reply->type == REDIS_REPLY_INTEGER && reply->integer == 1) {
         freeReplyObject (reply);
 
-        redisAppendCommand (context, "HGET %s x", _ent.key.c_str () );
-        redisAppendCommand (context, "HGET %s y", _ent.key.c_str () );
-        redisAppendCommand (context, "HGET %s owner", _ent.key.c_str () );
+        append ("HGET %s x", _ent.key.c_str () );
+        append ("HGET %s y", _ent.key.c_str () );
+        append ("HGET %s owner", _ent.key.c_str () );
 
-        redisGetReply (context, (void**)&reply);
+        reply = get_reply ();
         if (reply->type == REDIS_REPLY_STRING)
-            _ent.pos.x = std::stoi (reply->str);
+            _ent.pos.x = read_coordinate (coordinates, reply);
         freeReplyObject (reply);
-        redisGetReply (context, (void**)&reply);
+        reply = get_reply ();
         if (reply->type == REDIS_REPLY_STRING)
-            _ent.pos.y = std::stoi (reply->str);
+            _ent.pos.y = read_coordinate (coordinates, reply);
         freeReplyObject (reply);
-        redisGetReply (context, (void**)&reply);
+        reply = get_reply ();
         if (reply->type == REDIS_REPLY_STRING)
-            _ent.ownerKey = reply->str;
+            _ent.ownerKey.assign (reply->str, reply->len);
         freeReplyObject (reply);
     }
 
@@ -62,493 +285,2872 @@ void quadtree::get_entity (uint32_t _id, entity& _ent) {
 }
 
 void quadtree::insert_entity (entity& _ent) {
-    bool done = false;
-    node currNode, destNode;
-    bool stayParent = false;
+    op_counters::scope scope (counters, OP_INSERT_ENTITY);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        size_t changed = local->changed ();
+        local->insert_entity (_ent);
+        wake_flusher (changed);
+        return;
+    }
 
-    get_node ("root", currNode);
+    script_result result = useScripts ? run_script (SCRIPT_INSERT, _ent, _ent.ownerKey) : SCRIPT_NOT_RUN;
+    if (result == SCRIPT_DONE) {
+        _ent.key = "entities:" + std::to_string (_ent.id);
+        return;
+    }
+    if (result == SCRIPT_FAILED) {
+        // it may or may not be in the tree now, say which
+        _ent.ownerKey = "";
+        get_entity (_ent.id, _ent);
+        return;
+    }
 
-    do {
-        // check to see if the entity will fit in this node
-        if (currNode.rect.contains (_ent.pos) ) {
-            if (!currNode.subdivided && currNode.entities + 1 <= maxEntitiesPerNode) {
-                // there's still room here so add it
-                add_entity (currNode, _ent);
-                done = true;
-            }
-            else {
-                // subdivide if needed
-                if (!currNode.subdivided) {
-                    if (!subdivide (currNode) ) {
-                        // this is as small as the nodes can get, add the entity here
-                        add_entity (currNode, _ent);
-                        done = true;
-
-                        //std::cout << "Minimum node size reached, cannot subdivide " << currNode.key << std::endl;
-                    }
-                }
+    node currNode;
+    get_node (rootKey, currNode);
+    place_entity (_ent, NULL, currNode);
+}
+
+void quadtree::remove_entity (entity& _ent) {
+    op_counters::scope scope (counters, OP_REMOVE_ENTITY);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        size_t changed = local->changed ();
+        local->remove_entity (_ent);
+        wake_flusher (changed);
+        return;
+    }
 
-                // figure out which subnode the entity should move into
-                get_destination_node (_ent, currNode, destNode, stayParent);
+    std::string nodeKey;
+    script_result result = useScripts ? run_script (SCRIPT_REMOVE, _ent, nodeKey) : SCRIPT_NOT_RUN;
+    if (result == SCRIPT_DONE) {
+        _ent.key = "";
+        _ent.ownerKey = "";
+        return;
+    }
+    if (result == SCRIPT_FAILED) {
+        _ent.ownerKey = "";
+        get_entity (_ent.id, _ent);
+        return;
+    }
 
-                if (stayParent) {
-                    // if this entity won't fit in the subnodes it stays here
-                    add_entity (currNode, _ent);
-                    done = true;
-                }
-                else {
-                    // change the level down one
-                    // the loop will repeat and try to insert into the subnode
-                    get_node (destNode.key, currNode);
-                }
-            }
+    for (;;) {
+        nodeKey = _ent.ownerKey;
+        if (watch_owner (_ent) ) {
+            delete_entity (_ent);
+            if (exec () )
+                break;
         }
-    } while (!done);
-}
 
-void quadtree::remove_entity (entity& _ent) {
-    std::string nodeKey = _ent.ownerKey;
-    delete_entity (_ent);
+        // another client moved or removed it first
+        _ent.ownerKey = "";
+        get_entity (_ent.id, _ent);
+        if (_ent.ownerKey == "") {
+            _ent.key = "";
+            return;
+        }
+    }
 
     node ownerNode;
     get_node (nodeKey, ownerNode);
-    // if this node only has this entity in it (or less for whatever reason), then try to clean it
-    if (ownerNode.entities == 0) {
+    // if this node is down to the merge threshold (empty without one), then try to clean it
+    if (ownerNode.entities <= mergeEntities) {
         clean (ownerNode);
     }
 }
 
 void quadtree::relocate_entity (entity& _ent) {
-    node ownerNode, destNode;
-    get_node (_ent.ownerKey, ownerNode);
-    node currNode = ownerNode;
-    // change its position in the tree if needed
-    relocate_entity (_ent, ownerNode, currNode, destNode);
-    // update it's info in redis
-    update_entity (_ent);
+    op_counters::scope scope (counters, OP_RELOCATE_ENTITY);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        size_t changed = local->changed ();
+        local->relocate_entity (_ent);
+        wake_flusher (changed);
+        return;
+    }
+
+    std::string ownerKey;
+    script_result result = useScripts ? run_script (SCRIPT_RELOCATE, _ent, ownerKey) : SCRIPT_NOT_RUN;
+    if (result == SCRIPT_DONE) {
+        if (ownerKey != "")
+            _ent.ownerKey = ownerKey;
+        return;
+    }
+    if (result == SCRIPT_FAILED) {
+        _ent.ownerKey = "";
+        get_entity (_ent.id, _ent);
+        return;
+    }
+
+    // in optimistic mode an entity another client moved or removed first is looked up again, and relocated
+    // from where it is now
+    for (;;) {
+        node ownerNode, destNode;
+        get_node (_ent.ownerKey, ownerNode);
+        node currNode = ownerNode;
+
+        // change its position in the tree if needed and update it's info in redis
+        if (relocate_entity (_ent, ownerNode, currNode, destNode) && watch_owner (_ent) ) {
+            update_entity (_ent);
+            if (exec () )
+                return;
+        }
+
+        entity current;
+        get_entity (_ent.id, current);
+        if (current.ownerKey == "")
+            return;
+        _ent.ownerKey = current.ownerKey;
+    }
 }
 
-void quadtree::get_entities (const rectangle& _rect, std::vector<entity>& _ents) {
+void quadtree::get_entities (const region& _region, std::vector<entity>& _ents) {
+    op_counters::scope scope (counters, OP_GET_ENTITIES);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->get_entities (_region, _ents);
+        return;
+    }
+
     node rootNode;
-    get_node ("root", rootNode);
-    get_entities (rootNode, _rect, _ents);
+    get_node (rootKey, rootNode);
+
+    rectangle bounds = rootNode.rect.loosened (looseness);
+    if (!_region.intersects (bounds) )
+        return;
+
+    std::vector<node> nodes (1, rootNode);
+    std::vector<bool> contained (1, _region.contains (bounds) );
+    results.clear ();
+    get_entities (nodes, contained, _region, results);
+    results.get_all (_ents);
 }
 
-bool quadtree::subdivide (const node& _node) {
-    //std::cout << "Subdividing at node: " << _node.key << std::endl;
+void quadtree::get_entities (const region& _region, entity_arena& _arena) {
+    op_counters::scope scope (counters, OP_GET_ENTITIES);
+    change_scope changes (*this);
+    _arena.clear ();
 
-    // don't subdivide if we've reached the minimum
-    if (_node.rect.width / 2 < minNodeSize || _node.rect.height / 2 < minNodeSize)
-        return false;
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->get_entities (_region, _arena);
+        return;
+    }
+
+    node rootNode;
+    get_node (rootKey, rootNode);
 
+    rectangle bounds = rootNode.rect.loosened (looseness);
+    if (!_region.intersects (bounds) )
+        return;
+
+    std::vector<node> nodes (1, rootNode);
+    std::vector<bool> contained (1, _region.contains (bounds) );
+    get_entities (nodes, contained, _region, _arena);
+}
+
+size_t quadtree::visit_entities (const region& _region, const entity_visitor& _visit, size_t _offset, size_t _limit) {
+    op_counters::scope scope (counters, OP_VISIT_ENTITIES);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        return local->visit_entities (_region, _visit, _offset, _limit);
+    }
+
+    node rootNode;
+    get_node (rootKey, rootNode);
+
+    rectangle bounds = rootNode.rect.loosened (looseness);
+    if (!_region.intersects (bounds) )
+        return 0;
+
+    // the nodes still to read, in get_entities' order
+    std::deque<node> pending (1, rootNode);
+    std::deque<bool> pendingContained (1, _region.contains (bounds) );
+    std::vector<node> batch;
+    std::vector<bool> batchContained;
+    std::vector<size_t> readNodes, readSubnodes;
+    std::vector<std::string> members;
+    std::vector<size_t> memberNodeOf;
+    point_columns columns;
+    std::vector<uint32_t> keep;
+    size_t batchSize = visitBatchSize;
+    size_t visited = 0;
+    bool stopped = false;
+    entity ent;
     redisReply* reply;
-    const char* nodeKey = _node.key.c_str ();
-    const char* quads[4] = {"tl", "tr", "bl", "br"};
 
-    // setup the four quadrants
-    for (int i = 0; i < 4; i++) {
-        redisAppendCommand (context, "HSET %s:%s subdivided 0", nodeKey, quads[i]);
-        redisAppendCommand (context, "HSET %s:%s entities 0", nodeKey, quads[i]);
+    // an entity that's in the region, past the offset
+    auto visit = [&] () -> bool {
+        if (_offset > 0) {
+            _offset--;
+            return true;
+        }
 
-        for (int n = 0; n < 2; n++) {
-            redisGetReply (context, (void**)&reply);
-            freeReplyObject (reply);
+        visited++;
+        return _visit (ent) && visited != _limit;
+    };
+
+    while (!pending.empty () && !stopped) {
+        size_t count = std::min (batchSize, pending.size () );
+        batch.assign (pending.begin (), pending.begin () + count);
+        batchContained.assign (pendingContained.begin (), pendingContained.begin () + count);
+        pending.erase (pending.begin (), pending.begin () + count);
+        pendingContained.erase (pendingContained.begin (), pendingContained.begin () + count);
+        batchSize = std::min (batchSize * 2, bulkPipelineSize);
+
+        readNodes.clear ();
+        readSubnodes.clear ();
+        members.clear ();
+        memberNodeOf.clear ();
+
+        // the entities of the nodes inside the region that are read are sure to count, and once any node is read
+        // the offset can only be taken off as its entities come in
+        size_t sure = 0;
+        bool readAhead = false;
+        bool enough = false;
+
+        for (size_t i = 0; i < batch.size (); i++) {
+            // nothing after this in the tree's order is needed
+            enough = _limit > 0 && visited + sure >= _limit + _offset;
+            if (enough)
+                break;
+
+            const node& currNode = batch[i];
+            RQTREE_COUNT (counters, nodesVisited, 1);
+
+            if (batchContained[i] && !readAhead && currNode.entities <= _offset)
+                _offset -= currNode.entities;
+            else if (currNode.entities > 0) {
+                if (entityLayout == LAYOUT_PACKED)
+                    append ("GET %s:bucket", currNode.key.c_str () );
+                else
+                    append ("SMEMBERS %s:entities", currNode.key.c_str () );
+                readNodes.push_back (i);
+                readAhead = true;
+
+                if (batchContained[i])
+                    sure += currNode.entities;
+            }
+
+            if (!currNode.subdivided)
+                continue;
+
+            for (int quad = 0; quad < 4; quad++) {
+                node subnode;
+                subnode.key = subnode_key (currNode.key, quad);
+                subnode.parentKey = currNode.key;
+                subnode.rect = currNode.rect.quadrant (quad);
+
+                rectangle subnodeBounds = subnode.rect.loosened (looseness);
+                bool contained = batchContained[i] || _region.contains (subnodeBounds);
+                if (!contained && !_region.intersects (subnodeBounds) )
+                    continue;
+
+                if (!cacheNodes || !cache.get (subnode.key, subnode) )
+                    readSubnodes.push_back (pending.size () );
+
+                pending.push_back (subnode);
+                pendingContained.push_back (contained);
+            }
         }
-    }
 
-    // setup the sub rectangles
-    point size (_node.rect.width / 2, _node.rect.height / 2);
-    point mid (_node.rect.x + size.x, _node.rect.y + size.y);
-
-    //std::cout << "Size of children: (" << size.x << ", " << size.y << ")" << std::endl;
-    //std::cout << "Midpoint: (" << mid.x << ", " << mid.y << ")" << std::endl;
-
-    // top left rectangle
-    rectangle tlRect (_node.rect.x, _node.rect.y, size.x, size.y);
-    redisAppendCommand (context, "HSET %s:tl:rect x %i", nodeKey, tlRect.x);
-    redisAppendCommand (context, "HSET %s:tl:rect y %i", nodeKey, tlRect.y);
-    redisAppendCommand (context, "HSET %s:tl:rect w %i", nodeKey, tlRect.width);
-    redisAppendCommand (context, "HSET %s:tl:rect h %i", nodeKey, tlRect.height);
-
-    // top right rectangle
-    rectangle trRect (mid.x, _node.rect.y, size.x, size.y);
-    redisAppendCommand (context, "HSET %s:tr:rect x %i", nodeKey, trRect.x);
-    redisAppendCommand (context, "HSET %s:tr:rect y %i", nodeKey, trRect.y);
-    redisAppendCommand (context, "HSET %s:tr:rect w %i", nodeKey, trRect.width);
-    redisAppendCommand (context, "HSET %s:tr:rect h %i", nodeKey, trRect.height);
-
-    // bottom left rectangle
-    rectangle blRect (_node.rect.x, mid.y, size.x, size.y);
-    redisAppendCommand (context, "HSET %s:bl:rect x %i", nodeKey, blRect.x);
-    redisAppendCommand (context, "HSET %s:bl:rect y %i", nodeKey, blRect.y);
-    redisAppendCommand (context, "HSET %s:bl:rect w %i", nodeKey, blRect.width);
-    redisAppendCommand (context, "HSET %s:bl:rect h %i", nodeKey, blRect.height);
-
-    // bottom right rectangle
-    rectangle brRect (mid.x, mid.y, size.x, size.y);
-    redisAppendCommand (context, "HSET %s:br:rect x %i", nodeKey, brRect.x);
-    redisAppendCommand (context, "HSET %s:br:rect y %i", nodeKey, brRect.y);
-    redisAppendCommand (context, "HSET %s:br:rect w %i", nodeKey, brRect.width);
-    redisAppendCommand (context, "HSET %s:br:rect h %i", nodeKey, brRect.height);
+        for (size_t n = 0; n < readSubnodes.size (); n++)
+            append ("HMGET %s subdivided entities", pending[readSubnodes[n]].key.c_str () );
 
-    // set subdivided to true
-    redisAppendCommand (context, "HSET %s subdivided 1", nodeKey);
+        // every reply is read whatever happens, the entities only until the visitor has had enough
+        // the member hashes follow the subnode flags, like in get_entities
+        bool membersUndecided = false;
+        size_t membersSure = 0;
 
-    for (int n = 0; n < 17; n++) {
-        redisGetReply (context, (void**)&reply);
-        freeReplyObject (reply);
-    }
+        for (size_t n = 0; n < readNodes.size (); n++) {
+            const node& currNode = batch[readNodes[n]];
+            bool contained = batchContained[readNodes[n]];
+            reply = get_reply ();
 
-    node destNode;
-    bool stayParent;
-    std::vector<entity> ents;
-    get_node_entities (_node, ents);
+            if (stopped || reply->type != (entityLayout == LAYOUT_PACKED ? REDIS_REPLY_STRING : REDIS_REPLY_ARRAY) ) {
+                freeReplyObject (reply);
+                continue;
+            }
 
-    //std::cout << "Moving " << ents.size () << " entities down to subnodes" << std::endl;
+            if (entityLayout == LAYOUT_PACKED) {
+                columns.clear ();
+                columns.add_records (reply->str, reply->len);
 
-    if (ents.size () > 0) {
-        // move all the entities in this node down if possible
-        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
-            get_destination_node ( (*it), _node, destNode, stayParent);
+                size_t kept = columns.size ();
+                keep.resize (kept);
+                if (contained) {
+                    for (size_t k = 0; k < kept; k++)
+                        keep[k] = k;
+                }
+                else
+                    kept = _region.filter (columns.xs.data (), columns.ys.data (), columns.size (), keep.data () );
+
+                ent.ownerKey = currNode.key;
+                for (size_t k = 0; k < kept && !stopped; k++) {
+                    ent.id = columns.ids[keep[k]];
+                    ent.pos = point (columns.xs[keep[k]], columns.ys[keep[k]]);
+                    ent.key = "entities:" + std::to_string (ent.id);
+                    stopped = !visit ();
+                }
+            }
+            else {
+                for (size_t e = 0; e < reply->elements; e++) {
+                    if (contained) {
+                        // inside the region every member counts, so the offset and the limit are known up front
+                        // while no member from the region's edge is ahead of them
+                        if (!membersUndecided && _offset > 0) {
+                            _offset--;
+                            continue;
+                        }
+                        if (_limit > 0 && visited + membersSure >= _limit + _offset)
+                            break;
+                        membersSure++;
+                    }
+                    else
+                        membersUndecided = true;
 
-            if (!stayParent) {
-                move_entity ( (*it), _node, destNode);
+                    append ("HMGET entities:%b x y owner", reply->element[e]->str, (size_t)reply->element[e]->len);
+                    members.push_back (std::string (reply->element[e]->str, reply->element[e]->len) );
+                    memberNodeOf.push_back (readNodes[n]);
+                }
             }
+            freeReplyObject (reply);
         }
-    }
 
-    return true;
-}
+        for (size_t n = 0; n < readSubnodes.size (); n++) {
+            node& subnode = pending[readSubnodes[n]];
 
-void quadtree::clean (node& _node) {
-    //std::cout << "Cleaning node " << _node.key << std::endl;
-    if (_node.subdivided) {
-        bool empty = true;
-        delete_empty_subnodes (_node.key, empty);
+            reply = get_reply ();
+            if (parse_node (reply, subnode) && cacheNodes)
+                cache.put (subnode);
+            freeReplyObject (reply);
+        }
 
-        if (empty) {
-            // this node has been updated (subnodes deleted)
-            get_node (_node.key, _node);
+        for (size_t n = 0; n < members.size (); n++) {
+            reply = get_reply ();
 
-            if (!_node.subdivided && _node.entities == 0 && _node.parentKey != "") {
-                node parentNode;
-                get_node (_node.parentKey, parentNode);
-                clean (parentNode);
+            if (!stopped && parse_entity (coordinates, members[n].c_str (), reply, ent) ) {
+                if (batchContained[memberNodeOf[n]] || _region.contains (ent.pos) )
+                    stopped = !visit ();
             }
+            freeReplyObject (reply);
+        }
+
+        if (enough) {
+            pending.clear ();
+            pendingContained.clear ();
         }
     }
-    else if (_node.entities == 0 && _node.parentKey != "") {
-        // this could be one of the empty nodes, tell parent to clean up
-        node parentNode;
-        get_node (_node.parentKey, parentNode);
-        clean (parentNode);
-    }
-}
 
-void quadtree::get_node (const std::string& _nodeKey, node& _node) {
-    _node.key = _nodeKey;
-    _node.parentKey = "";
-    _node.rect = rectangle (context, _nodeKey + ":rect");
+    return visited;
+}
 
-    redisReply* reply;
-    reply = (redisReply*)redisCommand (context, "HGET %s subdivided", _node.key.c_str () );
+size_t quadtree::count_entities (const region& _region) {
+    op_counters::scope scope (counters, OP_COUNT_ENTITIES);
+    change_scope changes (*this);
 
-    if (reply->type == REDIS_REPLY_STRING) {
-        int value = std::stoi (reply->str);
-        _node.subdivided = (bool)value;
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        return local->count_entities (_region);
     }
 
-    reply = (redisReply*)redisCommand (context, "HGET %s entities", _node.key.c_str () );
+    node rootNode;
+    get_node (rootKey, rootNode);
 
-    if (reply->type == REDIS_REPLY_STRING) {
-        int value = std::stoi (reply->str);
-        _node.entities = value;
-    }
+    rectangle bounds = rootNode.rect.loosened (looseness);
+    if (!_region.intersects (bounds) )
+        return 0;
 
-    // calculate the parent
-    if (_nodeKey != "root") {
-        _node.parentKey = _nodeKey.substr (0, _nodeKey.size () - 3);
+    bool contained = _region.contains (bounds);
+    if (contained && countSubtrees) {
+        redisReply* reply = command ("GET %s:total", rootKey.c_str () );
+        size_t count = read_uint (reply);
+        freeReplyObject (reply);
+        return count;
     }
-}
 
-void quadtree::get_destination_node (const entity& _ent, const node& _currNode, node& _destNode, bool& _stayParent) {
-    _stayParent = true;
- 
-    node tlNode, trNode, blNode, brNode;
-    get_node (_currNode.key + ":tl", tlNode);
-    get_node (_currNode.key + ":tr", trNode);
-    get_node (_currNode.key + ":bl", blNode);
-    get_node (_currNode.key + ":br", brNode);
+    std::vector<node> nodes (1, rootNode);
+    std::vector<bool> containedNodes (1, contained);
+    return count_entities (nodes, containedNodes, _region);
+}
 
-    if (tlNode.rect.contains (_ent.pos) ) {
-        _destNode = tlNode;
-        _stayParent = false;
+void quadtree::density_grid (const rectangle& _rect, uint32_t _level, std::vector<density_cell>& _cells) {
+    op_counters::scope scope (counters, OP_DENSITY_GRID);
+    change_scope changes (*this);
 
-        //std::cout << "Found destination node " << _destNode.key << std::endl;
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->density_grid (_rect, _level, _cells);
+        return;
     }
-    else if (trNode.rect.contains (_ent.pos) ) {
-        _destNode = trNode;
-        _stayParent = false;
 
-        //std::cout << "Found destination node " << _destNode.key << std::endl;
+    node rootNode;
+    get_node (rootKey, rootNode);
+    if (!_rect.intersects (rootNode.rect) )
+        return;
+
+    // node rects follow from the root's, so every node down to _level that could be a cell is known up front and
+    // only has to be read to see whether it's there, a node too small to subdivide never has subnodes
+    // each node comes after its parent
+    std::vector<node> nodes (1, rootNode);
+    std::vector<size_t> parents (1, 0);
+    std::vector<uint32_t> depths (1, 0);
+
+    for (size_t n = 0; n < nodes.size (); n++) {
+        if (depths[n] >= _level || !can_subdivide (nodes[n]) )
+            continue;
+
+        for (int quad = 0; quad < 4; quad++) {
+            node subnode;
+            subnode.key = subnode_key (nodes[n].key, quad);
+            subnode.parentKey = nodes[n].key;
+            subnode.rect = nodes[n].rect.quadrant (quad);
+            if (!_rect.intersects (subnode.rect) )
+                continue;
+
+            nodes.push_back (subnode);
+            parents.push_back (n);
+            depths.push_back (depths[n] + 1);
+        }
     }
-    else if (blNode.rect.contains (_ent.pos) ) {
-        _destNode = blNode;
-        _stayParent = false;
 
-        //std::cout << "Found destination node " << _destNode.key << std::endl;
-    }
-    else if (brNode.rect.contains (_ent.pos) ) {
-        _destNode = brNode;
-        _stayParent = false;
+    RQTREE_COUNT (counters, nodesVisited, nodes.size () - 1);
+    std::vector<uint32_t> totals (nodes.size (), 0);
+    redisReply* reply;
 
-        //std::cout << "Found destination node " << _destNode.key << std::endl;
+    for (size_t begin = 0; begin < nodes.size (); begin += bulkPipelineSize) {
+        size_t end = std::min (begin + bulkPipelineSize, nodes.size () );
+
+        for (size_t n = begin; n < end; n++) {
+            if (n > 0)
+                append ("HMGET %s subdivided entities", nodes[n].key.c_str () );
+            if (countSubtrees)
+                append ("GET %s:total", nodes[n].key.c_str () );
+        }
+
+        for (size_t n = begin; n < end; n++) {
+            if (n > 0) {
+                reply = get_reply ();
+                parse_node (reply, nodes[n]);
+                freeReplyObject (reply);
+            }
+            if (countSubtrees) {
+                reply = get_reply ();
+                totals[n] = read_uint (reply);
+                freeReplyObject (reply);
+            }
+        }
     }
-}
 
-void quadtree::add_entity (const node& _node, entity& _ent) {
-    //std::cout << "Adding entity " << _ent.id << " to " << _node.key << " at (" << _ent.pos.x << ", " << _ent.pos.y << ")" << std::endl;
+    // a node is in the tree if its parent is and was subdivided, the cells are the ones at _level and the leaves above it
+    std::vector<bool> present (nodes.size (), false);
+    present[0] = true;
 
-    _ent.key = "entities:" + std::to_string (_ent.id);
-    _ent.ownerKey = _node.key;
+    for (size_t n = 0; n < nodes.size (); n++) {
+        if (n > 0)
+            present[n] = present[parents[n]] && nodes[parents[n]].subdivided;
+        if (!present[n] || (depths[n] < _level && nodes[n].subdivided) )
+            continue;
 
-    // update the node
-    redisAppendCommand (context, "HINCRBY %s entities 1", _node.key.c_str () );
-    redisAppendCommand (context, "SADD %s:entities %i", _node.key.c_str (), _ent.id);
+        density_cell cell;
+        cell.key = nodes[n].key;
+        cell.rect = nodes[n].rect;
 
-    // add the entity into redis
-    redisAppendCommand (context, "HSET %s x %i", _ent.key.c_str (), _ent.pos.x);
-    redisAppendCommand (context, "HSET %s y %i", _ent.key.c_str (), _ent.pos.y);
-    redisAppendCommand (context, "HSET %s owner %s", _ent.key.c_str (), _ent.ownerKey.c_str () );
- 
-    redisReply* reply;
-    for (int n = 0; n < 5; n++) {
-        redisGetReply (context, (void**)&reply);
-        freeReplyObject (reply);
+        if (countSubtrees)
+            cell.count = totals[n];
+        else if (!nodes[n].subdivided)
+            cell.count = nodes[n].entities;
+        else {
+            // the whole subtree is inside the cell, only its counters are read
+            std::vector<node> subtree (1, nodes[n]);
+            std::vector<bool> contained (1, true);
+            cell.count = count_entities (subtree, contained, rectangle_region (nodes[n].rect) );
+        }
+
+        _cells.push_back (cell);
     }
 }
 
-void quadtree::update_entity (const entity& _ent) {
-    // resave the entity info in redis
-    redisAppendCommand (context, "HSET %s x %i", _ent.key.c_str (), _ent.pos.x);
-    redisAppendCommand (context, "HSET %s y %i", _ent.key.c_str (), _ent.pos.y);
-    redisAppendCommand (context, "HSET %s owner %s", _ent.key.c_str (), _ent.ownerKey.c_str () );
- 
-    redisReply* reply;
-    for (int n = 0; n < 3; n++) {
-        redisGetReply (context, (void**)&reply);
-        freeReplyObject (reply);
+void quadtree::get_nearest (const point& _pos, size_t _k, std::vector<entity>& _ents, uint32_t _maxRadius) {
+    op_counters::scope scope (counters, OP_GET_NEAREST);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->get_nearest (_pos, _k, _ents, _maxRadius);
+        return;
     }
-}
 
-void quadtree::delete_entity (entity& _ent) {
-    //std::cout << "Deleting entity " << _ent.id << " from " << _ent.ownerKey << std::endl;
+    if (_k == 0)
+        return;
 
-    // remove the entity from redis and update the node
-    redisAppendCommand (context, "HINCRBY %s entities -1", _ent.ownerKey.c_str () );
-    redisAppendCommand (context, "SREM %s:entities %i", _ent.ownerKey.c_str (), _ent.id);
-    redisAppendCommand (context, "HDEL %s x", _ent.key.c_str () );
-    redisAppendCommand (context, "HDEL %s y", _ent.key.c_str () );
-    redisAppendCommand (context, "HDEL %s owner", _ent.key.c_str () );
+    uint64_t limit = _maxRadius > 0 ? (uint64_t)_maxRadius * _maxRadius : UINT64_MAX;
 
-    _ent.key = "";
-    _ent.ownerKey = "";
+    typedef std::pair<uint64_t, node> queued_node;
+    typedef std::pair<uint64_t, entity> candidate;
+    auto fartherNode = [] (const queued_node& _a, const queued_node& _b) { return _a.first > _b.first; };
+    auto nearerCandidate = [] (const candidate& _a, const candidate& _b) { return _a.first < _b.first; };
+
+    // nodes still to visit nearest first, and the _k nearest entities so far farthest first
+    std::priority_queue<queued_node, std::vector<queued_node>, decltype (fartherNode)> frontier (fartherNode);
+    std::priority_queue<candidate, std::vector<candidate>, decltype (nearerCandidate)> best (nearerCandidate);
 
+    auto offer = [&] (const entity& _ent) {
+        uint64_t distance = squared_distance (_pos, _ent.pos);
+        if (distance > limit)
+            return;
+
+        if (best.size () < _k)
+            best.push (std::make_pair (distance, _ent) );
+        else if (distance < best.top ().first) {
+            best.pop ();
+            best.push (std::make_pair (distance, _ent) );
+        }
+    };
+
+    node rootNode;
+    get_node (rootKey, rootNode);
+    frontier.push (std::make_pair (rootNode.rect.loosened (looseness).squared_distance (_pos), rootNode) );
+
+    std::vector<node> batch, subnodes;
+    std::vector<size_t> readSubnodes;
+    std::vector<size_t> memberNodes;
+    std::vector<std::string> members;
+    std::vector<entity> ents;
     redisReply* reply;
-    for (int n = 0; n < 5; n++) {
-        redisGetReply (context, (void**)&reply);
-        freeReplyObject (reply);
-    }
-}
 
-void quadtree::move_entity (entity& _ent, const node& _srcNode, const node& _destNode) {
-    //std::cout << "Moving entity " << _ent.id << " from " << _srcNode.key << " to " << _destNode.key << std::endl;
+    while (!frontier.empty () ) {
+        // a node farther away than the _k-th candidate can't hold anything nearer
+        uint64_t bound = best.size () < _k ? limit : best.top ().first;
 
-    // update both nodes entity info
-    redisAppendCommand (context, "HINCRBY %s entities -1", _srcNode.key.c_str () );
-    redisAppendCommand (context, "HINCRBY %s entities 1", _destNode.key.c_str () );
-    redisAppendCommand (context, "SREM %s:entities %i", _srcNode.key.c_str (), _ent.id);
-    redisAppendCommand (context, "SADD %s:entities %i", _destNode.key.c_str (), _ent.id);
+        batch.clear ();
+        while (!frontier.empty () && batch.size () < nearestBatchSize && frontier.top ().first <= bound) {
+            batch.push_back (frontier.top ().second);
+            frontier.pop ();
+        }
 
-    // change the entity's owner
-    redisAppendCommand (context, "HSET %s owner %s", _ent.key.c_str (), _destNode.key.c_str () );
+        if (batch.empty () )
+            break;
+        RQTREE_COUNT (counters, nodesVisited, batch.size () );
+
+        // same two pipelines as a range query level: the entities of the batch along with the flags
+        // of their subnodes, then the hashes of the entities in those sets
+        subnodes.clear ();
+        readSubnodes.clear ();
+        memberNodes.clear ();
+        members.clear ();
+
+        for (size_t i = 0; i < batch.size (); i++) {
+            const node& currNode = batch[i];
+
+            if (currNode.entities > 0) {
+                if (entityLayout == LAYOUT_PACKED)
+                    append ("GET %s:bucket", currNode.key.c_str () );
+                else
+                    append ("SMEMBERS %s:entities", currNode.key.c_str () );
+                memberNodes.push_back (i);
+            }
 
-    _ent.ownerKey = _destNode.key;
+            if (!currNode.subdivided)
+                continue;
 
-    redisReply* reply;
-    for (int n = 0; n < 5; n++) {
-        redisGetReply (context, (void**)&reply);
-        freeReplyObject (reply);
-    }
-}
+            for (int quad = 0; quad < 4; quad++) {
+                node subnode;
+                subnode.key = subnode_key (currNode.key, quad);
+                subnode.parentKey = currNode.key;
+                subnode.rect = currNode.rect.quadrant (quad);
 
-void quadtree::reinsert_entity (entity& _ent, const node& _ownerNode, node& _currNode) {
-    std::string nodeKey;
-    bool done = false;
-    node destNode;
-    bool stayParent = false;
+                if (subnode.rect.loosened (looseness).squared_distance (_pos) > bound)
+                    continue;
 
-    do {
-        // check to see if the entity will fit in this node
-        if (_currNode.rect.contains (_ent.pos) ) {
-            if (!_currNode.subdivided && _currNode.entities + 1 <= maxEntitiesPerNode) {
-                // there's still room here so add it
-                move_entity (_ent, _ownerNode, _currNode);
-                done = true;
+                if (!cacheNodes || !cache.get (subnode.key, subnode) )
+                    readSubnodes.push_back (subnodes.size () );
+
+                subnodes.push_back (subnode);
             }
-            else {
-                // subdivide if needed
-                if (!_currNode.subdivided) {
-                    if (!subdivide (_currNode) ) {
-                        // this is as small as the nodes can get, add the entity here
-                        move_entity (_ent, _ownerNode, _currNode);
-                        done = true;
-
-                        //std::cout << "Minimum node size reached, cannot subdivide " << currNode.key << std::endl;
-                    }
-                }
+        }
 
-                // figure out which subnode the entity should move into
-                get_destination_node (_ent, _currNode, destNode, stayParent);
+        for (size_t n = 0; n < readSubnodes.size (); n++)
+            append ("HMGET %s subdivided entities", subnodes[readSubnodes[n]].key.c_str () );
 
-                if (stayParent) {
-                    // if this entity won't fit in the subnodes it stays here
-                    move_entity (_ent, _ownerNode, _currNode);
-                    done = true;
-                }
-                else {
-                    // change the level down one
-                    // the loop will repeat and try to insert into the subnode
-                    get_node (destNode.key, _currNode);
+        for (size_t n = 0; n < memberNodes.size (); n++) {
+            reply = get_reply ();
+
+            if (entityLayout == LAYOUT_PACKED) {
+                ents.clear ();
+                parse_bucket (reply, batch[memberNodes[n]].key, ents);
+                for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++)
+                    offer (*it);
+            }
+            else if (reply->type == REDIS_REPLY_ARRAY) {
+                for (size_t e = 0; e < reply->elements; e++) {
+                    append ("HMGET entities:%b x y owner", reply->element[e]->str, (size_t)reply->element[e]->len);
+                    members.push_back (reply->element[e]->str);
                 }
             }
+            freeReplyObject (reply);
         }
-    } while (!done);
-}
 
-void quadtree::relocate_entity (entity& _ent, node& _ownerNode, node& _currNode, node& _destNode) {
-    // is the entity contained by this node?
-    if (_currNode.rect.contains (_ent.pos) ) {
-        bool stayParent = true;
-        // check if it needs to move between subnodes
-        get_destination_node (_ent, _currNode, _destNode, stayParent);
+        for (size_t n = 0; n < readSubnodes.size (); n++) {
+            node& subnode = subnodes[readSubnodes[n]];
 
-        // check if the entity is still in the owner same node
-        if (_ownerNode.key == _currNode.key) {
-            // check if the entity needs to move down,  otherwise we don't have to do anything
-            if (!stayParent) {
-                // reinsert the entity elsewhere
-                reinsert_entity (_ent, _ownerNode, _destNode);
-            }
+            reply = get_reply ();
+            if (parse_node (reply, subnode) && cacheNodes)
+                cache.put (subnode);
+            freeReplyObject (reply);
         }
-        else {
-            // the entity has moved out of its owner node, so reinsert it elsewhere
-            reinsert_entity (_ent, _ownerNode, _destNode);
 
-            // clean the former owner node
-            clean (_ownerNode);
+        for (size_t n = 0; n < members.size (); n++) {
+            reply = get_reply ();
+
+            entity ent;
+            if (parse_entity (coordinates, members[n].c_str (), reply, ent) )
+                offer (ent);
+            freeReplyObject (reply);
         }
-    }
+
+        // empty leaves have nothing to offer
+        for (std::vector<node>::iterator it = subnodes.begin (); it != subnodes.end (); it++) {
+            if (it->subdivided || it->entities > 0)
+                frontier.push (std::make_pair (it->rect.loosened (looseness).squared_distance (_pos), *it) );
+        }
+    }
+
+    size_t first = _ents.size ();
+    _ents.resize (first + best.size () );
+
+    for (size_t n = _ents.size (); n > first; n--) {
+        _ents[n - 1] = best.top ().second;
+        best.pop ();
+    }
+}
+
+void quadtree::relocate_entities (std::vector<entity>& _ents) {
+    op_counters::scope scope (counters, OP_RELOCATE_ENTITIES);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        size_t changed = local->changed ();
+        local->relocate_entities (_ents);
+        wake_flusher (changed);
+        return;
+    }
+
+    if (useScripts) {
+        // queue the scripts a pipeline at a time, redis still runs them one after the other
+        std::vector<size_t> retries, failures;
+        std::vector<std::string> dirtyKeys;
+
+        for (size_t begin = 0; begin < _ents.size (); begin += bulkPipelineSize) {
+            size_t end = std::min (begin + bulkPipelineSize, _ents.size () );
+
+            for (size_t n = begin; n < end; n++)
+                append_script (SCRIPT_RELOCATE, _ents[n]);
+
+            for (size_t n = begin; n < end; n++) {
+                redisReply* reply = get_reply ();
+
+                if (!reply || is_noscript (reply) ) {
+                    if (reply)
+                        freeReplyObject (reply);
+                    retries.push_back (n);
+                    continue;
+                }
+                if (reply->type == REDIS_REPLY_ERROR) {
+                    script_failed (reply);
+                    failures.push_back (n);
+                    continue;
+                }
+
+                std::string ownerKey;
+                read_script_reply (reply, ownerKey, dirtyKeys);
+                if (ownerKey != "")
+                    _ents[n].ownerKey = ownerKey;
+            }
+        }
+
+        // one at a time reloads the scripts (or falls back to the client side)
+        for (std::vector<size_t>::iterator it = retries.begin (); it != retries.end (); it++)
+            relocate_entity (_ents[*it]);
+
+        // a script that subdivided may have moved entities relocated before it
+        refresh_owners (_ents, std::unordered_set<std::string> (dirtyKeys.begin (), dirtyKeys.end () ) );
+
+        // the ones that failed are handed back as redis holds them
+        for (std::vector<size_t>::iterator it = failures.begin (); it != failures.end (); it++) {
+            _ents[*it].ownerKey = "";
+            get_entity (_ents[*it].id, _ents[*it]);
+        }
+        return;
+    }
+
+    if (optimistic) {
+        // every step of a batch would have to be watched, one at a time is the same thing
+        std::unordered_set<std::string> subdivided;
+        subdividedKeys = &subdivided;
+
+        for (std::vector<entity>::iterator it = _ents.begin (); it != _ents.end (); it++) {
+            if (it->ownerKey == "")
+                continue;
+
+            it->key = "entities:" + std::to_string (it->id);
+            relocate_entity (*it);
+        }
+
+        // a later one may have subdivided (or merged) the owner of an earlier one
+        subdividedKeys = NULL;
+        subdivided.insert (mergedKeys.begin (), mergedKeys.end () );
+        refresh_owners (_ents, subdivided);
+        return;
+    }
+
+    // every node the batch looks at is only read once
+    std::unordered_map<std::string, node> nodes;
+
+    auto lookup = [this, &nodes] (const std::string& _nodeKey) -> node& {
+        std::unordered_map<std::string, node>::iterator it = nodes.find (_nodeKey);
+        if (it != nodes.end () )
+            return it->second;
+
+        node& found = nodes[_nodeKey];
+        get_node (_nodeKey, found);
+        return found;
+    };
+
+    auto lookup_subnode = [this, &nodes] (const node& _node, int _quad) -> node& {
+        std::string subnodeKey = subnode_key (_node.key, _quad);
+        std::unordered_map<std::string, node>::iterator it = nodes.find (subnodeKey);
+        if (it != nodes.end () )
+            return it->second;
+
+        node& found = nodes[subnodeKey];
+        get_subnode (_node, _quad, found);
+        return found;
+    };
+
+    // stays keep their owner, moves go in the pipeline, reinserts need their destination subdivided
+    std::vector<size_t> stays, moves, reinserts;
+    std::vector<std::string> destKeys (_ents.size () );
+    std::unordered_map<std::string, uint32_t> incoming;
+
+    for (size_t n = 0; n < _ents.size (); n++) {
+        entity& ent = _ents[n];
+        if (ent.ownerKey == "")
+            continue;
+
+        ent.key = "entities:" + std::to_string (ent.id);
+
+        // up to the first node that contains the new position and back down to where it belongs
+        node* currNode = &lookup (ent.ownerKey);
+        if (!currNode->rect.contains (ent.pos) && currNode->rect.loosened (looseness).contains (ent.pos) ) {
+            // still inside its owner's loose bounds
+            stays.push_back (n);
+            continue;
+        }
+
+        while (!currNode->rect.contains (ent.pos) && currNode->parentKey != "")
+            currNode = &lookup (currNode->parentKey);
+
+        if (currNode->rect.contains (ent.pos) ) {
+            while (currNode->subdivided) {
+                int quad = 0;
+                while (quad < 4 && !currNode->rect.quadrant (quad).contains (ent.pos) )
+                    quad++;
+
+                // on the edge of the subnodes, it stays here
+                if (quad == 4)
+                    break;
+
+                currNode = &lookup_subnode (*currNode, quad);
+            }
+        }
+        else {
+            // outside of the tree, it keeps its owner
+            currNode = &lookup (ent.ownerKey);
+        }
+
+        if (currNode->key == ent.ownerKey) {
+            stays.push_back (n);
+            continue;
+        }
+
+        destKeys[n] = currNode->key;
+
+        uint32_t count = ++incoming[currNode->key];
+        bool fits = currNode->subdivided || currNode->entities + count <= maxEntitiesPerNode ||
+            currNode->rect.width / 2 < minNodeSize || currNode->rect.height / 2 < minNodeSize;
+
+        if (fits)
+            moves.push_back (n);
+        else
+            reinserts.push_back (n);
+    }
+
+    std::unordered_map<std::string, int32_t> deltas, totalDeltas;
+    std::vector<std::string> sourceKeys;
+
+    for (std::vector<size_t>::iterator it = moves.begin (); it != moves.end (); it++) {
+        deltas[_ents[*it].ownerKey]--;
+        deltas[destKeys[*it]]++;
+        total_deltas (_ents[*it].ownerKey, destKeys[*it], 1, totalDeltas);
+        sourceKeys.push_back (_ents[*it].ownerKey);
+    }
+
+    for (std::vector<size_t>::iterator it = reinserts.begin (); it != reinserts.end (); it++)
+        sourceKeys.push_back (_ents[*it].ownerKey);
+
+    size_t pending = 0;
+    auto queued = [this, &pending] (size_t _count) {
+        pending += _count;
+        if (pending >= bulkPipelineSize) {
+            read_replies (pending);
+            pending = 0;
+        }
+    };
+
+    std::vector<std::string> args;
+
+    if (entityLayout == LAYOUT_PACKED) {
+        // read every bucket that changes, rewrite them in memory and write each back once
+        // reinserted entities are taken out of their buckets by move_entity later on
+        std::unordered_map<std::string, std::string> buckets;
+        std::vector<std::string> bucketKeys;
+
+        auto touch = [&buckets, &bucketKeys] (const std::string& _nodeKey) {
+            if (buckets.insert (std::make_pair (_nodeKey, std::string () ) ).second)
+                bucketKeys.push_back (_nodeKey);
+        };
+
+        for (std::vector<size_t>::iterator it = stays.begin (); it != stays.end (); it++)
+            touch (_ents[*it].ownerKey);
+
+        for (std::vector<size_t>::iterator it = moves.begin (); it != moves.end (); it++) {
+            touch (_ents[*it].ownerKey);
+            touch (destKeys[*it]);
+        }
+
+        for (size_t begin = 0; begin < bucketKeys.size (); begin += bulkPipelineSize) {
+            size_t end = std::min (begin + bulkPipelineSize, bucketKeys.size () );
+
+            for (size_t n = begin; n < end; n++)
+                append ("GET %s:bucket", bucketKeys[n].c_str () );
+
+            for (size_t n = begin; n < end; n++) {
+                redisReply* reply;
+                reply = get_reply ();
+                if (reply->type == REDIS_REPLY_STRING)
+                    buckets[bucketKeys[n]].assign (reply->str, reply->len);
+                freeReplyObject (reply);
+            }
+        }
+
+        std::string record;
+
+        for (std::vector<size_t>::iterator it = stays.begin (); it != stays.end (); it++) {
+            std::string& bucket = buckets[_ents[*it].ownerKey];
+            size_t offset = find_entity (bucket, _ents[*it].id);
+
+            if (offset != std::string::npos) {
+                record.clear ();
+                pack_entity (_ents[*it], record);
+                bucket.replace (offset, entityRecordSize, record);
+            }
+        }
+
+        for (std::vector<size_t>::iterator it = moves.begin (); it != moves.end (); it++) {
+            entity& ent = _ents[*it];
+            std::string& bucket = buckets[ent.ownerKey];
+            size_t offset = find_entity (bucket, ent.id);
+
+            if (offset != std::string::npos)
+                bucket.erase (offset, entityRecordSize);
+
+            pack_entity (ent, buckets[destKeys[*it]]);
+            ent.ownerKey = destKeys[*it];
+
+            if (args.empty () ) {
+                args.push_back ("HMSET");
+                args.push_back ("entities:index");
+            }
+            args.push_back (std::to_string (ent.id) );
+            args.push_back (ent.ownerKey);
+
+            if (args.size () >= 2 + 2 * bulkSetSize) {
+                append_command (args);
+                args.clear ();
+                queued (1);
+            }
+        }
+
+        if (!args.empty () ) {
+            append_command (args);
+            queued (1);
+        }
+
+        for (std::vector<std::string>::iterator it = bucketKeys.begin (); it != bucketKeys.end (); it++) {
+            write_bucket (*it, buckets[*it]);
+            queued (1);
+        }
+    }
+    else {
+        std::unordered_map<std::string, std::vector<uint32_t> > removed, added;
+
+        for (std::vector<size_t>::iterator it = stays.begin (); it != stays.end (); it++) {
+            coordinate_arg x (coordinates, _ents[*it].pos.x), y (coordinates, _ents[*it].pos.y);
+            append ("HMSET %s x %b y %b", _ents[*it].key.c_str (), x.data (), x.size (), y.data (), y.size () );
+            queued (1);
+        }
+
+        // these are relocated one at a time once the rest of the batch is in, with their new position already written
+        for (std::vector<size_t>::iterator it = reinserts.begin (); it != reinserts.end (); it++) {
+            coordinate_arg x (coordinates, _ents[*it].pos.x), y (coordinates, _ents[*it].pos.y);
+            append ("HMSET %s x %b y %b", _ents[*it].key.c_str (), x.data (), x.size (), y.data (), y.size () );
+            queued (1);
+        }
+
+        for (std::vector<size_t>::iterator it = moves.begin (); it != moves.end (); it++) {
+            entity& ent = _ents[*it];
+
+            removed[ent.ownerKey].push_back (ent.id);
+            added[destKeys[*it]].push_back (ent.id);
+            ent.ownerKey = destKeys[*it];
+
+            coordinate_arg x (coordinates, ent.pos.x), y (coordinates, ent.pos.y);
+            append ("HMSET %s x %b y %b owner %s", ent.key.c_str (), x.data (), x.size (), y.data (), y.size (), ent.ownerKey.c_str () );
+            queued (1);
+        }
+
+        auto append_members = [this, &args, &queued] (const char* _command, const std::string& _nodeKey, const std::vector<uint32_t>& _ids) {
+            for (size_t n = 0; n < _ids.size (); n += bulkSetSize) {
+                size_t count = std::min (bulkSetSize, _ids.size () - n);
+
+                args.clear ();
+                args.push_back (_command);
+                args.push_back (_nodeKey + ":entities");
+                for (size_t i = n; i < n + count; i++)
+                    args.push_back (std::to_string (_ids[i]) );
+
+                append_command (args);
+                queued (1);
+            }
+        };
+
+        for (std::unordered_map<std::string, std::vector<uint32_t> >::iterator it = removed.begin (); it != removed.end (); it++)
+            append_members ("SREM", it->first, it->second);
+        for (std::unordered_map<std::string, std::vector<uint32_t> >::iterator it = added.begin (); it != added.end (); it++)
+            append_members ("SADD", it->first, it->second);
+    }
+
+    for (std::unordered_map<std::string, int32_t>::iterator it = deltas.begin (); it != deltas.end (); it++) {
+        if (it->second == 0)
+            continue;
+
+        append ("HINCRBY %s entities %i", it->first.c_str (), it->second);
+        queued (1);
+
+        if (cacheNodes)
+            cache.add_entities (it->first, it->second);
+        node_changed (it->first);
+    }
+
+    queued (append_totals (totalDeltas) );
+    read_replies (pending);
+
+    // the rest go one at a time, an earlier one may have subdivided their owner or destination since
+    std::unordered_set<std::string> subdividedKeys;
+    entity current;
+
+    for (std::vector<size_t>::iterator it = reinserts.begin (); it != reinserts.end (); it++) {
+        entity& ent = _ents[*it];
+
+        get_entity (ent.id, current);
+        if (current.ownerKey != "" && current.ownerKey != ent.ownerKey) {
+            ent.ownerKey = current.ownerKey;
+            sourceKeys.push_back (ent.ownerKey);
+        }
+
+        subdividedKeys.insert (destKeys[*it]);
+        relocate_entity (ent);
+    }
+
+    refresh_owners (_ents, subdividedKeys);
+
+    // deepest first, so a node is cleaned after its subnodes
+    std::sort (sourceKeys.begin (), sourceKeys.end (), [this] (const std::string& _a, const std::string& _b) {
+        uint32_t depthA = node_depth (keyScheme, _a), depthB = node_depth (keyScheme, _b);
+        return depthA != depthB ? depthA > depthB : _a < _b;
+    });
+    sourceKeys.erase (std::unique (sourceKeys.begin (), sourceKeys.end () ), sourceKeys.end () );
+
+    for (std::vector<std::string>::iterator it = sourceKeys.begin (); it != sourceKeys.end (); it++) {
+        node sourceNode;
+        get_node (*it, sourceNode);
+        if (sourceNode.entities <= mergeEntities)
+            clean (sourceNode);
+    }
+
+    // a merge moves the entities of a subtree up into its node
+    refresh_owners (_ents, std::unordered_set<std::string> (mergedKeys.begin (), mergedKeys.end () ) );
+}
+
+void quadtree::insert_entities (std::vector<entity>& _ents) {
+    op_counters::scope scope (counters, OP_INSERT_ENTITIES);
+    change_scope changes (*this);
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        size_t changed = local->changed ();
+        local->insert_entities (_ents);
+        wake_flusher (changed);
+        return;
+    }
+
+    node rootNode;
+    get_node (rootKey, rootNode);
+
+    if (optimistic || !is_empty () ) {
+        // the layout is only built from scratch, add to an existing tree one at a time
+        // another client could be adding to it while it's laid out, so the optimistic ones always do
+        for (std::vector<entity>::iterator it = _ents.begin (); it != _ents.end (); it++)
+            insert_entity (*it);
+        return;
+    }
+
+    // entities outside of the tree are never inserted
+    std::vector<entity>::iterator last = std::stable_partition (_ents.begin (), _ents.end (),
+        [&rootNode] (const entity& _ent) { return rootNode.rect.contains (_ent.pos); });
+
+    for (std::vector<entity>::iterator it = last; it != _ents.end (); it++) {
+        it->key = "";
+        it->ownerKey = "";
+    }
+
+    // sorting along the morton curve keeps every subtree's entities next to each other
+    std::stable_sort (_ents.begin (), last, [&rootNode] (const entity& _a, const entity& _b) {
+        return morton_code (_a.pos.x - rootNode.rect.x, _a.pos.y - rootNode.rect.y) < morton_code (_b.pos.x - rootNode.rect.x, _b.pos.y - rootNode.rect.y);
+    });
+
+    std::vector<node> nodes;
+    layout_entities (rootNode, _ents, 0, last - _ents.begin (), nodes);
+    write_entities (nodes, _ents);
+
+    for (std::vector<node>::iterator it = nodes.begin (); it != nodes.end (); it++) {
+        if (cacheNodes)
+            cache.put (*it);
+        node_changed (it->key);
+    }
+}
+
+void quadtree::clear_cache () {
+    cache.clear ();
+}
+
+size_t quadtree::warm () {
+    std::vector<node> nodes;
+
+    if (local) {
+        if (!flush () )
+            return 0;
+
+        // the flusher shares the context
+        std::lock_guard<std::mutex> writeLock (writeMutex);
+        std::vector<entity> ents;
+        read_tree (nodes, ents);
+
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->restore (nodes, ents);
+        return nodes.size ();
+    }
+
+    if (!cacheNodes)
+        return 0;
+
+    cache.clear ();
+    read_nodes (nodes);
+
+    for (std::vector<node>::iterator it = nodes.begin (); it != nodes.end (); it++)
+        cache.put (*it);
+    return nodes.size ();
+}
+
+bool quadtree::save_snapshot (const std::string& _path) {
+    std::vector<node> nodes;
+    std::vector<entity> ents;
+    rectangle rootRect;
+
+    if (local) {
+        // what's written has to be in redis too, or the snapshot is ahead of it
+        if (!flush () )
+            return false;
+
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->get_tree (nodes, ents);
+    }
+    else
+        read_tree (nodes, ents);
+
+    return !nodes.empty () && write_snapshot (_path, nodes[0].rect, keyScheme, nodes, ents);
+}
+
+bool quadtree::load_snapshot (const std::string& _path) {
+    if (!local && !cacheNodes)
+        return false;
+
+    // the snapshot has to be of this tree, which the root's rect and key tell apart well enough
+    std::vector<node> nodes;
+    std::vector<entity> ents;
+    if (!read_snapshot (_path, rootRect, keyScheme, nodes, ents) || nodes.empty () || nodes[0].key != rootKey)
+        return false;
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->restore (nodes, ents);
+        return true;
+    }
+
+    cache.clear ();
+    for (std::vector<node>::iterator it = nodes.begin (); it != nodes.end (); it++)
+        cache.put (*it);
+    return true;
+}
+
+uint32_t merge_threshold (uint32_t _maxEntities, uint32_t _mergeEntities) {
+    return std::min (_mergeEntities, std::max (_maxEntities, 1u) - 1);
+}
+
+uint32_t quadtree::split_threshold () const {
+    return maxEntitiesPerNode;
+}
+
+uint32_t quadtree::merge_threshold () const {
+    return mergeEntities;
+}
+
+void quadtree::set_thresholds (uint32_t _maxEntities, uint32_t _mergeEntities) {
+    _maxEntities = std::max (_maxEntities, 1u);
+    _mergeEntities = ::merge_threshold (_maxEntities, _mergeEntities);
+
+    {
+        // the flusher writes on the same context
+        std::unique_lock<std::mutex> writeLock (writeMutex, std::defer_lock);
+        if (local)
+            writeLock.lock ();
+
+        redisReply* reply = command ("HMSET %s maxEntities %u mergeEntities %u", rootKey.c_str (), _maxEntities, _mergeEntities);
+        if (reply)
+            freeReplyObject (reply);
+    }
+
+    if (local) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->set_thresholds (_maxEntities, _mergeEntities);
+    }
+
+    maxEntitiesPerNode = _maxEntities;
+    mergeEntities = _mergeEntities;
+}
+
+bool quadtree::runs_scripts () const {
+    return useScripts;
+}
+
+const std::string& quadtree::script_error () const {
+    return scriptError;
+}
+
+bool quadtree::get_node_rect (const std::string& _nodeKey, rectangle& _rect) {
+    // the flusher writes on the same context
+    std::unique_lock<std::mutex> writeLock (writeMutex, std::defer_lock);
+    if (local)
+        writeLock.lock ();
+
+    redisReply* reply = command ("HVALS %s:rect", _nodeKey.c_str () );
+    if (!reply)
+        return false;
+
+    bool exists = reply->type == REDIS_REPLY_ARRAY && reply->elements == 4;
+    if (exists)
+        _rect = rectangle (reply, coordinates);
+    freeReplyObject (reply);
+    return exists;
+}
+
+size_t quadtree::masters () const {
+    return router ? router->masters () : 0;
+}
+
+bool quadtree::flush () {
+    if (!local)
+        return true;
+
+    return write_changes ();
+}
+
+bool quadtree::subdivide (const node& _node) {
+    //std::cout << "Subdividing at node: " << _node.key << std::endl;
+
+    // don't subdivide if we've reached the minimum
+    if (!can_subdivide (_node) )
+        return false;
+    RQTREE_COUNT (counters, subdivides, 1);
+
+    // everything is read before anything is written, a transaction can't read once it's started
+    std::vector<entity> ents;
+    get_node_entities (_node, ents);
+    begin_writes ();
+
+    redisReply* reply;
+    const char* nodeKey = _node.key.c_str ();
+    std::string subnodeKeys[4];
+
+    // setup the four quadrants
+    for (int i = 0; i < 4; i++) {
+        subnodeKeys[i] = subnode_key (_node.key, i);
+        append ("HSET %s subdivided 0", subnodeKeys[i].c_str () );
+        append ("HSET %s entities 0", subnodeKeys[i].c_str () );
+
+        for (int n = 0; n < 2; n++) {
+            reply = get_reply ();
+            freeReplyObject (reply);
+        }
+    }
+
+    // setup the sub rectangles
+    rectangle rects[4];
+
+    for (int i = 0; i < 4; i++) {
+        rects[i] = _node.rect.quadrant (i);
+
+        coordinate_arg x (coordinates, rects[i].x), y (coordinates, rects[i].y), w (coordinates, rects[i].width), h (coordinates, rects[i].height);
+        append ("HSET %s:rect x %b", subnodeKeys[i].c_str (), x.data (), x.size () );
+        append ("HSET %s:rect y %b", subnodeKeys[i].c_str (), y.data (), y.size () );
+        append ("HSET %s:rect w %b", subnodeKeys[i].c_str (), w.data (), w.size () );
+        append ("HSET %s:rect h %b", subnodeKeys[i].c_str (), h.data (), h.size () );
+    }
+
+    // set subdivided to true
+    append ("HSET %s subdivided 1", nodeKey);
+
+    for (int n = 0; n < 17; n++) {
+        reply = get_reply ();
+        freeReplyObject (reply);
+    }
+
+    node subdividedNode = _node;
+    subdividedNode.subdivided = true;
+    if (subdividedKeys)
+        subdividedKeys->insert (_node.key);
+
+    if (cacheNodes) {
+        for (int i = 0; i < 4; i++) {
+            node subnode;
+            subnode.key = subnodeKeys[i];
+            subnode.parentKey = _node.key;
+            subnode.subdivided = false;
+            subnode.entities = 0;
+            subnode.rect = rects[i];
+            cache.put (subnode);
+        }
+        cache.set_subdivided (_node.key, true);
+    }
+    node_changed (_node.key);
+
+    //std::cout << "Moving " << ents.size () << " entities down to subnodes" << std::endl;
+
+    if (ents.size () > 0 && entityLayout == LAYOUT_PACKED) {
+        split_bucket (subdividedNode, ents);
+    }
+    else if (ents.size () > 0) {
+        // move all the entities in this node down if possible, the subnodes were just laid out
+        // so there's no need to read them
+        node destNode;
+
+        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
+            int quad = 0;
+            while (quad < 4 && !rects[quad].contains (it->pos) )
+                quad++;
+
+            if (quad < 4) {
+                destNode.key = subnodeKeys[quad];
+                move_entity ( (*it), _node, destNode);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool quadtree::can_subdivide (const node& _node) const {
+    return _node.rect.width / 2 >= minNodeSize && _node.rect.height / 2 >= minNodeSize;
+}
+
+void quadtree::subdivide_to_min_depth (node& _node) {
+    if (node_depth (keyScheme, _node.key) >= minDepth)
+        return;
+
+    // in optimistic mode another client making the tree at the same time may get there first
+    while (!_node.subdivided) {
+        if (!watch_node (_node) )
+            continue;
+
+        bool subdivided = subdivide (_node);
+        if (!exec () ) {
+            read_node (_node, false);
+            continue;
+        }
+
+        if (!subdivided)
+            return;
+        _node.subdivided = true;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        node subnode;
+        get_subnode (_node, i, subnode);
+        subdivide_to_min_depth (subnode);
+    }
+}
+
+bool quadtree::is_empty () {
+    // without a minimum depth an empty tree is a lone root, otherwise every node down to minDepth
+    // has to be checked, one pipeline per level
+    std::vector<node> nodes (1), subnodes;
+    get_node (rootKey, nodes[0]);
+
+    while (!nodes.empty () ) {
+        subnodes.clear ();
+
+        for (size_t i = 0; i < nodes.size (); i++) {
+            const node& currNode = nodes[i];
+
+            if (currNode.entities > 0)
+                return false;
+
+            if (!currNode.subdivided)
+                continue;
+
+            if (node_depth (keyScheme, currNode.key) >= minDepth)
+                return false;
+
+            for (int quad = 0; quad < 4; quad++) {
+                node subnode;
+                subnode.key = subnode_key (currNode.key, quad);
+                subnode.parentKey = currNode.key;
+                subnode.rect = currNode.rect.quadrant (quad);
+                subnodes.push_back (subnode);
+
+                append ("HMGET %s subdivided entities", subnode.key.c_str () );
+            }
+        }
+
+        redisReply* reply;
+        for (size_t n = 0; n < subnodes.size (); n++) {
+            reply = get_reply ();
+            parse_node (reply, subnodes[n]);
+            freeReplyObject (reply);
+        }
+
+        nodes.swap (subnodes);
+    }
+
+    return true;
+}
+
+void quadtree::clean (node& _node) {
+    //std::cout << "Cleaning node " << _node.key << std::endl;
+    RQTREE_COUNT (counters, cleans, 1);
+
+    // nodes above the minimum depth keep their subnodes
+    if (node_depth (keyScheme, _node.key) < minDepth)
+        return;
+    if (_node.subdivided) {
+        bool empty = true;
+        std::vector<std::string> emptyKeys;
+
+        // in optimistic mode the subnodes are watched as they're read, and a merge that lost to another
+        // client starts over from the node as it is now
+        if (!watch_node (_node) ) {
+            clean (_node);
+            return;
+        }
+
+        find_empty_subnodes (_node.key, empty, emptyKeys);
+
+        // with a merge threshold a subtree that isn't empty can still be small enough to go back into its node
+        bool merged = !empty && mergeEntities > 0 && merge_subtree (_node);
+        if (!merged) {
+            for (std::vector<std::string>::iterator it = emptyKeys.begin (); it != emptyKeys.end (); it++)
+                delete_subnodes (*it);
+        }
+
+        if (!exec () ) {
+            get_node (_node.key, _node);
+            clean (_node);
+            return;
+        }
+
+        if (empty || merged) {
+            // this node has been updated (subnodes deleted)
+            get_node (_node.key, _node);
+
+            if (!_node.subdivided && _node.entities <= mergeEntities && _node.parentKey != "") {
+                node parentNode;
+                get_node (_node.parentKey, parentNode);
+                clean (parentNode);
+            }
+        }
+    }
+    else if (_node.entities <= mergeEntities && _node.parentKey != "") {
+        // this could be one of the empty nodes, tell parent to clean up
+        node parentNode;
+        get_node (_node.parentKey, parentNode);
+        clean (parentNode);
+    }
+}
+
+bool quadtree::merge_subtree (node& _node) {
+    std::vector<node> below, level (1, _node), subnodes;
+    uint32_t count = _node.entities;
+    redisReply* reply;
+
+    // a level at a time, watched in optimistic mode like everything else the merge reads
+    while (!level.empty () ) {
+        std::vector<std::string> keys;
+        subnodes.clear ();
+
+        for (std::vector<node>::iterator it = level.begin (); it != level.end (); it++) {
+            if (!it->subdivided)
+                continue;
+
+            for (int quad = 0; quad < 4; quad++) {
+                node subnode;
+                subnode.key = subnode_key (it->key, quad);
+                subnode.parentKey = it->key;
+                subnode.rect = it->rect.quadrant (quad);
+                subnodes.push_back (subnode);
+                keys.push_back (subnode.key);
+            }
+        }
+        watch (keys);
+
+        for (std::vector<node>::iterator it = subnodes.begin (); it != subnodes.end (); it++)
+            append ("HMGET %s subdivided entities", it->key.c_str () );
+        for (std::vector<node>::iterator it = subnodes.begin (); it != subnodes.end (); it++) {
+            reply = get_reply ();
+            parse_node (reply, *it);
+            freeReplyObject (reply);
+            count += it->entities;
+        }
+
+        // a subtree this big stays as it is, there's no need to read the rest of it
+        if (count > mergeEntities)
+            return false;
+
+        below.insert (below.end (), subnodes.begin (), subnodes.end () );
+        level.swap (subnodes);
+    }
+
+    std::vector<entity> ents;
+    for (std::vector<node>::iterator it = below.begin (); it != below.end (); it++) {
+        if (it->entities > 0)
+            get_node_entities (*it, ents);
+    }
+
+    std::string bucket;
+    if (entityLayout == LAYOUT_PACKED) {
+        watch (std::vector<std::string> (1, _node.key + ":bucket") );
+        bucket = read_bucket (_node.key);
+    }
+
+    // the subtree's total doesn't change, only where in it the entities are
+    begin_writes ();
+    const char* nodeKey = _node.key.c_str ();
+    size_t pending = 0;
+
+    if (entityLayout == LAYOUT_PACKED) {
+        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
+            pack_entity (*it, bucket);
+            append ("HSET entities:index %u %s", it->id, nodeKey);
+            pending++;
+        }
+        write_bucket (_node.key, bucket);
+        pending++;
+    }
+    else if (!ents.empty () ) {
+        std::vector<std::string> args;
+        args.push_back ("SADD");
+        args.push_back (_node.key + ":entities");
+
+        for (std::vector<entity>::iterator it = ents.begin (); it != ents.end (); it++) {
+            append ("HSET %s owner %s", it->key.c_str (), nodeKey);
+            args.push_back (std::to_string (it->id) );
+            pending++;
+        }
+        append_command (args);
+        pending++;
+    }
+
+    const char* members = entityLayout == LAYOUT_PACKED ? "bucket" : "entities";
+    for (std::vector<node>::iterator it = below.begin (); it != below.end (); it++) {
+        const char* key = it->key.c_str ();
+        append ("DEL %s %s:rect %s:%s %s:total", key, key, key, members, key);
+        pending++;
+    }
+
+    append ("HSET %s subdivided 0", nodeKey);
+    append ("HINCRBY %s entities %u", nodeKey, (uint32_t)ents.size () );
+    read_replies (pending + 2);
+
+    _node.subdivided = false;
+    _node.entities += ents.size ();
+    mergedKeys.push_back (_node.key);
+
+    if (cacheNodes) {
+        for (std::vector<node>::iterator it = below.begin (); it != below.end (); it++)
+            cache.erase (it->key);
+        cache.set_subdivided (_node.key, false);
+        cache.add_entities (_node.key, ents.size () );
+    }
+    node_changed (_node.key);
+    return true;
+}
+
+bool quadtree::read_thresholds (bool _nodeSize) {
+    redisReply* reply = command ("HMGET %s maxEntities mergeEntities minNodeSize", rootKey.c_str () );
+    if (!reply)
+        return false;
+
+    bool read = reply->type == REDIS_REPLY_ARRAY && reply->elements == 3;
+    for (size_t n = 0; read && n < 3; n++)
+        read = reply->element[n]->type == REDIS_REPLY_STRING;
+
+    if (read) {
+        maxEntitiesPerNode = std::max ( (uint32_t)strtoul (reply->element[0]->str, NULL, 10), 1u);
+        mergeEntities = ::merge_threshold (maxEntitiesPerNode, strtoul (reply->element[1]->str, NULL, 10) );
+        if (_nodeSize)
+            minNodeSize = strtoul (reply->element[2]->str, NULL, 10);
+    }
+    freeReplyObject (reply);
+
+    return read;
+}
+
+void quadtree::refresh_thresholds () {
+    if (local || thresholdInterval == 0 || ++operationsSinceRefresh < thresholdInterval)
+        return;
+    operationsSinceRefresh = 0;
+
+    // the reply has next to nothing in it, so this is about as close to a bare round trip as the tree gets
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+    bool read = read_thresholds ();
+    double nanos = std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - start).count ();
+    roundTripNanos = roundTripNanos == 0 ? nanos : 0.8 * roundTripNanos + 0.2 * nanos;
+
+    if (read && adaptiveThresholds)
+        tune_thresholds ();
+}
+
+void quadtree::tune_thresholds () {
+#ifndef RQTREE_NO_STATS
+    quadtree_stats now = counters.stats ();
+    quadtree_stats window = now - tunedStats;
+    tunedStats = now;
+
+    uint64_t reads = 0, writes = 0, nanos = 0, roundTrips = 0, bytes = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        // the stats were reset since the last tuning, start the window over
+        if (now.ops[op].calls < window.ops[op].calls)
+            return;
+
+        const op_stats& stats = window.ops[op];
+        if (op == OP_INSERT_ENTITY || op == OP_REMOVE_ENTITY || op == OP_RELOCATE_ENTITY || op == OP_RELOCATE_ENTITIES ||
+            op == OP_INSERT_ENTITIES)
+            writes += stats.calls;
+        else
+            reads += stats.calls;
+
+        nanos += stats.nanos;
+        roundTrips += stats.io.roundTrips;
+        bytes += stats.io.replyBytes;
+    }
+    if (reads + writes == 0 || bytes == 0 || roundTripNanos <= 0)
+        return;
+
+    // whatever time the round trips don't account for went into sending and handling what was in the replies
+    double byteNanos = std::max ( (double)nanos - roundTrips * roundTripNanos, 0.0) / bytes;
+    double entityBytes = entityLayout == LAYOUT_PACKED ? entityRecordSize : 24;
+    // a write reads the leaf it lands in and then writes it, a read only reads it
+    double weight = (reads + 2.0 * writes) / (reads + writes);
+
+    // a descent takes a round trip per level, about log4 (entities / s) of them, and then reads a leaf of up to s
+    // entities, the sum of the two is smallest at s = rtt / (ln 4 * what an entity costs)
+    double target = adaptiveMax;
+    if (byteNanos > 0)
+        target = roundTripNanos / (std::log (4.0) * byteNanos * entityBytes * weight);
+    target = std::min (std::max (target, (double)adaptiveMin), (double)adaptiveMax);
+
+    // halfway there per window, and only once it's worth it: every change reshapes the tree as nodes change
+    double next = std::sqrt (target * maxEntitiesPerNode);
+    if (next < maxEntitiesPerNode * 1.25 && next * 1.25 > maxEntitiesPerNode)
+        return;
+
+    uint32_t split = (uint32_t)(next + 0.5);
+    set_thresholds (split, (uint32_t)(split * mergeRatio) );
+#endif
+}
+
+void quadtree::get_node (const std::string& _nodeKey, node& _node) {
+    RQTREE_COUNT (counters, nodesVisited, 1);
+    if (cacheNodes && cache.get (_nodeKey, _node) )
+        return;
+
+    // _nodeKey may be this node's own parentKey, so only use it before that gets reset
+    _node.key = _nodeKey;
+    _node.parentKey = parent_key (_node.key);
+
+    read_node (_node, true);
+}
+
+void quadtree::get_subnode (const node& _node, int _quad, node& _subnode) {
+    RQTREE_COUNT (counters, nodesVisited, 1);
+    std::string subnodeKey = subnode_key (_node.key, _quad);
+
+    if (cacheNodes && cache.get (subnodeKey, _subnode) )
+        return;
+
+    _subnode.key = subnodeKey;
+    _subnode.parentKey = _node.key;
+    // subnode rects are laid out by subdivide, no need to read them back
+    _subnode.rect = _node.rect.quadrant (_quad);
+
+    read_node (_subnode, false);
+}
+
+void quadtree::read_node (node& _node, bool _readRect) {
+    append ("HMGET %s subdivided entities", _node.key.c_str () );
+    if (_readRect)
+        append ("HVALS %s:rect", _node.key.c_str () );
+
+    redisReply* reply;
+    bool exists;
+
+    reply = get_reply ();
+    exists = parse_node (reply, _node);
+    freeReplyObject (reply);
+
+    if (_readRect) {
+        reply = get_reply ();
+        _node.rect = rectangle (reply, coordinates);
+        freeReplyObject (reply);
+    }
+
+    if (cacheNodes && exists)
+        cache.put (_node);
+}
+
+void quadtree::get_destination_node (const entity& _ent, const node& _currNode, node& _destNode, bool& _stayParent) {
+    _stayParent = true;
+    _destNode = _currNode;
+
+    // there is nowhere to go if this node has no subnodes
+    if (!_currNode.subdivided)
+        return;
+
+    // only the subnode that contains the entity has to be looked up
+    for (int i = 0; i < 4; i++) {
+        if (_currNode.rect.quadrant (i).contains (_ent.pos) ) {
+            get_subnode (_currNode, i, _destNode);
+            _stayParent = false;
+
+            //std::cout << "Found destination node " << _destNode.key << std::endl;
+            break;
+        }
+    }
+}
+
+void quadtree::add_entity (const node& _node, entity& _ent) {
+    //std::cout << "Adding entity " << _ent.id << " to " << _node.key << " at (" << _ent.pos.x << ", " << _ent.pos.y << ")" << std::endl;
+
+    _ent.key = "entities:" + std::to_string (_ent.id);
+    _ent.ownerKey = _node.key;
+    begin_writes ();
+
+    // update the node
+    append ("HINCRBY %s entities 1", _node.key.c_str () );
+    size_t totals = append_totals ("", _node.key, 1);
+
+    if (entityLayout == LAYOUT_PACKED) {
+        std::string record;
+        pack_entity (_ent, record);
+
+        append ("APPEND %s:bucket %b", _node.key.c_str (), record.data (), record.size () );
+        append ("HSET entities:index %u %s", _ent.id, _ent.ownerKey.c_str () );
+        read_replies (3 + totals);
+    }
+    else {
+        append ("SADD %s:entities %i", _node.key.c_str (), _ent.id);
+
+        // add the entity into redis
+        coordinate_arg x (coordinates, _ent.pos.x), y (coordinates, _ent.pos.y);
+        append ("HSET %s x %b", _ent.key.c_str (), x.data (), x.size () );
+        append ("HSET %s y %b", _ent.key.c_str (), y.data (), y.size () );
+        append ("HSET %s owner %s", _ent.key.c_str (), _ent.ownerKey.c_str () );
+        read_replies (5 + totals);
+    }
+
+    if (cacheNodes)
+        cache.add_entities (_node.key, 1);
+    node_changed (_node.key);
+}
+
+void quadtree::update_entity (const entity& _ent) {
+    if (entityLayout == LAYOUT_PACKED) {
+        // overwrite the entity's record in place, the index only changes when it moves
+        std::string bucket = read_bucket (_ent.ownerKey);
+        size_t offset = find_entity (bucket, _ent.id);
+
+        if (offset != std::string::npos) {
+            std::string record;
+            pack_entity (_ent, record);
+
+            begin_writes ();
+            redisReply* reply = command ("SETRANGE %s:bucket %u %b", _ent.ownerKey.c_str (), (uint32_t)offset, record.data (), record.size () );
+            freeReplyObject (reply);
+        }
+        return;
+    }
+
+    // resave the entity info in redis
+    begin_writes ();
+    coordinate_arg x (coordinates, _ent.pos.x), y (coordinates, _ent.pos.y);
+    append ("HSET %s x %b", _ent.key.c_str (), x.data (), x.size () );
+    append ("HSET %s y %b", _ent.key.c_str (), y.data (), y.size () );
+    append ("HSET %s owner %s", _ent.key.c_str (), _ent.ownerKey.c_str () );
+ 
+    redisReply* reply;
+    for (int n = 0; n < 3; n++) {
+        reply = get_reply ();
+        freeReplyObject (reply);
+    }
+}
+
+void quadtree::delete_entity (entity& _ent) {
+    //std::cout << "Deleting entity " << _ent.id << " from " << _ent.ownerKey << std::endl;
+
+    // the bucket has to be read before anything else is queued on the context
+    std::string bucket;
+    if (entityLayout == LAYOUT_PACKED)
+        bucket = read_bucket (_ent.ownerKey);
+
+    // remove the entity from redis and update the node
+    begin_writes ();
+    append ("HINCRBY %s entities -1", _ent.ownerKey.c_str () );
+    size_t totals = append_totals (_ent.ownerKey, "", 1);
+
+    if (entityLayout == LAYOUT_PACKED) {
+        size_t offset = find_entity (bucket, _ent.id);
+        if (offset != std::string::npos)
+            bucket.erase (offset, entityRecordSize);
+
+        write_bucket (_ent.ownerKey, bucket);
+        append ("HDEL entities:index %u", _ent.id);
+        read_replies (3 + totals);
+    }
+    else {
+        append ("SREM %s:entities %i", _ent.ownerKey.c_str (), _ent.id);
+        append ("HDEL %s x", _ent.key.c_str () );
+        append ("HDEL %s y", _ent.key.c_str () );
+        append ("HDEL %s owner", _ent.key.c_str () );
+        read_replies (5 + totals);
+    }
+
+    if (cacheNodes)
+        cache.add_entities (_ent.ownerKey, -1);
+    node_changed (_ent.ownerKey);
+
+    _ent.key = "";
+    _ent.ownerKey = "";
+}
+
+void quadtree::move_entity (entity& _ent, const node& _srcNode, const node& _destNode) {
+    //std::cout << "Moving entity " << _ent.id << " from " << _srcNode.key << " to " << _destNode.key << std::endl;
+
+    std::string bucket;
+    if (entityLayout == LAYOUT_PACKED)
+        bucket = read_bucket (_srcNode.key);
+
+    // update both nodes entity info
+    begin_writes ();
+    append ("HINCRBY %s entities -1", _srcNode.key.c_str () );
+    append ("HINCRBY %s entities 1", _destNode.key.c_str () );
+    size_t totals = append_totals (_srcNode.key, _destNode.key, 1);
+
+    if (entityLayout == LAYOUT_PACKED) {
+        // the record is rewritten from _ent, so a relocated entity moves with its new position
+        std::string record;
+        pack_entity (_ent, record);
+
+        size_t offset = find_entity (bucket, _ent.id);
+        if (offset != std::string::npos)
+            bucket.erase (offset, entityRecordSize);
+
+        write_bucket (_srcNode.key, bucket);
+        append ("APPEND %s:bucket %b", _destNode.key.c_str (), record.data (), record.size () );
+        append ("HSET entities:index %u %s", _ent.id, _destNode.key.c_str () );
+    }
     else {
+        append ("SREM %s:entities %i", _srcNode.key.c_str (), _ent.id);
+        append ("SADD %s:entities %i", _destNode.key.c_str (), _ent.id);
+
+        // change the entity's owner, with its position so it's never in a node it isn't inside of
+        coordinate_arg x (coordinates, _ent.pos.x), y (coordinates, _ent.pos.y);
+        append ("HMSET %s x %b y %b owner %s", _ent.key.c_str (), x.data (), x.size (), y.data (), y.size (), _destNode.key.c_str () );
+    }
+
+    _ent.ownerKey = _destNode.key;
+    read_replies (5 + totals);
+
+    if (cacheNodes) {
+        cache.add_entities (_srcNode.key, -1);
+        cache.add_entities (_destNode.key, 1);
+    }
+    node_changed (_srcNode.key);
+    node_changed (_destNode.key);
+}
+
+bool quadtree::place_entity (entity& _ent, const node* _ownerNode, node& _currNode) {
+    node destNode;
+    bool stayParent = false;
+
+    // every pass adds the entity, subdivides or goes down a level, in optimistic mode a pass that lost
+    // to another client runs again from the node as it is now
+    while (_currNode.rect.contains (_ent.pos) ) {
+        if (_currNode.subdivided) {
+            // figure out which subnode the entity should move into
+            get_destination_node (_ent, _currNode, destNode, stayParent);
+
+            if (!stayParent) {
+                // change the level down one
+                // the loop will repeat and try to insert into the subnode
+                _currNode = destNode;
+                continue;
+            }
+            // if this entity won't fit in the subnodes it stays here
+        }
+        else if (_currNode.entities + 1 > maxEntitiesPerNode && can_subdivide (_currNode) ) {
+            // subdivide if needed, otherwise this is as small as the nodes can get and it's added here
+            if (watch_node (_currNode) ) {
+                subdivide (_currNode);
+
+                if (exec () ) {
+                    _currNode.subdivided = true;
+                    // its entities just moved down, the count is only checked by the next watch
+                    if (optimistic)
+                        read_node (_currNode, false);
+                }
+            }
+            continue;
+        }
+
+        if (!watch_node (_currNode) )
+            continue;
+        if (_ownerNode && !watch_owner (_ent) )
+            return false;
+
+        if (_ownerNode)
+            move_entity (_ent, *_ownerNode, _currNode);
+        else
+            add_entity (_currNode, _ent);
+
+        if (exec () )
+            return true;
+    }
+
+    return true;
+}
+
+bool quadtree::relocate_entity (entity& _ent, node& _ownerNode, node& _currNode, node& _destNode) {
+    // is the entity contained by this node? the owner keeps it anywhere in its loose bounds
+    bool contained = _currNode.rect.contains (_ent.pos);
+    if (!contained && _currNode.key == _ownerNode.key)
+        contained = _currNode.rect.loosened (looseness).contains (_ent.pos);
+
+    if (contained) {
+        bool stayParent = true;
+        // check if it needs to move between subnodes
+        get_destination_node (_ent, _currNode, _destNode, stayParent);
+
+        // check if the entity is still in the owner same node
+        if (_ownerNode.key == _currNode.key) {
+            // check if the entity needs to move down,  otherwise we don't have to do anything
+            if (!stayParent) {
+                // reinsert the entity elsewhere
+                return place_entity (_ent, &_ownerNode, _destNode);
+            }
+        }
+        else {
+            // the entity has moved out of its owner node, so reinsert it elsewhere
+            if (!place_entity (_ent, &_ownerNode, _destNode) )
+                return false;
+
+            // clean the former owner node, a watched clean has to start from its count after the move
+            if (optimistic)
+                get_node (_ownerNode.key, _ownerNode);
+
+            // a merge the clean makes can take the entity up with the rest of a subtree
+            size_t merges = mergedKeys.size ();
+            clean (_ownerNode);
+            if (mergedKeys.size () != merges) {
+                entity current;
+                get_entity (_ent.id, current);
+                if (current.ownerKey != "")
+                    _ent.ownerKey = current.ownerKey;
+            }
+        }
+    }
+    else if (_currNode.parentKey != "") {
         // move up the tree
-        get_node (_ownerNode.parentKey, _currNode);
-        relocate_entity (_ent, _ownerNode, _currNode, _destNode);
+        get_node (_currNode.parentKey, _currNode);
+        return relocate_entity (_ent, _ownerNode, _currNode, _destNode);
+    }
+
+    return true;
+}
+
+void quadtree::split_bucket (const node& _node, const std::vector<entity>& _ents) {
+    // same result as a move_entity per entity, but the bucket is only rewritten once
+    // _node has just been subdivided so its subnodes are still empty
+    std::string bucket, subnodeBuckets[4];
+    std::string subnodeKeys[4];
+    uint32_t moved = 0;
+    size_t pending = 0;
+
+    for (int i = 0; i < 4; i++)
+        subnodeKeys[i] = subnode_key (_node.key, i);
+
+    for (std::vector<entity>::const_iterator it = _ents.begin (); it != _ents.end (); it++) {
+        int quad = 0;
+        while (quad < 4 && !_node.rect.quadrant (quad).contains (it->pos) )
+            quad++;
+
+        if (quad == 4) {
+            pack_entity (*it, bucket);
+            continue;
+        }
+
+        pack_entity (*it, subnodeBuckets[quad]);
+        append ("HSET entities:index %u %s", it->id, subnodeKeys[quad].c_str () );
+        pending++;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        uint32_t count = subnodeBuckets[i].size () / entityRecordSize;
+        if (count == 0)
+            continue;
+
+        write_bucket (subnodeKeys[i], subnodeBuckets[i]);
+        append ("HINCRBY %s entities %u", subnodeKeys[i].c_str (), count);
+        pending += 2 + append_totals (_node.key, subnodeKeys[i], count);
+        moved += count;
+
+        if (cacheNodes)
+            cache.add_entities (subnodeKeys[i], count);
+    }
+
+    if (moved == 0) {
+        read_replies (pending);
+        return;
+    }
+
+    write_bucket (_node.key, bucket);
+    append ("HINCRBY %s entities -%u", _node.key.c_str (), moved);
+    read_replies (pending + 2);
+
+    if (cacheNodes)
+        cache.add_entities (_node.key, -(int32_t)moved);
+}
+
+void quadtree::total_deltas (const std::string& _srcKey, const std::string& _destKey, int32_t _count,
+    std::unordered_map<std::string, int32_t>& _deltas) const {
+    if (!countSubtrees || _count == 0)
+        return;
+
+    std::vector<std::string> srcPath, destPath;
+    for (std::string key = _srcKey; key != ""; key = parent_key (key) )
+        srcPath.push_back (key);
+    for (std::string key = _destKey; key != ""; key = parent_key (key) )
+        destPath.push_back (key);
+
+    // the nodes both paths go through keep the entities in their subtrees
+    while (!srcPath.empty () && !destPath.empty () && srcPath.back () == destPath.back () ) {
+        srcPath.pop_back ();
+        destPath.pop_back ();
+    }
+
+    for (std::vector<std::string>::iterator it = srcPath.begin (); it != srcPath.end (); it++)
+        _deltas[*it] -= _count;
+    for (std::vector<std::string>::iterator it = destPath.begin (); it != destPath.end (); it++)
+        _deltas[*it] += _count;
+}
+
+size_t quadtree::append_totals (const std::unordered_map<std::string, int32_t>& _deltas) {
+    size_t queued = 0;
+
+    for (std::unordered_map<std::string, int32_t>::const_iterator it = _deltas.begin (); it != _deltas.end (); it++) {
+        if (it->second == 0)
+            continue;
+
+        append ("INCRBY %s:total %i", it->first.c_str (), it->second);
+        queued++;
+    }
+
+    return queued;
+}
+
+size_t quadtree::append_totals (const std::string& _srcKey, const std::string& _destKey, int32_t _count) {
+    if (!countSubtrees)
+        return 0;
+
+    std::unordered_map<std::string, int32_t> deltas;
+    total_deltas (_srcKey, _destKey, _count, deltas);
+    return append_totals (deltas);
+}
+
+std::string quadtree::read_bucket (const std::string& _nodeKey) {
+    std::string bucket;
+    redisReply* reply = command ("GET %s:bucket", _nodeKey.c_str () );
+
+    if (reply->type == REDIS_REPLY_STRING)
+        bucket.assign (reply->str, reply->len);
+    freeReplyObject (reply);
+
+    return bucket;
+}
+
+void quadtree::write_bucket (const std::string& _nodeKey, const std::string& _bucket) {
+    // only queues the command, the caller reads the reply along with the rest of its pipeline
+    // an empty bucket is deleted instead, redis would keep an empty string around
+    if (_bucket.empty () )
+        append ("DEL %s:bucket", _nodeKey.c_str () );
+    else
+        append ("SET %s:bucket %b", _nodeKey.c_str (), _bucket.data (), _bucket.size () );
+}
+
+void quadtree::layout_entities (node& _node, std::vector<entity>& _ents, size_t _begin, size_t _end, std::vector<node>& _nodes) {
+    // same end result as inserting [_begin, _end) one at a time: a node only gets subdivided
+    // once it holds too many entities, and entities on the edge of every subnode stay with it
+    size_t index = _nodes.size ();
+    _nodes.push_back (_node);
+    _nodes[index].subdivided = false;
+    _nodes[index].entities = _end - _begin;
+
+    bool split = (_end - _begin > maxEntitiesPerNode || node_depth (keyScheme, _node.key) < minDepth)
+        && _node.rect.width / 2 >= minNodeSize && _node.rect.height / 2 >= minNodeSize;
+
+    if (split) {
+        rectangle rects[4];
+        size_t bounds[5];
+        bounds[0] = _begin;
+
+        // the range is in morton order so partitioning it keeps each subnode in order too
+        for (int i = 0; i < 4; i++) {
+            rects[i] = _node.rect.quadrant (i);
+            bounds[i + 1] = std::stable_partition (_ents.begin () + bounds[i], _ents.begin () + _end,
+                [&rects, i] (const entity& _ent) { return rects[i].contains (_ent.pos); }) - _ents.begin ();
+        }
+
+        _nodes[index].subdivided = true;
+        _nodes[index].entities = _end - bounds[4];
+
+        for (int i = 0; i < 4; i++) {
+            node subnode;
+            subnode.key = subnode_key (_node.key, i);
+            subnode.parentKey = _node.key;
+            subnode.rect = rects[i];
+            layout_entities (subnode, _ents, bounds[i], bounds[i + 1], _nodes);
+        }
+
+        _begin = bounds[4];
+    }
+
+    for (size_t n = _begin; n < _end; n++) {
+        _ents[n].key = "entities:" + std::to_string (_ents[n].id);
+        _ents[n].ownerKey = _node.key;
+    }
+}
+
+void quadtree::write_entities (const std::vector<node>& _nodes, const std::vector<entity>& _ents) {
+    size_t pending = 0;
+    std::vector<std::string> args;
+
+    // group the entities by owner so each node's set is written with a few large SADDs
+    // (or its whole bucket with one SET)
+    std::unordered_map<std::string, std::vector<uint32_t> > members;
+    std::unordered_map<std::string, std::string> buckets;
+
+    for (std::vector<entity>::const_iterator it = _ents.begin (); it != _ents.end (); it++) {
+        if (it->ownerKey == "")
+            continue;
+
+        if (entityLayout == LAYOUT_PACKED) {
+            pack_entity (*it, buckets[it->ownerKey]);
+
+            // the index is written bulkSetSize entries at a time
+            if (args.empty () ) {
+                args.push_back ("HMSET");
+                args.push_back ("entities:index");
+            }
+            args.push_back (std::to_string (it->id) );
+            args.push_back (it->ownerKey);
+
+            if (args.size () < 2 + 2 * bulkSetSize)
+                continue;
+
+            append_command (args);
+            args.clear ();
+        }
+        else {
+            coordinate_arg x (coordinates, it->pos.x), y (coordinates, it->pos.y);
+            append ("HMSET %s x %b y %b owner %s", it->key.c_str (), x.data (), x.size (), y.data (), y.size (), it->ownerKey.c_str () );
+            members[it->ownerKey].push_back (it->id);
+        }
+
+        if (++pending >= bulkPipelineSize) {
+            read_replies (pending);
+            pending = 0;
+        }
+    }
+
+    if (!args.empty () ) {
+        append_command (args);
+        pending++;
+    }
+
+    // every node comes after its parent, so going backwards each subtree is summed up before its parent takes it
+    std::vector<uint32_t> totals (_nodes.size (), 0);
+    if (countSubtrees) {
+        std::unordered_map<std::string, size_t> indices;
+        for (size_t n = 0; n < _nodes.size (); n++)
+            indices[_nodes[n].key] = n;
+
+        for (size_t n = _nodes.size (); n > 0; n--) {
+            totals[n - 1] += _nodes[n - 1].entities;
+
+            std::unordered_map<std::string, size_t>::iterator parent = indices.find (parent_key (_nodes[n - 1].key) );
+            if (parent != indices.end () )
+                totals[parent->second] += totals[n - 1];
+        }
+    }
+
+    for (std::vector<node>::const_iterator it = _nodes.begin (); it != _nodes.end (); it++) {
+        const char* nodeKey = it->key.c_str ();
+
+        append ("HMSET %s subdivided %i entities %i", nodeKey, it->subdivided ? 1 : 0, it->entities);
+        coordinate_arg x (coordinates, it->rect.x), y (coordinates, it->rect.y), w (coordinates, it->rect.width), h (coordinates, it->rect.height);
+        append ("HMSET %s:rect x %b y %b w %b h %b", nodeKey, x.data (), x.size (), y.data (), y.size (), w.data (), w.size (), h.data (), h.size () );
+        pending += 2;
+
+        if (countSubtrees) {
+            append ("SET %s:total %u", nodeKey, totals[it - _nodes.begin ()]);
+            pending++;
+        }
+
+        if (entityLayout == LAYOUT_PACKED) {
+            const std::string& bucket = buckets[it->key];
+            if (!bucket.empty () ) {
+                write_bucket (it->key, bucket);
+                pending++;
+            }
+        }
+        else {
+            const std::vector<uint32_t>& ids = members[it->key];
+
+            for (size_t n = 0; n < ids.size (); n += bulkSetSize) {
+                size_t count = std::min (bulkSetSize, ids.size () - n);
+
+                args.clear ();
+                args.push_back ("SADD");
+                args.push_back (it->key + ":entities");
+                for (size_t i = n; i < n + count; i++)
+                    args.push_back (std::to_string (ids[i]) );
+
+                append_command (args);
+                pending++;
+            }
+        }
+
+        if (pending >= bulkPipelineSize) {
+            read_replies (pending);
+            pending = 0;
+        }
+    }
+
+    read_replies (pending);
+}
+
+void quadtree::append_command (const std::vector<std::string>& _args) {
+    queue_argv (_args);
+    RQTREE_COUNT (counters, commands, 1);
+    unsent = true;
+}
+
+void quadtree::append (const char* _format, ...) {
+    va_list args;
+    va_start (args, _format);
+    vqueue (_format, args);
+    va_end (args);
+
+    RQTREE_COUNT (counters, commands, 1);
+    unsent = true;
+}
+
+redisReply* quadtree::command (const char* _format, ...) {
+    va_list args;
+    va_start (args, _format);
+    vqueue (_format, args);
+    va_end (args);
+
+    RQTREE_COUNT (counters, commands, 1);
+    unsent = true;
+    return get_reply ();
+}
+
+redisReply* quadtree::get_reply () {
+    void* reply = NULL;
+    bool waited;
+
+    if (!drop_unread_replies () )
+        return NULL;
+
+    // a reply that's already in the read buffer doesn't cost a round trip, and neither does
+    // waiting on more of a pipeline's replies when nothing new was queued since it was sent
+    if (!next_reply (&reply, waited) )
+        return NULL;
+
+    if (waited) {
+        if (unsent)
+            RQTREE_COUNT (counters, roundTrips, 1);
+        unsent = false;
+    }
+
+    RQTREE_COUNT (counters, replyBytes, reply_bytes ( (redisReply*)reply) );
+    return (redisReply*)reply;
+}
+
+bool quadtree::drop_unread_replies () {
+    void* reply;
+    bool waited;
+
+    for (; unreadReplies > 0; unreadReplies--) {
+        if (!next_reply (&reply, waited) )
+            return false;
+        freeReplyObject (reply);
+    }
+    return true;
+}
+
+void quadtree::queue (const char* _format, ...) {
+    va_list args;
+    va_start (args, _format);
+    vqueue (_format, args);
+    va_end (args);
+}
+
+void quadtree::vqueue (const char* _format, va_list _args) {
+    if (!router && !keySpace.maps () ) {
+        redisvAppendCommand (context, _format, _args);
+        return;
+    }
+
+    va_list copy;
+    va_copy (copy, _args);
+
+    size_t count;
+    bool split = format_args (_format, copy, formatArgs, count);
+    va_end (copy);
+
+    if (split) {
+        formatArgs.resize (count);
+        keySpace.map_args (formatArgs);
+        send_argv (formatArgs);
+        return;
+    }
+
+    // a format format_args doesn't take, the keys are only known once hiredis formatted it, so it's taken apart again
+    char* formatted;
+    int length = redisvFormatCommand (&formatted, _format, _args);
+    if (length < 0)
+        return;
+
+    std::vector<std::string> args;
+    parse_command (formatted, length, args);
+    free (formatted);
+
+    keySpace.map_args (args);
+    send_argv (args);
+}
+
+void quadtree::queue_argv (const std::vector<std::string>& _args) {
+    if (!keySpace.maps () ) {
+        send_argv (_args);
+        return;
+    }
+
+    std::vector<std::string> args (_args);
+    keySpace.map_args (args);
+    send_argv (args);
+}
+
+void quadtree::send_argv (const std::vector<std::string>& _args) {
+    if (router) {
+        router->append (_args);
+        return;
+    }
+
+    sendArgv.clear ();
+    sendArgvLengths.clear ();
+
+    for (size_t i = 0; i < _args.size (); i++) {
+        sendArgv.push_back (_args[i].data () );
+        sendArgvLengths.push_back (_args[i].size () );
+    }
+
+    redisAppendCommandArgv (context, sendArgv.size (), &sendArgv[0], &sendArgvLengths[0]);
+}
+
+bool quadtree::next_reply (void** _reply, bool& _waited) {
+    if (router)
+        return router->get_reply (_reply, _waited) == REDIS_OK;
+
+    _waited = false;
+    *_reply = NULL;
+
+    if (redisGetReplyFromReader (context, _reply) == REDIS_OK && *_reply)
+        return true;
+
+    _waited = true;
+    return redisGetReply (context, _reply) == REDIS_OK;
+}
+
+void quadtree::flush_output () {
+    if (router) {
+        router->flush ();
+        return;
+    }
+
+    int done = 0;
+    while (!done && redisBufferWrite (context, &done) == REDIS_OK);
+}
+
+void quadtree::read_replies (size_t _count) {
+    redisReply* reply;
+
+    for (size_t n = 0; n < _count; n++) {
+        reply = get_reply ();
+        freeReplyObject (reply);
+    }
+}
+
+bool quadtree::watch_node (node& _node) {
+    if (!optimistic)
+        return true;
+
+    // the node is read again after the WATCH, so anything that changes it from here on drops the transaction
+    RQTREE_COUNT (counters, nodesVisited, 1);
+    watching = true;
+    watch (std::vector<std::string> (1, _node.key) );
+
+    node current = _node;
+    append ("HMGET %s subdivided entities", _node.key.c_str () );
+
+    redisReply* reply = get_reply ();
+    bool exists = parse_node (reply, current);
+    freeReplyObject (reply);
+
+    if (exists && current.subdivided == _node.subdivided && current.entities == _node.entities)
+        return true;
+
+    unwatch ();
+    RQTREE_COUNT (counters, conflicts, 1);
+    if (cacheNodes)
+        cache.clear ();
+
+    if (exists) {
+        _node = current;
+    }
+    else {
+        // merged into its parent since, which is where to carry on from (the root is never merged)
+        _node.key = _node.parentKey;
+        _node.parentKey = parent_key (_node.key);
+        read_node (_node, true);
+    }
+    return false;
+}
+
+bool quadtree::watch_owner (const entity& _ent) {
+    if (!optimistic)
+        return true;
+
+    std::string entityKey = "entities:" + std::to_string (_ent.id);
+    bool owned;
+    watching = true;
+
+    if (entityLayout == LAYOUT_PACKED) {
+        watch (std::vector<std::string> (1, _ent.ownerKey + ":bucket") );
+        owned = find_entity (read_bucket (_ent.ownerKey), _ent.id) != std::string::npos;
+    }
+    else {
+        watch (std::vector<std::string> (1, entityKey) );
+        redisReply* reply = command ("HGET %s owner", entityKey.c_str () );
+        owned = reply->type == REDIS_REPLY_STRING && _ent.ownerKey == reply->str;
+        freeReplyObject (reply);
+    }
+
+    if (!owned) {
+        unwatch ();
+        RQTREE_COUNT (counters, conflicts, 1);
+    }
+    return owned;
+}
+
+void quadtree::watch (const std::vector<std::string>& _keys) {
+    if (!watching || _keys.empty () )
+        return;
+
+    // sent along with the read that follows it, and its reply is dropped before that read's
+    std::vector<std::string> args (1, "WATCH");
+    args.insert (args.end (), _keys.begin (), _keys.end () );
+    append_command (args);
+    unreadReplies++;
+}
+
+void quadtree::unwatch () {
+    append ("UNWATCH");
+    unreadReplies++;
+    watching = false;
+}
+
+void quadtree::begin_writes () {
+    if (!watching || inMulti)
+        return;
+
+    append ("MULTI");
+    unreadReplies++;
+    inMulti = true;
+}
+
+bool quadtree::exec () {
+    if (!watching)
+        return true;
+
+    if (!inMulti) {
+        // the step didn't write anything
+        unwatch ();
+        return true;
+    }
+
+    watching = false;
+    inMulti = false;
+
+    // a nil reply means one of the watched keys changed, the writes were dropped
+    redisReply* reply = command ("EXEC");
+    if (!reply)
+        return true;
+
+    bool done = reply->type == REDIS_REPLY_ARRAY;
+    freeReplyObject (reply);
+
+    if (!done) {
+        RQTREE_COUNT (counters, conflicts, 1);
+        // whatever the writes changed in the cache didn't happen
+        if (cacheNodes)
+            cache.clear ();
     }
+    return done;
 }
 
 void quadtree::get_node_entities (const node& _node, std::vector<entity>& _ents) {
     redisReply* reply;
     redisReply* entityReply;
 
-    reply = (redisReply*)redisCommand (context, "SMEMBERS %s:entities", _node.key.c_str () );
+    if (entityLayout == LAYOUT_PACKED) {
+        watch (std::vector<std::string> (1, _node.key + ":bucket") );
+        reply = command ("GET %s:bucket", _node.key.c_str () );
+        parse_bucket (reply, _node.key, _ents);
+        freeReplyObject (reply);
+        return;
+    }
+
+    watch (std::vector<std::string> (1, _node.key + ":entities") );
+    reply = command ("SMEMBERS %s:entities", _node.key.c_str () );
 
     if (reply->type == REDIS_REPLY_ARRAY) {
+        std::vector<std::string> entityKeys;
+        for (unsigned int n = 0; n < reply->elements; n++)
+            entityKeys.push_back (std::string ("entities:").append (reply->element[n]->str, reply->element[n]->len) );
+        watch (entityKeys);
+
+        // read every entity hash in one pipeline
+        for (unsigned int n = 0; n < reply->elements; n++)
+            append ("HMGET entities:%b x y owner", reply->element[n]->str, (size_t)reply->element[n]->len);
+
         for (unsigned int n = 0; n < reply->elements; n++) {
-            entityReply = (redisReply*)redisCommand (context, "HVALS entities:%s", reply->element[n]->str);
-
-            if (entityReply->type == REDIS_REPLY_ARRAY && entityReply->elements == 3) {
-                entity ent;
-                ent.id = std::stoi (reply->element[n]->str);
-                ent.pos = point (std::stoi (entityReply->element[0]->str), std::stoi (entityReply->element[1]->str) );
-                ent.key = "entities:" + std::string (reply->element[n]->str);
-                ent.ownerKey = entityReply->element[2]->str;
+            entityReply = get_reply ();
+
+            entity ent;
+            if (parse_entity (coordinates, reply->element[n]->str, entityReply, ent) )
                 _ents.push_back (ent);
-            }
             freeReplyObject (entityReply);
         }
     }
     freeReplyObject (reply);
 }
 
-void quadtree::get_entities (const node& _node, const rectangle& _rect, std::vector<entity>& _ents) {
-    if (_rect.contains (_node.rect) ) {
-        // the search area completely contains this node, get all entities
-        get_all_entities (_node, _ents);
-    }
-    else if (_rect.intersects (_node.rect) ) {
-        // go through the entities in this node and figure out which ones to add
-        get_node_entities (_node, tempEnts);
+void quadtree::get_entities (std::vector<node>& _nodes, std::vector<bool>& _contained, const region& _region, entity_arena& _arena,
+    std::vector<node>* _visited) {
+    // the search runs one tree level at a time, and each level costs two pipelines:
+    // one for the entity sets of the level and the flags of the subnodes worth visiting,
+    // another for the hashes of every entity in those sets
+    // with LAYOUT_PACKED the buckets already hold the entities, so the second pipeline is empty
+    // the results go into the arena as they're read out of the replies, with an owner per node rather than
+    // two strings per entity
+    std::vector<node> subnodes;
+    std::vector<bool> subnodesContained;
+    std::vector<size_t> readSubnodes;
+    std::vector<size_t> memberNodes;
+    std::vector<uint32_t> members;
+    std::vector<size_t> memberNodeOf;
+    std::vector<uint32_t> owners;
+    // a boundary bucket is split into columns and filtered a vector at a time (see region::filter)
+    point_columns columns;
+    std::vector<uint32_t> keep;
+    redisReply* reply;
+
+    while (!_nodes.empty () ) {
+        RQTREE_COUNT (counters, nodesVisited, _nodes.size () );
+        if (_visited)
+            _visited->insert (_visited->end (), _nodes.begin (), _nodes.end () );
+        subnodes.clear ();
+        subnodesContained.clear ();
+        readSubnodes.clear ();
+        memberNodes.clear ();
+        members.clear ();
+        memberNodeOf.clear ();
+        owners.resize (_nodes.size () );
+
+        for (size_t i = 0; i < _nodes.size (); i++) {
+            const node& currNode = _nodes[i];
+
+            if (currNode.entities > 0) {
+                if (entityLayout == LAYOUT_PACKED)
+                    append ("GET %s:bucket", currNode.key.c_str () );
+                else
+                    append ("SMEMBERS %s:entities", currNode.key.c_str () );
+                memberNodes.push_back (i);
+                owners[i] = _arena.add_owner (currNode.key);
+            }
+
+            if (!currNode.subdivided)
+                continue;
+
+            for (int quad = 0; quad < 4; quad++) {
+                node subnode;
+                subnode.key = subnode_key (currNode.key, quad);
+                subnode.parentKey = currNode.key;
+                subnode.rect = currNode.rect.quadrant (quad);
+
+                // skip subnodes that are outside the search area, a subnode's loose bounds are inside its parent's
+                rectangle bounds = subnode.rect.loosened (looseness);
+                bool contained = _contained[i] || _region.contains (bounds);
+                if (!contained && !_region.intersects (bounds) )
+                    continue;
+
+                if (!cacheNodes || !cache.get (subnode.key, subnode) )
+                    readSubnodes.push_back (subnodes.size () );
+
+                subnodes.push_back (subnode);
+                subnodesContained.push_back (contained);
+            }
+        }
+
+        // replies come back in order, so the subnode flags are queued after all the sets
+        for (size_t n = 0; n < readSubnodes.size (); n++)
+            append ("HMGET %s subdivided entities", subnodes[readSubnodes[n]].key.c_str () );
+
+        // queue up the entity hashes as soon as the sets come back
+        for (size_t n = 0; n < memberNodes.size (); n++) {
+            reply = get_reply ();
+
+            if (entityLayout == LAYOUT_PACKED) {
+                uint32_t owner = owners[memberNodes[n]];
 
-        for (std::vector<entity>::iterator it = tempEnts.begin (); it != tempEnts.end (); it++) {
-            if (_rect.contains ( (*it).pos) ) {
-                _ents.push_back ( (*it) );
+                if (_contained[memberNodes[n]])
+                    parse_bucket (reply, owner, _arena);
+                else if (reply->type == REDIS_REPLY_STRING) {
+                    // only take whatever is inside the search area
+                    columns.clear ();
+                    columns.add_records (reply->str, reply->len);
+                    keep.resize (columns.size () );
+
+                    size_t kept = _region.filter (columns.xs.data (), columns.ys.data (), columns.size (), keep.data () );
+                    for (size_t k = 0; k < kept; k++)
+                        _arena.add (columns.ids[keep[k]], point (columns.xs[keep[k]], columns.ys[keep[k]]), owner);
+                }
+            }
+            else if (reply->type == REDIS_REPLY_ARRAY) {
+                for (size_t e = 0; e < reply->elements; e++) {
+                    append ("HMGET entities:%b x y owner", reply->element[e]->str, (size_t)reply->element[e]->len);
+                    members.push_back (read_uint (reply->element[e]) );
+                    memberNodeOf.push_back (memberNodes[n]);
+                }
             }
+            freeReplyObject (reply);
+        }
+
+        for (size_t n = 0; n < readSubnodes.size (); n++) {
+            node& subnode = subnodes[readSubnodes[n]];
+
+            reply = get_reply ();
+            if (parse_node (reply, subnode) && cacheNodes)
+                cache.put (subnode);
+            freeReplyObject (reply);
         }
-        tempEnts.clear ();
 
-        if (_node.subdivided) {
-            // keep going for all subnodes
-            node tlNode, trNode, blNode, brNode;
-            get_node (_node.key + ":tl", tlNode);
-            get_node (_node.key + ":tr", trNode);
-            get_node (_node.key + ":bl", blNode);
-            get_node (_node.key + ":br", brNode);
+        for (size_t n = 0; n < members.size (); n++) {
+            reply = get_reply ();
 
-            get_entities (tlNode, _rect, _ents);
-            get_entities (trNode, _rect, _ents);
-            get_entities (blNode, _rect, _ents);
-            get_entities (brNode, _rect, _ents);
+            size_t memberNode = memberNodeOf[n];
+            if (parse_entity (coordinates, members[n], reply, owners[memberNode], _arena) ) {
+                if (!_contained[memberNode] && !_region.contains (_arena[_arena.size () - 1].pos) )
+                    _arena.pop_back ();
+            }
+            freeReplyObject (reply);
         }
+
+        _nodes.swap (subnodes);
+        _contained.swap (subnodesContained);
     }
 }
 
 void quadtree::get_all_entities (const node& _node, std::vector<entity>& _ents) {
-    get_node_entities (_node, _ents);
-    
-    if (_node.subdivided) {
-        // keep going for all subnodes
-        node tlNode, trNode, blNode, brNode;
-        get_node (_node.key + ":tl", tlNode);
-        get_node (_node.key + ":tr", trNode);
-        get_node (_node.key + ":bl", blNode);
-        get_node (_node.key + ":br", brNode);
+    std::vector<node> nodes (1, _node);
+    std::vector<bool> contained (1, true);
+    entity_arena arena;
+
+    get_entities (nodes, contained, rectangle_region (_node.rect), arena);
+    arena.get_all (_ents);
+}
+
+size_t quadtree::count_entities (std::vector<node>& _nodes, std::vector<bool>& _contained, const region& _region) {
+    // the same levels as get_entities: one pipeline for the buckets or sets of the level's nodes on the region's edge,
+    // the totals of the subnodes inside it and the flags of the rest, and with LAYOUT_SETS another for the positions
+    // of the entities on the edge, a node inside the region only gets here without countSubtrees and counts as its
+    // counter
+    size_t count = 0;
+    std::vector<node> subnodes;
+    std::vector<bool> subnodesContained;
+    std::vector<size_t> readSubnodes;
+    std::vector<std::string> totalKeys;
+    size_t memberNodes, positions;
+    point_columns columns;
+    std::vector<uint32_t> keep;
+    redisReply* reply;
+
+    while (!_nodes.empty () ) {
+        RQTREE_COUNT (counters, nodesVisited, _nodes.size () );
+        subnodes.clear ();
+        subnodesContained.clear ();
+        readSubnodes.clear ();
+        totalKeys.clear ();
+        memberNodes = 0;
+
+        for (size_t i = 0; i < _nodes.size (); i++) {
+            const node& currNode = _nodes[i];
+
+            if (_contained[i])
+                count += currNode.entities;
+            else if (currNode.entities > 0) {
+                if (entityLayout == LAYOUT_PACKED)
+                    append ("GET %s:bucket", currNode.key.c_str () );
+                else
+                    append ("SMEMBERS %s:entities", currNode.key.c_str () );
+                memberNodes++;
+            }
+
+            if (!currNode.subdivided)
+                continue;
+
+            for (int quad = 0; quad < 4; quad++) {
+                node subnode;
+                subnode.key = subnode_key (currNode.key, quad);
+                subnode.parentKey = currNode.key;
+                subnode.rect = currNode.rect.quadrant (quad);
+
+                rectangle bounds = subnode.rect.loosened (looseness);
+                bool contained = _contained[i] || _region.contains (bounds);
+                if (!contained && !_region.intersects (bounds) )
+                    continue;
+
+                if (contained && countSubtrees) {
+                    totalKeys.push_back (subnode.key);
+                    continue;
+                }
+
+                if (!cacheNodes || !cache.get (subnode.key, subnode) )
+                    readSubnodes.push_back (subnodes.size () );
+
+                subnodes.push_back (subnode);
+                subnodesContained.push_back (contained);
+            }
+        }
 
-        get_all_entities (tlNode, _ents);
-        get_all_entities (trNode, _ents);
-        get_all_entities (blNode, _ents);
-        get_all_entities (brNode, _ents);
+        for (size_t n = 0; n < totalKeys.size (); n++)
+            append ("GET %s:total", totalKeys[n].c_str () );
+        for (size_t n = 0; n < readSubnodes.size (); n++)
+            append ("HMGET %s subdivided entities", subnodes[readSubnodes[n]].key.c_str () );
+
+        positions = 0;
+        for (size_t n = 0; n < memberNodes; n++) {
+            reply = get_reply ();
+
+            if (entityLayout == LAYOUT_PACKED) {
+                if (reply->type == REDIS_REPLY_STRING) {
+                    columns.clear ();
+                    columns.add_records (reply->str, reply->len);
+                    keep.resize (columns.size () );
+                    count += _region.filter (columns.xs.data (), columns.ys.data (), columns.size (), keep.data () );
+                }
+            }
+            else if (reply->type == REDIS_REPLY_ARRAY) {
+                for (size_t e = 0; e < reply->elements; e++)
+                    append ("HMGET entities:%b x y", reply->element[e]->str, (size_t)reply->element[e]->len);
+                positions += reply->elements;
+            }
+            freeReplyObject (reply);
+        }
+
+        RQTREE_COUNT (counters, nodesVisited, totalKeys.size () );
+        for (size_t n = 0; n < totalKeys.size (); n++) {
+            reply = get_reply ();
+            count += read_uint (reply);
+            freeReplyObject (reply);
+        }
+
+        for (size_t n = 0; n < readSubnodes.size (); n++) {
+            node& subnode = subnodes[readSubnodes[n]];
+
+            reply = get_reply ();
+            if (parse_node (reply, subnode) && cacheNodes)
+                cache.put (subnode);
+            freeReplyObject (reply);
+        }
+
+        // a hash that's half written or half deleted by another client doesn't count
+        for (size_t n = 0; n < positions; n++) {
+            reply = get_reply ();
+
+            if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 && reply->element[0]->type == REDIS_REPLY_STRING &&
+                reply->element[1]->type == REDIS_REPLY_STRING) {
+                point pos (read_coordinate (coordinates, reply->element[0]), read_coordinate (coordinates, reply->element[1]) );
+                if (_region.contains (pos) )
+                    count++;
+            }
+            freeReplyObject (reply);
+        }
+
+        _nodes.swap (subnodes);
+        _contained.swap (subnodesContained);
+    }
+
+    return count;
+}
+
+void quadtree::read_tree (std::vector<node>& _nodes, std::vector<entity>& _ents) {
+    std::vector<node> nodes (1);
+    get_node (rootKey, nodes[0]);
+    std::vector<bool> contained (1, true);
+    entity_arena arena;
+
+    get_entities (nodes, contained, rectangle_region (nodes[0].rect), arena, &_nodes);
+    arena.get_all (_ents);
+}
+
+void quadtree::read_nodes (std::vector<node>& _nodes) {
+    _nodes.push_back (node () );
+    get_node (rootKey, _nodes.back () );
+
+    redisReply* reply;
+    std::vector<node> subnodes;
+
+    // _nodes[level, end) is the level being read, its subnodes are read in pipelines of bulkPipelineSize
+    for (size_t level = _nodes.size () - 1; level < _nodes.size ();) {
+        subnodes.clear ();
+        for (size_t n = level; n < _nodes.size (); n++) {
+            if (!_nodes[n].subdivided)
+                continue;
+
+            for (int quad = 0; quad < 4; quad++) {
+                node subnode;
+                subnode.key = subnode_key (_nodes[n].key, quad);
+                subnode.parentKey = _nodes[n].key;
+                subnode.rect = _nodes[n].rect.quadrant (quad);
+                subnodes.push_back (subnode);
+            }
+        }
+
+        RQTREE_COUNT (counters, nodesVisited, subnodes.size () );
+
+        for (size_t begin = 0; begin < subnodes.size (); begin += bulkPipelineSize) {
+            size_t end = std::min (begin + bulkPipelineSize, subnodes.size () );
+
+            for (size_t n = begin; n < end; n++)
+                append ("HMGET %s subdivided entities", subnodes[n].key.c_str () );
+
+            for (size_t n = begin; n < end; n++) {
+                reply = get_reply ();
+                parse_node (reply, subnodes[n]);
+                freeReplyObject (reply);
+            }
+        }
+
+        level = _nodes.size ();
+        _nodes.insert (_nodes.end (), subnodes.begin (), subnodes.end () );
     }
 }
 
-void quadtree::delete_empty_subnodes (const std::string& _nodeKey, bool& empty) {
+void quadtree::find_empty_subnodes (const std::string& _nodeKey, bool& empty, std::vector<std::string>& _emptyKeys) {
     //std::cout << "Checking for empty subnodes for node " << _nodeKey << std::endl;
 
-    const char* nodeKey = _nodeKey.c_str ();
-    const char* quads[4] = {"tl", "tr", "bl", "br"};
+    std::vector<std::string> subnodeKeys (4);
 
     // first check if these subnodes contain any entities
+    for (int i = 0; i < 4; i++)
+        subnodeKeys[i] = subnode_key (_nodeKey, i);
+    watch (subnodeKeys);
+
     for (int i = 0; i < 4; i++) {
-        //std::cout << "HGET " << nodeKey << ":" << quads[i] << " entities" << std::endl;
-        redisAppendCommand (context, "HGET %s:%s entities", nodeKey, quads[i]);
+        //std::cout << "HGET " << subnodeKeys[i] << " entities" << std::endl;
+        append ("HGET %s entities", subnodeKeys[i].c_str () );
     }
 
     redisReply* reply;
     for (int n = 0; n < 4; n++) {
-        redisGetReply (context, (void**)&reply);
+        reply = get_reply ();
 
         if (reply->type == REDIS_REPLY_STRING && strncmp (reply->str, "0", 1) != 0) {
             empty = false;
-            //std::cout << "Node " << nodeKey << ":" << quads[n] << " is not empty" << std::endl;
+            //std::cout << "Node " << subnodeKeys[n] << " is not empty" << std::endl;
         }
         freeReplyObject (reply);
     }
@@ -556,50 +3158,509 @@ void quadtree::delete_empty_subnodes (const std::string& _nodeKey, bool& empty)
     if (empty) {
         // continue on to the subnodes if there are any
         for (int i = 0; i < 4; i++) {
-            redisAppendCommand (context, "HGET %s:%s subdivided", nodeKey, quads[i]);
+            append ("HGET %s subdivided", subnodeKeys[i].c_str () );
         }
 
+        // read every reply before recursing, the recursion issues its own commands on this context
+        bool subdivided[4];
         for (int i = 0; i < 4; i++) {
-            redisGetReply (context, (void**)&reply);
+            reply = get_reply ();
+            subdivided[i] = reply->type == REDIS_REPLY_STRING && strncmp (reply->str, "1", 1) == 0;
+            freeReplyObject (reply);
+        }
 
+        for (int i = 0; i < 4; i++) {
             // only recurse into subnodes if they are subdivided
-            if (reply->type == REDIS_REPLY_STRING && strncmp (reply->str, "1", 1) == 0) {
-                std::string key = _nodeKey + ":";
-                key += quads[i];
-                delete_empty_subnodes (key, empty);
-            }
-            freeReplyObject (reply);
+            if (subdivided[i])
+                find_empty_subnodes (subnodeKeys[i], empty, _emptyKeys);
         }
     }
 
-    // delete only this node's subnodes (everything below has been deleted or never existed)
+    // only this node's subnodes go (everything below goes first or never existed)
     if (empty)
-        delete_subnodes (_nodeKey);
+        _emptyKeys.push_back (_nodeKey);
 }
 
 void quadtree::delete_subnodes (const std::string& _nodeKey) {
     //std::cout << "Deleting subnodes for node " << _nodeKey << std::endl;
 
     const char* nodeKey = _nodeKey.c_str ();
-    const char* quads[4] = {"tl", "tr", "bl", "br"};
+    std::string subnodeKeys[4];
+    begin_writes ();
  
     // delete the hashes for each node
     for (int i = 0; i < 4; i++) {
-        redisAppendCommand (context, "HDEL %s:%s subdivided", nodeKey, quads[i]);
-        redisAppendCommand (context, "HDEL %s:%s entities", nodeKey, quads[i]);
+        subnodeKeys[i] = subnode_key (_nodeKey, i);
+        const char* subnodeKey = subnodeKeys[i].c_str ();
+
+        append ("HDEL %s subdivided", subnodeKey);
+        append ("HDEL %s entities", subnodeKey);
 
-        redisAppendCommand (context, "HDEL %s:%s:rect x", nodeKey, quads[i]);
-        redisAppendCommand (context, "HDEL %s:%s:rect y", nodeKey, quads[i]);
-        redisAppendCommand (context, "HDEL %s:%s:rect w", nodeKey, quads[i]);
-        redisAppendCommand (context, "HDEL %s:%s:rect h", nodeKey, quads[i]);
+        append ("HDEL %s:rect x", subnodeKey);
+        append ("HDEL %s:rect y", subnodeKey);
+        append ("HDEL %s:rect w", subnodeKey);
+        append ("HDEL %s:rect h", subnodeKey);
+
+        // an empty subtree's total is 0, it only has to go
+        append ("DEL %s:total", subnodeKey);
     }
 
     // reset this node to an unsubdivided state
-    redisAppendCommand (context, "HSET %s subdivided 0", nodeKey);
+    append ("HSET %s subdivided 0", nodeKey);
+
+    redisReply* reply;
+    for (int n = 0; n < 29; n++) {
+        reply = get_reply ();
+        freeReplyObject (reply);
+    }
+
+    if (cacheNodes) {
+        for (int i = 0; i < 4; i++)
+            cache.erase (subnodeKeys[i]);
+        cache.set_subdivided (_nodeKey, false);
+    }
+    node_changed (_nodeKey);
+}
 
+bool quadtree::load_scripts () {
     redisReply* reply;
-    for (int n = 0; n < 25; n++) {
-        redisGetReply (context, (void**)&reply);
+
+    for (int i = 0; i < SCRIPT_COUNT; i++) {
+        std::string source = script_source ( (script_id)i);
+        reply = command ("SCRIPT LOAD %b", source.data (), source.size () );
+
+        if (!reply || reply->type != REDIS_REPLY_STRING) {
+            // no scripting support on this server
+            if (reply)
+                freeReplyObject (reply);
+            return false;
+        }
+
+        scriptShas[i] = reply->str;
+        freeReplyObject (reply);
+    }
+
+    return true;
+}
+
+quadtree::script_result quadtree::run_script (script_id _script, const entity& _ent, std::string& _ownerKey) {
+    append_script (_script, _ent);
+    redisReply* reply = get_reply ();
+
+    if (is_noscript (reply) ) {
+        // the server's script cache was flushed, load them again and retry
+        freeReplyObject (reply);
+
+        if (!load_scripts () ) {
+            useScripts = false;
+            return SCRIPT_NOT_RUN;
+        }
+
+        append_script (_script, _ent);
+        reply = get_reply ();
+    }
+
+    if (!reply)
+        return SCRIPT_NOT_RUN;
+
+    if (reply->type == REDIS_REPLY_ERROR) {
+        script_failed (reply);
+        return SCRIPT_FAILED;
+    }
+
+    std::vector<std::string> dirtyKeys;
+    read_script_reply (reply, _ownerKey, dirtyKeys);
+    return SCRIPT_DONE;
+}
+
+void quadtree::script_failed (redisReply* _reply) {
+    scriptError.assign (_reply->str, _reply->len);
+    freeReplyObject (_reply);
+
+    // the script may have got part way, nothing cached can be trusted
+    if (cacheNodes)
+        cache.clear ();
+}
+
+void quadtree::append_script (script_id _script, const entity& _ent) {
+    std::vector<std::string> args = {
+        "EVALSHA", scriptShas[_script], "0",
+        std::to_string (maxEntitiesPerNode), std::to_string (minNodeSize), std::to_string (keyScheme), std::to_string (entityLayout),
+        std::to_string (minDepth), looseness_arg (looseness), keySpace.prefix (), std::to_string (coordinates), countSubtrees ? "1" : "0",
+        std::to_string (mergeEntities),
+        std::to_string (_ent.id),
+        std::to_string (_ent.pos.x), std::to_string (_ent.pos.y)
+    };
+
+    append_command (args);
+}
+
+bool quadtree::is_noscript (const redisReply* _reply) const {
+    return _reply && _reply->type == REDIS_REPLY_ERROR && strncmp (_reply->str, "NOSCRIPT", 8) == 0;
+}
+
+void quadtree::read_script_reply (redisReply* _reply, std::string& _ownerKey, std::vector<std::string>& _dirtyKeys) {
+    if (_reply->type == REDIS_REPLY_ARRAY && _reply->elements > 0) {
+        _ownerKey = _reply->element[0]->str;
+
+        // forget the nodes the script changed
+        for (size_t n = 1; n < _reply->elements; n++) {
+            _dirtyKeys.push_back (_reply->element[n]->str);
+            if (cacheNodes)
+                uncache_subtree (_dirtyKeys.back () );
+            node_changed (_dirtyKeys.back () );
+        }
+    }
+    else if (cacheNodes) {
+        // the script failed part way, nothing cached can be trusted
+        cache.clear ();
+    }
+
+    freeReplyObject (_reply);
+}
+
+void quadtree::refresh_owners (std::vector<entity>& _ents, const std::unordered_set<std::string>& _nodeKeys) {
+    if (_nodeKeys.empty () )
+        return;
+
+    entity current;
+
+    for (std::vector<entity>::iterator it = _ents.begin (); it != _ents.end (); it++) {
+        std::string nodeKey = it->ownerKey;
+        while (nodeKey != "" && _nodeKeys.count (nodeKey) == 0)
+            nodeKey = parent_key (nodeKey);
+
+        if (nodeKey == "")
+            continue;
+
+        get_entity (it->id, current);
+        if (current.ownerKey != "")
+            it->ownerKey = current.ownerKey;
+    }
+}
+
+void quadtree::uncache_subtree (const std::string& _nodeKey) {
+    node cachedNode;
+    if (!cache.get (_nodeKey, cachedNode) )
+        return;
+
+    cache.erase (_nodeKey);
+
+    for (int i = 0; i < 4; i++)
+        uncache_subtree (subnode_key (_nodeKey, i) );
+}
+
+void quadtree::node_changed (const std::string& _nodeKey) {
+    if (!changeChannel.empty () )
+        changedKeys.insert (_nodeKey);
+}
+
+void quadtree::publish_changes () {
+    if (changedKeys.empty () )
+        return;
+
+    // the keys one per line after the sender's id, no key contains a newline
+    std::string message = sourceId;
+    for (std::unordered_set<std::string>::iterator it = changedKeys.begin (); it != changedKeys.end (); it++) {
+        message += '\n';
+        message += *it;
+    }
+    changedKeys.clear ();
+
+    append ("PUBLISH %b %b", changeChannel.data (), changeChannel.size (), message.data (), message.size () );
+    unreadReplies++;
+
+    // send it now instead of with the next operation, a writer that goes quiet would hold its last changes back
+    flush_output ();
+    unsent = false;
+}
+
+void quadtree::apply_changes () {
+    if (!changesWaiting)
+        return;
+
+    std::vector<std::string> keys;
+    bool lost;
+    {
+        std::lock_guard<std::mutex> lock (incomingMutex);
+        keys.swap (incomingKeys);
+        lost = listenerLost;
+        changesWaiting = false;
+    }
+
+    if (lost) {
+        // nothing says what the others change anymore
+        cache.clear ();
+        cacheNodes = false;
+        return;
+    }
+
+    for (std::vector<std::string>::iterator it = keys.begin (); it != keys.end (); it++)
+        forget_node (*it);
+}
+
+void quadtree::forget_node (const std::string& _nodeKey) {
+    // a split or merge changes the node and its subnodes, the ones below that were merged away
+    // first and published on their own
+    uncache_subtree (_nodeKey);
+    for (int i = 0; i < 4; i++)
+        cache.erase (subnode_key (_nodeKey, i) );
+}
+
+bool quadtree::listen_for_changes (redisContext* _subscriber) {
+    if (!cacheNodes || changeChannel.empty () || subscriber)
+        return false;
+
+    redisReply* reply = (redisReply*)redisCommand (_subscriber, "SUBSCRIBE %b", changeChannel.data (), changeChannel.size () );
+    bool subscribed = reply && reply->type == REDIS_REPLY_ARRAY;
+    if (reply)
+        freeReplyObject (reply);
+    if (!subscribed)
+        return false;
+
+    // whatever was cached until now may have missed changes
+    cache.clear ();
+
+    subscriber = _subscriber;
+    listener = std::thread (&quadtree::run_listener, this);
+    return true;
+}
+
+void quadtree::run_listener () {
+    std::vector<std::string> keys;
+
+    while (!listenerStopping) {
+        void* reply = NULL;
+        if (redisGetReplyFromReader (subscriber, &reply) != REDIS_OK)
+            break;
+
+        if (!reply) {
+            // wait for more with a timeout, so stopping is noticed
+            pollfd ready;
+            ready.fd = subscriber->fd;
+            ready.events = POLLIN;
+
+            int events = poll (&ready, 1, listenerPollInterval);
+            if ( (events < 0 && errno != EINTR) || (events > 0 && redisBufferRead (subscriber) != REDIS_OK) )
+                break;
+            continue;
+        }
+
+        // a message is {"message", channel, payload}
+        redisReply* message = (redisReply*)reply;
+        keys.clear ();
+
+        if (message->type == REDIS_REPLY_ARRAY && message->elements == 3 && message->element[2]->type == REDIS_REPLY_STRING) {
+            std::string payload (message->element[2]->str, message->element[2]->len);
+            size_t begin = payload.find ('\n');
+
+            if (payload.compare (0, begin, sourceId) != 0) {
+                while (begin != std::string::npos) {
+                    size_t end = payload.find ('\n', begin + 1);
+                    keys.push_back (payload.substr (begin + 1, end == std::string::npos ? end : end - begin - 1) );
+                    begin = end;
+                }
+            }
+        }
         freeReplyObject (reply);
+
+        if (keys.empty () )
+            continue;
+
+        std::lock_guard<std::mutex> lock (incomingMutex);
+        incomingKeys.insert (incomingKeys.end (), keys.begin (), keys.end () );
+        changesWaiting = true;
+    }
+
+    if (listenerStopping)
+        return;
+
+    std::lock_guard<std::mutex> lock (incomingMutex);
+    listenerLost = true;
+    changesWaiting = true;
+}
+
+void quadtree::wake_flusher (size_t _changedBefore) {
+    // only when there's something new to wait on, the flusher sleeps through every change in between
+    size_t changed = local->changed ();
+    if ( (_changedBefore == 0 && changed > 0) || (_changedBefore < flushThreshold && changed >= flushThreshold) )
+        flushWake.notify_one ();
+}
+
+void quadtree::run_flusher () {
+    std::unique_lock<std::mutex> lock (localMutex);
+
+    for (;;) {
+        // the first change starts the clock, then give the rest of the window a chance to coalesce
+        flushWake.wait (lock, [this] { return stopping || local->changed () > 0; });
+        flushWake.wait_for (lock, flushInterval, [this] { return stopping || local->changed () >= flushThreshold; });
+
+        // once stopping, the owner is in the destructor and nothing changes after this last write
+        bool last = stopping;
+
+        lock.unlock ();
+        bool written = write_changes ();
+        lock.lock ();
+
+        if (last)
+            break;
+
+        // what failed is back in local, give redis an interval before trying it again
+        if (!written)
+            flushWake.wait_for (lock, flushInterval, [this] { return stopping; });
+    }
+}
+
+bool quadtree::write_changes () {
+    // the flusher doesn't go through append and get_reply, the counters belong to the caller's thread
+    // on a cluster the writes span every master and can't be one transaction
+    std::lock_guard<std::mutex> writeLock (writeMutex);
+
+    // with the connection gone the changes stay with local, there's nothing to write them on
+    if (writeFailed)
+        return false;
+
+    tree_changes changes;
+    {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->take_changes (changes);
+    }
+
+    if (changes.nodes.empty () && changes.removedNodes.empty () && changes.entities.empty () && changes.removedEntities.empty () &&
+        changes.totals.empty () )
+        return true;
+
+    // one transaction, so other clients never see a node's entities half written, sent a bounded pipeline at a time
+    // every reply is read even after an error so the connection stays in step, only a lost connection stops the reads
+    size_t pending = 0;
+    bool failed = false;
+    auto drain = [this, &pending, &failed] () {
+        void* reply;
+        bool waited;
+        for (; pending > 0 && !writeFailed; pending--) {
+            if (!next_reply (&reply, waited) ) {
+                writeFailed = true;
+                return;
+            }
+
+            // a command rejected while queueing aborts the transaction and without one any error is a write that
+            // didn't happen, EXEC's reply is nil for an aborted transaction and holds an error for each command
+            // that failed in it
+            redisReply* r = (redisReply*)reply;
+            if (r->type == REDIS_REPLY_ERROR || (!router && r->type == REDIS_REPLY_NIL) )
+                failed = true;
+            else if (r->type == REDIS_REPLY_ARRAY) {
+                for (size_t n = 0; n < r->elements; n++)
+                    if (r->element[n]->type == REDIS_REPLY_ERROR)
+                        failed = true;
+            }
+            freeReplyObject (reply);
+        }
+    };
+    auto sent = [&pending, &drain] () {
+        if (++pending >= bulkPipelineSize)
+            drain ();
+    };
+
+    const char* members = entityLayout == LAYOUT_PACKED ? "bucket" : "entities";
+
+    if (!router) {
+        queue ("MULTI");
+        sent ();
+    }
+
+    // a node merged away and laid out again in the same window is deleted first and then written
+    for (std::vector<std::string>::iterator it = changes.removedNodes.begin (); it != changes.removedNodes.end (); it++) {
+        queue ("DEL %s %s:rect %s:%s %s:total", it->c_str (), it->c_str (), it->c_str (), members, it->c_str () );
+        sent ();
+    }
+
+    std::vector<std::string> args;
+    for (size_t n = 0; n < changes.nodes.size (); n++) {
+        const node& changed = changes.nodes[n];
+        const std::string& bucket = changes.buckets[n];
+        const char* nodeKey = changed.key.c_str ();
+
+        queue ("HMSET %s subdivided %i entities %u", nodeKey, changed.subdivided ? 1 : 0, changed.entities);
+        sent ();
+        coordinate_arg x (coordinates, changed.rect.x), y (coordinates, changed.rect.y), w (coordinates, changed.rect.width),
+            h (coordinates, changed.rect.height);
+        queue ("HMSET %s:rect x %b y %b w %b h %b", nodeKey, x.data (), x.size (), y.data (), y.size (), w.data (), w.size (), h.data (), h.size () );
+        sent ();
+
+        if (entityLayout == LAYOUT_PACKED) {
+            if (bucket.empty () )
+                queue ("DEL %s:bucket", nodeKey);
+            else
+                queue ("SET %s:bucket %b", nodeKey, bucket.data (), bucket.size () );
+            sent ();
+            continue;
+        }
+
+        queue ("DEL %s:entities", nodeKey);
+        sent ();
+
+        if (bucket.empty () )
+            continue;
+
+        args.clear ();
+        args.push_back ("SADD");
+        args.push_back (changed.key + ":entities");
+
+        uint32_t id;
+        for (size_t offset = 0; offset < bucket.size (); offset += entityRecordSize) {
+            memcpy (&id, bucket.data () + offset, sizeof (uint32_t) );
+            args.push_back (std::to_string (id) );
+        }
+
+        queue_argv (args);
+        sent ();
+    }
+
+    for (std::vector<entity>::iterator it = changes.entities.begin (); it != changes.entities.end (); it++) {
+        if (entityLayout == LAYOUT_PACKED)
+            queue ("HSET entities:index %u %s", it->id, it->ownerKey.c_str () );
+        else {
+            coordinate_arg x (coordinates, it->pos.x), y (coordinates, it->pos.y);
+            queue ("HMSET %s x %b y %b owner %s", it->key.c_str (), x.data (), x.size (), y.data (), y.size (), it->ownerKey.c_str () );
+        }
+        sent ();
+    }
+
+    for (std::vector<uint32_t>::iterator it = changes.removedEntities.begin (); it != changes.removedEntities.end (); it++) {
+        if (entityLayout == LAYOUT_PACKED)
+            queue ("HDEL entities:index %u", *it);
+        else
+            queue ("DEL entities:%u", *it);
+        sent ();
+    }
+
+    for (std::vector<std::pair<std::string, uint32_t> >::iterator it = changes.totals.begin (); it != changes.totals.end (); it++) {
+        queue ("SET %s:total %u", it->first.c_str (), it->second);
+        sent ();
+    }
+
+    if (!router) {
+        queue ("EXEC");
+        pending++;
     }
+
+    drain ();
+
+    // redis turned the writes down (e.g. OOM or READONLY) on a connection that still works, they go back
+    // to local and the next write tries them again with whatever changed since
+    if (failed && !writeFailed) {
+        std::lock_guard<std::mutex> lock (localMutex);
+        local->return_changes (changes);
+    }
+
+    return !failed && !writeFailed;
+}
+
+std::string quadtree::subnode_key (const std::string& _nodeKey, int _quad) const {
+    return ::subnode_key (keyScheme, _nodeKey, _quad);
+}
+
+std::string quadtree::parent_key (const std::string& _nodeKey) const {
+    return ::parent_key (keyScheme, _nodeKey);
 }
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <region.hpp>
+#include <point_filter.hpp>
+
+// which side of the edge from _a to _b the point _p is on, 0 if it's on the line
+static int64_t cross (const point& _a, const point& _b, const point& _p) {
+    return ( (int64_t)_b.x - _a.x) * ( (int64_t)_p.y - _a.y) - ( (int64_t)_b.y - _a.y) * ( (int64_t)_p.x - _a.x);
+}
+
+static void corners (const rectangle& _rect, point _corners[4]) {
+    _corners[0] = point (_rect.x, _rect.y);
+    _corners[1] = point (_rect.x2, _rect.y);
+    _corners[2] = point (_rect.x2, _rect.y2);
+    _corners[3] = point (_rect.x, _rect.y2);
+}
+
+size_t region::filter (const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep) const {
+    size_t kept = 0;
+
+    for (size_t n = 0; n < _count; n++) {
+        if (contains (point (_xs[n], _ys[n]) ) )
+            _keep[kept++] = n;
+    }
+
+    return kept;
+}
+
+rectangle_region::rectangle_region (const rectangle& _rect)
+    : rect (_rect) {
+}
+
+bool rectangle_region::contains (const point& _point) const {
+    return rect.contains (_point);
+}
+
+bool rectangle_region::contains (const rectangle& _rect) const {
+    return rect.contains (_rect);
+}
+
+bool rectangle_region::intersects (const rectangle& _rect) const {
+    return rect.intersects (_rect);
+}
+
+size_t rectangle_region::filter (const uint32_t* _xs, const uint32_t* _ys, size_t _count, uint32_t* _keep) const {
+    return filter_inside (rect, _xs, _ys, _count, _keep);
+}
+
+circle::circle (const point& _center, uint32_t _radius)
+    : center (_center), squaredRadius ( (uint64_t)_radius * _radius) {
+}
+
+bool circle::contains (const point& _point) const {
+    return squared_distance (center, _point) <= squaredRadius;
+}
+
+bool circle::contains (const rectangle& _rect) const {
+    // a rect is inside once its farthest corner is
+    point points[4];
+    corners (_rect, points);
+
+    for (int i = 0; i < 4; i++) {
+        if (squared_distance (center, points[i]) > squaredRadius)
+            return false;
+    }
+    return true;
+}
+
+bool circle::intersects (const rectangle& _rect) const {
+    return _rect.squared_distance (center) <= squaredRadius;
+}
+
+polygon::polygon (const std::vector<point>& _vertices)
+    : vertices (_vertices), winding (0) {
+    uint32_t minX = UINT32_MAX, minY = UINT32_MAX, maxX = 0, maxY = 0;
+
+    for (size_t n = 0; n < vertices.size (); n++) {
+        minX = std::min (minX, vertices[n].x);
+        minY = std::min (minY, vertices[n].y);
+        maxX = std::max (maxX, vertices[n].x);
+        maxY = std::max (maxY, vertices[n].y);
+    }
+
+    if (!vertices.empty () )
+        bounds = rectangle (minX, minY, maxX - minX, maxY - minY);
+
+    // the first turn that isn't straight tells which way around the vertices go
+    for (size_t n = 2; n < vertices.size (); n++) {
+        int64_t turn = cross (vertices[0], vertices[1], vertices[n]);
+        if (turn != 0) {
+            winding = turn > 0 ? 1 : -1;
+            break;
+        }
+    }
+}
+
+bool polygon::contains (const point& _point) const {
+    if (winding == 0)
+        return false;
+
+    for (size_t n = 0; n < vertices.size (); n++) {
+        const point& next = vertices[(n + 1) % vertices.size ()];
+        if (cross (vertices[n], next, _point) * winding < 0)
+            return false;
+    }
+    return true;
+}
+
+bool polygon::contains (const rectangle& _rect) const {
+    // convex, so a rect is inside once all of its corners are
+    point points[4];
+    corners (_rect, points);
+
+    for (int i = 0; i < 4; i++) {
+        if (!contains (points[i]) )
+            return false;
+    }
+    return true;
+}
+
+bool polygon::intersects (const rectangle& _rect) const {
+    if (winding == 0)
+        return false;
+
+    // separating axes: the rect's own axes are covered by the bounding box
+    if (!bounds.intersects (_rect) )
+        return false;
+
+    // then every polygon edge, the rect is apart if all its corners are outside the same edge
+    point points[4];
+    corners (_rect, points);
+
+    for (size_t n = 0; n < vertices.size (); n++) {
+        const point& next = vertices[(n + 1) % vertices.size ()];
+        int outside = 0;
+
+        for (int i = 0; i < 4; i++) {
+            if (cross (vertices[n], next, points[i]) * winding < 0)
+                outside++;
+        }
+
+        if (outside == 4)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,622 @@
+#include <cstdio>
+#include <scripts.hpp>
+
+// helpers shared by every script, these mirror the client side versions in quadtree.cpp
+static const char* prelude = R"lua(
+local maxEntities = tonumber (ARGV[1])
+local minSize = tonumber (ARGV[2])
+local mortonKeys = ARGV[3] == '1'
+local packed = ARGV[4] == '1'
+local minDepth = tonumber (ARGV[5])
+local looseness = tonumber (ARGV[6])
+local prefix = ARGV[7]
+local binaryCoords = ARGV[8] == '1'
+local countSubtrees = ARGV[9] == '1'
+local mergeEntities = tonumber (ARGV[10])
+local quads = {'tl', 'tr', 'bl', 'br'}
+local dirty = {}
+local dirtyKeys = {}
+
+-- every key a script touches goes through here, with the tree's key prefix in front (see key_space)
+local function call (command, key, ...)
+    return redis.call (command, prefix .. key, ...)
+end
+
+local function mark_dirty (key)
+    if not dirty[key] then
+        dirty[key] = true
+        table.insert (dirtyKeys, key)
+    end
+end
+
+local function reply (ownerKey)
+    local result = {ownerKey or ''}
+    for _, key in ipairs (dirtyKeys) do
+        table.insert (result, key)
+    end
+    return result
+end
+
+-- LAYOUT_PACKED records are the id, x and y as little endian 32 bit integers, same as the client's bytes
+local recordSize = 12
+
+local function pack_u32 (n)
+    return string.char (n % 256, math.floor (n / 256) % 256, math.floor (n / 65536) % 256, math.floor (n / 16777216) % 256)
+end
+
+local function unpack_u32 (s, i)
+    local a, b, c, d = string.byte (s, i, i + 3)
+    return a + b * 256 + c * 65536 + d * 16777216
+end
+
+-- a coordinate as the hashes hold it, see coordinate_encoding
+local function encode (n)
+    if binaryCoords then
+        return pack_u32 (n)
+    end
+    return n
+end
+
+local function decode (value)
+    if binaryCoords then
+        return value and unpack_u32 (value, 1)
+    end
+    return tonumber (value)
+end
+
+local function get_node (key)
+    local values = call ('HMGET', key, 'subdivided', 'entities')
+    return {subdivided = values[1] == '1', entities = tonumber (values[2]) or 0}
+end
+
+local function get_rect (key)
+    local values = call ('HMGET', key .. ':rect', 'x', 'y', 'w', 'h')
+    return {x = decode (values[1]), y = decode (values[2]), w = decode (values[3]), h = decode (values[4])}
+end
+
+-- same layout as rectangle::quadrant
+local function quadrant (rect, quad)
+    local w = math.floor (rect.w / 2)
+    local h = math.floor (rect.h / 2)
+    local x = rect.x
+    local y = rect.y
+
+    if quad == 2 or quad == 4 then
+        x = x + w
+    end
+    if quad == 3 or quad == 4 then
+        y = y + h
+    end
+
+    return {x = x, y = y, w = w, h = h}
+end
+
+local function contains (rect, x, y)
+    return x > rect.x and y > rect.y and x < rect.x + rect.w and y < rect.y + rect.h
+end
+
+-- same as rectangle::loosened
+local function loosened (rect)
+    local marginX = math.floor (rect.w * (looseness - 1) / 2)
+    local marginY = math.floor (rect.h * (looseness - 1) / 2)
+    local left = math.min (marginX, rect.x)
+    local top = math.min (marginY, rect.y)
+
+    return {x = rect.x - left, y = rect.y - top, w = rect.w + left + marginX, h = rect.h + top + marginY}
+end
+
+-- same encoding as morton_key: the code's base 128 digits, most significant first, each with the top bit set
+-- a lua number only holds 53 bits of a code exactly (26 levels), so below the root the keys are worked on a
+-- digit at a time and never turned into a number
+local function morton_key (code)
+    local bytes = {}
+    repeat
+        table.insert (bytes, 1, string.char (128 + code % 128) )
+        code = math.floor (code / 128)
+    until code == 0
+    return table.concat (bytes)
+end
+
+local rootKey = 'root'
+if mortonKeys then
+    rootKey = morton_key (1)
+end
+
+local function subnode_key (key, quad)
+    if not mortonKeys then
+        return key .. ':' .. quads[quad]
+    end
+
+    -- code * 4 + quad - 1
+    local bytes = {}
+    local carry = quad - 1
+    for n = #key, 1, -1 do
+        local value = (string.byte (key, n) - 128) * 4 + carry
+        bytes[n] = string.char (128 + value % 128)
+        carry = math.floor (value / 128)
+    end
+    if carry > 0 then
+        table.insert (bytes, 1, string.char (128 + carry) )
+    end
+    return table.concat (bytes)
+end
+
+local function node_depth (key)
+    if not mortonKeys then
+        local depth = 0
+        for _ in string.gmatch (key, ':') do
+            depth = depth + 1
+        end
+        return depth
+    end
+
+    -- two bits per level below the leading 1
+    local bits = 7 * (#key - 1)
+    local first = string.byte (key, 1) - 128
+    while first > 0 do
+        bits = bits + 1
+        first = math.floor (first / 2)
+    end
+    return math.floor ( (bits - 1) / 2)
+end
+
+local function parent_key (key)
+    if key == rootKey then
+        return nil
+    end
+    if not mortonKeys then
+        return string.sub (key, 1, -4)
+    end
+
+    -- floor (code / 4), without the leading zero digits
+    local bytes = {}
+    local rest = 0
+    for n = 1, #key do
+        local value = rest * 128 + string.byte (key, n) - 128
+        local digit = math.floor (value / 4)
+        rest = value % 4
+        if digit > 0 or #bytes > 0 then
+            table.insert (bytes, string.char (128 + digit) )
+        end
+    end
+    return table.concat (bytes)
+end
+
+-- the subnode an entity belongs in, nil if it has to stay in this node
+local function destination (rect, x, y)
+    for quad = 1, 4 do
+        if contains (quadrant (rect, quad), x, y) then
+            return quad
+        end
+    end
+    return nil
+end
+
+local function get_bucket (key)
+    return call ('GET', key .. ':bucket') or ''
+end
+
+local function set_bucket (key, bucket)
+    if bucket == '' then
+        call ('DEL', key .. ':bucket')
+    else
+        call ('SET', key .. ':bucket', bucket)
+    end
+end
+
+-- offset of the entity's record in a bucket (1 based), nil if it isn't there
+local function find_record (bucket, id)
+    local tag = pack_u32 (tonumber (id) )
+    for offset = 1, #bucket, recordSize do
+        if string.sub (bucket, offset, offset + 3) == tag then
+            return offset
+        end
+    end
+    return nil
+end
+
+-- remove the entity's record from a node's bucket
+local function take_record (key, id)
+    local bucket = get_bucket (key)
+    local offset = find_record (bucket, id)
+    if offset then
+        set_bucket (key, string.sub (bucket, 1, offset - 1) .. string.sub (bucket, offset + recordSize) )
+    end
+end
+
+local function get_owner (id)
+    if packed then
+        return call ('HGET', 'entities:index', id)
+    end
+    return call ('HGET', 'entities:' .. id, 'owner')
+end
+
+-- every entity in a node as {id, x, y}
+local function get_entities (key)
+    local ents = {}
+
+    if packed then
+        local bucket = get_bucket (key)
+        for offset = 1, #bucket - recordSize + 1, recordSize do
+            table.insert (ents, {tostring (unpack_u32 (bucket, offset) ), unpack_u32 (bucket, offset + 4), unpack_u32 (bucket, offset + 8)})
+        end
+        return ents
+    end
+
+    for _, id in ipairs (call ('SMEMBERS', key .. ':entities') ) do
+        local pos = call ('HMGET', 'entities:' .. id, 'x', 'y')
+        table.insert (ents, {id, decode (pos[1]), decode (pos[2])})
+    end
+    return ents
+end
+
+local function set_position (key, id, x, y)
+    if packed then
+        local offset = find_record (get_bucket (key), id)
+        if offset then
+            call ('SETRANGE', key .. ':bucket', offset + 3, pack_u32 (x) .. pack_u32 (y) )
+        end
+    else
+        call ('HMSET', 'entities:' .. id, 'x', encode (x), 'y', encode (y) )
+    end
+end
+
+-- an entity left srcKey's subtree for destKey's (either nil for an add or a remove), the totals change
+-- below where the two paths meet
+local function move_totals (srcKey, destKey)
+    if not countSubtrees then
+        return
+    end
+
+    local onDestPath = {}
+    local key = destKey
+    while key do
+        onDestPath[key] = true
+        key = parent_key (key)
+    end
+
+    key = srcKey
+    while key and not onDestPath[key] do
+        call ('INCRBY', key .. ':total', -1)
+        key = parent_key (key)
+    end
+
+    local meet = key
+    key = destKey
+    while key and key ~= meet do
+        call ('INCRBY', key .. ':total', 1)
+        key = parent_key (key)
+    end
+end
+
+local function add_entity (key, id, x, y)
+    call ('HINCRBY', key, 'entities', 1)
+    move_totals (nil, key)
+    if packed then
+        call ('APPEND', key .. ':bucket', pack_u32 (tonumber (id) ) .. pack_u32 (x) .. pack_u32 (y) )
+        call ('HSET', 'entities:index', id, key)
+    else
+        call ('SADD', key .. ':entities', id)
+        call ('HMSET', 'entities:' .. id, 'x', encode (x), 'y', encode (y), 'owner', key)
+    end
+    mark_dirty (key)
+end
+
+local function delete_entity (key, id)
+    call ('HINCRBY', key, 'entities', -1)
+    move_totals (key, nil)
+    if packed then
+        take_record (key, id)
+        call ('HDEL', 'entities:index', id)
+    else
+        call ('SREM', key .. ':entities', id)
+        call ('DEL', 'entities:' .. id)
+    end
+    mark_dirty (key)
+end
+
+local function move_entity (id, srcKey, destKey)
+    call ('HINCRBY', srcKey, 'entities', -1)
+    call ('HINCRBY', destKey, 'entities', 1)
+    move_totals (srcKey, destKey)
+    if packed then
+        local bucket = get_bucket (srcKey)
+        local offset = find_record (bucket, id)
+        if offset then
+            call ('APPEND', destKey .. ':bucket', string.sub (bucket, offset, offset + recordSize - 1) )
+            set_bucket (srcKey, string.sub (bucket, 1, offset - 1) .. string.sub (bucket, offset + recordSize) )
+        end
+        call ('HSET', 'entities:index', id, destKey)
+    else
+        call ('SREM', srcKey .. ':entities', id)
+        call ('SADD', destKey .. ':entities', id)
+        call ('HSET', 'entities:' .. id, 'owner', destKey)
+    end
+    mark_dirty (srcKey)
+    mark_dirty (destKey)
+end
+
+local function subdivide (key, rect)
+    -- don't subdivide if we've reached the minimum
+    if math.floor (rect.w / 2) < minSize or math.floor (rect.h / 2) < minSize then
+        return false
+    end
+
+    for quad = 1, 4 do
+        local subKey = subnode_key (key, quad)
+        local subRect = quadrant (rect, quad)
+        call ('HMSET', subKey, 'subdivided', 0, 'entities', 0)
+        call ('HMSET', subKey .. ':rect', 'x', encode (subRect.x), 'y', encode (subRect.y), 'w', encode (subRect.w), 'h', encode (subRect.h) )
+    end
+    call ('HSET', key, 'subdivided', 1)
+    mark_dirty (key)
+
+    -- move all the entities in this node down if possible
+    for _, ent in ipairs (get_entities (key) ) do
+        local quad = destination (rect, ent[2], ent[3])
+
+        if quad then
+            move_entity (ent[1], key, subnode_key (key, quad) )
+        end
+    end
+
+    return true
+end
+
+-- walk down from a node to the first one with room for the entity
+-- the entity is moved there from srcKey if given, otherwise it's added
+local function insert (key, rect, id, x, y, srcKey)
+    while true do
+        local node = get_node (key)
+
+        if not node.subdivided then
+            if node.entities + 1 <= maxEntities or not subdivide (key, rect) then
+                break
+            end
+        end
+
+        local quad = destination (rect, x, y)
+        if not quad then
+            break
+        end
+
+        key = subnode_key (key, quad)
+        rect = quadrant (rect, quad)
+    end
+
+    if srcKey then
+        move_entity (id, srcKey, key)
+    else
+        add_entity (key, id, x, y)
+    end
+
+    return key
+end
+
+local function delete_subnodes (key)
+    for quad = 1, 4 do
+        local subKey = subnode_key (key, quad)
+        redis.call ('DEL', prefix .. subKey, prefix .. subKey .. ':rect', prefix .. subKey .. ':total')
+    end
+    call ('HSET', key, 'subdivided', 0)
+    mark_dirty (key)
+end
+
+local function delete_empty_subnodes (key)
+    local empty = true
+
+    -- first check if these subnodes contain any entities
+    for quad = 1, 4 do
+        local count = call ('HGET', subnode_key (key, quad), 'entities')
+        if count and count ~= '0' then
+            empty = false
+        end
+    end
+
+    if empty then
+        -- continue on to the subnodes if there are any
+        for quad = 1, 4 do
+            local subKey = subnode_key (key, quad)
+            if call ('HGET', subKey, 'subdivided') == '1' and not delete_empty_subnodes (subKey) then
+                empty = false
+            end
+        end
+    end
+
+    if empty then
+        delete_subnodes (key)
+    end
+
+    return empty
+end
+
+-- move every entity below a node up into it and delete its subnodes, false if the node and its subtree hold
+-- more than mergeEntities, the subtree is read a level at a time and only as far as it takes to tell
+local function merge_subtree (key)
+    local count = get_node (key).entities
+    local below = {}
+    local level = {key}
+
+    while #level > 0 do
+        local nextLevel = {}
+        for _, levelKey in ipairs (level) do
+            for quad = 1, 4 do
+                local subKey = subnode_key (levelKey, quad)
+                local subnode = get_node (subKey)
+
+                count = count + subnode.entities
+                if count > mergeEntities then
+                    return false
+                end
+
+                table.insert (below, {subKey, subnode.entities})
+                if subnode.subdivided then
+                    table.insert (nextLevel, subKey)
+                end
+            end
+        end
+        level = nextLevel
+    end
+
+    -- the subtree's total doesn't change, only where in it the entities are
+    local moved = 0
+    for _, subnode in ipairs (below) do
+        local subKey = subnode[1]
+        if subnode[2] > 0 then
+            for _, ent in ipairs (get_entities (subKey) ) do
+                if packed then
+                    call ('APPEND', key .. ':bucket', pack_u32 (tonumber (ent[1]) ) .. pack_u32 (ent[2]) .. pack_u32 (ent[3]) )
+                    call ('HSET', 'entities:index', ent[1], key)
+                else
+                    call ('SADD', key .. ':entities', ent[1])
+                    call ('HSET', 'entities:' .. ent[1], 'owner', key)
+                end
+                moved = moved + 1
+            end
+        end
+
+        redis.call ('DEL', prefix .. subKey, prefix .. subKey .. ':rect', prefix .. subKey .. ':entities',
+            prefix .. subKey .. ':bucket', prefix .. subKey .. ':total')
+    end
+
+    call ('HSET', key, 'subdivided', 0)
+    call ('HINCRBY', key, 'entities', moved)
+    mark_dirty (key)
+    return true
+end
+
+-- merge empty subnodes (or a subtree down to mergeEntities), working up the tree for as long as nodes end up
+-- at or below it, nodes above minDepth keep their subnodes
+local function clean (key)
+    while key and node_depth (key) >= minDepth do
+        local node = get_node (key)
+
+        if node.subdivided then
+            if not delete_empty_subnodes (key) and (mergeEntities == 0 or not merge_subtree (key) ) then
+                return
+            end
+            node = get_node (key)
+        end
+
+        if node.subdivided or node.entities > mergeEntities then
+            return
+        end
+
+        key = parent_key (key)
+    end
+end
+)lua";
+
+static const char* insertBody = R"lua(
+local id = ARGV[11]
+local x = tonumber (ARGV[12])
+local y = tonumber (ARGV[13])
+
+local rect = get_rect (rootKey)
+if not contains (rect, x, y) then
+    return reply (nil)
+end
+
+return reply (insert (rootKey, rect, id, x, y) )
+)lua";
+
+static const char* removeBody = R"lua(
+local id = ARGV[11]
+local ownerKey = get_owner (id)
+if not ownerKey then
+    return reply (nil)
+end
+
+delete_entity (ownerKey, id)
+
+-- if this node is down to the merge threshold (empty without one), then try to clean it
+if get_node (ownerKey).entities <= mergeEntities then
+    clean (ownerKey)
+end
+
+return reply (nil)
+)lua";
+
+static const char* relocateBody = R"lua(
+local id = ARGV[11]
+local x = tonumber (ARGV[12])
+local y = tonumber (ARGV[13])
+
+local ownerKey = get_owner (id)
+if not ownerKey then
+    return reply (nil)
+end
+
+local key = ownerKey
+local rect = get_rect (key)
+
+-- it stays anywhere in its owner's loose bounds
+if not contains (rect, x, y) and contains (loosened (rect), x, y) then
+    set_position (ownerKey, id, x, y)
+    return reply (ownerKey)
+end
+
+-- move up the tree until a node contains the entity
+while not contains (rect, x, y) and parent_key (key) do
+    key = parent_key (key)
+    rect = get_rect (key)
+end
+
+local newOwnerKey = ownerKey
+if contains (rect, x, y) then
+    local quad = nil
+    if get_node (key).subdivided then
+        quad = destination (rect, x, y)
+    end
+
+    if key == ownerKey then
+        -- the entity is still in its owner, it only has to move if it fits in a subnode now
+        if quad then
+            newOwnerKey = insert (subnode_key (key, quad), quadrant (rect, quad), id, x, y, ownerKey)
+        end
+    else
+        -- the entity has moved out of its owner node, so reinsert it elsewhere
+        if quad then
+            newOwnerKey = insert (subnode_key (key, quad), quadrant (rect, quad), id, x, y, ownerKey)
+        else
+            newOwnerKey = insert (key, rect, id, x, y, ownerKey)
+        end
+
+        -- clean the former owner node, a merge can take the entity up with the rest of a subtree
+        clean (ownerKey)
+        if mergeEntities > 0 then
+            newOwnerKey = get_owner (id)
+        end
+    end
+end
+
+set_position (newOwnerKey, id, x, y)
+
+return reply (newOwnerKey)
+)lua";
+
+std::string script_source (script_id _script) {
+    std::string source = prelude;
+
+    switch (_script) {
+        case SCRIPT_INSERT:
+            source += insertBody;
+            break;
+        case SCRIPT_REMOVE:
+            source += removeBody;
+            break;
+        case SCRIPT_RELOCATE:
+            source += relocateBody;
+            break;
+        default:
+            break;
+    }
+
+    return source;
+}
+
+std::string looseness_arg (double _looseness) {
+    char arg[32];
+    snprintf (arg, sizeof (arg), "%.17g", _looseness);
+    return arg;
+}
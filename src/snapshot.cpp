@@ -0,0 +1,201 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <snapshot.hpp>
+
+namespace {
+    const char snapshotMagic[8] = {'R', 'Q', 'T', 'S', 'N', 'A', 'P', 0};
+    const uint32_t snapshotVersion = 1;
+    const uint32_t noOwner = UINT32_MAX;
+
+    struct snapshot_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t keyScheme;
+        uint32_t x, y, width, height;
+        uint64_t nodeCount;
+        uint64_t entityCount;
+        uint64_t keyBytes;
+    };
+
+    // the key is at keyOffset in the keys that follow the entity table
+    struct node_record {
+        uint32_t x, y, width, height;
+        uint32_t entities;
+        uint32_t subdivided;
+        uint32_t keyOffset;
+        uint32_t keyLength;
+    };
+
+    // owner is the index of the node in the node table
+    struct entity_record {
+        uint32_t id;
+        uint32_t x, y;
+        uint32_t owner;
+    };
+}
+
+bool write_snapshot (const std::string& _path, const rectangle& _rect, key_scheme _keyScheme,
+    const std::vector<node>& _nodes, const std::vector<entity>& _ents) {
+    snapshot_header header;
+    memcpy (header.magic, snapshotMagic, sizeof (snapshotMagic) );
+    header.version = snapshotVersion;
+    header.keyScheme = _keyScheme;
+    header.x = _rect.x;
+    header.y = _rect.y;
+    header.width = _rect.width;
+    header.height = _rect.height;
+    header.nodeCount = _nodes.size ();
+    header.entityCount = _ents.size ();
+
+    std::vector<node_record> nodeRecords (_nodes.size () );
+    std::unordered_map<std::string, uint32_t> indices;
+    std::string keys;
+
+    for (size_t n = 0; n < _nodes.size (); n++) {
+        const node& currNode = _nodes[n];
+        node_record& record = nodeRecords[n];
+
+        record.x = currNode.rect.x;
+        record.y = currNode.rect.y;
+        record.width = currNode.rect.width;
+        record.height = currNode.rect.height;
+        record.entities = currNode.entities;
+        record.subdivided = currNode.subdivided ? 1 : 0;
+        record.keyOffset = keys.size ();
+        record.keyLength = currNode.key.size ();
+
+        keys += currNode.key;
+        indices[currNode.key] = n;
+    }
+    header.keyBytes = keys.size ();
+
+    std::vector<entity_record> entityRecords (_ents.size () );
+    for (size_t n = 0; n < _ents.size (); n++) {
+        const entity& ent = _ents[n];
+        entity_record& record = entityRecords[n];
+
+        std::unordered_map<std::string, uint32_t>::const_iterator owner = indices.find (ent.ownerKey);
+        record.id = ent.id;
+        record.x = ent.pos.x;
+        record.y = ent.pos.y;
+        record.owner = owner != indices.end () ? owner->second : noOwner;
+    }
+
+    // written next to the old snapshot and moved over it, so a crash never leaves half a file behind
+    std::string tempPath = _path + ".tmp";
+    {
+        std::ofstream file (tempPath.c_str (), std::ios::binary | std::ios::trunc);
+        if (!file.is_open () )
+            return false;
+
+        file.write ( (const char*)&header, sizeof (header) );
+        if (!nodeRecords.empty () )
+            file.write ( (const char*)&nodeRecords[0], nodeRecords.size () * sizeof (node_record) );
+        if (!entityRecords.empty () )
+            file.write ( (const char*)&entityRecords[0], entityRecords.size () * sizeof (entity_record) );
+        file.write (keys.data (), keys.size () );
+
+        file.flush ();
+        if (!file.good () ) {
+            remove (tempPath.c_str () );
+            return false;
+        }
+    }
+
+    return rename (tempPath.c_str (), _path.c_str () ) == 0;
+}
+
+bool read_snapshot (const std::string& _path, const rectangle& _rect, key_scheme _keyScheme,
+    std::vector<node>& _nodes, std::vector<entity>& _ents) {
+    int fd = open (_path.c_str (), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat (fd, &info) != 0 || (size_t)info.st_size < sizeof (snapshot_header) ) {
+        close (fd);
+        return false;
+    }
+
+    size_t size = info.st_size;
+    void* mapped = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (mapped == MAP_FAILED)
+        return false;
+
+    // the tables are only read front to back
+    madvise (mapped, size, MADV_SEQUENTIAL);
+
+    const char* data = (const char*)mapped;
+    const snapshot_header* header = (const snapshot_header*)data;
+
+    bool valid = memcmp (header->magic, snapshotMagic, sizeof (snapshotMagic) ) == 0 && header->version == snapshotVersion
+        && header->keyScheme == (uint32_t)_keyScheme && header->x == _rect.x && header->y == _rect.y
+        && header->width == _rect.width && header->height == _rect.height
+        && header->nodeCount <= size / sizeof (node_record) && header->entityCount <= size / sizeof (entity_record)
+        // bounded first, a keyBytes near 2^64 would wrap the sum below around to the file size
+        && header->keyBytes <= size
+        && sizeof (snapshot_header) + header->nodeCount * sizeof (node_record) + header->entityCount * sizeof (entity_record)
+            + header->keyBytes == size;
+
+    if (!valid) {
+        munmap (mapped, size);
+        return false;
+    }
+
+    const node_record* nodeRecords = (const node_record*)(data + sizeof (snapshot_header) );
+    const entity_record* entityRecords = (const entity_record*)(nodeRecords + header->nodeCount);
+    const char* keys = (const char*)(entityRecords + header->entityCount);
+
+    size_t firstNode = _nodes.size ();
+    _nodes.resize (firstNode + header->nodeCount);
+
+    for (size_t n = 0; n < header->nodeCount && valid; n++) {
+        const node_record& record = nodeRecords[n];
+        node& currNode = _nodes[firstNode + n];
+
+        if ( (uint64_t)record.keyOffset + record.keyLength > header->keyBytes) {
+            valid = false;
+            break;
+        }
+
+        currNode.key.assign (keys + record.keyOffset, record.keyLength);
+        currNode.parentKey = parent_key (_keyScheme, currNode.key);
+        currNode.rect = rectangle (record.x, record.y, record.width, record.height);
+        currNode.entities = record.entities;
+        currNode.subdivided = record.subdivided != 0;
+    }
+
+    size_t firstEntity = _ents.size ();
+    if (valid)
+        _ents.resize (firstEntity + header->entityCount);
+
+    for (size_t n = 0; n < header->entityCount && valid; n++) {
+        const entity_record& record = entityRecords[n];
+        entity& ent = _ents[firstEntity + n];
+
+        if (record.owner != noOwner && record.owner >= header->nodeCount) {
+            valid = false;
+            break;
+        }
+
+        ent.id = record.id;
+        ent.pos = point (record.x, record.y);
+        ent.key = "entities:" + std::to_string (record.id);
+        ent.ownerKey = record.owner != noOwner ? _nodes[firstNode + record.owner].key : std::string ();
+    }
+
+    munmap (mapped, size);
+
+    if (!valid) {
+        _nodes.resize (firstNode);
+        _ents.resize (firstEntity);
+    }
+    return valid;
+}
@@ -0,0 +1,65 @@
+#include <fstream>
+#include <spatial_index.hpp>
+
+void spatial_index::get_entities (const rectangle& _rect, std::vector<entity>& _ents) {
+    get_entities (rectangle_region (_rect), _ents);
+}
+
+void spatial_index::get_entities_in_radius (const point& _center, uint32_t _radius, std::vector<entity>& _ents) {
+    get_entities (circle (_center, _radius), _ents);
+}
+
+void spatial_index::get_entities_in_polygon (const std::vector<point>& _vertices, std::vector<entity>& _ents) {
+    get_entities (polygon (_vertices), _ents);
+}
+
+size_t spatial_index::visit_entities (const rectangle& _rect, const entity_visitor& _visit, size_t _offset, size_t _limit) {
+    return visit_entities (rectangle_region (_rect), _visit, _offset, _limit);
+}
+
+void spatial_index::get_entities (const region& _region, std::vector<entity>& _ents, size_t _offset, size_t _limit) {
+    _ents.clear ();
+    visit_entities (_region, [&_ents] (const entity& _ent) {
+        _ents.push_back (_ent);
+        return true;
+    }, _offset, _limit);
+}
+
+size_t spatial_index::count_entities (const rectangle& _rect) {
+    return count_entities (rectangle_region (_rect) );
+}
+
+bool spatial_index::load_entities (const std::string& _filename) {
+    std::ifstream file (_filename.c_str () );
+    if (!file.is_open () )
+        return false;
+
+    std::vector<entity> ents;
+    entity ent;
+    uint32_t id, x, y;
+
+    while (file >> id >> x >> y) {
+        ent.id = id;
+        ent.pos = point (x, y);
+        ents.push_back (ent);
+    }
+
+    insert_entities (ents);
+    return true;
+}
+
+const quadtree_io& spatial_index::io () const {
+    return counters.io;
+}
+
+const quadtree_stats& spatial_index::stats () const {
+    return counters.stats ();
+}
+
+void spatial_index::reset_stats () {
+    counters.reset ();
+}
+
+void spatial_index::dump_stats (std::ostream* _out, uint32_t _intervalSeconds) {
+    counters.dump_every (_out, _intervalSeconds);
+}
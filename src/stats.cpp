@@ -0,0 +1,132 @@
+#include <cstdio>
+#include <stats.hpp>
+
+quadtree_io& quadtree_io::operator+= (const quadtree_io& _io) {
+    commands += _io.commands;
+    roundTrips += _io.roundTrips;
+    replyBytes += _io.replyBytes;
+    nodesVisited += _io.nodesVisited;
+    subdivides += _io.subdivides;
+    cleans += _io.cleans;
+    conflicts += _io.conflicts;
+    return *this;
+}
+
+quadtree_io quadtree_io::operator- (const quadtree_io& _io) const {
+    quadtree_io diff;
+    diff.commands = commands - _io.commands;
+    diff.roundTrips = roundTrips - _io.roundTrips;
+    diff.replyBytes = replyBytes - _io.replyBytes;
+    diff.nodesVisited = nodesVisited - _io.nodesVisited;
+    diff.subdivides = subdivides - _io.subdivides;
+    diff.cleans = cleans - _io.cleans;
+    diff.conflicts = conflicts - _io.conflicts;
+    return diff;
+}
+
+const char* op_name (stats_op _op) {
+    switch (_op) {
+        case OP_GET_ENTITY:
+            return "get_entity";
+        case OP_INSERT_ENTITY:
+            return "insert_entity";
+        case OP_REMOVE_ENTITY:
+            return "remove_entity";
+        case OP_RELOCATE_ENTITY:
+            return "relocate_entity";
+        case OP_GET_ENTITIES:
+            return "get_entities";
+        case OP_GET_NEAREST:
+            return "get_nearest";
+        case OP_RELOCATE_ENTITIES:
+            return "relocate_entities";
+        case OP_INSERT_ENTITIES:
+            return "insert_entities";
+        case OP_COUNT_ENTITIES:
+            return "count_entities";
+        case OP_DENSITY_GRID:
+            return "density_grid";
+        case OP_VISIT_ENTITIES:
+            return "visit_entities";
+        default:
+            return "unknown";
+    }
+}
+
+quadtree_stats& quadtree_stats::operator+= (const quadtree_stats& _stats) {
+    for (int op = 0; op < OP_COUNT; op++) {
+        ops[op].calls += _stats.ops[op].calls;
+        ops[op].nanos += _stats.ops[op].nanos;
+        ops[op].io += _stats.ops[op].io;
+    }
+    return *this;
+}
+
+quadtree_stats quadtree_stats::operator- (const quadtree_stats& _stats) const {
+    quadtree_stats diff;
+    for (int op = 0; op < OP_COUNT; op++) {
+        diff.ops[op].calls = ops[op].calls - _stats.ops[op].calls;
+        diff.ops[op].nanos = ops[op].nanos - _stats.ops[op].nanos;
+        diff.ops[op].io = ops[op].io - _stats.ops[op].io;
+    }
+    return diff;
+}
+
+void quadtree_stats::write (std::ostream& _out) const {
+    char line[256];
+
+    // per call averages, the totals are in ops
+    snprintf (line, sizeof (line), "%-18s %10s %10s %8s %8s %10s %8s %8s %8s %8s\n",
+        "op", "calls", "us/call", "rtt", "cmds", "bytes", "nodes", "subdiv", "cleans", "retries");
+    _out << line;
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        const op_stats& stats = ops[op];
+        if (stats.calls == 0)
+            continue;
+
+        double calls = (double)stats.calls;
+        snprintf (line, sizeof (line), "%-18s %10llu %10.1f %8.2f %8.2f %10.1f %8.2f %8.3f %8.3f %8.3f\n",
+            op_name ( (stats_op)op), (unsigned long long)stats.calls, stats.nanos / calls / 1000.0,
+            stats.io.roundTrips / calls, stats.io.commands / calls, stats.io.replyBytes / calls,
+            stats.io.nodesVisited / calls, stats.io.subdivides / calls, stats.io.cleans / calls,
+            stats.io.conflicts / calls);
+        _out << line;
+    }
+}
+
+op_counters::op_counters ()
+    : depth (0), dumpOut (NULL) {
+}
+
+const quadtree_stats& op_counters::stats () const {
+    return opStats;
+}
+
+void op_counters::reset () {
+    opStats = quadtree_stats ();
+    lastDump = quadtree_stats ();
+}
+
+void op_counters::dump_every (std::ostream* _out, uint32_t _intervalSeconds) {
+    dumpOut = _out;
+    dumpInterval = std::chrono::seconds (_intervalSeconds);
+    nextDump = std::chrono::steady_clock::now () + dumpInterval;
+    lastDump = opStats;
+}
+
+void op_counters::book (stats_op _op, const std::chrono::steady_clock::time_point& _start, const quadtree_io& _startIo) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+
+    op_stats& stats = opStats.ops[_op];
+    stats.calls++;
+    stats.nanos += std::chrono::duration_cast<std::chrono::nanoseconds> (now - _start).count ();
+    stats.io += io - _startIo;
+
+    if (!dumpOut || now < nextDump)
+        return;
+
+    (opStats - lastDump).write (*dumpOut);
+    lastDump = opStats;
+    nextDump = now + dumpInterval;
+}
@@ -1,24 +1,93 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <util.hpp>
 
 rectangle::rectangle (uint32_t _x, uint32_t _y, uint32_t _width, uint32_t _height)
     : x (_x), y (_y), x2 (_x + _width), y2 (_y + _height), width (_width), height (_height) {
 }
 
-rectangle::rectangle (redisContext* _context, std::string _key) {
+rectangle::rectangle (redisContext* _context, std::string _key, coordinate_encoding _encoding) {
     redisReply* reply = (redisReply*)redisCommand (_context, "HVALS %s", _key.c_str () );
 
     if (reply) {
-        if (reply->elements == 4) {
-            x = std::stoi (reply->element[0]->str);
-            y = std::stoi (reply->element[1]->str);
-            width = std::stoi (reply->element[2]->str);
-            height = std::stoi (reply->element[3]->str);
-            x2 = x + width;
-            y2 = y + height;
-        }
+        *this = rectangle (reply, _encoding);
+        freeReplyObject (reply);
     }
 }
 
+rectangle::rectangle (const redisReply* _reply, coordinate_encoding _encoding) {
+    if (_reply->type == REDIS_REPLY_ARRAY && _reply->elements == 4) {
+        x = read_coordinate (_encoding, _reply->element[0]);
+        y = read_coordinate (_encoding, _reply->element[1]);
+        width = read_coordinate (_encoding, _reply->element[2]);
+        height = read_coordinate (_encoding, _reply->element[3]);
+        x2 = x + width;
+        y2 = y + height;
+    }
+}
+
+rectangle rectangle::quadrant (int _quad) const {
+    point size (width / 2, height / 2);
+    point mid (x + size.x, y + size.y);
+
+    switch (_quad) {
+        case 0:
+            return rectangle (x, y, size.x, size.y);
+        case 1:
+            return rectangle (mid.x, y, size.x, size.y);
+        case 2:
+            return rectangle (x, mid.y, size.x, size.y);
+        default:
+            return rectangle (mid.x, mid.y, size.x, size.y);
+    }
+}
+
+static uint64_t spread_bits (uint32_t _value) {
+    uint64_t bits = _value;
+    bits = (bits | (bits << 16) ) & 0x0000ffff0000ffffULL;
+    bits = (bits | (bits << 8) ) & 0x00ff00ff00ff00ffULL;
+    bits = (bits | (bits << 4) ) & 0x0f0f0f0f0f0f0f0fULL;
+    bits = (bits | (bits << 2) ) & 0x3333333333333333ULL;
+    bits = (bits | (bits << 1) ) & 0x5555555555555555ULL;
+    return bits;
+}
+
+uint64_t morton_code (uint32_t _x, uint32_t _y) {
+    return spread_bits (_x) | (spread_bits (_y) << 1);
+}
+
+std::string morton_key (uint64_t _code) {
+    char bytes[10];
+    int start = sizeof (bytes);
+
+    do {
+        bytes[--start] = (char)(0x80 | (_code & 0x7f) );
+        _code >>= 7;
+    } while (_code > 0);
+
+    return std::string (bytes + start, sizeof (bytes) - start);
+}
+
+uint64_t morton_key_code (const std::string& _key) {
+    uint64_t code = 0;
+
+    for (size_t n = 0; n < _key.size (); n++)
+        code = (code << 7) | ( (unsigned char)_key[n] & 0x7f);
+
+    return code;
+}
+
+rectangle rectangle::loosened (double _looseness) const {
+    // same arithmetic as the lua scripts' loosened, so both agree on every edge
+    uint32_t marginX = (uint32_t)(width * (_looseness - 1) / 2);
+    uint32_t marginY = (uint32_t)(height * (_looseness - 1) / 2);
+    uint32_t left = std::min (marginX, x), top = std::min (marginY, y);
+
+    return rectangle (x - left, y - top, width + left + marginX, height + top + marginY);
+}
+
 const bool rectangle::contains (const point& _point) const {
     return (_point.x > x && _point.y > y && _point.x < x2 && _point.y < y2);
 }
@@ -30,3 +99,48 @@ const bool rectangle::contains (const rectangle& _rect) const {
 const bool rectangle::intersects (const rectangle& _rect) const {
     return !(_rect.x > x2 || _rect.x2 < x || _rect.y > y2 || _rect.y2 < y);
 }
+
+uint64_t rectangle::squared_distance (const point& _point) const {
+    uint64_t dx = _point.x < x ? x - _point.x : (_point.x > x2 ? _point.x - x2 : 0);
+    uint64_t dy = _point.y < y ? y - _point.y : (_point.y > y2 ? _point.y - y2 : 0);
+
+    return dx * dx + dy * dy;
+}
+
+uint64_t squared_distance (const point& _a, const point& _b) {
+    uint64_t dx = _a.x > _b.x ? _a.x - _b.x : _b.x - _a.x;
+    uint64_t dy = _a.y > _b.y ? _a.y - _b.y : _b.y - _a.y;
+
+    return dx * dx + dy * dy;
+}
+
+coordinate_arg::coordinate_arg (coordinate_encoding _encoding, uint32_t _value) {
+    if (_encoding == COORDS_BINARY) {
+        memcpy (bytes, &_value, sizeof (uint32_t) );
+        length = sizeof (uint32_t);
+    }
+    else {
+        length = snprintf (bytes, sizeof (bytes), "%u", _value);
+    }
+}
+
+uint32_t read_coordinate (coordinate_encoding _encoding, const redisReply* _reply) {
+    if (_reply->type != REDIS_REPLY_STRING)
+        return 0;
+
+    if (_encoding == COORDS_TEXT)
+        return read_uint (_reply->str);
+
+    uint32_t value = 0;
+    if (_reply->len == sizeof (uint32_t) )
+        memcpy (&value, _reply->str, sizeof (uint32_t) );
+    return value;
+}
+
+uint32_t read_uint (const redisReply* _reply) {
+    return _reply->type == REDIS_REPLY_STRING ? read_uint (_reply->str) : 0;
+}
+
+uint32_t read_uint (const char* _str) {
+    return (uint32_t)strtoul (_str, NULL, 10);
+}
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <map>
+#include <random>
+#include <thread>
+#include <concurrent_quadtree.hpp>
+#include <memory_quadtree.hpp>
+#include "test_redis.hpp"
+
+// several threads insert, relocate and remove through one concurrent_quadtree at once, their entities jumping
+// back and forth over the borders of the lock subtrees, and half the time with an ownerKey from before their
+// last move so the locks taken first are the wrong ones and have to be taken again
+// the tree is then checked against a memory_quadtree holding what the threads say they left
+
+static const uint32_t worldSize = 4096;
+static const uint32_t callers = 4;
+static const uint32_t entitiesPerCaller = 200;
+static const int ticks = 4;
+static const uint32_t lockDepth = 2;
+
+static std::string describe (const quadtree_options& _options) {
+    return std::string (_options.useScripts ? "scripts" : "client side") + ", " + (_options.entityLayout == LAYOUT_PACKED ? "packed" : "sets");
+}
+
+// next to one of the lines between the subtrees at lockDepth, on either side of it
+static point border_point (std::mt19937& _random) {
+    int line = (1 + _random () % 3) * (worldSize >> lockDepth);
+    int side = _random () % 2 ? 1 : -1;
+    uint32_t off = line + side * (int)(1 + _random () % 16);
+    uint32_t along = 1 + _random () % (worldSize - 2);
+
+    return _random () % 2 ? point (off, along) : point (along, off);
+}
+
+static void caller (concurrent_quadtree& _tree, uint32_t _caller, std::map<uint32_t, point>& _kept) {
+    std::mt19937 random (_caller + 1);
+    std::vector<entity> ents;
+
+    for (uint32_t n = 0; n < entitiesPerCaller; n++) {
+        entity ent;
+        ent.id = _caller * entitiesPerCaller + n + 1;
+        ent.pos = border_point (random);
+        _tree.insert_entity (ent);
+        ents.push_back (ent);
+    }
+
+    // the ownerKeys as they were inserted, out of date once an entity has moved
+    std::vector<entity> stale = ents;
+
+    for (int tick = 0; tick < ticks; tick++) {
+        for (uint32_t n = 0; n < entitiesPerCaller; n++) {
+            entity moved = n % 2 ? stale[n] : ents[n];
+            moved.pos = border_point (random);
+            _tree.relocate_entity (moved);
+            ents[n] = moved;
+        }
+    }
+
+    for (uint32_t n = 0; n < entitiesPerCaller; n++) {
+        if (n % 4 == 0)
+            _tree.remove_entity (n % 8 ? stale[n] : ents[n]);
+        else
+            _kept[ents[n].id] = ents[n].pos;
+    }
+}
+
+static uint64_t distance (const point& _a, const point& _b) {
+    int64_t dx = (int64_t)_a.x - _b.x, dy = (int64_t)_a.y - _b.y;
+    return dx * dx + dy * dy;
+}
+
+static std::map<uint32_t, std::pair<uint32_t, uint32_t> > positions (const std::vector<entity>& _ents) {
+    std::map<uint32_t, std::pair<uint32_t, uint32_t> > found;
+    for (std::vector<entity>::const_iterator it = _ents.begin (); it != _ents.end (); it++)
+        found[it->id] = std::make_pair (it->pos.x, it->pos.y);
+    return found;
+}
+
+static bool run (redisContext* _context, const quadtree_options& _options) {
+    if (!reset_test_db (_context) )
+        return false;
+
+    std::string what = describe (_options);
+    rectangle rect (0, 0, worldSize, worldSize);
+    concurrent_quadtree tree (test_host (), test_port (), rect, callers, lockDepth, _options, testDb);
+    check (tree.connected (), what + ": the workers couldn't connect");
+    if (!tree.connected () )
+        return true;
+
+    std::vector<std::map<uint32_t, point> > kept (callers);
+    std::vector<std::thread> threads;
+    for (uint32_t n = 0; n < callers; n++)
+        threads.push_back (std::thread (caller, std::ref (tree), n, std::ref (kept[n]) ) );
+    for (uint32_t n = 0; n < callers; n++)
+        threads[n].join ();
+
+    // the model only has to hold the same entities, the order the threads ran in decided how the tree is split
+    quadtree_options modelOptions = _options;
+    modelOptions.minDepth = std::max (modelOptions.minDepth, lockDepth);
+    memory_quadtree model (rect, modelOptions);
+    for (uint32_t n = 0; n < callers; n++) {
+        for (std::map<uint32_t, point>::iterator it = kept[n].begin (); it != kept[n].end (); it++) {
+            entity ent;
+            ent.id = it->first;
+            ent.pos = it->second;
+            model.insert_entity (ent);
+        }
+    }
+
+    quadtree reader (_context, rect, modelOptions);
+    for (uint32_t id = 1; id <= callers * entitiesPerCaller; id++) {
+        entity ent, expected;
+        reader.get_entity (id, ent);
+        model.get_entity (id, expected);
+
+        if (expected.ownerKey == "") {
+            check (ent.ownerKey == "", what + ": removed entity " + std::to_string (id) + " is still in the tree");
+            continue;
+        }
+
+        rectangle ownerRect;
+        check (ent.ownerKey != "" && reader.get_node_rect (ent.ownerKey, ownerRect), what + ": entity " + std::to_string (id) + " is missing");
+        check (ent.pos.x == expected.pos.x && ent.pos.y == expected.pos.y, what + ": entity " + std::to_string (id) + " is out of place");
+        check (ent.ownerKey == "" || ownerRect.contains (ent.pos), what + ": entity " + std::to_string (id) + " is in a node that doesn't hold it");
+    }
+
+    std::mt19937 random (7);
+    std::vector<entity> found, expected;
+    for (int n = 0; n < 30; n++) {
+        rectangle query = n == 0 ? rect : rectangle (random () % worldSize, random () % worldSize, 1 + random () % 1024, 1 + random () % 1024);
+
+        found.clear ();
+        expected.clear ();
+        tree.get_entities (query, found);
+        model.get_entities (query, expected);
+        check (found.size () == expected.size () && positions (found) == positions (expected), what + ": queries found " +
+            std::to_string (found.size () ) + " entities, expected " + std::to_string (expected.size () ) );
+
+        point center = border_point (random);
+        found.clear ();
+        expected.clear ();
+        tree.get_nearest (center, 5, found);
+        model.get_nearest (center, 5, expected);
+        check (found.size () == expected.size (), what + ": nearest found " + std::to_string (found.size () ) + " entities");
+        for (size_t k = 0; k < std::min (found.size (), expected.size () ); k++)
+            check (distance (center, found[k].pos) == distance (center, expected[k].pos), what + ": nearest are out of order");
+    }
+
+    return true;
+}
+
+int main () {
+    redisContext* context = connect_test_redis ();
+    if (!context)
+        return testSkipped;
+
+    for (int scripts = 0; scripts < 2; scripts++) {
+        for (int layout = 0; layout < 2; layout++) {
+            quadtree_options options;
+            options.maxEntitiesPerNode = 8;
+            options.mergeEntities = 4;
+            options.minNodeSize = 4;
+            options.useScripts = scripts == 1;
+            options.entityLayout = layout == 1 ? LAYOUT_PACKED : LAYOUT_SETS;
+
+            if (!run (context, options) ) {
+                printf ("can't empty database %d\n", testDb);
+                redisFree (context);
+                return 1;
+            }
+        }
+    }
+
+    reset_test_db (context);
+    redisFree (context);
+
+    printf ("%s\n", testFailures ? "FAILED" : "passed");
+    return testFailures ? 1 : 0;
+}
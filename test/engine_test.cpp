@@ -0,0 +1,436 @@
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <quadtree.hpp>
+#include <memory_quadtree.hpp>
+#include "test_redis.hpp"
+
+// quadtree walks the tree client side, in the lua scripts and, with writeBehind, through a memory_quadtree
+// of its own, each is checked against a plain memory_quadtree that gets the same operations
+// both engines split, merge and name their nodes the same way, so every entity has to end up in the same node
+// and every query has to give the same answer
+// and then two optimistic writers on the same nodes at once, checked against what they say they left
+
+static const uint32_t worldSize = 4096;
+static const uint32_t entityCount = 500;
+static const int rounds = 3;
+
+static std::string describe (const quadtree_options& _options) {
+    std::string what = _options.writeBehind ? "write-behind" : _options.useScripts ? "scripts" : "client side";
+    return what + ", " + (_options.entityLayout == LAYOUT_PACKED ? "packed" : "sets") + ", " +
+        (_options.keyScheme == KEYS_MORTON ? "morton" : "path") + " keys" + (_options.countSubtrees ? ", subtree totals" : "") +
+        (_options.keyPrefix.empty () ? "" : ", prefix " + _options.keyPrefix) + (_options.cluster ? ", cluster" : "") +
+        (_options.looseness > 1 ? ", looseness " + std::to_string (_options.looseness) : "") +
+        (_options.coordinates == COORDS_BINARY ? ", binary coordinates" : "") + (_options.optimistic ? ", optimistic" : "");
+}
+
+static point random_point (std::mt19937& _random) {
+    return point (1 + _random () % (worldSize - 2), 1 + _random () % (worldSize - 2) );
+}
+
+static uint64_t distance (const point& _a, const point& _b) {
+    int64_t dx = (int64_t)_a.x - _b.x, dy = (int64_t)_a.y - _b.y;
+    return dx * dx + dy * dy;
+}
+
+static std::map<uint32_t, std::pair<uint32_t, uint32_t> > positions (const std::vector<entity>& _ents) {
+    std::map<uint32_t, std::pair<uint32_t, uint32_t> > found;
+    for (std::vector<entity>::const_iterator it = _ents.begin (); it != _ents.end (); it++)
+        found[it->id] = std::make_pair (it->pos.x, it->pos.y);
+    return found;
+}
+
+// the engine's own order may differ, so only what the pages hold between them is compared
+static std::map<uint32_t, std::pair<uint32_t, uint32_t> > paged (spatial_index& _tree, const region& _region, size_t& _pages) {
+    static const size_t pageSize = 7;
+    std::vector<entity> all, page;
+
+    for (_pages = 0; ; _pages++) {
+        _tree.get_entities (_region, page, all.size (), pageSize);
+        all.insert (all.end (), page.begin (), page.end () );
+        if (page.size () < pageSize)
+            break;
+    }
+    return positions (all);
+}
+
+static void compare (spatial_index& _tree, memory_quadtree& _model, std::mt19937& _random, const std::string& _what) {
+    for (uint32_t id = 1; id <= entityCount; id++) {
+        entity ent, expected;
+        _tree.get_entity (id, ent);
+        _model.get_entity (id, expected);
+
+        check (ent.ownerKey == expected.ownerKey, _what + ": entity " + std::to_string (id) + " is in the wrong node");
+        check (expected.ownerKey == "" || (ent.pos.x == expected.pos.x && ent.pos.y == expected.pos.y),
+            _what + ": entity " + std::to_string (id) + " is out of place");
+    }
+
+    std::vector<entity> found, expected;
+    for (int n = 0; n < 20; n++) {
+        rectangle rect = n == 0 ? rectangle (0, 0, worldSize, worldSize) :
+            rectangle (_random () % worldSize, _random () % worldSize, 1 + _random () % 1024, 1 + _random () % 1024);
+        rectangle_region query (rect);
+
+        // get_entities and get_nearest add to what's there
+        found.clear ();
+        expected.clear ();
+        _tree.get_entities (query, found);
+        _model.get_entities (query, expected);
+        check (found.size () == expected.size () && positions (found) == positions (expected), _what + ": queries found " +
+            std::to_string (found.size () ) + " entities, expected " + std::to_string (expected.size () ) );
+        check (_tree.count_entities (query) == expected.size (), _what + ": count doesn't match the query");
+
+        size_t pages, expectedPages;
+        check (paged (_tree, query, pages) == paged (_model, query, expectedPages) && pages == expectedPages,
+            _what + ": pages don't match the query");
+
+        // ties can come in either order, the distances can't
+        point center = random_point (_random);
+        found.clear ();
+        expected.clear ();
+        _tree.get_nearest (center, 5, found);
+        _model.get_nearest (center, 5, expected);
+        check (found.size () == expected.size (), _what + ": nearest found " + std::to_string (found.size () ) + " entities");
+        for (size_t k = 0; k < std::min (found.size (), expected.size () ); k++)
+            check (distance (center, found[k].pos) == distance (center, expected[k].pos), _what + ": nearest are out of order");
+    }
+
+    std::vector<density_cell> cells, expectedCells;
+    _tree.density_grid (rectangle (0, 0, worldSize, worldSize), 3, cells);
+    _model.density_grid (rectangle (0, 0, worldSize, worldSize), 3, expectedCells);
+
+    std::map<std::string, uint32_t> counts, expectedCounts;
+    for (size_t n = 0; n < cells.size (); n++)
+        counts[cells[n].key] = cells[n].count;
+    for (size_t n = 0; n < expectedCells.size (); n++)
+        expectedCounts[expectedCells[n].key] = expectedCells[n].count;
+    check (cells.size () == expectedCells.size () && counts == expectedCounts, _what + ": density grids differ");
+}
+
+// with writeBehind the tree answers from its memory_quadtree, so what it wrote to redis is read back through a
+// plain quadtree on a connection of its own
+static void compare (quadtree& _tree, redisContext* _readContext, const quadtree_options& _options, memory_quadtree& _model,
+    std::mt19937& _random, const std::string& _what) {
+    if (!_options.writeBehind) {
+        compare (_tree, _model, _random, _what);
+        return;
+    }
+
+    check (_tree.flush (), _what + ": flush failed");
+
+    quadtree_options readOptions = _options;
+    readOptions.writeBehind = false;
+    quadtree reader (_readContext, rectangle (0, 0, worldSize, worldSize), readOptions);
+    compare (reader, _model, _random, _what + ", read back");
+}
+
+static bool run (redisContext* _context, redisContext* _readContext, const quadtree_options& _options) {
+    if (! (_options.cluster ? reset_test_cluster (_context) : reset_test_db (_context) ) )
+        return false;
+
+    std::string what = describe (_options);
+    rectangle rect (0, 0, worldSize, worldSize);
+    quadtree tree (_context, rect, _options);
+    memory_quadtree model (rect, _options);
+
+    std::mt19937 random (1);
+
+    for (uint32_t id = 1; id <= entityCount; id++) {
+        entity ent;
+        ent.id = id;
+        ent.pos = random_point (random);
+
+        entity copy = ent;
+        tree.insert_entity (ent);
+        model.insert_entity (copy);
+    }
+    compare (tree, _readContext, _options, model, random, what + " after inserting");
+
+    for (int round = 0; round < rounds; round++) {
+        for (uint32_t id = 1; id <= entityCount; id++) {
+            entity ent, copy;
+            tree.get_entity (id, ent);
+            model.get_entity (id, copy);
+            int pick = random () % 10;
+
+            if (copy.ownerKey == "") {
+                ent.id = copy.id = id;
+                ent.pos = copy.pos = random_point (random);
+                tree.insert_entity (ent);
+                model.insert_entity (copy);
+            }
+            else if (pick < 2) {
+                tree.remove_entity (ent);
+                model.remove_entity (copy);
+            }
+            else {
+                // small steps merge and split around the same nodes, jumps empty whole subtrees
+                if (pick < 8) {
+                    int x = std::min (std::max ( (int)copy.pos.x + (int)(random () % 65) - 32, 1), (int)worldSize - 2);
+                    int y = std::min (std::max ( (int)copy.pos.y + (int)(random () % 65) - 32, 1), (int)worldSize - 2);
+                    ent.pos = copy.pos = point (x, y);
+                }
+                else
+                    ent.pos = copy.pos = random_point (random);
+
+                tree.relocate_entity (ent);
+                model.relocate_entity (copy);
+            }
+        }
+
+        compare (tree, _readContext, _options, model, random, what + " after round " + std::to_string (round + 1) );
+    }
+
+    // and the batched paths, everything still in the tree moves at once and the removed ones come back
+    std::vector<entity> moved, movedCopies, added;
+    for (uint32_t id = 1; id <= entityCount; id++) {
+        entity ent, copy;
+        tree.get_entity (id, ent);
+        model.get_entity (id, copy);
+
+        ent.id = copy.id = id;
+        ent.pos = copy.pos = random_point (random);
+        if (copy.ownerKey == "")
+            added.push_back (ent);
+        else {
+            moved.push_back (ent);
+            movedCopies.push_back (copy);
+        }
+    }
+
+    std::vector<entity> addedCopies = added;
+    tree.relocate_entities (moved);
+    model.relocate_entities (movedCopies);
+    tree.insert_entities (added);
+    model.insert_entities (addedCopies);
+    compare (tree, _readContext, _options, model, random, what + " after batches");
+
+    check (tree.script_error () == "", what + ": a script failed: " + tree.script_error () );
+    return true;
+}
+
+static const uint32_t conflictWriters = 2;
+static const uint32_t conflictEntities = 300;
+static const int conflictTicks = 4;
+
+// a writer of its own ids, all of them in the same corner of the tree so the two writers' splits and merges
+// land on the same nodes, _kept gets where each entity it left in the tree is
+static void conflict_writer (uint32_t _writer, const quadtree_options& _options, std::map<uint32_t, point>& _kept, bool& _connected) {
+    redisContext* context = connect_test_redis ();
+    _connected = context && select_test_db (context);
+    if (!_connected) {
+        if (context)
+            redisFree (context);
+        return;
+    }
+
+    std::mt19937 random (_writer + 2);
+    std::vector<entity> ents;
+    {
+        quadtree tree (context, rectangle (0, 0, worldSize, worldSize), _options);
+
+        for (uint32_t n = 0; n < conflictEntities; n++) {
+            entity ent;
+            ent.id = _writer * conflictEntities + n + 1;
+            ent.pos = point (1 + random () % 512, 1 + random () % 512);
+            tree.insert_entity (ent);
+            ents.push_back (ent);
+        }
+
+        for (int tick = 0; tick < conflictTicks; tick++) {
+            for (size_t n = 0; n < ents.size (); n++) {
+                // the other writer may have moved it to another node since
+                tree.get_entity (ents[n].id, ents[n]);
+                int x = std::min (std::max ( (int)ents[n].pos.x + (int)(random () % 33) - 16, 1), 512);
+                int y = std::min (std::max ( (int)ents[n].pos.y + (int)(random () % 33) - 16, 1), 512);
+                ents[n].pos = point (x, y);
+                tree.relocate_entity (ents[n]);
+            }
+        }
+
+        for (size_t n = 0; n < ents.size (); n++) {
+            if (n % 4 == 0) {
+                tree.get_entity (ents[n].id, ents[n]);
+                tree.remove_entity (ents[n]);
+            }
+            else
+                _kept[ents[n].id] = ents[n].pos;
+        }
+    }
+
+    redisFree (context);
+}
+
+// two optimistic writers on connections of their own at the same time, then everything they left has to be in the
+// tree once, where they left it, in a node whose rect holds it
+static bool run_conflicts (redisContext* _context, const quadtree_options& _options) {
+    if (!reset_test_db (_context) )
+        return false;
+
+    std::string what = describe (_options) + ", " + std::to_string (conflictWriters) + " writers";
+    {
+        // the tree is laid out before the writers race to add to it
+        quadtree tree (_context, rectangle (0, 0, worldSize, worldSize), _options);
+    }
+
+    std::vector<std::map<uint32_t, point> > kept (conflictWriters);
+    bool connected[conflictWriters];
+    std::vector<std::thread> writers;
+    for (uint32_t writer = 0; writer < conflictWriters; writer++)
+        writers.push_back (std::thread (conflict_writer, writer, std::cref (_options), std::ref (kept[writer]), std::ref (connected[writer]) ) );
+    for (uint32_t writer = 0; writer < conflictWriters; writer++) {
+        writers[writer].join ();
+        check (connected[writer], what + ": writer " + std::to_string (writer) + " couldn't connect");
+    }
+
+    std::map<uint32_t, point> expected;
+    for (uint32_t writer = 0; writer < conflictWriters; writer++)
+        expected.insert (kept[writer].begin (), kept[writer].end () );
+
+    quadtree tree (_context, rectangle (0, 0, worldSize, worldSize), _options);
+    for (uint32_t id = 1; id <= conflictWriters * conflictEntities; id++) {
+        entity ent;
+        tree.get_entity (id, ent);
+
+        std::map<uint32_t, point>::const_iterator it = expected.find (id);
+        if (it == expected.end () ) {
+            check (ent.ownerKey == "", what + ": removed entity " + std::to_string (id) + " is still in the tree");
+            continue;
+        }
+
+        rectangle ownerRect;
+        check (ent.ownerKey != "" && tree.get_node_rect (ent.ownerKey, ownerRect), what + ": entity " + std::to_string (id) + " is missing");
+        check (ent.pos.x == it->second.x && ent.pos.y == it->second.y, what + ": entity " + std::to_string (id) + " is out of place");
+        check (ent.ownerKey == "" || ownerRect.loosened (_options.looseness).contains (ent.pos),
+            what + ": entity " + std::to_string (id) + " is in a node that doesn't hold it");
+    }
+
+    std::vector<entity> found;
+    tree.get_entities (rectangle (0, 0, worldSize, worldSize), found);
+    std::map<uint32_t, point> all;
+    for (std::vector<entity>::iterator it = found.begin (); it != found.end (); it++)
+        all[it->id] = it->pos;
+
+    bool same = found.size () == expected.size () && all.size () == expected.size ();
+    for (std::map<uint32_t, point>::const_iterator it = expected.begin (); same && it != expected.end (); it++)
+        same = all.count (it->first) && all[it->first].x == it->second.x && all[it->first].y == it->second.y;
+    check (same, what + ": the whole tree has " + std::to_string (found.size () ) + " entities, expected " + std::to_string (expected.size () ) );
+    check (tree.count_entities (rectangle (0, 0, worldSize, worldSize) ) == expected.size (), what + ": count doesn't match");
+    return true;
+}
+
+static quadtree_options variant (int _engine, bool _packed) {
+    quadtree_options options;
+    options.maxEntitiesPerNode = 8;
+    options.mergeEntities = 4;
+    options.minNodeSize = 4;
+    options.useScripts = _engine == 1;
+    options.writeBehind = _engine == 2;
+    options.entityLayout = _packed ? LAYOUT_PACKED : LAYOUT_SETS;
+    options.keyScheme = _packed ? KEYS_MORTON : KEYS_PATH;
+    options.countSubtrees = _packed;
+    return options;
+}
+
+// client side, scripts and write-behind, each with the two layouts and a merge threshold, and with the
+// other key scheme and subtree totals every other time
+static void add_variants (std::vector<quadtree_options>& _variants) {
+    for (int engine = 0; engine < 3; engine++) {
+        for (int packed = 0; packed < 2; packed++)
+            _variants.push_back (variant (engine, packed == 1) );
+    }
+
+    // every key the tree touches behind a prefix, the scripts map their own
+    for (int engine = 0; engine < 2; engine++) {
+        _variants.push_back (variant (engine, engine == 1) );
+        _variants.back ().keyPrefix = "rqtree-test:";
+    }
+
+    // loose nodes keep entities that step over their edge, and the queries and nearest have to reach past them
+    for (int engine = 0; engine < 2; engine++) {
+        for (int packed = 0; packed < 2; packed++) {
+            _variants.push_back (variant (engine, packed == 1) );
+            _variants.back ().looseness = 1.5;
+        }
+    }
+
+    // the rects, and with sets the entities' positions, as little endian bytes, which the scripts decode themselves
+    for (int engine = 0; engine < 2; engine++) {
+        for (int packed = 0; packed < 2; packed++) {
+            _variants.push_back (variant (engine, packed == 1) );
+            _variants.back ().coordinates = COORDS_BINARY;
+        }
+    }
+
+    // every client side step as a WATCH/MULTI/EXEC transaction
+    for (int packed = 0; packed < 2; packed++) {
+        _variants.push_back (variant (0, packed == 1) );
+        _variants.back ().optimistic = true;
+    }
+}
+
+// a cluster ignores useScripts and optimistic, the model has to lay out the levels above the shards too
+static void add_cluster_variants (std::vector<quadtree_options>& _variants) {
+    for (int engine = 0; engine < 3; engine += 2) {
+        for (int packed = 0; packed < 2; packed++) {
+            _variants.push_back (variant (engine, packed == 1) );
+            _variants.back ().cluster = true;
+            _variants.back ().minDepth = _variants.back ().shardDepth;
+        }
+    }
+}
+
+// with --cluster, the same against the cluster RQTREE_TEST_CLUSTER names
+int main (int argc, char** argv) {
+    bool cluster = argc > 1 && strcmp (argv[1], "--cluster") == 0;
+
+    redisContext* context = cluster ? connect_test_cluster () : connect_test_redis ();
+    if (!context)
+        return testSkipped;
+
+    redisContext* readContext = cluster ? connect_test_cluster () : connect_test_redis ();
+    if (!readContext || (!cluster && !select_test_db (readContext) ) ) {
+        printf ("can't open the connection to read back on\n");
+        redisFree (context);
+        if (readContext)
+            redisFree (readContext);
+        return 1;
+    }
+
+    std::vector<quadtree_options> variants;
+    if (cluster)
+        add_cluster_variants (variants);
+    else
+        add_variants (variants);
+
+    bool reset = true;
+    for (size_t n = 0; reset && n < variants.size (); n++)
+        reset = run (context, readContext, variants[n]);
+
+    // the two writers race on the same nodes, so their transactions have to retry
+    for (int packed = 0; reset && !cluster && packed < 2; packed++) {
+        quadtree_options options = variant (0, packed == 1);
+        options.optimistic = true;
+        reset = run_conflicts (context, options);
+    }
+
+    if (!reset) {
+        printf ("can't empty the %s\n", cluster ? "cluster" : ("database " + std::to_string (testDb) ).c_str () );
+        redisFree (context);
+        redisFree (readContext);
+        return 1;
+    }
+
+    if (cluster)
+        reset_test_cluster (context);
+    else
+        reset_test_db (context);
+    redisFree (context);
+    redisFree (readContext);
+
+    printf ("%s\n", testFailures ? "FAILED" : "passed");
+    return testFailures ? 1 : 0;
+}
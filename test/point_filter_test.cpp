@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <point_filter.hpp>
+#include "test_redis.hpp"
+
+// runs every filter kernel this build and cpu have against filter_inside_scalar, index for index, and the
+// scalar one against rectangle::contains
+// the points sit on, just inside and just outside each edge and corner, around rectangles on both sides of
+// 2^31 where the vector kernels' sign flip has to keep the unsigned order, in runs of every length up to
+// a few vectors so each tail of 1 to 7 points after the last full vector comes up
+// needs no redis
+
+static const char* kernelNames[] = { "avx2", "sse2" };
+static const size_t maxRun = 40;
+
+// the edges of _rect, one in from them and one out, as far as they fit in a uint32_t
+static void edge_values (uint32_t _low, uint32_t _high, std::vector<uint32_t>& _values) {
+    _values.clear ();
+    _values.push_back (_low);
+    _values.push_back (_high);
+    _values.push_back (_low + 1);
+    _values.push_back (_high - 1);
+    if (_low > 0)
+        _values.push_back (_low - 1);
+    if (_high < 0xffffffffu)
+        _values.push_back (_high + 1);
+    _values.push_back (_low + (_high - _low) / 2);
+}
+
+// every pairing of the edge values, then random points near the rectangle and anywhere
+static void make_points (const rectangle& _rect, std::mt19937& _random, std::vector<uint32_t>& _xs, std::vector<uint32_t>& _ys) {
+    std::vector<uint32_t> xs, ys;
+    edge_values (_rect.x, _rect.x2, xs);
+    edge_values (_rect.y, _rect.y2, ys);
+
+    _xs.clear ();
+    _ys.clear ();
+    for (size_t x = 0; x < xs.size (); x++) {
+        for (size_t y = 0; y < ys.size (); y++) {
+            _xs.push_back (xs[x]);
+            _ys.push_back (ys[y]);
+        }
+    }
+
+    std::uniform_int_distribution<uint32_t> pick (0, 0xffffffffu), near (0, 4);
+    for (int n = 0; n < 400; n++) {
+        // an edge value nudged by a little, or any coordinate at all
+        _xs.push_back (n % 3 ? xs[near (_random)] + near (_random) - 2 : pick (_random) );
+        _ys.push_back (n % 3 ? ys[near (_random)] + near (_random) - 2 : pick (_random) );
+    }
+
+    // mixed up in pairs, so the edge cases land in every lane
+    for (size_t n = _xs.size () - 1; n > 0; n--) {
+        size_t other = std::uniform_int_distribution<size_t> (0, n) (_random);
+        std::swap (_xs[n], _xs[other]);
+        std::swap (_ys[n], _ys[other]);
+    }
+}
+
+static void check_run (const char* _name, filter_fn _kernel, const rectangle& _rect, const uint32_t* _xs, const uint32_t* _ys,
+    size_t _count, const std::string& _what) {
+    std::vector<uint32_t> expected (_count), kept (_count);
+    size_t expectedCount = filter_inside_scalar (_rect, _xs, _ys, _count, expected.data () );
+    size_t keptCount = _kernel (_rect, _xs, _ys, _count, kept.data () );
+
+    check (keptCount == expectedCount, std::string (_name) + ", " + _what + ": kept " + std::to_string (keptCount) +
+        " points, scalar kept " + std::to_string (expectedCount) );
+    for (size_t n = 0; n < keptCount && n < expectedCount; n++) {
+        if (kept[n] != expected[n]) {
+            check (false, std::string (_name) + ", " + _what + ": index " + std::to_string (n) + " is " +
+                std::to_string (kept[n]) + ", scalar has " + std::to_string (expected[n]) );
+            break;
+        }
+    }
+}
+
+int main () {
+    std::mt19937 random (2024);
+    std::vector<rectangle> rects;
+    rects.push_back (rectangle (100, 200, 50, 60) );
+    rects.push_back (rectangle (0, 0, 1024, 1024) );
+    // across 2^31, where a signed compare without the flip would order the two halves the wrong way round
+    rects.push_back (rectangle (0x7ffffff0u, 0x7fffff00u, 0x20, 0x200) );
+    rects.push_back (rectangle (0x80000000u, 0x80000000u, 0x1000, 0x1000) );
+    rects.push_back (rectangle (0xf0000000u, 0xc0000000u, 0x0ffffffeu, 0x3ffffffeu) );
+
+    std::vector<filter_fn> kernels;
+    std::vector<const char*> names;
+    for (size_t n = 0; n < sizeof (kernelNames) / sizeof (kernelNames[0]); n++) {
+        filter_fn kernel = find_filter_kernel (kernelNames[n]);
+        if (kernel) {
+            kernels.push_back (kernel);
+            names.push_back (kernelNames[n]);
+        } else
+            printf ("no %s kernel here, not tested\n", kernelNames[n]);
+    }
+
+    std::vector<uint32_t> xs, ys, kept;
+    for (size_t r = 0; r < rects.size (); r++) {
+        const rectangle& rect = rects[r];
+        std::string what = "rect " + std::to_string (r);
+        make_points (rect, random, xs, ys);
+
+        // the scalar loop is the reference, so it has to agree with contains first
+        kept.resize (xs.size () );
+        size_t keptCount = filter_inside_scalar (rect, xs.data (), ys.data (), xs.size (), kept.data () );
+        size_t inside = 0;
+        for (size_t n = 0; n < xs.size (); n++) {
+            if (rect.contains (point (xs[n], ys[n]) ) ) {
+                check (inside < keptCount && kept[inside] == n, "scalar, " + what + ": point " + std::to_string (n) +
+                    " is inside but wasn't kept");
+                inside++;
+            }
+        }
+        check (inside == keptCount, "scalar, " + what + ": kept " + std::to_string (keptCount) + " points, " +
+            std::to_string (inside) + " are inside");
+
+        for (size_t k = 0; k < kernels.size (); k++) {
+            // every run length from every 13th start, so each tail length follows each number of full vectors
+            for (size_t count = 0; count <= maxRun; count++) {
+                for (size_t start = 0; start + count <= xs.size (); start += 13)
+                    check_run (names[k], kernels[k], rect, xs.data () + start, ys.data () + start, count,
+                        what + ", " + std::to_string (count) + " points from " + std::to_string (start) );
+            }
+            check_run (names[k], kernels[k], rect, xs.data (), ys.data (), xs.size (), what + ", all points");
+        }
+    }
+
+    printf ("%s\n", testFailures ? "FAILED" : "passed");
+    return testFailures ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <quadtree.hpp>
+#include "test_redis.hpp"
+
+// inserts, removes and relocates through the lua scripts and through the client side walk, and checks the
+// tree against a plain map of every entity's position after every round
+// both layouts, with and without a merge threshold
+
+static const uint32_t worldSize = 4096;
+static const uint32_t entityCount = 600;
+static const int rounds = 4;
+
+static std::string describe (const quadtree_options& _options) {
+    return std::string (_options.useScripts ? "scripts" : "client side") + ", " +
+        (_options.entityLayout == LAYOUT_PACKED ? "packed" : "sets") + ", merge " + std::to_string (_options.mergeEntities);
+}
+
+// every entity get_entities finds in _rect, against the ones in the model inside it
+static void check_query (quadtree& _tree, const std::map<uint32_t, point>& _model, const rectangle& _rect, const std::string& _what) {
+    std::vector<entity> found;
+    _tree.get_entities (_rect, found);
+
+    std::set<uint32_t> ids, expected;
+    for (std::vector<entity>::iterator it = found.begin (); it != found.end (); it++)
+        ids.insert (it->id);
+    for (std::map<uint32_t, point>::const_iterator it = _model.begin (); it != _model.end (); it++) {
+        if (_rect.contains (it->second) )
+            expected.insert (it->first);
+    }
+
+    check (found.size () == ids.size (), _what + ": an entity was found twice");
+    check (ids == expected, _what + ": query found " + std::to_string (ids.size () ) + " entities, expected " +
+        std::to_string (expected.size () ) );
+}
+
+static void check_tree (quadtree& _tree, const std::map<uint32_t, point>& _model, std::mt19937& _random, const std::string& _what) {
+    for (uint32_t id = 1; id <= entityCount; id++) {
+        entity ent;
+        _tree.get_entity (id, ent);
+
+        std::map<uint32_t, point>::const_iterator it = _model.find (id);
+        if (it == _model.end () ) {
+            check (ent.ownerKey == "", _what + ": removed entity " + std::to_string (id) + " is still in the tree");
+            continue;
+        }
+
+        check (ent.ownerKey != "", _what + ": entity " + std::to_string (id) + " is missing");
+        check (ent.pos.x == it->second.x && ent.pos.y == it->second.y, _what + ": entity " + std::to_string (id) + " is out of place");
+    }
+
+    check_query (_tree, _model, rectangle (0, 0, worldSize, worldSize), _what + " (whole tree)");
+    for (int n = 0; n < 20; n++) {
+        rectangle rect (_random () % worldSize, _random () % worldSize, 1 + _random () % 1024, 1 + _random () % 1024);
+        check_query (_tree, _model, rect, _what);
+    }
+}
+
+static point random_point (std::mt19937& _random) {
+    return point (1 + _random () % (worldSize - 2), 1 + _random () % (worldSize - 2) );
+}
+
+static bool run (redisContext* _context, const quadtree_options& _options) {
+    if (!reset_test_db (_context) )
+        return false;
+
+    std::string what = describe (_options);
+    quadtree tree (_context, rectangle (0, 0, worldSize, worldSize), _options);
+    check (tree.runs_scripts () == _options.useScripts, what + ": scripts " + (tree.runs_scripts () ? "loaded" : "didn't load") );
+
+    std::mt19937 random (1);
+    std::map<uint32_t, point> model;
+
+    for (uint32_t id = 1; id <= entityCount; id++) {
+        entity ent;
+        ent.id = id;
+        ent.pos = random_point (random);
+        tree.insert_entity (ent);
+
+        check (ent.ownerKey != "", what + ": insert of " + std::to_string (id) + " has no owner");
+        model[id] = ent.pos;
+    }
+    check_tree (tree, model, random, what + " after inserting");
+
+    for (int round = 0; round < rounds; round++) {
+        for (uint32_t id = 1; id <= entityCount; id++) {
+            entity ent;
+            tree.get_entity (id, ent);
+            int pick = random () % 10;
+
+            if (model.count (id) == 0) {
+                // back in somewhere new
+                ent.id = id;
+                ent.pos = random_point (random);
+                tree.insert_entity (ent);
+                model[id] = ent.pos;
+            }
+            else if (pick < 2) {
+                tree.remove_entity (ent);
+                check (ent.ownerKey == "", what + ": remove of " + std::to_string (id) + " left an owner");
+                model.erase (id);
+            }
+            else {
+                // mostly small steps, which stay near their owner, and now and then a jump across the tree
+                if (pick < 8) {
+                    int x = std::min (std::max ( (int)ent.pos.x + (int)(random () % 65) - 32, 1), (int)worldSize - 2);
+                    int y = std::min (std::max ( (int)ent.pos.y + (int)(random () % 65) - 32, 1), (int)worldSize - 2);
+                    ent.pos = point (x, y);
+                }
+                else
+                    ent.pos = random_point (random);
+
+                tree.relocate_entity (ent);
+                model[id] = ent.pos;
+            }
+        }
+
+        check_tree (tree, model, random, what + " after round " + std::to_string (round + 1) );
+    }
+
+    // and the same batched
+    std::vector<entity> batch;
+    for (std::map<uint32_t, point>::iterator it = model.begin (); it != model.end (); it++) {
+        entity ent;
+        tree.get_entity (it->first, ent);
+        ent.pos = random_point (random);
+        it->second = ent.pos;
+        batch.push_back (ent);
+    }
+    tree.relocate_entities (batch);
+    check_tree (tree, model, random, what + " after a batch");
+
+    check (tree.script_error () == "", what + ": a script failed: " + tree.script_error () );
+    return true;
+}
+
+int main () {
+    redisContext* context = connect_test_redis ();
+    if (!context)
+        return testSkipped;
+
+    for (int scripts = 0; scripts < 2; scripts++) {
+        for (int layout = 0; layout < 2; layout++) {
+            for (uint32_t merge = 0; merge <= 4; merge += 4) {
+                quadtree_options options;
+                options.maxEntitiesPerNode = 8;
+                options.mergeEntities = merge;
+                options.minNodeSize = 4;
+                options.useScripts = scripts == 1;
+                options.entityLayout = layout == 1 ? LAYOUT_PACKED : LAYOUT_SETS;
+
+                if (!run (context, options) ) {
+                    printf ("can't empty database %d\n", testDb);
+                    redisFree (context);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    reset_test_db (context);
+    redisFree (context);
+
+    printf ("%s\n", testFailures ? "FAILED" : "passed");
+    return testFailures ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+#ifndef REDIS_QUADTREE_TEST_REDIS_HPP
+#define REDIS_QUADTREE_TEST_REDIS_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <hiredis/hiredis.h>
+
+// the tests run against a local redis-server, RQTREE_TEST_HOST and RQTREE_TEST_PORT name another one
+// database 15 is emptied before every tree a test makes, a test with no server to run against is skipped
+// the cluster runs need RQTREE_TEST_CLUSTER, <host>:<port> of any node of a cluster (e.g. several local
+// redis-server instances) whose every master is emptied, they're skipped without it
+static const int testSkipped = 77;
+static const int testDb = 15;
+
+inline redisContext* connect_test_redis (const char* _host, int _port) {
+    redisContext* context = redisConnect (_host, _port);
+    if (!context || context->err) {
+        printf ("no redis to test against at %s:%d (%s), skipped\n", _host, _port, context ? context->errstr : "out of memory");
+        if (context)
+            redisFree (context);
+        return NULL;
+    }
+
+    return context;
+}
+
+inline const char* test_host () {
+    const char* host = getenv ("RQTREE_TEST_HOST");
+    return host ? host : "localhost";
+}
+
+inline int test_port () {
+    const char* port = getenv ("RQTREE_TEST_PORT");
+    return port ? atoi (port) : 6379;
+}
+
+inline redisContext* connect_test_redis () {
+    return connect_test_redis (test_host (), test_port () );
+}
+
+// NULL if RQTREE_TEST_CLUSTER isn't set or names nothing to connect to
+inline redisContext* connect_test_cluster () {
+    const char* seed = getenv ("RQTREE_TEST_CLUSTER");
+    if (!seed) {
+        printf ("RQTREE_TEST_CLUSTER doesn't name a cluster node, skipped\n");
+        return NULL;
+    }
+
+    std::string host = seed;
+    size_t colon = host.rfind (':');
+    int port = colon == std::string::npos ? 6379 : atoi (host.c_str () + colon + 1);
+    if (colon != std::string::npos)
+        host.resize (colon);
+
+    return connect_test_redis (host.c_str (), port);
+}
+
+inline bool select_test_db (redisContext* _context) {
+    redisReply* reply = (redisReply*)redisCommand (_context, "SELECT %d", testDb);
+    bool selected = reply && reply->type == REDIS_REPLY_STATUS;
+    if (reply)
+        freeReplyObject (reply);
+
+    return selected;
+}
+
+// empties the test database, false if it couldn't
+inline bool reset_test_db (redisContext* _context) {
+    bool reset = select_test_db (_context);
+
+    redisReply* reply = (redisReply*)redisCommand (_context, "FLUSHDB");
+    reset = reset && reply && reply->type == REDIS_REPLY_STATUS;
+    if (reply)
+        freeReplyObject (reply);
+
+    return reset;
+}
+
+// empties every master of the cluster _context is a node of
+inline bool reset_test_cluster (redisContext* _context) {
+    // a range is {start, end, {host, port, ...}, replicas...}
+    redisReply* reply = (redisReply*)redisCommand (_context, "CLUSTER SLOTS");
+    bool reset = reply && reply->type == REDIS_REPLY_ARRAY;
+
+    for (size_t n = 0; reset && n < reply->elements; n++) {
+        redisReply* master = reply->element[n]->element[2];
+        redisContext* masterContext = redisConnect (master->element[0]->str, master->element[1]->integer);
+
+        redisReply* flushed = masterContext->err ? NULL : (redisReply*)redisCommand (masterContext, "FLUSHDB");
+        reset = flushed && flushed->type == REDIS_REPLY_STATUS;
+        if (flushed)
+            freeReplyObject (flushed);
+        redisFree (masterContext);
+    }
+
+    if (reply)
+        freeReplyObject (reply);
+    return reset;
+}
+
+// counts the checks that failed, printing each one
+static int testFailures = 0;
+
+static void check (bool _passed, const std::string& _what) {
+    if (_passed)
+        return;
+
+    testFailures++;
+    printf ("FAILED: %s\n", _what.c_str () );
+}
+
+#endif